@@ -0,0 +1,129 @@
+// cachesrv is a minimal content-addressed store for the compat
+// runtime's remote result cache (WIN32_CACHE_REMOTE).
+//
+// It stores opaque objects under two namespaces:
+//
+//	GET|HEAD|PUT /m/<16 hex digits>   manifests
+//	GET|HEAD|PUT /b/<16 hex digits>   blobs
+//
+// Objects are written to disk as received (already compressed by the
+// client) and never expire.  Meant for testing and small teams; put a
+// real HTTP cache in front of it for anything else.
+package main
+
+import (
+	"errors"
+	"flag"
+	"io"
+	"io/fs"
+	"log"
+	"net/http"
+	"os"
+	"path/filepath"
+	"strconv"
+)
+
+const maxObjectSize = 256 << 20
+
+type store struct {
+	dir string
+}
+
+func validName(name string) bool {
+	if len(name) != 16 {
+		return false
+	}
+	for _, c := range name {
+		if !(c >= '0' && c <= '9' || c >= 'a' && c <= 'f') {
+			return false
+		}
+	}
+	return true
+}
+
+func (s *store) path(ns, name string) string {
+	return filepath.Join(s.dir, ns, name[:2], name)
+}
+
+func (s *store) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	if len(r.URL.Path) != 19 || r.URL.Path[0] != '/' || r.URL.Path[2] != '/' {
+		http.NotFound(w, r)
+		return
+	}
+	ns, name := r.URL.Path[1:2], r.URL.Path[3:]
+	if (ns != "m" && ns != "b") || !validName(name) {
+		http.NotFound(w, r)
+		return
+	}
+	path := s.path(ns, name)
+
+	switch r.Method {
+	case http.MethodGet, http.MethodHead:
+		s.get(w, r, path)
+	case http.MethodPut:
+		s.put(w, r, path)
+	default:
+		w.Header().Set("Allow", "GET, HEAD, PUT")
+		w.Header().Set("Content-Length", "0")
+		w.WriteHeader(http.StatusMethodNotAllowed)
+	}
+}
+
+func (s *store) get(w http.ResponseWriter, r *http.Request, path string) {
+	data, err := os.ReadFile(path)
+	if errors.Is(err, fs.ErrNotExist) {
+		w.Header().Set("Content-Length", "0")
+		w.WriteHeader(http.StatusNotFound)
+		return
+	} else if err != nil {
+		log.Print(err)
+		w.Header().Set("Content-Length", "0")
+		w.WriteHeader(http.StatusInternalServerError)
+		return
+	}
+	w.Header().Set("Content-Type", "application/octet-stream")
+	w.Header().Set("Content-Length", strconv.Itoa(len(data)))
+	if r.Method == http.MethodGet {
+		_, _ = w.Write(data)
+	}
+}
+
+func (s *store) put(w http.ResponseWriter, r *http.Request, path string) {
+	w.Header().Set("Content-Length", "0")
+	if err := os.MkdirAll(filepath.Dir(path), 0o755); err != nil {
+		log.Print(err)
+		w.WriteHeader(http.StatusInternalServerError)
+		return
+	}
+	tmp, err := os.CreateTemp(filepath.Dir(path), ".tmp-*")
+	if err != nil {
+		log.Print(err)
+		w.WriteHeader(http.StatusInternalServerError)
+		return
+	}
+	defer os.Remove(tmp.Name())
+	_, err = io.Copy(tmp, http.MaxBytesReader(w, r.Body, maxObjectSize))
+	if closeErr := tmp.Close(); err == nil {
+		err = closeErr
+	}
+	if err == nil {
+		err = os.Rename(tmp.Name(), path)
+	}
+	if err != nil {
+		log.Print(err)
+		w.WriteHeader(http.StatusInternalServerError)
+		return
+	}
+	w.WriteHeader(http.StatusCreated)
+}
+
+func main() {
+	listen := flag.String("listen", "127.0.0.1:8370", "Listen address")
+	dir := flag.String("dir", "cache", "Storage directory")
+	flag.Parse()
+
+	log.Default().SetFlags(0)
+
+	log.Printf("Serving %s on http://%s", *dir, *listen)
+	log.Fatal(http.ListenAndServe(*listen, &store{dir: *dir}))
+}
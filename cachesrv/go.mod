@@ -0,0 +1,3 @@
+module github.com/terorie/mwcc-native/cachesrv
+
+go 1.19
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 #include <assert.h>
 #include <dirent.h>
@@ -9,15 +10,29 @@
 #include <string.h>
 #include <signal.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ctype.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <elf.h>
+#include <ucontext.h>
+#include <netdb.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <linux/limits.h>
+#include <linux/perf_event.h>
 
 #include "compat.h"
 
@@ -33,6 +48,56 @@ char ** g_argv;
 
 static __thread int g_last_error = ERROR_SUCCESS;
 
+/* Fork server socket path (WIN32_SERVER), NULL if disabled */
+static char const * g_server_path;
+
+static void
+compat_server_run( char const * path );
+
+/* Batch mode (WIN32_BATCH): ExitProcess jumps back to the batch loop */
+static int      g_batch_active;
+static jmp_buf  g_batch_jmp;
+static uint32_t g_batch_exit_code;
+
+/* Snapshot mode (WIN32_SNAPSHOT): snapshot file to create once CRT
+   init is done, NULL if disabled or already restored from one */
+static char * g_snapshot_path;
+
+static void
+compat_snapshot_take( void );
+
+/* Clock pinning (SOURCE_DATE_EPOCH), see Time */
+static int      g_time_pinned;   /* SOURCE_DATE_EPOCH is set */
+static int64_t  g_time_epoch;    /* SOURCE_DATE_EPOCH value */
+static uint32_t g_time_ticks;    /* pinned GetTickCount value */
+
+/* Nondeterminism tracking hooks, by leaking shim */
+#define COMPAT_NONDET_TICK      0
+#define COMPAT_NONDET_SYSTIME   1
+#define COMPAT_NONDET_LOCALTIME 2
+#define COMPAT_NONDET_CWD       3
+#define COMPAT_NONDET_ENV       4
+#define COMPAT_NONDET_FILETIME  5
+#define COMPAT_NONDET_CNT       6
+
+static void compat_nondet_note     ( uint32_t src, void const * val, size_t sz );
+static void compat_nondet_pattern  ( uint32_t src, void const * val, size_t sz );
+static void compat_nondet_note_time( uint32_t src, SYSTEMTIME const * st );
+static void compat_nondet_scan     ( void const * buf, size_t sz );
+static void compat_nondet_begin    ( void );
+static void compat_nondet_report   ( uint32_t exit_code );
+static int  compat_nondet_cacheable( void );
+static int  compat_nondet_leaked   ( uint32_t src );
+
+/* Result cache (WIN32_CACHE) hooks */
+static void compat_cache_begin   ( void );
+static void compat_cache_finish  ( uint32_t exit_code );
+static void compat_cache_disable ( char const * reason );
+static void compat_cache_on_read ( char const * path, int ok );
+static void compat_cache_on_probe( char const * path, int kind );
+static void compat_cache_on_write( char const * path );
+static void compat_cache_on_stdio( int fd, void const * buf, size_t sz );
+
 /* Handles */
 
 static uint32_t compat_stdin;
@@ -66,1990 +131,8468 @@ compat_handle_free( uint32_t h ) {
   memset( &compat_handles[h], 0, sizeof(compat_handle_t) );
 }
 
-static uint32_t
-compat_handle_file_close( void * data ) {
-  FILE * f = (FILE *)data;
-  if( f==stdin || f==stdout || f==stderr ) {
-    LOG_TRACE(( "CloseHandle: Ignoring request to close stdin/stdout/stderr" ));
-    g_last_error = ERROR_SUCCESS;
-    return 1;
-  }
-  LOG_TRACE(( "CloseHandle: closing FILE %p", f ));
-  int fd = fileno( f );
-  int res = fclose( f );
-  if( res==0 ) {
-    LOG_DEBUG(( "CloseHandle: fclose(%d)", fd ));
-    g_last_error = ERROR_SUCCESS;
-    return 1;
-  } else {
-    LOG_WARN(( "CloseHandle: fclose(%d) failed: %s", fd, strerror( errno ) ));
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
-  }
+/* Files
+
+   A file handle holds a compat_file.  Regular files are accessed with
+   pread/pwrite at a logical file pointer, the kernel file offset is
+   unused.  One buffer per file serves as read-ahead or as write-behind,
+   growing while access stays sequential.  The file size is cached from
+   fstat at open and kept up to date by writes through the handle.
+
+   Standard handles are streams: read/write on the shared file offset,
+   unbuffered, since the PE does its own stdio buffering. */
+
+/* File content cache
+
+   Read-only opens of regular files up to COMPAT_FCACHE_FILE_MAX bytes
+   keep the whole content in memory, keyed by device and inode.  A later
+   open of the same file, through any path, costs one stat: the entry is
+   used if size, mtime and ctime still match, and the handle is served
+   from memory without an fd.  WIN32_FILE_CACHE=<MiB> sets the budget
+   (default 256, 0 disables); unreferenced entries are evicted beyond it. */
+
+#define COMPAT_FCACHE_FILE_MAX (16U<<20)
+#define COMPAT_FCACHE_BUCKETS  1024U
+
+struct compat_fcache_ent {
+  uint64_t                   dev;
+  uint64_t                   ino;
+  uint64_t                   size;
+  int64_t                    mtime_ns;
+  int64_t                    ctime_ns;
+  uint32_t                   ref;       /* open handles */
+  int                        stale;     /* removed from the table */
+  char *                     path;      /* as first opened, for mappings */
+  uint8_t *                  data;
+  struct compat_fcache_ent * next;
+};
+
+static struct {
+  uint64_t                   cap;       /* bytes, 0 if disabled */
+  uint64_t                   bytes;
+  uint64_t                   hits;
+  uint64_t                   misses;
+  uint64_t                   stale;
+  uint64_t                   served;    /* bytes read from the cache */
+  struct compat_fcache_ent * bucket[ COMPAT_FCACHE_BUCKETS ];
+} g_fcache = { .cap = 256ULL<<20 };
+
+static inline struct compat_fcache_ent **
+compat_fcache_bucket( uint64_t dev,
+                      uint64_t ino ) {
+  return &g_fcache.bucket[ (ino*0x9e3779b97f4a7c15ULL ^ dev)%COMPAT_FCACHE_BUCKETS ];
 }
 
-/* Logging */
+static void
+compat_fcache_free( struct compat_fcache_ent * e ) {
+  g_fcache.bytes -= e->size;
+  free( e->data );
+  free( e->path );
+  free( e );
+}
 
-static int log_level = LOGLVL_FATAL;
+/* compat_fcache_unlink: Removes e from the table, freeing it unless
+   handles still use it. */
+static void
+compat_fcache_unlink( struct compat_fcache_ent * e ) {
+  for( struct compat_fcache_ent ** p=compat_fcache_bucket( e->dev, e->ino ); *p; p=&(*p)->next ) {
+    if( *p==e ) { *p = e->next; break; }
+  }
+  e->stale = 1;
+  if( !e->ref ) compat_fcache_free( e );
+}
 
-__attribute__((format(printf,1,2)))
-char const *
-compat_log0_( char const * fmt, ... ) {
-  static __thread char msg[ 4096 ];
-  va_list ap;
-  va_start( ap, fmt );
-  int len = vsnprintf( msg, sizeof(msg), fmt, ap );
-  if( len<0               ) len = 0;
-  if( len>(sizeof(msg)-1) ) len = sizeof(msg)-1;
-  msg[ len ] = '\0';
-  va_end( ap );
-  return msg;
+static void
+compat_fcache_put( struct compat_fcache_ent * e ) {
+  if( !--e->ref && e->stale ) compat_fcache_free( e );
 }
 
-void
-compat_log1_( int level,
-              char const * msg ) {
-  if( level<0 || level>LOGLVL_FATAL || level<log_level ) return;
+/* compat_fcache_evict: Frees unreferenced entries until want more bytes fit. */
+static void
+compat_fcache_evict( uint64_t want ) {
+  for( uint32_t b=0; b<COMPAT_FCACHE_BUCKETS && g_fcache.bytes+want>g_fcache.cap; b++ ) {
+    struct compat_fcache_ent ** p = &g_fcache.bucket[ b ];
+    while( *p && g_fcache.bytes+want>g_fcache.cap ) {
+      struct compat_fcache_ent * e = *p;
+      if( e->ref ) { p = &e->next; continue; }
+      *p = e->next;
+      compat_fcache_free( e );
+    }
+  }
+}
 
-  fprintf( stderr, "%s  %s\n", compat_level_str_[ level ], msg );
+/* compat_fcache_lookup: Returns a referenced entry matching st, or NULL. */
+static struct compat_fcache_ent *
+compat_fcache_lookup( struct stat64 const * st ) {
+  for( struct compat_fcache_ent * e=*compat_fcache_bucket( st->st_dev, st->st_ino ); e; e=e->next ) {
+    if( e->dev!=(uint64_t)st->st_dev || e->ino!=(uint64_t)st->st_ino ) continue;
+    if( e->size==(uint64_t)st->st_size &&
+        e->mtime_ns==(int64_t)st->st_mtim.tv_sec*1000000000LL+st->st_mtim.tv_nsec &&
+        e->ctime_ns==(int64_t)st->st_ctim.tv_sec*1000000000LL+st->st_ctim.tv_nsec ) {
+      e->ref++;
+      g_fcache.hits++;
+      return e;
+    }
+    g_fcache.stale++;
+    compat_fcache_unlink( e );
+    return NULL;
+  }
+  return NULL;
 }
 
-/* Glue functions */
+/* compat_fcache_fill: Reads the file open as fd into a new referenced
+   entry.  Returns NULL if it does not fit or changed while reading. */
+static struct compat_fcache_ent *
+compat_fcache_fill( int          fd,
+                    char const * path ) {
+  struct stat64 st;
+  if( fstat64( fd, &st )<0 || !S_ISREG( st.st_mode ) || (uint64_t)st.st_size>COMPAT_FCACHE_FILE_MAX ) return NULL;
+  uint64_t size = (uint64_t)st.st_size;
+  if( size>g_fcache.cap ) return NULL;
+  compat_fcache_evict( size );
+
+  struct compat_fcache_ent * e = calloc( 1, sizeof(struct compat_fcache_ent) );
+  uint8_t * data = malloc( size ? size : 1 );
+  if( !e || !data ) { free( e ); free( data ); return NULL; }
+  for( uint64_t done=0; done<size; ) {
+    ssize_t n = pread64( fd, data+done, size-done, (off64_t)done );
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ) { free( e ); free( data ); return NULL; }
+    done += (uint64_t)n;
+  }
 
-/* compat_check_winpath_absolute: Checks whether a path is absolute.
+  e->dev      = (uint64_t)st.st_dev;
+  e->ino      = (uint64_t)st.st_ino;
+  e->size     = size;
+  e->mtime_ns = (int64_t)st.st_mtim.tv_sec*1000000000LL+st.st_mtim.tv_nsec;
+  e->ctime_ns = (int64_t)st.st_ctim.tv_sec*1000000000LL+st.st_ctim.tv_nsec;
+  e->ref      = 1;
+  e->path     = strdup( path );
+  e->data     = data;
+  struct compat_fcache_ent ** head = compat_fcache_bucket( e->dev, e->ino );
+  e->next = *head;
+  *head   = e;
+  g_fcache.bytes += size;
+  g_fcache.misses++;
+  return e;
+}
 
-   Returns NULL if not, returns a pointer to the root excluding the drive name. */
-static inline
-char const *
-compat_check_winpath_absolute( char const * path ) {
-  if( *path == '\\' ) return path;
+/* compat_fcache_open: Opens the file of e for mapping it.  Fails if the
+   path now refers to a different file. */
+static int
+compat_fcache_open( struct compat_fcache_ent const * e ) {
+  int fd = open( e->path, O_RDONLY|O_CLOEXEC );
+  struct stat64 st;
+  if( fd>=0 && ( fstat64( fd, &st )<0 || (uint64_t)st.st_dev!=e->dev || (uint64_t)st.st_ino!=e->ino ) ) {
+    close( fd );
+    errno = ESTALE;
+    fd = -1;
+  }
+  return fd;
+}
 
-  if( !isupper( *path++ ) ) return NULL;
-  if( *path++ != ':'      ) return NULL;
-  if( *path   != '\\'     ) return NULL;
-  return path;
+static void
+compat_fcache_init( char const * mib ) {
+  if( !mib ) return;
+  char * end;
+  unsigned long n = strtoul( mib, &end, 10 );
+  if( *end || end==mib ) {
+    LOG_WARN(( "ignoring invalid WIN32_FILE_CACHE \"%s\"", mib ));
+    return;
+  }
+  g_fcache.cap = (uint64_t)n<<20;
 }
 
-/* compat_winpath_to_posix: Converts a Windows path to a POSIX path.
+/* Directory reading
 
-   Returns the number of bytes occupied by the POSIX string including trailing NULL.
-   If this number is greater than out_size, assume error.
+   compat_dir_next hands out the entries of an open directory one at a
+   time, reading them in bulk with getdents64.  Used by the stat cache
+   (and through it the case index) and by FindFirstFileA. */
 
-   Returns 0 if the Windows path is not representable in POSIX. */
-static inline
-uint32_t
-compat_winpath_to_posix( char *       out,
-                         size_t       out_sz,
-                         char const * win ) {
-  assert( out_sz>0 );
-  out[0] = '\0';
+#define COMPAT_DIR_BUFSZ 32768
 
-  char const * str = compat_check_winpath_absolute( win );
-  if( str && win[0]!='\\' && win[0]!='Z' ) {
-    /* Absolute path, but not in unix volume */
-    return 0;
-  }
+struct compat_dirent64 {
+  uint64_t d_ino;
+  int64_t  d_off;
+  uint16_t d_reclen;
+  uint8_t  d_type;
+  char     d_name[];
+};
 
-  if( !str ) str = win;
+struct compat_dir {
+  int      fd;
+  uint32_t pos;
+  uint32_t len;
+  char     buf[ COMPAT_DIR_BUFSZ ] __attribute__((aligned(8)));
+};
 
-  size_t sz = strlen( str )+1;
-  if( sz>out_sz ) return sz;
+/* compat_dir_open: Starts reading the directory open as fd. */
+static inline void
+compat_dir_open( struct compat_dir * d,
+                 int                 fd ) {
+  d->fd  = fd;
+  d->pos = 0;
+  d->len = 0;
+}
 
-  /* Copy path, converting slashes */
-  char * orig = out;
-  while( *str ) {
-    if( *str=='\\' ) *out = '/';
-    else             *out = *str;
-    ++out; ++str;
+/* compat_dir_next: Returns the next entry, "." and ".." included, or
+   NULL at the end (errno 0) or on error. */
+static struct compat_dirent64 const *
+compat_dir_next( struct compat_dir * d ) {
+  if( d->pos>=d->len ) {
+    long n = syscall( SYS_getdents64, d->fd, d->buf, sizeof(d->buf) );
+    if( n<=0 ) {
+      if( n==0 ) errno = 0;
+      return NULL;
+    }
+    d->pos = 0;
+    d->len = (uint32_t)n;
   }
-  *out = '\0';
-
-  return sz;
+  struct compat_dirent64 const * de = (struct compat_dirent64 const *)( d->buf+d->pos );
+  d->pos += de->d_reclen;
+  return de;
 }
 
-/* Dummy markers */
-static int g_cur_module;
-static int g_cur_library;
-
-typedef struct _COORD {
-  uint16_t X;
-  uint16_t Y;
-} COORD, *PCOORD;
-
-typedef struct _SMALL_RECT {
-  uint16_t Left;
-  uint16_t Top;
-  uint16_t Right;
-  uint16_t Bottom;
-} SMALL_RECT;
-
-struct _CONSOLE_SCREEN_BUFFER_INFO {
-  COORD      dwSize;
-  COORD      dwCursorPosition;
-  uint32_t   wAttributes;
-  SMALL_RECT srWindow;
-  COORD      dwMaximumWindowSize;
+/* Stat cache
+
+   Remembers whether paths exist, and as what, for GetFileAttributesA and
+   read-only CreateFileA, since include path probing looks up the same
+   missing files over and over.  Entries are keyed by the translated path.
+   Once COMPAT_STAT_LIST_AFTER lookups in one directory came up empty,
+   the directory is read with a single getdents64 pass, after which any
+   name not listed is known to be missing.  Paths the process creates or
+   deletes through the shims are forgotten, and the whole cache is dropped
+   when a child process may have changed the tree.  WIN32_STAT_CACHE=0
+   disables it. */
+
+static void compat_case_forget( char const * path );
+static void compat_case_reset ( void );
+static void compat_case_index ( char const * path, char * names, size_t len, uint32_t cnt );
+
+#define COMPAT_STAT_BUCKETS    4096U
+#define COMPAT_STAT_LIST_AFTER 4U
+
+#define COMPAT_STAT_UNKNOWN 0
+#define COMPAT_STAT_ABSENT  1
+#define COMPAT_STAT_FILE    2
+#define COMPAT_STAT_DIR     3
+
+struct compat_stat_ent {
+  struct compat_stat_ent * next;
+  uint32_t                 hash;
+  uint8_t                  kind;
+  uint8_t                  listed;  /* all children are in the table */
+  uint16_t                 misses;  /* children found missing */
+  char                     path[];
 };
-typedef struct _CONSOLE_SCREEN_BUFFER_INFO CONSOLE_SCREEN_BUFFER_INFO;
 
-static CONSOLE_SCREEN_BUFFER_INFO console_buf = {0};
+static struct {
+  int                      off;
+  uint64_t                 hits;
+  uint64_t                 misses;  /* lookups that needed a syscall */
+  uint64_t                 listed;  /* directories read */
+  struct compat_stat_ent * bucket[ COMPAT_STAT_BUCKETS ];
+} g_statc;
 
-WIN32_STDCALL
-int32_t
-ADVAPI32_RegOpenKeyExA( uint32_t     h_key,
-                        char const * lp_sub_key,
-                        uint32_t     ul_options,
-                        uint32_t     sam_desired,
-                        void **      phk_result ) {
+static uint32_t
+compat_stat_hash( char const * s,
+                  size_t       n ) {
+  uint32_t h = 2166136261U;
+  for( size_t i=0; i<n; i++ ) h = ( h^(uint8_t)s[i] )*16777619U;
+  return h;
+}
 
-  char const * hkey_name;
-  switch( h_key ) {
-  case HKEY_CLASSES_ROOT     : hkey_name = "HKEY_CLASSES_ROOT"     ; break;
-  case HKEY_CURRENT_USER     : hkey_name = "HKEY_CURRENT_USER"     ; break;
-  case HKEY_LOCAL_MACHINE    : hkey_name = "HKEY_LOCAL_MACHINE"    ; break;
-  case HKEY_USERS            : hkey_name = "HKEY_USERS"            ; break;
-  case HKEY_PERFORMANCE_DATA : hkey_name = "HKEY_PERFORMANCE_DATA" ; break;
-  case HKEY_CURRENT_CONFIG   : hkey_name = "HKEY_CURRENT_CONFIG"   ; break;
-  case HKEY_DYN_DATA         : hkey_name = "HKEY_DYN_DATA"         ; break;
-  default                    : hkey_name = "<unknown>"             ; break;
+static struct compat_stat_ent *
+compat_stat_find( char const * path,
+                  size_t       n,
+                  int          create ) {
+  uint32_t h = compat_stat_hash( path, n );
+  struct compat_stat_ent ** head = &g_statc.bucket[ h%COMPAT_STAT_BUCKETS ];
+  for( struct compat_stat_ent * e=*head; e; e=e->next ) {
+    if( e->hash==h && 0==strncmp( e->path, path, n ) && !e->path[n] ) return e;
   }
+  if( !create ) return NULL;
+  struct compat_stat_ent * e = calloc( 1, sizeof(struct compat_stat_ent)+n+1 );
+  if( !e ) return NULL;
+  memcpy( e->path, path, n );
+  e->hash = h;
+  e->next = *head;
+  *head   = e;
+  return e;
+}
 
-  LOG_DEBUG(( "[TODO] ADVAPI32_RegOpenKeyExA(%s (%p), \"%s\", %x, %x, %p)",
-              hkey_name, h_key, lp_sub_key, ul_options, sam_desired, phk_result ));
+/* compat_stat_parent: Length of the directory part of path, as used for
+   the key of the directory.  "" stands for the working directory. */
+static size_t
+compat_stat_parent( char const * path ) {
+  char const * slash = strrchr( path, '/' );
+  if( !slash ) return 0;
+  return slash==path ? 1 : (size_t)( slash-path );
+}
 
-  return ERROR_ACCESS_DENIED;
+static void
+compat_stat_reset( void ) {
+  compat_case_reset();
+  for( uint32_t b=0; b<COMPAT_STAT_BUCKETS; b++ ) {
+    while( g_statc.bucket[b] ) {
+      struct compat_stat_ent * e = g_statc.bucket[b];
+      g_statc.bucket[b] = e->next;
+      free( e );
+    }
+  }
 }
 
-WIN32_STDCALL
-int32_t
-ADVAPI32_RegQueryValueExA( void *       h_key,
-                           char const * lp_value_name,
-                           uint32_t *   lp_reserved,
-                           uint32_t *   lp_type,
-                           uint8_t *    lp_data,
-                           uint32_t *   lpcb_data ) {
-  LOG_ERR(( "[TODO] ADVAPI32_RegQueryValueExA(%p, \"%s\", %p, %p, %p, %p)",
-          h_key,
-          lp_value_name,
-          lp_reserved,
-          lp_type,
-          lp_data,
-          lpcb_data ));
-  return ERROR_ACCESS_DENIED;
+/* compat_stat_list: Adds all entries of directory d to the table, and
+   hands their names to the case index. */
+static void
+compat_stat_list( struct compat_stat_ent * d ) {
+  d->misses = UINT16_MAX;  /* don't try again */
+  int fd = open( d->path[0] ? d->path : ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC );
+  if( fd<0 ) {
+    if( errno==ENOENT ) d->kind = COMPAT_STAT_ABSENT;
+    return;
+  }
+  size_t dlen = strlen( d->path );
+  char   path[ PATH_MAX ];
+  memcpy( path, d->path, dlen );
+  if( dlen && path[dlen-1]!='/' ) path[ dlen++ ] = '/';
+
+  char *   names = NULL;  /* NUL separated */
+  size_t   len   = 0, cap = 0;
+  uint32_t cnt   = 0;
+  int      ok    = 1;
+  static struct compat_dir dir;
+  compat_dir_open( &dir, fd );
+  for(;;) {
+    struct compat_dirent64 const * de = compat_dir_next( &dir );
+    if( !de ) {
+      ok = !errno;
+      break;
+    }
+    size_t nlen = strlen( de->d_name );
+    /* The case index keeps "." and "..", for paths that go up */
+    if( len+nlen+1>cap ) {
+      cap = ( len+nlen+1 )*2;
+      char * grown = realloc( names, cap );
+      if( !grown ) { ok = 0; break; }
+      names = grown;
+    }
+    memcpy( names+len, de->d_name, nlen+1 );
+    len += nlen+1;
+    cnt++;
+    if( 0==strcmp( de->d_name, "." ) || 0==strcmp( de->d_name, ".." ) || dlen+nlen>=sizeof(path) ) continue;
+    memcpy( path+dlen, de->d_name, nlen );
+    struct compat_stat_ent * e = compat_stat_find( path, dlen+nlen, 1 );
+    if( !e ) { ok = 0; break; }
+    if( e->kind==COMPAT_STAT_UNKNOWN || e->kind==COMPAT_STAT_ABSENT ) {
+      /* Symlinks and unknown types are stat'ed when asked for */
+      e->kind = de->d_type==DT_REG ? COMPAT_STAT_FILE :
+                de->d_type==DT_DIR ? COMPAT_STAT_DIR  : COMPAT_STAT_UNKNOWN;
+    }
+  }
+  close( fd );
+  if( !ok ) {
+    free( names );
+    return;
+  }
+  d->kind   = COMPAT_STAT_DIR;
+  d->listed = 1;
+  g_statc.listed++;
+  compat_case_index( d->path, names, len, cnt );
 }
 
-WIN32_STDCALL
-int32_t
-ADVAPI32_RegCloseKey( void * h_key ) {
-  LOG_ERR(( "[TODO] ADVAPI32_RegCloseKey(%p)", h_key ));
-  return ERROR_ACCESS_DENIED;
+/* compat_stat_peek: Returns what is known about path without syscalls. */
+static int
+compat_stat_peek( char const * path ) {
+  if( g_statc.off ) return COMPAT_STAT_UNKNOWN;
+  size_t n = strlen( path );
+  struct compat_stat_ent * e = compat_stat_find( path, n, 0 );
+  if( e && e->kind!=COMPAT_STAT_UNKNOWN ) {
+    g_statc.hits++;
+    return e->kind;
+  }
+  if( e || !n || path[n-1]=='/' ) return COMPAT_STAT_UNKNOWN;
+  struct compat_stat_ent * d = compat_stat_find( path, compat_stat_parent( path ), 0 );
+  if( d && ( d->listed || d->kind==COMPAT_STAT_ABSENT ) ) {
+    g_statc.hits++;
+    return COMPAT_STAT_ABSENT;
+  }
+  return COMPAT_STAT_UNKNOWN;
 }
 
-WIN32_STDCALL
-int32_t
-KERNEL32_IsBadReadPtr( void const * lp,
-                       uint32_t     ucb ) {
-  LOG_ERR(( "[TODO] KERNEL32_IsBadReadPtr(%p, %x)", lp, ucb ));
-  abort();
-  return 1;
+/* compat_stat_note: Records what a syscall found out about path. */
+static void
+compat_stat_note( char const * path,
+                  int          kind ) {
+  if( g_statc.off ) return;
+  g_statc.misses++;
+  struct compat_stat_ent * e = compat_stat_find( path, strlen( path ), 1 );
+  if( e ) e->kind = (uint8_t)kind;
+  if( kind!=COMPAT_STAT_ABSENT ) return;
+  struct compat_stat_ent * d = compat_stat_find( path, compat_stat_parent( path ), 1 );
+  if( d && !d->listed && d->misses<UINT16_MAX && ++d->misses>=COMPAT_STAT_LIST_AFTER )
+    compat_stat_list( d );
 }
 
-WIN32_STDCALL
-void
-KERNEL32_RtlUnwind( void * target_frame,
-                    void * target_ip,
-                    void * exception_record,
-                    void * return_value ) {
-  puts( "KERNEL32_RtlUnwind" );
+/* compat_stat_forget: Marks path as changed by this process. */
+static void
+compat_stat_forget( char const * path ) {
+  compat_case_forget( path );
+  if( g_statc.off ) return;
+  struct compat_stat_ent * e = compat_stat_find( path, strlen( path ), 1 );
+  if( e ) {
+    e->kind   = COMPAT_STAT_UNKNOWN;
+    e->listed = 0;
+  }
+  /* Without an entry, a listed parent would report path missing */
+  else compat_stat_reset();
 }
 
-WIN32_STDCALL
-void
-KERNEL32_ExitProcess( uint32_t exit_code ) {
-  LOG_INFO(( "KERNEL32_ExitProcess(%d)", exit_code ));
-  exit( exit_code );
+/* compat_stat_lookup: Returns whether path exists, and as what. */
+static int
+compat_stat_lookup( char const * path ) {
+  int kind = compat_stat_peek( path );
+  if( kind!=COMPAT_STAT_UNKNOWN ) return kind;
+  struct stat64 st;
+  if(      stat64( path, &st )<0   ) kind = COMPAT_STAT_ABSENT;
+  else if( S_ISDIR( st.st_mode )   ) kind = COMPAT_STAT_DIR;
+  else                               kind = COMPAT_STAT_FILE;
+  compat_stat_note( path, kind );
+  return kind;
 }
 
-WIN32_STDCALL
-int32_t
-KERNEL32_GetCurrentProcess( void ) {
-  return -1;
+/* Case-insensitive paths
+
+   With WIN32_IGNORE_CASE=1, translated paths that do not exist as
+   spelled are resolved one component at a time against a case-folded
+   index of each directory, built from the names compat_stat_list reads
+   the first time the directory is searched or listed.  Paths that
+   exist as spelled only cost the (cached) lookup.  If a directory holds
+   several names equal up to case and none matches exactly, the first
+   is used and a warning is logged.  Indexes are dropped along with the
+   stat cache. */
+
+#define COMPAT_CASE_BUCKETS 1024U
+
+struct compat_case_dir {
+  struct compat_case_dir * next;
+  uint32_t                 hash;    /* of path */
+  uint32_t                 mask;    /* slot count-1 */
+  uint32_t *               slot;    /* offset into names+1, 0 if free */
+  char *                   names;   /* NUL separated */
+  int                      warned;
+  char                     path[];
+};
+
+static struct {
+  int                      on;
+  struct compat_case_dir * bucket[ COMPAT_CASE_BUCKETS ];
+} g_case;
+
+static uint32_t
+compat_case_hash( char const * s,
+                  size_t       n ) {
+  uint32_t h = 2166136261U;
+  for( size_t i=0; i<n; i++ ) h = ( h^(uint8_t)tolower( (uint8_t)s[i] ) )*16777619U;
+  return h;
 }
 
-WIN32_STDCALL
-int32_t
-KERNEL32_DuplicateHandle( uint32_t   h_source_process_handle,
-                          uint32_t   h_source_handle,
-                          uint32_t   h_target_process_handle,
-                          uint32_t * lp_target_handle,
-                          uint32_t   dw_desired_access,
-                          int32_t    b_inherit_handle,
-                          uint32_t   dw_options ) {
-  LOG_TRACE(( "KERNEL32_DuplicateHandle(%u, %u, %u, %p, %x, %x, %x)",
-              h_source_process_handle, h_source_handle,
-              h_target_process_handle, lp_target_handle,
-              dw_desired_access, b_inherit_handle, dw_options ));
+static void
+compat_case_free( struct compat_case_dir * d ) {
+  free( d->slot );
+  free( d->names );
+  free( d );
+}
 
-  /* Check handle type */
-  compat_handle_t * hdl = compat_handle_get( h_source_handle );
-  if( !hdl || hdl->close!=compat_handle_file_close ) {
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+static void
+compat_case_reset( void ) {
+  for( uint32_t b=0; b<COMPAT_CASE_BUCKETS; b++ ) {
+    while( g_case.bucket[b] ) {
+      struct compat_case_dir * d = g_case.bucket[b];
+      g_case.bucket[b] = d->next;
+      compat_case_free( d );
+    }
   }
+}
 
-  FILE * f = (FILE *)hdl->data;
+/* compat_case_forget: Drops the index of the directory holding path. */
+static void
+compat_case_forget( char const * path ) {
+  size_t   n = compat_stat_parent( path );
+  uint32_t h = compat_stat_hash( path, n );
+  for( struct compat_case_dir ** p=&g_case.bucket[ h%COMPAT_CASE_BUCKETS ]; *p; p=&(*p)->next ) {
+    struct compat_case_dir * d = *p;
+    if( d->hash==h && 0==strncmp( d->path, path, n ) && !d->path[n] ) {
+      *p = d->next;
+      compat_case_free( d );
+      return;
+    }
+  }
+}
 
-  int dup_fd = dup( fileno( f ) );
-  if( dup_fd<0 ) {
-    LOG_WARN(( "KERNEL32_DuplicateHandle: dup() failed: %s", strerror( errno ) ));
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+/* compat_case_index: Builds the index of directory path from its n
+   entries in names, which it takes over. */
+static void
+compat_case_index( char const * path,
+                   char *       names,
+                   size_t       len,
+                   uint32_t     cnt ) {
+  if( !g_case.on ) {
+    free( names );
+    return;
+  }
+  size_t   n = strlen( path );
+  uint32_t h = compat_stat_hash( path, n );
+  struct compat_case_dir ** head = &g_case.bucket[ h%COMPAT_CASE_BUCKETS ];
+  for( struct compat_case_dir ** p=head; *p; p=&(*p)->next ) {
+    struct compat_case_dir * d = *p;
+    if( d->hash==h && 0==strcmp( d->path, path ) ) {
+      *p = d->next;
+      compat_case_free( d );
+      break;
+    }
   }
 
-  FILE * dup_f;
-  /*switch( dw_desired_access ) {
-  // Missing DUPLICATE_SAME_ACCESS mode
-  case 0x80000000: dup_f = fdopen( dup_fd, "rb"  ); break;
-  case 0x40000000: dup_f = fdopen( dup_fd, "wb"  ); break;
-  case 0xc0000000: dup_f = fdopen( dup_fd, "wb+" ); break;
-  default:
-    LOG_ERR(( "Unsupported KERNEL32_DuplicateHandle desired_access mode 0x%08x", dw_desired_access ));
-    g_last_error = ERROR_INVALID_PARAMETER;
-    return INVALID_HANDLE_VALUE;
+  uint32_t slots = 16;
+  while( slots<cnt*2U ) slots *= 2;
+  struct compat_case_dir * d = calloc( 1, sizeof(struct compat_case_dir)+n+1 );
+  uint32_t * slot = calloc( slots, sizeof(uint32_t) );
+  if( !d || !slot ) {
+    free( names );
+    free( slot );
+    free( d );
+    return;
+  }
+  for( size_t off=0; off<len; off+=strlen( names+off )+1 ) {
+    uint32_t i = compat_case_hash( names+off, strlen( names+off ) );
+    while( slot[ i&(slots-1U) ] ) i++;
+    slot[ i&(slots-1U) ] = (uint32_t)off+1U;
   }
-  assert( dup_f );*/
-  dup_f = fdopen( dup_fd, "wb+" );
+  memcpy( d->path, path, n );
+  d->hash  = h;
+  d->mask  = slots-1U;
+  d->slot  = slot;
+  d->names = names;
+  d->next  = *head;
+  *head    = d;
+}
 
-  *lp_target_handle = compat_handle_alloc( dup_f, compat_handle_file_close );
-  return 1;
+/* compat_case_dir: Returns the index of directory path[0,n), "" being
+   the working directory.  NULL if it cannot be read. */
+static struct compat_case_dir *
+compat_case_dir( char const * path,
+                 size_t       n ) {
+  uint32_t h = compat_stat_hash( path, n );
+  for( int listed=0;; listed=1 ) {
+    for( struct compat_case_dir * d=g_case.bucket[ h%COMPAT_CASE_BUCKETS ]; d; d=d->next ) {
+      if( d->hash==h && 0==strncmp( d->path, path, n ) && !d->path[n] ) return d;
+    }
+    if( listed ) return NULL;
+    /* Listed once for the stat cache and the index */
+    struct compat_stat_ent * e = compat_stat_find( path, n, 1 );
+    if( !e ) return NULL;
+    compat_stat_list( e );
+  }
 }
 
-WIN32_STDCALL
-int32_t
-KERNEL32_GetLastError( void ) {
-  return g_last_error;
+/* compat_case_find: Returns the name in d matching name[0,n) up to case,
+   preferring an exact match, or NULL. */
+static char const *
+compat_case_find( struct compat_case_dir * d,
+                  char const *             name,
+                  size_t                   n ) {
+  char const * found = NULL;
+  for( uint32_t i=compat_case_hash( name, n ); d->slot[ i&d->mask ]; i++ ) {
+    char const * cand = d->names+d->slot[ i&d->mask ]-1U;
+    if( cand[n] || 0!=strncasecmp( cand, name, n ) ) continue;
+    if( 0==memcmp( cand, name, n ) ) return cand;
+    if( !found ) {
+      found = cand;
+    } else if( !d->warned ) {
+      d->warned = 1;
+      LOG_WARN(( "WIN32_IGNORE_CASE: \"%s\" and \"%s\" in \"%s\" differ only in case, using the first",
+                 found, cand, d->path[0] ? d->path : "." ));
+    }
+  }
+  return found;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_GetStdHandle( int32_t n_std_handle ) {
-  uint32_t h;
-  switch( n_std_handle ) {
-  case STD_INPUT_HANDLE  : h = compat_stdin;  break;
-  case STD_OUTPUT_HANDLE : h = compat_stdout; break;
-  case STD_ERROR_HANDLE  : h = compat_stderr; break;
-  default:
-    h = INVALID_HANDLE_VALUE;
+/* compat_case_resolve: Rewrites the components of path to the case they
+   have on disk, as far as they exist. */
+static void
+compat_case_resolve( char * path ) {
+  if( compat_stat_lookup( path )!=COMPAT_STAT_ABSENT ) return;
+  char * comp = path;
+  while( *comp=='/' ) comp++;
+  while( *comp ) {
+    char * end = strchr( comp, '/' );
+    size_t n   = end ? (size_t)( end-comp ) : strlen( comp );
+    /* The directory is everything before comp, without the slash */
+    size_t dlen = comp==path ? 0 : comp-path==1 ? 1 : (size_t)( comp-path-1 );
+    struct compat_case_dir * d = n ? compat_case_dir( path, dlen ) : NULL;
+    char const * name = d ? compat_case_find( d, comp, n ) : NULL;
+    if( n && !name ) return;
+    if( name ) memcpy( comp, name, n );
+    if( !end ) return;
+    comp = end+1;
   }
-  LOG_INFO(( "KERNEL32_GetStdHandle(%p) = %p", n_std_handle, h ));
-  return h;
 }
 
-WIN32_STDCALL
-void
-KERNEL32_InitializeCriticalSection( void * lp_critical_section ) {
-# ifdef HAS_THREADS
-  pthread_mutexattr_t attr;
-  pthread_mutexattr_init(&attr);
-  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutex_init( lp_critical_section, &attr );
-# endif /* HAS_THREADS */
+/* Background writer
+
+   With WIN32_ASYNC_WRITE=1, filled write-behind buffers are handed to a
+   writer thread through a single-producer single-consumer ring, so the
+   PE keeps compiling while its output goes to disk.  Anything that needs
+   the bytes on disk (reads, mappings, truncation, closing, process
+   creation and exit) first waits for the file's queued writes, and write
+   errors are reported there.  The thread only runs host code and blocks
+   all signals, and is restarted lazily after a fork. */
+
+#define COMPAT_AW_DEPTH 64U  /* queued buffers, power of two */
+
+struct compat_aw_req {
+  int       fd;
+  uint8_t * buf;   /* owned by the writer until done */
+  uint32_t  len;
+  uint64_t  off;
+  int *     err;   /* set to errno on failure */
+};
+
+static struct {
+  int                  on;       /* WIN32_ASYNC_WRITE */
+  pid_t                pid;      /* process the writer thread runs in */
+  uint32_t             head;     /* next request, written by the PE thread */
+  uint32_t             tail;     /* requests done, written by the writer */
+  int                  waiting;  /* PE thread blocks on done */
+  sem_t                items;
+  sem_t                done;
+  struct compat_aw_req ring[ COMPAT_AW_DEPTH ];
+} g_aw;
+
+static void *
+compat_aw_main( void * arg ) {
+  (void)arg;
+  for(;;) {
+    while( sem_wait( &g_aw.items )<0 ) {}
+    uint32_t tail = __atomic_load_n( &g_aw.tail, __ATOMIC_RELAXED );
+    struct compat_aw_req * r = &g_aw.ring[ tail%COMPAT_AW_DEPTH ];
+    for( uint32_t done=0; done<r->len; ) {
+      ssize_t n = pwrite64( r->fd, r->buf+done, r->len-done, (off64_t)( r->off+done ) );
+      if( n<0 && errno==EINTR ) continue;
+      if( n<=0 ) {
+        int zero = 0;
+        __atomic_compare_exchange_n( r->err, &zero, n<0 ? errno : ENOSPC, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+        break;
+      }
+      done += (uint32_t)n;
+    }
+    free( r->buf );
+    __atomic_store_n( &g_aw.tail, tail+1U, __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &g_aw.waiting, __ATOMIC_SEQ_CST ) ) sem_post( &g_aw.done );
+  }
+  return NULL;
 }
 
-WIN32_STDCALL
-void
-KERNEL32_DeleteCriticalSection( void * lp_critical_section ) {
-  LOG_TRACE(( "KERNEL32_DeleteCriticalSection(%p)", lp_critical_section ));
-# ifdef HAS_THREADS
-  pthread_mutex_destroy( lp_critical_section );
-# endif /* HAS_THREADS */
+/* compat_aw_start: Starts the writer thread in this process.  Returns 0
+   if it cannot, writes are then done in place. */
+static int
+compat_aw_start( void ) {
+  g_aw.head    = 0;
+  g_aw.tail    = 0;
+  g_aw.waiting = 0;
+  sem_init( &g_aw.items, 0, 0 );
+  sem_init( &g_aw.done,  0, 0 );
+
+  sigset_t all, old;
+  sigfillset( &all );
+  pthread_sigmask( SIG_SETMASK, &all, &old );
+  pthread_attr_t attr;
+  pthread_attr_init( &attr );
+  pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+  pthread_attr_setstacksize( &attr, 64U<<10 );
+  pthread_t tid;
+  int res = pthread_create( &tid, &attr, compat_aw_main, NULL );
+  pthread_attr_destroy( &attr );
+  pthread_sigmask( SIG_SETMASK, &old, NULL );
+  if( res ) {
+    LOG_WARN(( "WIN32_ASYNC_WRITE: cannot start writer thread: %s", strerror( res ) ));
+    g_aw.on = 0;
+    return 0;
+  }
+  g_aw.pid = getpid();
+  return 1;
 }
 
-WIN32_STDCALL
-void
-KERNEL32_EnterCriticalSection( void * lp_critical_section ) {
-  LOG_TRACE(( "KERNEL32_EnterCriticalSection(%p)", lp_critical_section ));
-# ifdef HAS_THREADS
-  pthread_mutex_lock( lp_critical_section );
-# endif /* HAS_THREADS */
+/* compat_aw_wait: Waits until the writer has finished request seq-1. */
+static void
+compat_aw_wait( uint32_t seq ) {
+  if( (int32_t)( __atomic_load_n( &g_aw.tail, __ATOMIC_SEQ_CST )-seq )>=0 ) return;
+  __atomic_store_n( &g_aw.waiting, 1, __ATOMIC_SEQ_CST );
+  while( (int32_t)( __atomic_load_n( &g_aw.tail, __ATOMIC_SEQ_CST )-seq )<0 )
+    sem_wait( &g_aw.done );
+  __atomic_store_n( &g_aw.waiting, 0, __ATOMIC_SEQ_CST );
 }
 
-WIN32_STDCALL
-void
-KERNEL32_LeaveCriticalSection( void * lp_critical_section ) {
-# ifdef HAS_THREADS
-  pthread_mutex_unlock( lp_critical_section );
-# endif /* HAS_THREADS */
+/* compat_aw_push: Queues writing buf, which the writer frees, and sets
+   *seq to wait for.  Returns 0 with buf untouched if writes cannot be
+   queued. */
+static int
+compat_aw_push( int        fd,
+                uint8_t *  buf,
+                uint32_t   len,
+                uint64_t   off,
+                int *      err,
+                uint32_t * seq ) {
+  if( g_aw.pid!=getpid() && !compat_aw_start() ) return 0;
+  uint32_t head = g_aw.head;
+  compat_aw_wait( head-COMPAT_AW_DEPTH+1U );  /* for a free slot */
+  g_aw.ring[ head%COMPAT_AW_DEPTH ] = (struct compat_aw_req){
+    .fd = fd, .buf = buf, .len = len, .off = off, .err = err
+  };
+  __atomic_store_n( &g_aw.head, head+1U, __ATOMIC_RELEASE );
+  sem_post( &g_aw.items );
+  *seq = head+1U;
+  return 1;
 }
 
-/* FindFile API */
+#define COMPAT_FILE_BUF_MIN (16U<<10)
+#define COMPAT_FILE_BUF_MAX (256U<<10)
+
+struct compat_file {
+  int       fd;
+  uint32_t  ref;       /* handles sharing this file (DuplicateHandle) */
+  int       stream;    /* standard handle, no positional I/O */
+  int       shared;    /* open through another handle too, unbuffered */
+  int       dirty;     /* buf holds pending writes, not read-ahead */
+  uint64_t  off;       /* file pointer */
+  uint64_t  size;      /* file size including pending writes */
+  uint8_t * buf;
+  uint32_t  buf_cap;
+  uint32_t  buf_len;
+  uint32_t  ra;        /* next read-ahead size */
+  uint64_t  buf_off;   /* file offset of buf[0] */
+  struct compat_fcache_ent * ent;  /* content if served from the cache, fd is -1 */
+  char *    publish;   /* target path while writing to a temporary */
+  char *    tmp;       /* name of that temporary, NULL if unnamed */
+  int       err;       /* errno of a failed write not yet reported */
+  int       lost;      /* errno of writes lost in compat_file_flush_all */
+  uint64_t  dev;
+  uint64_t  ino;
+  int       aw_pending;
+  uint32_t  aw_seq;    /* background write to wait for */
+};
 
-#define COMPAT_FINDFILE_PATSZ 256
+static struct compat_file *
+compat_file_new( int fd,
+                 int stream ) {
+  struct compat_file * f = calloc( 1, sizeof(struct compat_file) );
+  if( !f ) return NULL;
+  f->fd     = fd;
+  f->ref    = 1;
+  f->stream = stream;
+  f->ra     = COMPAT_FILE_BUF_MIN;
+  struct stat64 st;
+  if( !stream && fstat64( fd, &st )==0 ) {
+    f->size = (uint64_t)st.st_size;
+    f->dev  = (uint64_t)st.st_dev;
+    f->ino  = (uint64_t)st.st_ino;
+  }
+  return f;
+}
 
-struct compat_findfile {
-  DIR * dir;
-  char pattern[ COMPAT_FINDFILE_PATSZ ];
-};
+static struct compat_file *
+compat_file_new_cached( struct compat_fcache_ent * ent ) {
+  struct compat_file * f = calloc( 1, sizeof(struct compat_file) );
+  if( !f ) return NULL;
+  f->fd   = -1;
+  f->ref  = 1;
+  f->size = ent->size;
+  f->ent  = ent;
+  return f;
+}
 
-/* compat_findfile_match: implements basic wildcard matching.
-   question marks not handled yet. */
 static int
-compat_findfile_match( char const * name,
-                       char const * pat ) {
-  char const * wild;
-  wild = strchr( pat, '*' );
+compat_file_reserve( struct compat_file * f,
+                     uint32_t             cap ) {
+  if( f->buf_cap>=cap ) return 1;
+  uint8_t * buf = realloc( f->buf, cap );
+  if( !buf ) return 0;
+  f->buf     = buf;
+  f->buf_cap = cap;
+  return 1;
+}
 
-  if( wild==NULL ) return 0==strcmp( name, pat );
-  if( wild==pat  ) return 1;
+/* compat_file_drain: Waits for the background writes of f. */
+static void
+compat_file_drain( struct compat_file * f ) {
+  if( !f->aw_pending ) return;
+  compat_aw_wait( f->aw_seq );
+  f->aw_pending = 0;
+}
 
-  return 0==strncmp( name, pat, wild-pat );
+/* compat_file_queue: Hands buf over to the background writer.  Returns
+   0 if it is not used, buf then still belongs to the caller. */
+static int
+compat_file_queue( struct compat_file * f,
+                   uint8_t *            buf,
+                   uint32_t             len,
+                   uint64_t             off ) {
+  if( !g_aw.on || !compat_aw_push( f->fd, buf, len, off, &f->err, &f->aw_seq ) ) return 0;
+  f->aw_pending = 1;
+  return 1;
 }
 
-static void
-compat_findfile_dirent( struct dirent * ent,
-                        WIN32_FIND_DATAA * lp_find_file_data ) {
-  if( ent->d_type==DT_DIR ) {
-    lp_find_file_data->dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY;
-  } else {
-    lp_find_file_data->dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+/* compat_file_pwrite: Writes n bytes at off in place. */
+static int
+compat_file_pwrite( struct compat_file * f,
+                    uint8_t const *      p,
+                    size_t               left,
+                    uint64_t             off ) {
+  compat_file_drain( f );
+  while( left ) {
+    ssize_t n = pwrite64( f->fd, p, left, (off64_t)off );
+    if( n<0 && errno==EINTR ) continue;
+    if( n==0 ) errno = ENOSPC;
+    if( n<=0 ) return 0;
+    p    += n;
+    left -= (size_t)n;
+    off  += (uint64_t)n;
   }
-  lp_find_file_data->ftCreationTime  .dwLowDateTime  = 0;
-  lp_find_file_data->ftCreationTime  .dwHighDateTime = 0;
-  lp_find_file_data->ftLastAccessTime.dwLowDateTime  = 0;
-  lp_find_file_data->ftLastAccessTime.dwHighDateTime = 0;
-  lp_find_file_data->ftLastWriteTime .dwLowDateTime  = 0;
-  lp_find_file_data->ftLastWriteTime .dwHighDateTime = 0;
-  lp_find_file_data->nFileSizeHigh = 0;
-  lp_find_file_data->nFileSizeLow  = 0;
-  strncpy( lp_find_file_data->cFileName, ent->d_name, 259 );
-  lp_find_file_data->cAlternateFileName[0] = '\0';
+  return 1;
 }
 
+/* compat_file_submit: Starts writing out pending writes, in the
+   background if enabled.  Returns 0 if they or earlier background
+   writes failed, in which case those are lost. */
 static int
-compat_findfile_next( struct compat_findfile * ff,
-                      WIN32_FIND_DATAA *       lp_find_file_data ) {
-  struct dirent * ent;
-  while( (ent=readdir( ff->dir ))!=NULL ) {
-    if( compat_findfile_match( ent->d_name, ff->pattern ) ) {
-      compat_findfile_dirent( ent, lp_find_file_data );
-      return 1;
+compat_file_submit( struct compat_file * f ) {
+  if( f->dirty ) {
+    uint32_t cap = f->buf_cap;
+    f->dirty = 0;
+    if( compat_file_queue( f, f->buf, f->buf_len, f->buf_off ) ) {
+      f->buf     = NULL;
+      f->buf_cap = 0;
+      compat_file_reserve( f, cap );
+    } else if( !compat_file_pwrite( f, f->buf, f->buf_len, f->buf_off ) ) {
+      f->err = errno;
     }
+    f->buf_len = 0;
   }
-  return 0;
+  int err = __atomic_exchange_n( &f->err, 0, __ATOMIC_SEQ_CST );
+  if( err ) errno = err;
+  return !err;
 }
 
-static uint32_t
-compat_handle_findfile_close( void * opaque ) {
-  LOG_WARN(( "CloseHandle called on FindFirstFileA" ));
-  g_last_error = ERROR_INVALID_HANDLE;
-  return 0;
+/* compat_file_flush: Writes out pending writes and waits until they are
+   done.  Returns 0 on failure, in which case they are lost. */
+static int
+compat_file_flush( struct compat_file * f ) {
+  int ok = compat_file_submit( f );
+  compat_file_drain( f );
+  return compat_file_submit( f ) && ok;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_FindFirstFileA( char const *       lp_file_name,
-                         WIN32_FIND_DATAA * lp_find_file_data ) {
-  char dir_path[ PATH_MAX ];
+/* compat_file_read: Reads up to n bytes at the file pointer.  Returns
+   the number of bytes read, 0 at end of file, or -1 on error. */
+static ssize_t
+compat_file_read( struct compat_file * f,
+                  void *               dst,
+                  size_t               n ) {
+  uint8_t * out  = dst;
+  size_t    done = 0;
+
+  if( f->stream ) {
+    while( done<n ) {
+      ssize_t r = read( f->fd, out+done, n-done );
+      if( r<0 && errno==EINTR ) continue;
+      if( r<0 ) return done ? (ssize_t)done : -1;
+      if( r==0 ) break;
+      done += (size_t)r;
+    }
+    return (ssize_t)done;
+  }
 
-  uint32_t n = compat_winpath_to_posix( dir_path, sizeof(dir_path), lp_file_name );
-  if( n==0 ) {
-    LOG_TRACE(( "KERNEL32_FindFirstFileA: Cannot represent path \"%s\"", lp_file_name ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_FILE_ATTRIBUTES;
+  if( !compat_file_flush( f ) ) return -1;
+
+  if( f->shared ) {
+    while( done<n ) {
+      ssize_t r = pread64( f->fd, out+done, n-done, (off64_t)f->off );
+      if( r<0 && errno==EINTR ) continue;
+      if( r<0 ) return done ? (ssize_t)done : -1;
+      if( r==0 ) break;
+      done   += (size_t)r;
+      f->off += (uint64_t)r;
+    }
+    return (ssize_t)done;
   }
-  if( n>sizeof(dir_path) ) {
-    LOG_TRACE(( "KERNEL32_FindFirstFileA: Oversize unix path (%lu bytes)", n ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_FILE_ATTRIBUTES;
+
+  if( f->off>=f->size ) return 0;
+  if( n>f->size-f->off ) n = (size_t)( f->size-f->off );
+
+  if( f->ent ) {
+    memcpy( out, f->ent->data+f->off, n );
+    f->off            += n;
+    g_fcache.served   += n;
+    return (ssize_t)n;
   }
 
-  /* Split dir name and file name */
-  uint32_t pathsz;
-  char * name = strrchr( dir_path, '/' );
-  if( !name ) {
-    dir_path[0] = '.'; dir_path[1] = '\0';
-    pathsz = 1;
-    name = dir_path;
-  } else {
-    pathsz = name-dir_path;
-    if( pathsz > sizeof(dir_path)-1 ) {
-      LOG_WARN(( "FindFirstFileA: path too long (%d bytes)", pathsz ));
-      g_last_error = ERROR_INSUFFICIENT_BUFFER;
-      return 0;
+  while( done<n ) {
+    if( f->buf_len && f->off>=f->buf_off && f->off<f->buf_off+f->buf_len ) {
+      size_t k = (size_t)( f->buf_off+f->buf_len-f->off );
+      if( k>n-done ) k = n-done;
+      memcpy( out+done, f->buf+( f->off-f->buf_off ), k );
+      done   += k;
+      f->off += k;
+      continue;
+    }
+
+    /* Grow read-ahead while reads continue where the last one ended */
+    if( f->buf_len && f->off==f->buf_off+f->buf_len ) {
+      if( f->ra<COMPAT_FILE_BUF_MAX ) f->ra *= 2;
+    } else {
+      f->ra = COMPAT_FILE_BUF_MIN;
+    }
+
+    /* Large reads go straight to the caller's buffer */
+    int     direct = n-done>=f->ra || !compat_file_reserve( f, f->ra );
+    ssize_t r = direct ? pread64( f->fd, out+done, n-done, (off64_t)f->off )
+                       : pread64( f->fd, f->buf,   f->ra,  (off64_t)f->off );
+    if( r<0 && errno==EINTR ) continue;
+    if( r<0 ) return done ? (ssize_t)done : -1;
+    if( r==0 ) break;
+    if( direct ) {
+      done   += (size_t)r;
+      f->off += (uint64_t)r;
+    } else {
+      f->buf_off = f->off;
+      f->buf_len = (uint32_t)r;
     }
-    *name = '\0'; // split path into two separate strings
-    name++;
   }
+  return (ssize_t)done;
+}
 
-  if( strlen(name) >= COMPAT_FINDFILE_PATSZ ) {
-    LOG_WARN(( "FindFirstFileA: pattern too long (\"%s\"; %d bytes)", name, pathsz ));
-    g_last_error = ERROR_INSUFFICIENT_BUFFER;
-    return 0;
+/* compat_file_write: Writes n bytes at the file pointer.  Returns n, or
+   -1 on error.  Errors of buffered writes show up in a later call. */
+static ssize_t
+compat_file_write( struct compat_file * f,
+                   void const *         src,
+                   size_t               n ) {
+  uint8_t const * in = src;
+
+  if( f->ent ) {
+    errno = EBADF;
+    return -1;
   }
 
-  /* Open directory */
-  DIR * dir = opendir( dir_path );
-  if( !dir ) {
-    LOG_WARN(( "FindFirstFileA: opendir(\"%s\") failed: %s", dir_path, strerror( errno ) ));
-    g_last_error = ERROR_PATH_NOT_FOUND;
-    return 0;
+  if( f->stream ) {
+    size_t done = 0;
+    while( done<n ) {
+      ssize_t w = write( f->fd, in+done, n-done );
+      if( w<0 && errno==EINTR ) continue;
+      if( w<=0 ) return -1;
+      done += (size_t)w;
+    }
+    return (ssize_t)n;
   }
 
-  /* Create compat handle */
-  struct compat_findfile * find = calloc(1, sizeof(struct compat_findfile));
-  find->dir = dir;
-  strcpy( find->pattern, name );
+  if( f->shared ) {
+    if( !compat_file_pwrite( f, in, n, f->off ) ) return -1;
+    f->off += n;
+    return (ssize_t)n;
+  }
 
-  if( !compat_findfile_next( find, lp_find_file_data ) ) {
-    /* Don't alloc handle if no file matches */
-    closedir( dir );
-    free( find );
-    LOG_DEBUG(( "FindFirstFileA(\"%s\"): not found", lp_file_name ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_HANDLE_VALUE;
+  if( f->dirty ) {
+    int seq = f->off==f->buf_off+f->buf_len;
+    if( !seq || n>f->buf_cap-f->buf_len ) {
+      if( !compat_file_submit( f ) ) return -1;
+      /* A sequential writer filled the buffer */
+      if( seq && f->buf_cap<COMPAT_FILE_BUF_MAX ) compat_file_reserve( f, f->buf_cap*2 );
+    }
+  }
+  if( !f->dirty ) {
+    /* Drop read-ahead, it may overlap the written range */
+    f->buf_len = 0;
+    f->buf_off = f->off;
+    compat_file_reserve( f, COMPAT_FILE_BUF_MIN );
   }
 
-  /* Create handle for finding further files */
-  uint32_t h = compat_handle_alloc( (void *)find, compat_handle_findfile_close );
-  LOG_DEBUG(( "FindFirstFileA(\"%s\"): found \"%s\"", lp_file_name, lp_find_file_data->cFileName ));
-  g_last_error = ERROR_SUCCESS;
-  return h;
+  if( n>f->buf_cap-f->buf_len ) {
+    uint8_t * copy = g_aw.on ? malloc( n ) : NULL;
+    if( copy ) memcpy( copy, in, n );
+    if( !copy || !compat_file_queue( f, copy, (uint32_t)n, f->off ) ) {
+      free( copy );
+      if( !compat_file_pwrite( f, in, n, f->off ) ) return -1;
+    }
+  } else {
+    memcpy( f->buf+f->buf_len, in, n );
+    f->buf_len += (uint32_t)n;
+    f->dirty    = 1;
+  }
+  f->off += n;
+  if( f->off>f->size ) f->size = f->off;
+  return (ssize_t)n;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_FindNextFileA( uint32_t h_find_file,
-                        void *   lp_find_file_data ) {
-  compat_handle_t * h = compat_handle_get( h_find_file );
-  if( !h ) {
-    LOG_ERR(( "KERNEL32_FindNextFileA: invalid handle %u", h ));
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+static int64_t
+compat_file_size( struct compat_file * f ) {
+  if( !f->stream && !f->shared ) return (int64_t)f->size;
+  struct stat64 st;
+  if( fstat64( f->fd, &st )<0 ) return -1;
+  return (int64_t)st.st_size;
+}
+
+/* compat_file_seek: Moves the file pointer.  Returns the new position,
+   or -1 on error. */
+static int64_t
+compat_file_seek( struct compat_file * f,
+                  int64_t              dist,
+                  int                  whence ) {
+  if( f->stream ) return lseek64( f->fd, dist, whence );
+  int64_t base = 0;
+  switch( whence ) {
+  case SEEK_CUR: base = (int64_t)f->off;       break;
+  case SEEK_END: base = compat_file_size( f ); break;
   }
+  if( base<0 ) return -1;
+  if( base+dist<0 ) {
+    errno = EINVAL;
+    return -1;
+  }
+  f->off = (uint64_t)( base+dist );
+  return (int64_t)f->off;
+}
 
-  struct compat_findfile * find = (struct compat_findfile *)h->data;
+/* Atomic output
 
-  if( !compat_findfile_next( find, lp_find_file_data ) ) {
-    LOG_DEBUG(( "KERNEL32_FindNextFileA(%u, %p): not found", h_find_file, lp_find_file_data ));
-    g_last_error = ERROR_NO_MORE_FILES;
-    return 0;
+   With WIN32_ATOMIC_WRITE=1, files opened for writing start out as an
+   unnamed O_TMPFILE in the target directory and replace the target path
+   when the last handle is closed, so a partially written object is never
+   visible.  If the target already holds the same bytes it is left alone,
+   keeping its mtime so that make and ninja skip dependent steps. */
+
+static int    g_publish;       /* WIN32_ATOMIC_WRITE */
+static mode_t g_publish_mode;  /* 0666 minus umask, for named temporaries */
+
+/* compat_file_open_tmp: Creates a temporary for writing path.  Falls
+   back to a named "<path>.XXXXXX" returned in *tmp where the file system
+   lacks O_TMPFILE.  It is opened for reading too, compat_file_same
+   compares it with the target. */
+static int
+compat_file_open_tmp( char const * path,
+                      char **      tmp ) {
+  char         dir[ PATH_MAX ];
+  char const * slash = strrchr( path, '/' );
+  size_t       dlen  = slash ? (size_t)( slash-path ) : 0;
+  if( !slash )      strcpy( dir, "." );
+  else if( !dlen )  strcpy( dir, "/" );
+  else            { memcpy( dir, path, dlen ); dir[ dlen ] = '\0'; }
+
+  *tmp = NULL;
+  int fd = open( dir, O_TMPFILE|O_RDWR|O_CLOEXEC, 0666 );
+  if( fd>=0 || ( errno!=EOPNOTSUPP && errno!=EISDIR && errno!=EINVAL ) ) return fd;
+
+  size_t n    = strlen( path );
+  char * name = malloc( n+8 );
+  if( !name ) return -1;
+  memcpy( name,   path,      n );
+  memcpy( name+n, ".XXXXXX", 8 );
+  fd = mkostemp( name, O_CLOEXEC );
+  if( fd<0 ) {
+    free( name );
+    return -1;
   }
+  fchmod( fd, g_publish_mode );
+  *tmp = name;
+  return fd;
+}
 
-  g_last_error = ERROR_SUCCESS;
-  return 1;
+/* compat_file_same: Returns 1 if path holds exactly the size bytes of fd. */
+static int
+compat_file_same( int          fd,
+                  uint64_t     size,
+                  char const * path ) {
+  int old = open( path, O_RDONLY|O_CLOEXEC );
+  if( old<0 ) return 0;
+  struct stat64 st;
+  int same = fstat64( old, &st )==0 && S_ISREG( st.st_mode ) && (uint64_t)st.st_size==size;
+  static uint8_t a[ 1<<16 ], b[ 1<<16 ];
+  for( uint64_t off=0; same && off<size; ) {
+    size_t  want = size-off<sizeof(a) ? (size_t)( size-off ) : sizeof(a);
+    ssize_t x = pread64( fd,  a, want, (off64_t)off );
+    ssize_t y = pread64( old, b, want, (off64_t)off );
+    same = x>0 && x==y && 0==memcmp( a, b, (size_t)x );
+    off += (uint64_t)( x>0 ? x : 0 );
+  }
+  close( old );
+  return same;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_FindClose( uint32_t h_find_file ) {
-  compat_handle_t * h = compat_handle_get( h_find_file );
-  if( !h ) {
-    if( h_find_file!=INVALID_HANDLE_VALUE )
-      LOG_ERR(( "KERNEL32_FindClose: invalid handle %u", h ));
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+/* compat_file_publish: Moves the flushed temporary of f over its target,
+   unless the target already holds the same bytes.  Only done once the
+   output is complete, when the handle is closed or at exit.  Returns 0
+   on failure. */
+static int
+compat_file_publish( struct compat_file * f ) {
+  char * path = f->publish;
+  if( !path ) return 1;
+  f->publish = NULL;
+
+  int ok;
+  if( compat_file_same( f->fd, f->size, path ) ) {
+    LOG_DEBUG(( "CloseHandle: %s unchanged, keeping it", path ));
+    ok = !f->tmp || unlink( f->tmp )==0;
+  } else if( f->tmp ) {
+    ok = rename( f->tmp, path )==0;
+  } else {
+    /* linkat cannot replace the target, so link to a side name first */
+    char proc[ 32 ], side[ PATH_MAX+16 ];
+    snprintf( proc, sizeof(proc), "/proc/self/fd/%d", f->fd );
+    snprintf( side, sizeof(side), "%s.%d~", path, (int)getpid() );
+    unlink( side );
+    ok = linkat( AT_FDCWD, proc, AT_FDCWD, side, AT_SYMLINK_FOLLOW )==0;
+    if( ok && rename( side, path )!=0 ) {
+      unlink( side );
+      ok = 0;
+    }
   }
+  if( !ok ) LOG_WARN(( "CloseHandle: cannot publish %s: %s", path, strerror( errno ) ));
+  compat_stat_forget( path );
+  free( f->tmp );
+  f->tmp = NULL;
+  free( path );
+  return ok;
+}
 
-  struct compat_findfile * find = (struct compat_findfile *)h->data;
-  closedir( find->dir );
+static uint32_t compat_handle_file_close( void * data );
 
-  free( find );
-  compat_handle_free( h_find_file );
-  g_last_error = ERROR_SUCCESS;
-  return 1;
+/* compat_file_discard: Drops the unpublished output of open handles to
+   path, for DeleteFileA. Returns the number of outputs dropped. */
+static uint32_t
+compat_file_discard( char const * path ) {
+  uint32_t cnt = 0;
+  for( uint32_t h=1; h<=handle_nonce && h<COMPAT_HANDLE_CNT; h++ ) {
+    if( compat_handles[h].close!=compat_handle_file_close ) continue;
+    struct compat_file * f = (struct compat_file *)compat_handles[h].data;
+    if( !f->publish || 0!=strcmp( f->publish, path ) ) continue;
+    if( f->tmp ) unlink( f->tmp );
+    free( f->tmp );
+    free( f->publish );
+    f->tmp     = NULL;
+    f->publish = NULL;
+    cnt++;
+  }
+  return cnt;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_GetFileAttributesA( char const * lp_file_name ) {
-  /* Special case: Check if program requested */
-  static char sys32[] = "C:\\Windows\\System32\\";
-  if( 0==strncmp( lp_file_name, sys32, strlen( sys32 ) ) &&
-      !strchr( lp_file_name+strlen( sys32 ), '\\' ) &&
-      strstr( lp_file_name+strlen( sys32 ), ".elf.exe" ) ) {
-    LOG_TRACE(( "KERNEL32_GetFileAttributesA: asking for program %s", lp_file_name ));
-    g_last_error = ERROR_SUCCESS;
-    return FILE_ATTRIBUTE_NORMAL;
+/* compat_file_unbuffer: Writes out pending writes of f and stops
+   buffering on it.  Returns 0 if the writes failed. */
+static int
+compat_file_unbuffer( struct compat_file * f ) {
+  if( f->stream || f->ent ) return 1;
+  f->shared  = 1;
+  int ok = compat_file_flush( f );
+  f->buf_len = 0;  /* read-ahead */
+  return ok;
+}
+
+/* compat_file_share: Called before opening path.  Handles already open
+   on the same file stop buffering, so that each handle sees the writes
+   and size of the others.  Returns 1 if there are any, the new handle
+   must then not buffer or use the content cache either. */
+static int
+compat_file_share( char const * path ) {
+  struct stat64 st;
+  int known = 0, shared = 0;
+  for( uint32_t h=1; h<=handle_nonce && h<COMPAT_HANDLE_CNT; h++ ) {
+    if( compat_handles[h].close!=compat_handle_file_close ) continue;
+    struct compat_file * f = (struct compat_file *)compat_handles[h].data;
+    if( f->stream || f->ent ) continue;
+    if( !known ) {
+      if( stat64( path, &st )<0 ) return 0;
+      known = 1;
+    }
+    if( f->dev!=(uint64_t)st.st_dev || f->ino!=(uint64_t)st.st_ino ) continue;
+    if( !compat_file_unbuffer( f ) ) {
+      LOG_WARN(( "handle %u: pending writes failed: %s", h, strerror( errno ) ));
+      if( !f->lost ) f->lost = errno;
+    }
+    shared = 1;
   }
+  return shared;
+}
 
-  /* Special case: Mock license.dat */
-  if( 0==strcmp( lp_file_name, "L:\\license.dat" ) ) {
-    LOG_TRACE(( "KERNEL32_GetFileAttributesA: Reporting \"%s\" as exist", lp_file_name ));
-    g_last_error = ERROR_SUCCESS;
-    return FILE_ATTRIBUTE_NORMAL;
+/* compat_file_flush_all: Writes out pending writes of all open files
+   and stops buffering them, for a child process that may use them.
+   When exiting, also publishes their atomic outputs; until then a
+   half-written output stays hidden.  Returns the number of files that
+   could not be written; CloseHandle fails on them too. */
+static uint32_t
+compat_file_flush_all( int exiting ) {
+  uint32_t failed = 0;
+  for( uint32_t h=1; h<=handle_nonce && h<COMPAT_HANDLE_CNT; h++ ) {
+    if( compat_handles[h].close!=compat_handle_file_close ) continue;
+    struct compat_file * f = (struct compat_file *)compat_handles[h].data;
+    if( !compat_file_unbuffer( f ) || ( exiting && !compat_file_publish( f ) ) ) {
+      LOG_WARN(( "handle %u: pending writes failed: %s", h, strerror( errno ) ));
+      if( !f->lost ) f->lost = errno;
+      failed++;
+    }
   }
+  return failed;
+}
 
-  /* Convert path to POSIX */
-  char path[ PATH_MAX ];
-  size_t n = compat_winpath_to_posix( path, sizeof(path), lp_file_name );
-  if( n==0 ) {
-    LOG_TRACE(( "KERNEL32_GetFileAttributesA: Cannot represent path \"%s\"", lp_file_name ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_FILE_ATTRIBUTES;
+static void
+compat_file_flush_exit( void ) {
+  compat_file_flush_all( 1 );
+}
+
+static uint32_t
+compat_handle_file_close( void * data ) {
+  struct compat_file * f = (struct compat_file *)data;
+  if( --f->ref ) {
+    g_last_error = ERROR_SUCCESS;
+    return 1;
   }
-  if( n>sizeof(path) ) {
-    LOG_TRACE(( "KERNEL32_GetFileAttributesA: Oversize unix path (%lu bytes)", n ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_FILE_ATTRIBUTES;
+  if( f->stream ) {
+    LOG_TRACE(( "CloseHandle: Ignoring request to close stdin/stdout/stderr" ));
+    f->ref = 1;
+    g_last_error = ERROR_SUCCESS;
+    return 1;
   }
-
-  /* Stat file */
-  struct stat posix_stat;
-  if( -1==stat( path, &posix_stat ) ) {
-    LOG_TRACE(( "KERNEL32_GetFileAttributesA: stat(\"%s\") failed: %s", path, strerror( errno ) ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_FILE_ATTRIBUTES;
+  if( f->ent ) {
+    compat_fcache_put( f->ent );
+    free( f );
+    g_last_error = ERROR_SUCCESS;
+    return 1;
+  }
+  LOG_TRACE(( "CloseHandle: closing fd %d", f->fd ));
+  /* Writes lost earlier leave the output incomplete */
+  int ok  = compat_file_flush( f ) && !f->lost && compat_file_publish( f );
+  if( f->lost ) errno = f->lost;
+  if( f->tmp ) unlink( f->tmp );  /* not published after a failed flush */
+  int res = close( f->fd );
+  if( res==0 && ok ) {
+    LOG_DEBUG(( "CloseHandle: close(%d)", f->fd ));
+    g_last_error = ERROR_SUCCESS;
+  } else {
+    LOG_WARN(( "CloseHandle: close(%d) failed: %s", f->fd, strerror( errno ) ));
+    g_last_error = ERROR_WRITE_FAULT;
   }
+  free( f->buf );
+  free( f->tmp );
+  free( f->publish );
+  free( f );
+  return res==0 && ok;
+}
 
-  /* Convert stat to KERNEL32 format */
-  uint32_t mode = 0;
-  if( S_ISDIR( posix_stat.st_mode )   ) mode |= FILE_ATTRIBUTE_DIRECTORY;
- // if( !(posix_stat.st_mode & S_IWUSR) ) mode |= FILE_ATTRIBUTE_READONLY;
-  if( mode==0U ) mode = FILE_ATTRIBUTE_NORMAL;
+/* Logging */
 
-  LOG_TRACE(( "KERNEL32_GetFileAttributesA(\"%s\") = 0x%08x", lp_file_name, mode ));
+int compat_log_level_ = LOGLVL_FATAL;
 
-  g_last_error = ERROR_SUCCESS;
-  return mode;
+__attribute__((format(printf,1,2)))
+char const *
+compat_log0_( char const * fmt, ... ) {
+  static __thread char msg[ 4096 ];
+  va_list ap;
+  va_start( ap, fmt );
+  int len = vsnprintf( msg, sizeof(msg), fmt, ap );
+  if( len<0               ) len = 0;
+  if( len>(sizeof(msg)-1) ) len = sizeof(msg)-1;
+  msg[ len ] = '\0';
+  va_end( ap );
+  return msg;
 }
 
-WIN32_STDCALL
-char *
-KERNEL32_GetCommandLineA( void ) {
-  static char * cmd = NULL;
-  if( cmd ) return cmd;
-
-  int argc     = g_argc-1;
-  char ** argv = g_argv+1;
-  char x;
+void
+compat_log1_( int level,
+              char const * msg ) {
+  if( level<0 || level>LOGLVL_FATAL || level<compat_log_level_ ) return;
 
-  char const * progname = __progname;
-  size_t progname_len = strlen( progname );
+  fprintf( stderr, "%s  %s\n", compat_level_str_[ level ], msg );
+}
 
-  /* Count number of chars required */
-  int arglen = progname_len + 4;
-  for( int i=0; i<argc; i++ ) {
-    arglen += 3; // quotes and space
-    char * arg = argv[i];
-    while( (x = *arg++) ) {
-      if( *arg == '"' )
-        arglen += 2;
-      else
-        arglen += 1;
-    }
-  }
+/* Binary trace
 
-  cmd = malloc( arglen );
-  assert( cmd );
+   With WIN32_TRACE=<file>, every shim in COMPAT_APIS appends a
+   compat_trace_ev_t to a ring buffer in a shared mapping of that file,
+   on each of its return paths.  The kernel owns the pages, so the ring
+   survives crashes of the process; on fatal paths the timestamp
+   calibration is updated and the tail of the ring is also printed to
+   stderr.  w32trace decodes the file. */
 
-  /* Copy program name */
-  char * c = cmd;
-  *c++ = '"';
-  memcpy( c, progname, progname_len );
-  c += progname_len;
-  *c++ = '"';
+static compat_trace_hdr_t * g_trace;
+static compat_trace_ev_t *  g_trace_ev;
+static uint16_t             g_trace_tid;
 
-  /* Copy arguments */
-  for( int i=0; i<argc; i++ ) {
-    *c++ = ' ';
-    *c++ = '"';
-    char * arg = argv[i];
-    while( (x = *arg++) ) {
-      if( x == '"' ) {
-        *c++ = '\\';
-        *c++ = '"';
-      } else {
-        *c++ = x;
-      }
-    }
-    *c++ = '"';
-  }
-  *c = '\0';
+#define COMPAT_TRACE_NAME_(n) #n,
+static char const * const g_trace_api_name[ COMPAT_API_CNT ] = {
+  COMPAT_APIS( COMPAT_TRACE_NAME_ )
+};
+#undef COMPAT_TRACE_NAME_
+
+static inline uint64_t
+compat_trace_tick( void ) {
+#if defined(__i386__) || defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
 
-  return cmd;
+static void
+compat_trace_rec( uint32_t api,
+                  uint32_t ret,
+                  uint32_t a0,
+                  uint32_t a1,
+                  uint32_t a2 ) {
+  uint32_t i = __atomic_fetch_add( &g_trace->head, 1U, __ATOMIC_RELAXED );
+  compat_trace_ev_t * ev = &g_trace_ev[ i&(g_trace->ev_cnt-1U) ];
+  ev->tick   = compat_trace_tick();
+  ev->api    = (uint16_t)api;
+  ev->tid    = g_trace_tid;
+  ev->ret    = ret;
+  ev->err    = g_last_error;
+  ev->arg[0] = a0;
+  ev->arg[1] = a1;
+  ev->arg[2] = a2;
 }
 
-static char * g_envstr = NULL;
+/* TRACE_API: Records a call to shim <name>.  A single load and branch
+   when tracing is off. */
+#define TRACE_API( name, ret, a0, a1, a2 )                               \
+  do {                                                                   \
+    if( __builtin_expect( !!g_trace, 0 ) )                               \
+      compat_trace_rec( COMPAT_API_##name, (uint32_t)(uintptr_t)(ret),   \
+                        (uint32_t)(uintptr_t)(a0),                       \
+                        (uint32_t)(uintptr_t)(a1),                       \
+                        (uint32_t)(uintptr_t)(a2) );                     \
+  } while(0)
+
+/* compat_trace_sync: Samples a second calibration point. */
+static void
+compat_trace_sync( void ) {
+  if( !g_trace ) return;
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  g_trace->tick1 = compat_trace_tick();
+  g_trace->ns1   = (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
-WIN32_STDCALL
-char *
-KERNEL32_GetEnvironmentStrings( void ) {
-  if( g_envstr ) return g_envstr;
+/* compat_trace_attach: Tags subsequent events with the calling thread. */
+static void
+compat_trace_attach( void ) {
+  g_trace_tid = (uint16_t)syscall( SYS_gettid );
+}
 
-  int envlen = 2;
-  char ** env = environ;
-  char * line;
-  while( (line = *env++) ) {
-    envlen += strlen( line ) + 1;
+void
+compat_trace_fatal( int sig ) {
+  if( !g_trace ) return;
+  g_trace->fatal_sig = sig;
+  compat_trace_sync();
+
+  uint32_t head = __atomic_load_n( &g_trace->head, __ATOMIC_RELAXED );
+  uint32_t cnt  = head<16U ? head : 16U;
+  fprintf( stderr, "trace: last %u of %u events (signal %d)\n", cnt, head, sig );
+  for( uint32_t i=head-cnt; i!=head; i++ ) {
+    compat_trace_ev_t const * ev = &g_trace_ev[ i&(g_trace->ev_cnt-1U) ];
+    fprintf( stderr, "trace: %8u %5u %s(%#x, %#x, %#x) = %#x (err %u)\n",
+             i, ev->tid,
+             ev->api<COMPAT_API_CNT ? g_trace_api_name[ ev->api ] : "?",
+             ev->arg[0], ev->arg[1], ev->arg[2], ev->ret, ev->err );
   }
+  msync( g_trace, sizeof(compat_trace_hdr_t) + g_trace->ev_cnt*sizeof(compat_trace_ev_t), MS_SYNC );
+}
 
-  g_envstr = malloc( envlen );
-  assert( g_envstr );
-  char * s = g_envstr;
+static void
+compat_trace_on_signal( int sig ) {
+  compat_trace_fatal( sig );
+  raise( sig );  /* SA_RESETHAND restored the default action */
+}
 
-  env = environ;
-  while( (line = *env++) ) {
-    char x;
-    while( (x = *line++) )
-      *s++ = x;
-    *s++ = '\0';
+static void
+compat_trace_init( char const * path ) {
+  size_t sz = sizeof(compat_trace_hdr_t) + COMPAT_TRACE_EV_CNT*sizeof(compat_trace_ev_t);
+  int fd = open( path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644 );
+  if( fd<0 || ftruncate( fd, (off_t)sz )<0 ) {
+    LOG_WARN(( "trace: cannot create %s: %s", path, strerror( errno ) ));
+    if( fd>=0 ) close( fd );
+    return;
+  }
+  void * map = mmap( NULL, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( map==MAP_FAILED ) {
+    LOG_WARN(( "trace: cannot map %s: %s", path, strerror( errno ) ));
+    return;
   }
-  *s++ = '\0';
-
-  assert( envlen >= (s - g_envstr) );
-  return g_envstr;
-}
 
-WIN32_STDCALL
-int
-KERNEL32_FreeEnvironmentStringsA( char * lpsz_environment_block ) {
-  if( !g_envstr ) return 0;
-  free( g_envstr );
-  g_envstr = NULL;
-  return 1;
+  g_trace    = map;
+  g_trace_ev = (compat_trace_ev_t *)( g_trace+1 );
+  g_trace->ev_cnt    = COMPAT_TRACE_EV_CNT;
+  g_trace->fatal_sig = -1;
+  g_trace->pid       = (uint32_t)getpid();
+  compat_trace_sync();
+  g_trace->tick0     = g_trace->tick1;
+  g_trace->ns0       = g_trace->ns1;
+  g_trace->magic     = COMPAT_TRACE_MAGIC;
+  compat_trace_attach();
+  atexit( compat_trace_sync );
+
+  static uint8_t altstack[ 16384 ];
+  stack_t ss = { .ss_sp = altstack, .ss_size = sizeof(altstack) };
+  sigaltstack( &ss, NULL );
+  struct sigaction sa = {
+    .sa_handler = compat_trace_on_signal,
+    .sa_flags   = SA_RESETHAND|SA_ONSTACK
+  };
+  static int const sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+  for( uint32_t i=0; i<sizeof(sigs)/sizeof(sigs[0]); i++ ) sigaction( sigs[i], &sa, NULL );
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_GetCurrentDirectoryA( uint32_t n_buffer_length,
-                               char *   lp_buffer ) {
-  char unix_path[ PATH_MAX ];
-  if( !getcwd( unix_path, sizeof(unix_path) ) ) {
-    LOG_ERR(( "KERNEL32_GetCurrentDirectoryA(%u, %p) failed: %s", n_buffer_length, lp_buffer, strerror(errno) ));
-    g_last_error = ERROR_OUTOFMEMORY;
-    return 0;
-  }
+/* Call statistics
 
-  size_t const prefix_sz = 2; // strlen( "U:\\" );
-  size_t unix_path_sz = strlen( unix_path )+1;
-  size_t sz = prefix_sz + unix_path_sz;
+   With WIN32_STATS set, every shim counts its calls and the wall time
+   spent inside it, including nested shim calls, into a log2 histogram.
+   The table is printed at exit, or appended to a file as one JSON line
+   per process. */
 
-  /* Bounds check */
-  if( unix_path_sz > n_buffer_length-prefix_sz ) {
-    LOG_ERR(( "KERNEL32_GetCurrentDirectoryA(%u, %p) failed: insufficient buffer" ));
-    g_last_error = ERROR_INSUFFICIENT_BUFFER;
-    return sz;
-  }
+#define COMPAT_STATS_BUCKETS 32
 
-  /* Replace slashes with backslashes */
-  char * s = unix_path;
-  do {
-    if( *s == '/' )
-      *s = '\\';
-  } while( *s++ );
+struct compat_stats_api {
+  uint64_t calls;
+  uint64_t ns;
+  uint64_t max_ns;
+  uint64_t hist[ COMPAT_STATS_BUCKETS ];  /* bucket b counts calls in [2^(b-1), 2^b) ns */
+};
 
-  /* Copy to output buffer */
-  lp_buffer[0] = 'Z';
-  lp_buffer[1] = ':';
-  memcpy( lp_buffer+prefix_sz, unix_path, unix_path_sz );
+static struct compat_stats_api * g_stats;       /* COMPAT_API_CNT entries if enabled */
+static char const *              g_stats_path;  /* JSON output, or NULL for stderr */
+static uint64_t                  g_stats_epoch; /* ignore scopes opened before this */
 
-  LOG_TRACE(( "KERNEL32_GetCurrentDirectoryA(%u, %p) = \"%s\"", n_buffer_length, lp_buffer, lp_buffer ));
+struct compat_stats_scope {
+  uint32_t api;
+  uint64_t t0;
+};
 
-  g_last_error = ERROR_SUCCESS;
-  return sz-1;
+static inline uint64_t
+compat_stats_now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_SetCurrentDirectoryA( char const * lp_path_name ) {
-  LOG_WARN(( "[TODO] KERNEL32_SetCurrentDirectoryA(%s)", lp_path_name ));
-  g_last_error = ERROR_ACCESS_DENIED;
-  return 0;
+/* With WIN32_COUNTERS=1 as well, CPU events are counted through
+   perf_event_open.  The hardware counters form one group, read at the
+   outermost shim entry and exit to split them between compat shims and
+   PE code.  Host code outside the PE (startup, batch bookkeeping, exit
+   reporting) counts as shim time: the split starts at depth 1 and
+   compat_ctr_pe drops to 0 when control passes to the PE.  Where the
+   kernel allows it, reads use rdpmc on the mmap'ed event pages instead
+   of a read() syscall.  Software events have no rdpmc access, so they
+   are opened on their own and only read for the report totals. */
+
+#define COMPAT_CTR_CNT 6
+
+static struct {
+  uint32_t     type;
+  uint64_t     config;
+  char const * name;
+  int          split;   /* in the group read around shims */
+} const g_ctr_ev[ COMPAT_CTR_CNT ] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,    "cycles",        1 },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,  "instructions",  1 },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,  "cache-misses",  1 },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses", 1 },
+  { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB |
+                        (PERF_COUNT_HW_CACHE_OP_READ<<8) |
+                        (PERF_COUNT_HW_CACHE_RESULT_MISS<<16), "itlb-misses", 1 },
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,   "page-faults",   0 }
+};
+
+static int                           g_ctr_on;
+static int                           g_ctr_fd[ COMPAT_CTR_CNT ] =   /* -1 if unavailable */
+  { [ 0 ... COMPAT_CTR_CNT-1 ] = -1 };
+static int                           g_ctr_slot[ COMPAT_CTR_CNT ];  /* index in group read */
+static struct perf_event_mmap_page * g_ctr_pg[ COMPAT_CTR_CNT ];
+static int                           g_ctr_leader = -1;
+static int                           g_ctr_rdpmc;
+static int                           g_ctr_user_only;
+static uint32_t                      g_ctr_depth;                   /* shim nesting, 1 in host code */
+static uint64_t                      g_ctr_base[ COMPAT_CTR_CNT ];  /* at open */
+static uint64_t                      g_ctr_t0  [ COMPAT_CTR_CNT ];  /* at outermost shim entry */
+static uint64_t                      g_ctr_shim[ COMPAT_CTR_CNT ];  /* accumulated inside shims */
+
+static uint64_t
+compat_ctr_rdpmc( struct perf_event_mmap_page const * pg ) {
+  uint32_t seq;
+  uint64_t count;
+  do {
+    seq = pg->lock;
+    __atomic_signal_fence( __ATOMIC_SEQ_CST );
+    uint32_t idx = pg->index;
+    count = (uint64_t)pg->offset;
+#if defined(__i386__) || defined(__x86_64__)
+    if( pg->cap_user_rdpmc && idx ) {
+      uint32_t w   = pg->pmc_width;
+      int64_t  pmc = (int64_t)__builtin_ia32_rdpmc( (int)idx-1 );
+      count += (uint64_t)( (int64_t)((uint64_t)pmc<<(64-w)) >> (64-w) );
+    }
+#endif
+    __atomic_signal_fence( __ATOMIC_SEQ_CST );
+  } while( pg->lock!=seq );
+  return count;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_GetSystemDefaultLangID( void ) {
-  LOG_WARN(( "[TODO] KERNEL32_GetSystemDefaultLangID()" ));
-  return 0;
+/* compat_ctr_read: Reads the group into out, other counters as 0. */
+static void
+compat_ctr_read( uint64_t out[ COMPAT_CTR_CNT ] ) {
+  if( g_ctr_rdpmc ) {
+    for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ )
+      out[i] = g_ctr_pg[i] ? compat_ctr_rdpmc( g_ctr_pg[i] ) : 0;
+    return;
+  }
+  uint64_t buf[ 3+COMPAT_CTR_CNT ] = {0};  /* nr, time_enabled, time_running, values */
+  if( g_ctr_leader<0 || read( g_ctr_leader, buf, sizeof(buf) )<(ssize_t)(3*sizeof(uint64_t)) ) buf[0] = 0;
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ )
+    out[i] = ( g_ctr_slot[i]>=0 && (uint64_t)g_ctr_slot[i]<buf[0] ) ? buf[ 3+g_ctr_slot[i] ] : 0;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_GetShortPathNameA( char const * lpsz_long_path,
-                            char *       lpsz_short_path,
-                            int          cch_buffer ) {
-  LOG_WARN(( "[TODO] KERNEL32_GetShortPathNameA(%s, %p, %d)", lpsz_long_path, lpsz_short_path, cch_buffer ));
-  return 0;
+static void
+compat_ctr_close( void ) {
+  long pgsz = sysconf( _SC_PAGESIZE );
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ ) {
+    if( g_ctr_pg[i] ) munmap( g_ctr_pg[i], (size_t)pgsz );
+    if( g_ctr_fd[i]>=0 ) close( g_ctr_fd[i] );
+    g_ctr_pg[i] = NULL;
+    g_ctr_fd[i] = -1;
+  }
+  g_ctr_leader = -1;
+  g_ctr_on     = 0;
 }
 
-/********************************************************************************
-   Process Launching
- ********************************************************************************/
+/* compat_ctr_read_solo: Reads counter i, opened outside the group. */
+static uint64_t
+compat_ctr_read_solo( uint32_t i ) {
+  uint64_t val;
+  if( read( g_ctr_fd[i], &val, sizeof(val) )!=(ssize_t)sizeof(val) ) val = 0;
+  return val;
+}
 
-static uint32_t
-compat_handle_proc_close( void * data ) {}
+/* compat_ctr_open_set: Opens every event the host has, counting kernel
+   time unless g_ctr_user_only.  Returns 0 if kernel time was refused. */
+static int
+compat_ctr_open_set( void ) {
+  compat_ctr_close();
+  uint64_t const group_fmt = PERF_FORMAT_GROUP|PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING;
+  long pgsz = sysconf( _SC_PAGESIZE );
+  int  rdpmc = 1, slots = 0;
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ ) {
+    int split = g_ctr_ev[i].split;
+    struct perf_event_attr attr = {
+      .size           = sizeof(attr),
+      .type           = g_ctr_ev[i].type,
+      .config         = g_ctr_ev[i].config,
+      .read_format    = split ? group_fmt : 0,
+      .exclude_kernel = (uint64_t)g_ctr_user_only,
+      .exclude_hv     = 1
+    };
+    int fd = (int)syscall( SYS_perf_event_open, &attr, 0, -1, split ? g_ctr_leader : -1, PERF_FLAG_FD_CLOEXEC );
+    if( fd<0 && (errno==EACCES || errno==EPERM) && !g_ctr_user_only ) return 0;
+    g_ctr_fd[i]   = fd;
+    g_ctr_slot[i] = -1;
+    if( fd<0 ) {
+      LOG_DEBUG(( "counters: %s unavailable: %s", g_ctr_ev[i].name, strerror( errno ) ));
+      continue;
+    }
+    if( !split ) continue;
+    if( g_ctr_leader<0 ) g_ctr_leader = fd;
+    g_ctr_slot[i] = slots++;
 
-struct compat_proc_state {
-  pid_t pid;
-  int status;
-};
+    void * pg = mmap( NULL, (size_t)pgsz, PROT_READ, MAP_SHARED, fd, 0 );
+    g_ctr_pg[i] = pg==MAP_FAILED ? NULL : pg;
+    if( !g_ctr_pg[i] || !g_ctr_pg[i]->cap_user_rdpmc ) rdpmc = 0;
+  }
+  g_ctr_rdpmc = rdpmc && slots;
+  return 1;
+}
 
-WIN32_STDCALL
-int
-KERNEL32_CreateProcessA( char const * lp_application_name,
-                         char *       lp_command_line,
-                         void *       lp_process_attributes,
-                         void *       lp_thread_attributes,
-                         int32_t      b_inherit_handles,
-                         uint32_t     dw_creation_flags,
-                         void *       lp_environment,
-                         char const * lp_current_directory,
-                         void *       lp_startup_info,
-                         PROCESS_INFORMATION * lp_process_information ) {
-  if( 0!=strncmp( "C:\\Windows\\System32\\", lp_application_name, 20 ) ) {
-    LOG_ERR(( "KERNEL32_CreateProcessA: Refusing to launch %s", lp_application_name ));
-    g_last_error = ERROR_ACCESS_DENIED;
-    return 0;
+/* compat_ctr_open: Opens the counters of the calling process.  Events
+   the host lacks are skipped.  If kernel time is not permitted, all
+   events are reopened to count user time only, so the whole report is
+   in one mode. */
+static void
+compat_ctr_open( void ) {
+  if( !compat_ctr_open_set() ) {
+    g_ctr_user_only = 1;
+    compat_ctr_open_set();
+  }
+  int any = 0;
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ ) any |= g_ctr_fd[i]>=0;
+  if( !any ) {
+    LOG_WARN(( "counters: perf_event_open failed, no counters available" ));
+    return;
   }
+  g_ctr_on = 1;
+  compat_ctr_read( g_ctr_base );
+  memcpy( g_ctr_t0, g_ctr_base, sizeof(g_ctr_t0) );
+  memset( g_ctr_shim, 0, sizeof(g_ctr_shim) );
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ )
+    if( g_ctr_fd[i]>=0 && !g_ctr_ev[i].split ) g_ctr_base[i] = compat_ctr_read_solo( i );
+  g_ctr_depth = 1;
+}
 
-  char progname[ 256 ];
-  strncpy( progname, lp_application_name+20, sizeof(progname)-1 );
+static inline void
+compat_ctr_enter( void ) {
+  if( !g_ctr_depth++ ) compat_ctr_read( g_ctr_t0 );
+}
 
-  char * exe_ext = strstr( progname, ".exe" );
-  if( exe_ext ) *exe_ext = '\0';
+static inline void
+compat_ctr_leave( void ) {
+  if( !g_ctr_depth || --g_ctr_depth ) return;
+  uint64_t now[ COMPAT_CTR_CNT ];
+  compat_ctr_read( now );
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ ) g_ctr_shim[i] += now[i]-g_ctr_t0[i];
+}
 
-  LOG_INFO(( "KERNEL32_CreateProcessA: Launching %s", progname ));
+/* compat_ctr_pe: Closes the open shim interval, however deep, before
+   control passes to the PE.  ExitProcess in batch mode longjmps out of
+   its shims without leaving them.
+   compat_ctr_host: Reopens it when the PE is done. */
+static void
+compat_ctr_pe( void ) {
+  if( !g_ctr_on || !g_ctr_depth ) return;
+  g_ctr_depth = 1;
+  compat_ctr_leave();
+}
 
-  pid_t child = fork();
-  if( child==0 ) {
-    char * const argv[2] = {
-      progname,
-      NULL
-    };
-    int res = execv( progname, argv );
-    if( res<0 ) {
-      LOG_ERR(( "KERNEL32_CreateProcessA: execv(\"%s\") failed: %s", progname, strerror( errno ) ));
-      exit( 127 );
-    }
-    exit( 0 );
-    __builtin_unreachable();
-  }
+static void
+compat_ctr_host( void ) {
+  if( !g_ctr_on ) return;
+  compat_ctr_pe();
+  compat_ctr_enter();
+}
 
-  if( child<0 ) {
-    LOG_ERR(( "KERNEL32_CreateProcessA: fork() failed: %s", strerror( errno ) ));
-    g_last_error = ERROR_ACCESS_DENIED;
-    return 0;
+/* compat_ctr_report: Prints totals and the shim/PE split, as a table or
+   as the members of a JSON object. */
+static void
+compat_ctr_report( FILE * f,
+                   int    json ) {
+  if( !g_ctr_on ) return;
+  uint64_t now[ COMPAT_CTR_CNT ], shim[ COMPAT_CTR_CNT ];
+  compat_ctr_read( now );
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ )
+    shim[i] = g_ctr_shim[i] + ( g_ctr_depth ? now[i]-g_ctr_t0[i] : 0 );
+
+  /* Counters not scheduled all the time were multiplexed */
+  uint64_t buf[ 3+COMPAT_CTR_CNT ] = {0};
+  double running = 1.0;
+  if( g_ctr_leader>=0 && read( g_ctr_leader, buf, sizeof(buf) )>=(ssize_t)(3*sizeof(uint64_t)) && buf[1] )
+    running = (double)buf[2]/(double)buf[1];
+
+  if( !json ) {
+    fprintf( f, "\n%-36s %16s %16s %16s   (%s, %.0f%% scheduled)\n",
+             "counter", "total", "shim", "pe",
+             g_ctr_user_only ? "user" : "user+kernel", running*100.0 );
   }
-
-  int status;
-  if( waitpid( child, &status, WNOHANG ) ) {
-    LOG_ERR(( "KERNEL32_CreateProcessA: waitpid(%d) failed: %s", child, strerror( errno ) ));
-    g_last_error = ERROR_ACCESS_DENIED;
-    return 0;
+  int first = 1;
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ ) {
+    if( g_ctr_fd[i]<0 ) {
+      if( !json ) fprintf( f, "%-36s %16s\n", g_ctr_ev[i].name, "n/a" );
+      continue;
+    }
+    if( !g_ctr_ev[i].split ) {
+      unsigned long long total = (unsigned long long)( compat_ctr_read_solo( i )-g_ctr_base[i] );
+      if( json ) fprintf( f, "%s\"%s\":{\"total\":%llu}", first ? "" : ",", g_ctr_ev[i].name, total );
+      else       fprintf( f, "%-36s %16llu %16s %16s\n", g_ctr_ev[i].name, total, "-", "-" );
+      first = 0;
+      continue;
+    }
+    unsigned long long total = (unsigned long long)( now[i]-g_ctr_base[i] );
+    unsigned long long in    = (unsigned long long)shim[i];
+    if( json ) fprintf( f, "%s\"%s\":{\"total\":%llu,\"shim\":%llu}", first ? "" : ",", g_ctr_ev[i].name, total, in );
+    else       fprintf( f, "%-36s %16llu %16llu %16llu\n", g_ctr_ev[i].name, total, in, total-in );
+    first = 0;
   }
+}
 
-  struct compat_proc_state * state = calloc( 1, sizeof(*state) );
-  assert( state );
-  state->pid = child;
+static uint64_t
+compat_stats_enter( uint32_t api ) {
+  g_stats[ api ].calls++;
+  if( g_ctr_on ) compat_ctr_enter();
+  return compat_stats_now();
+}
 
-  uint32_t h = compat_handle_alloc( state, compat_handle_proc_close );
+static inline void
+compat_stats_leave( struct compat_stats_scope const * scope ) {
+  if( __builtin_expect( !scope->t0, 1 ) ) return;
+  if( g_ctr_on ) compat_ctr_leave();
+  uint64_t now = compat_stats_now();
+  /* Scopes may predate a fork server request or a snapshot restore */
+  if( scope->t0<g_stats_epoch || now<scope->t0 ) return;
+
+  uint64_t dt = now-scope->t0;
+  struct compat_stats_api * st = &g_stats[ scope->api ];
+  uint32_t b = dt ? 64U-(uint32_t)__builtin_clzll( dt ) : 0U;
+  if( b>=COMPAT_STATS_BUCKETS ) b = COMPAT_STATS_BUCKETS-1U;
+  st->ns += dt;
+  st->hist[ b ]++;
+  if( dt>st->max_ns ) st->max_ns = dt;
+}
 
-  LOG_INFO(( "KERNEL32_CreateProcessA(\"%s\", \"%s\", %p, %p, %d, %u, %p, \"%s\", %p, %p)",
-          lp_application_name,
-          lp_command_line,
-          lp_process_attributes,
-          lp_thread_attributes,
-          b_inherit_handles,
-          dw_creation_flags,
-          lp_environment,
-          lp_current_directory,
-          lp_startup_info,
-          lp_process_information ));
+/* STATS_API: Opens a statistics scope for shim <name>, closed on return. */
+#define STATS_API( name )                                                \
+  struct compat_stats_scope compat_stats_scope_                          \
+    __attribute__((cleanup(compat_stats_leave))) = {                     \
+      COMPAT_API_##name,                                                 \
+      __builtin_expect( !!g_stats, 0 ) ? compat_stats_enter( COMPAT_API_##name ) : 0 }
 
-  lp_process_information->hProcess = h;
-  lp_process_information->hThread = h;
-  lp_process_information->dwProcessId = h;
-  lp_process_information->dwThreadId = h;
+static void
+compat_stats_reset( void ) {
+  if( !g_stats ) return;
+  memset( g_stats, 0, COMPAT_API_CNT*sizeof(struct compat_stats_api) );
+  g_stats_epoch = compat_stats_now();
+  g_fcache.hits = g_fcache.misses = g_fcache.stale = g_fcache.served = 0;
+  g_statc.hits = g_statc.misses = g_statc.listed = 0;
+  /* Counters of the parent do not follow into a forked worker */
+  if( g_ctr_on ) compat_ctr_open();
+}
 
-  return 1;
+/* compat_stats_pct: Upper bound of the bucket holding the given percentile. */
+static uint64_t
+compat_stats_pct( struct compat_stats_api const * st,
+                  uint32_t                        pct ) {
+  uint64_t want = (st->calls*pct+99U)/100U, seen = 0;
+  for( uint32_t b=0; b<COMPAT_STATS_BUCKETS; b++ ) {
+    seen += st->hist[ b ];
+    if( seen>=want ) return b ? 1ULL<<b : 0;
+  }
+  return st->max_ns;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_WaitForSingleObject( uint32_t h_handle,
-                              uint32_t dw_milliseconds ) {
-  LOG_INFO(( "KERNEL32_WaitForSingleObject(%u, %u)", h_handle, dw_milliseconds ));
+static int
+compat_stats_cmp( void const * a,
+                  void const * b ) {
+  uint64_t x = g_stats[ *(uint32_t const *)a ].ns;
+  uint64_t y = g_stats[ *(uint32_t const *)b ].ns;
+  return (x<y) - (x>y);
+}
 
-  /* Check handle type */
-  compat_handle_t * hdl = compat_handle_get( h_handle );
-  if( !hdl || hdl->close!=compat_handle_proc_close ) {
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+static void
+compat_stats_report( void ) {
+  if( !g_stats ) return;
+
+  if( g_stats_path ) {
+    FILE * f = fopen( g_stats_path, "a" );
+    if( !f ) {
+      LOG_WARN(( "stats: cannot open %s: %s", g_stats_path, strerror( errno ) ));
+      return;
+    }
+    fprintf( f, "{\"pid\":%d,\"apis\":{", (int)getpid() );
+    int first = 1;
+    for( uint32_t i=0; i<COMPAT_API_CNT; i++ ) {
+      struct compat_stats_api const * st = &g_stats[ i ];
+      if( !st->calls ) continue;
+      fprintf( f, "%s\"%s\":{\"calls\":%llu,\"ns\":%llu,\"max_ns\":%llu,\"hist\":[",
+               first ? "" : ",", g_trace_api_name[ i ],
+               (unsigned long long)st->calls, (unsigned long long)st->ns,
+               (unsigned long long)st->max_ns );
+      for( uint32_t b=0; b<COMPAT_STATS_BUCKETS; b++ )
+        fprintf( f, "%s%llu", b ? "," : "", (unsigned long long)st->hist[ b ] );
+      fputs( "]}", f );
+      first = 0;
+    }
+    fputs( "}", f );
+    if( g_fcache.cap ) {
+      fprintf( f, ",\"file_cache\":{\"hits\":%llu,\"misses\":%llu,\"stale\":%llu,\"bytes\":%llu,\"served\":%llu}",
+               (unsigned long long)g_fcache.hits, (unsigned long long)g_fcache.misses,
+               (unsigned long long)g_fcache.stale, (unsigned long long)g_fcache.bytes,
+               (unsigned long long)g_fcache.served );
+    }
+    if( !g_statc.off ) {
+      fprintf( f, ",\"stat_cache\":{\"hits\":%llu,\"misses\":%llu,\"dirs_listed\":%llu}",
+               (unsigned long long)g_statc.hits, (unsigned long long)g_statc.misses,
+               (unsigned long long)g_statc.listed );
+    }
+    if( g_ctr_on ) {
+      fputs( ",\"counters\":{", f );
+      compat_ctr_report( f, 1 );
+      fputs( "}", f );
+    }
+    fputs( "}\n", f );
+    fclose( f );
+    return;
   }
 
-  struct compat_proc_state * state = hdl->data;
-  waitpid( state->pid, &state->status, 0 );
-
-  return 0;
+  uint32_t order[ COMPAT_API_CNT ];
+  for( uint32_t i=0; i<COMPAT_API_CNT; i++ ) order[ i ] = i;
+  qsort( order, COMPAT_API_CNT, sizeof(uint32_t), compat_stats_cmp );
+
+  fprintf( stderr, "%-36s %10s %12s %9s %9s %9s %10s\n",
+           "api", "calls", "total_us", "avg_ns", "p50_ns<=", "p99_ns<=", "max_ns" );
+  for( uint32_t i=0; i<COMPAT_API_CNT; i++ ) {
+    struct compat_stats_api const * st = &g_stats[ order[ i ] ];
+    if( !st->calls ) continue;
+    fprintf( stderr, "%-36s %10llu %12.1f %9llu %9llu %9llu %10llu\n",
+             g_trace_api_name[ order[ i ] ],
+             (unsigned long long)st->calls, (double)st->ns/1e3,
+             (unsigned long long)(st->ns/st->calls),
+             (unsigned long long)compat_stats_pct( st, 50 ),
+             (unsigned long long)compat_stats_pct( st, 99 ),
+             (unsigned long long)st->max_ns );
+  }
+  uint64_t lookups = g_fcache.hits+g_fcache.misses;
+  if( g_fcache.cap && lookups ) {
+    fprintf( stderr, "file cache: %llu hits, %llu misses (%.1f%% hit), %llu stale, %.1f MiB held, %.1f MiB served\n",
+             (unsigned long long)g_fcache.hits, (unsigned long long)g_fcache.misses,
+             100.0*(double)g_fcache.hits/(double)lookups,
+             (unsigned long long)g_fcache.stale,
+             (double)g_fcache.bytes/(1<<20), (double)g_fcache.served/(1<<20) );
+  }
+  uint64_t stats = g_statc.hits+g_statc.misses;
+  if( !g_statc.off && stats ) {
+    fprintf( stderr, "stat cache: %llu hits, %llu misses (%.1f%% hit), %llu directories listed\n",
+             (unsigned long long)g_statc.hits, (unsigned long long)g_statc.misses,
+             100.0*(double)g_statc.hits/(double)stats, (unsigned long long)g_statc.listed );
+  }
+  compat_ctr_report( stderr, 0 );
 }
 
-WIN32_STDCALL
-int
-KERNEL32_GetExitCodeProcess( uint32_t   h_process,
-                             uint32_t * lp_exit_code ) {
-  LOG_WARN(( "[WARN] KERNEL32_GetExitCodeProcess(%u, %p)", h_process, lp_exit_code ));
+static void
+compat_stats_init( char const * mode,
+                   int          counters ) {
+  g_stats = calloc( COMPAT_API_CNT, sizeof(struct compat_stats_api) );
+  if( !g_stats ) return;
+  for( uint32_t i=0; i<COMPAT_CTR_CNT; i++ ) g_ctr_fd[i] = -1;
+  if( counters ) compat_ctr_open();
+  if( 0!=strcmp( mode, "1" ) ) g_stats_path = strdup( mode );
+  g_stats_epoch = compat_stats_now();
+  atexit( compat_stats_report );
+}
 
-  /* Check handle type */
-  compat_handle_t * hdl = compat_handle_get( h_process );
-  if( !hdl || hdl->close!=compat_handle_proc_close ) {
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
-  }
+/* Timeline
 
-  struct compat_proc_state * state = hdl->data;
-  *lp_exit_code = WEXITSTATUS( state->status );
+   With WIN32_TIMELINE=<file>, file handles, read/write bursts, directory
+   scans, child processes and waits are recorded as Chrome trace events
+   and written to <file> at exit, for chrome://tracing or Perfetto.
+   Handle lifetimes are async spans, blocking calls are complete ("X")
+   events on the thread.  Timestamps are CLOCK_MONOTONIC, so files of
+   several processes line up.  "%p" in <file> expands to the PID. */
 
-  return 1;
+enum {
+  COMPAT_TL_FILE = 1,
+  COMPAT_TL_FIND,
+  COMPAT_TL_PROC
+};
+
+struct compat_tl_span {
+  uint32_t kind;      /* COMPAT_TL_*, 0 if no span is open */
+  uint32_t id;
+  uint64_t rd_bytes;
+  uint64_t wr_bytes;
+  uint32_t rd_cnt;    /* reads, or directory entries */
+  uint32_t wr_cnt;
+  int32_t  pid;
+  char *   name;
+};
+
+static FILE *                g_tl;      /* memstream of events, NULL if disabled */
+static char *                g_tl_buf;
+static size_t                g_tl_sz;
+static char const *          g_tl_path;
+static uint32_t              g_tl_cnt;
+static uint32_t              g_tl_id;
+static int                   g_tl_tid;
+static struct compat_tl_span g_tl_span[ COMPAT_HANDLE_CNT ];
+
+/* Consecutive reads or writes on one handle are merged into a burst.
+   A burst ends at any other event on the thread, or when the next call
+   starts more than COMPAT_TL_BURST_GAP ns after the last one ended. */
+#define COMPAT_TL_BURST_GAP 100000
+
+static struct {
+  uint32_t h;         /* 0 if no burst is open */
+  int      write;
+  uint64_t t0, t1;
+  uint64_t bytes;
+  uint32_t calls;
+} g_tl_burst;
+
+static inline uint64_t
+compat_tl_now( void ) {
+  return g_tl ? compat_stats_now() : 0;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_CloseHandle( uint32_t h_object ) {
-  LOG_TRACE(( "KERNEL32_CloseHandle(%u)", h_object ));
-  compat_handle_t * hdl = compat_handle_get( h_object );
-  if( !hdl ) {
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+static void
+compat_tl_str( char const * s ) {
+  fputc( '"', g_tl );
+  for( ; *s; s++ ) {
+    unsigned char c = (unsigned char)*s;
+    if( c=='"' || c=='\\' ) fprintf( g_tl, "\\%c", c );
+    else if( c<0x20 )       fprintf( g_tl, "\\u%04x", c );
+    else                    fputc( c, g_tl );
   }
-  uint32_t res = hdl->close( hdl->data );
-  compat_handle_free( h_object );
-  return res;
+  fputc( '"', g_tl );
 }
 
-#define COMPAT_TLS_SIZE 32
-static __thread uint32_t tls_index = 1;
-static __thread uint32_t tls_slots[COMPAT_TLS_SIZE];
+static void compat_tl_burst_flush( void );
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_TlsAlloc( void ) {
-  uint32_t index = tls_index++;
-  if( index>=COMPAT_TLS_SIZE )
-    return TLS_OUT_OF_INDEXES;
-  tls_slots[ index ] = 0;
-  LOG_TRACE(( "KERNEL32_TlsAlloc() = %d", index ));
-  return index;
+/* compat_tl_ev: Starts an event, the caller appends args and closes it
+   with "}}".  Ends the open burst first. */
+static void
+compat_tl_ev( char const * ph,
+              char const * cat,
+              char const * name,
+              uint64_t     t0,
+              uint64_t     t1,
+              uint32_t     id ) {
+  compat_tl_burst_flush();
+  fputs( g_tl_cnt++ ? ",\n{" : "{", g_tl );
+  fprintf( g_tl, "\"ph\":\"%s\",\"cat\":\"%s\",\"name\":", ph, cat );
+  compat_tl_str( name );
+  fprintf( g_tl, ",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+           (double)t0/1e3, (int)getpid(), g_tl_tid );
+  if( ph[0]=='X' ) fprintf( g_tl, ",\"dur\":%.3f", (double)(t1-t0)/1e3 );
+  if( id ) fprintf( g_tl, ",\"id\":%u", id );
+  fputs( ",\"args\":{", g_tl );
 }
 
-WIN32_STDCALL
-int
-KERNEL32_TlsFree( uint32_t dw_tls_index ) {
-  LOG_TRACE(( "KERNEL32_TlsFree(%u)", dw_tls_index ));
-  if( dw_tls_index>=COMPAT_TLS_SIZE )
-    return 0;
-  g_last_error = ERROR_SUCCESS;
-  return 1;
+static char const *
+compat_tl_name( uint32_t h ) {
+  static char buf[ 24 ];
+  if( h<COMPAT_HANDLE_CNT && g_tl_span[ h ].name ) return g_tl_span[ h ].name;
+  snprintf( buf, sizeof(buf), "handle %u", h );
+  return buf;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_TlsGetValue( uint32_t dw_tls_index ) {
-  uint32_t val = tls_slots[ dw_tls_index ];
-  LOG_TRACE(( "KERNEL32_TlsGetValue(%u) = %#x", dw_tls_index, val ));
-  g_last_error = ERROR_SUCCESS;
-  return val;
+static void
+compat_tl_burst_flush( void ) {
+  uint32_t h = g_tl_burst.h;
+  if( !h ) return;
+  g_tl_burst.h = 0;
+  compat_tl_ev( "X", "io", g_tl_burst.write ? "write" : "read", g_tl_burst.t0, g_tl_burst.t1, 0 );
+  fputs( "\"path\":", g_tl );
+  compat_tl_str( compat_tl_name( h ) );
+  fprintf( g_tl, ",\"bytes\":%llu,\"calls\":%u}}",
+           (unsigned long long)g_tl_burst.bytes, g_tl_burst.calls );
 }
 
-WIN32_STDCALL
-int
-KERNEL32_TlsSetValue( uint32_t dw_tls_index,
-                      uint32_t lp_tls_value ) {
-  LOG_TRACE(( "KERNEL32_TlsSetValue(%u, %#x)", dw_tls_index, lp_tls_value ));
-  tls_slots[ dw_tls_index ] = lp_tls_value;
-  g_last_error = ERROR_SUCCESS;
-  return 1;
+/* compat_tl_open: Starts the lifetime span of handle h. */
+static void
+compat_tl_open( uint32_t     h,
+                uint32_t     kind,
+                char const * name,
+                uint64_t     t0,
+                int32_t      pid ) {
+  if( !g_tl || h>=COMPAT_HANDLE_CNT ) return;
+  struct compat_tl_span * sp = &g_tl_span[ h ];
+  free( sp->name );
+  *sp = (struct compat_tl_span){ .kind = kind, .id = ++g_tl_id, .pid = pid, .name = strdup( name ) };
+  static char const * const cat[] = { "", "file", "find", "process" };
+  compat_tl_ev( "b", cat[ kind ], sp->name, t0, t0, sp->id );
+  fputs( "}}", g_tl );
 }
 
-WIN32_STDCALL
-void *
-KERNEL32_GetModuleHandleA( char const * lp_module_name ) {
-  LOG_DEBUG(( "KERNEL32_GetModuleHandleA(\"%s\")", lp_module_name ));
-
-  void * handle = NULL;
-  if( !lp_module_name ) {
-    handle = &g_cur_module;
-    return handle;
+/* compat_tl_close: Ends the lifetime span of handle h, if any. */
+static void
+compat_tl_close( uint32_t h,
+                 int      status ) {
+  if( !g_tl || h>=COMPAT_HANDLE_CNT || !g_tl_span[ h ].kind ) return;
+  struct compat_tl_span * sp = &g_tl_span[ h ];
+  uint64_t now = compat_stats_now();
+  switch( sp->kind ) {
+  case COMPAT_TL_FILE:
+    compat_tl_ev( "e", "file", sp->name, now, now, sp->id );
+    fprintf( g_tl, "\"read_bytes\":%llu,\"reads\":%u,\"written_bytes\":%llu,\"writes\":%u}}",
+             (unsigned long long)sp->rd_bytes, sp->rd_cnt,
+             (unsigned long long)sp->wr_bytes, sp->wr_cnt );
+    break;
+  case COMPAT_TL_FIND:
+    compat_tl_ev( "e", "find", sp->name, now, now, sp->id );
+    fprintf( g_tl, "\"entries\":%u}}", sp->rd_cnt );
+    break;
+  case COMPAT_TL_PROC:
+    compat_tl_ev( "e", "process", sp->name, now, now, sp->id );
+    fprintf( g_tl, "\"pid\":%d", sp->pid );
+    if( status>=0 ) fprintf( g_tl, ",\"exit\":%d", WEXITSTATUS( status ) );
+    fputs( "}}", g_tl );
+    break;
   }
-
-  g_last_error = ERROR_FILE_NOT_FOUND;
-  return NULL;
+  free( sp->name );
+  memset( sp, 0, sizeof(*sp) );
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_GetModuleFileNameA( void *   h_module,
-                             char *   lp_file_name,
-                             uint32_t n_size ) {
-  LOG_DEBUG(( "KERNEL32_GetModuleFileNameA(%p, %p, %u)", h_module, lp_file_name, n_size ));
-  if( h_module == &g_cur_module ) {
-    snprintf( lp_file_name, n_size, "%s", __progname );
-    return 1;
+/* compat_tl_io: Accounts a read or write of n bytes on handle h that
+   started at t0. */
+static void
+compat_tl_io( uint32_t h,
+              int      write,
+              uint64_t t0,
+              uint64_t n ) {
+  if( !g_tl ) return;
+  if( g_tl_burst.h!=h || g_tl_burst.write!=write || t0-g_tl_burst.t1>COMPAT_TL_BURST_GAP ) {
+    compat_tl_burst_flush();
+    g_tl_burst.h     = h;
+    g_tl_burst.write = write;
+    g_tl_burst.t0    = t0;
+    g_tl_burst.bytes = 0;
+    g_tl_burst.calls = 0;
+  }
+  g_tl_burst.t1     = compat_stats_now();
+  g_tl_burst.bytes += n;
+  g_tl_burst.calls++;
+
+  if( h<COMPAT_HANDLE_CNT ) {
+    struct compat_tl_span * sp = &g_tl_span[ h ];
+    if( write ) { sp->wr_bytes += n; sp->wr_cnt++; }
+    else        { sp->rd_bytes += n; sp->rd_cnt++; }
   }
-  return 0;
 }
 
-WIN32_STDCALL
-void *
-KERNEL32_LoadLibraryA( char const * lp_lib_file_name ) {
-  LOG_DEBUG(( "KERNEL32_LoadLibraryA(\"%s\")", lp_lib_file_name ));
-  if( strcmp( lp_lib_file_name, __progname )==0 )
-    return &g_cur_library;
-  g_last_error = ERROR_FILE_NOT_FOUND;
-  return 0;
+/* compat_tl_entry: Counts a directory entry returned by a scan. */
+static void
+compat_tl_entry( uint32_t h ) {
+  if( !g_tl || h>=COMPAT_HANDLE_CNT ) return;
+  g_tl_span[ h ].rd_cnt++;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_FreeLibrary( void * h_lib_module ) {
-  LOG_WARN(( "[WARN] KERNEL32_FreeLibrary(%p)", h_lib_module ));
-  return 0;
+/* compat_tl_fail: Records a failed open or scan that started at t0. */
+static void
+compat_tl_fail( char const * cat,
+                char const * name,
+                uint64_t     t0,
+                uint32_t     err ) {
+  if( !g_tl ) return;
+  compat_tl_ev( "X", cat, name, t0, compat_stats_now(), 0 );
+  fprintf( g_tl, "\"error\":%u}}", err );
 }
 
-WIN32_STDCALL
-int32_t *
-KERNEL32_GlobalAlloc( uint32_t u_flags,
-                      uint32_t dw_bytes ) {
-  if( dw_bytes==0 )
-    dw_bytes=1;
-  void * ptr = malloc( dw_bytes );
-  if( ptr && (u_flags&0x40)!=0 ) {
-    memset( ptr, 0, dw_bytes );
-  }
-  LOG_TRACE(( "KERNEL32_GlobalAlloc(%#x, %u) = %p", u_flags, dw_bytes, ptr ));
-  return (int32_t *)ptr;
+/* compat_tl_wait: Records a wait for the child process of handle h that
+   started at t0, and ends the child's span. */
+static void
+compat_tl_wait( uint32_t h,
+                uint64_t t0,
+                int      status ) {
+  if( !g_tl ) return;
+  compat_tl_ev( "X", "process", "wait", t0, compat_stats_now(), 0 );
+  fputs( "\"child\":", g_tl );
+  compat_tl_str( compat_tl_name( h ) );
+  fprintf( g_tl, ",\"exit\":%d}}", WEXITSTATUS( status ) );
+  compat_tl_close( h, status );
 }
 
-WIN32_STDCALL
-int32_t *
-KERNEL32_GlobalFree( int32_t * h_mem ) {
-  LOG_TRACE(( "KERNEL32_GlobalFree(%p)", h_mem ));
-  free( h_mem );
-  return 0;
-}
+static void
+compat_tl_write( void ) {
+  if( !g_tl ) return;
+  for( uint32_t h=0; h<COMPAT_HANDLE_CNT; h++ ) compat_tl_close( h, -1 );
+  compat_tl_burst_flush();
+  fclose( g_tl );
+  g_tl = NULL;
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_GetFullPathNameA( char const * lp_file_name,
-                           uint32_t     n_buffer_length,
-                           char *       lp_buffer,
-                           char **      lp_file_part ) {
-  /* Special case: Check if program is searching for itself */
-  if( 0==strncmp( lp_file_name,                    __progname, strlen(__progname) ) &&
-      0==strcmp(  lp_file_name+strlen(__progname), ".exe" ) ) {
-    LOG_DEBUG(( "KERNEL32_GetFullPathNameA: requested System32 self exe path" ));
-    return snprintf( lp_buffer, n_buffer_length, "C:\\Windows\\System32\\%s.exe", __progname );
+  char path[ PATH_MAX ];
+  size_t n = 0;
+  for( char const * s=g_tl_path; *s && n+16<sizeof(path); s++ ) {
+    if( s[0]=='%' && s[1]=='p' ) { n += (size_t)sprintf( path+n, "%d", (int)getpid() ); s++; }
+    else                         path[ n++ ] = *s;
   }
+  path[ n ] = '\0';
 
-  /* Special case: license.dat */
-  if( strstr( lp_file_name, "license.dat" ) ) {
-    LOG_DEBUG(( "KERNEL32_GetFullPathNameA: requested license.dat" ));
-    return snprintf( lp_buffer, n_buffer_length, "L:\\license.dat" );
+  FILE * f = fopen( path, "w" );
+  if( !f ) {
+    LOG_WARN(( "timeline: cannot create %s: %s", path, strerror( errno ) ));
+    return;
   }
+  fputs( "[\n", f );
+  fwrite( g_tl_buf, 1, g_tl_sz, f );
+  fputs( "\n]\n", f );
+  fclose( f );
+}
 
-  size_t name_sz = strlen( lp_file_name )+1;
-  size_t sz;
+/* compat_tl_reset: Drops all events, e.g. in a fork server worker. */
+static void
+compat_tl_reset( void ) {
+  if( !g_tl ) return;
+  fclose( g_tl );
+  free( g_tl_buf );
+  g_tl = open_memstream( &g_tl_buf, &g_tl_sz );
+  for( uint32_t h=0; h<COMPAT_HANDLE_CNT; h++ ) free( g_tl_span[ h ].name );
+  memset( g_tl_span, 0, sizeof(g_tl_span) );
+  g_tl_burst.h = 0;
+  g_tl_cnt     = 0;
+  g_tl_tid     = (int)syscall( SYS_gettid );
+}
 
-  /* Check if path is absolute */
-  if( compat_check_winpath_absolute( lp_file_name ) ) {
-    /* Bounds check */
-    if( name_sz > n_buffer_length ) {
-      g_last_error = ERROR_INSUFFICIENT_BUFFER;
-      name_sz++;
-    } else {
-      /* Copy path as-is */
-      memcpy( lp_buffer, lp_file_name, name_sz );
-      g_last_error = ERROR_SUCCESS;
-    }
-    sz = name_sz;
-  } else {
-    /* Prepend cwdir */
-    uint32_t n = KERNEL32_GetCurrentDirectoryA( n_buffer_length, lp_buffer );
-    sz = n+name_sz;
-    if( sz>n_buffer_length ) {
-      LOG_WARN(( "KERNEL32_GetFullPathNameA(\"%s\", %u, %p, %p) failed: insufficient buffer",
-                 lp_file_name, n_buffer_length, lp_buffer, lp_file_part ));
-      g_last_error = ERROR_INSUFFICIENT_BUFFER;
-      return sz;
-    }
+static void
+compat_tl_init( char const * path ) {
+  g_tl = open_memstream( &g_tl_buf, &g_tl_sz );
+  if( !g_tl ) return;
+  g_tl_path = strdup( path );
+  g_tl_tid  = (int)syscall( SYS_gettid );
+  atexit( compat_tl_write );
+}
 
-    /* Join with relative path */
-    char * s = lp_buffer+n;
-    *s++ = '\\';
-    memcpy( s, lp_file_name, name_sz );
-  }
+/* Glue functions */
 
-  /* Fill in base name */
-  char const * dbg_file_part = "";
-  if( lp_file_part ) {
-    char * last = strrchr( lp_buffer, '\\' );
-    if( !last ) last = lp_buffer;
-    dbg_file_part = *lp_file_part = last+1;
-  }
+/* compat_check_winpath_absolute: Checks whether a path is absolute.
 
-  LOG_TRACE(( "KERNEL32_GetFullPathNameA(\"%s\", %u, %p, %p) => (\"%s\", \"%s\")",
-              lp_file_name, n_buffer_length, lp_buffer, lp_file_part, lp_buffer, dbg_file_part ));
-  g_last_error = ERROR_SUCCESS;
-  return sz-1;
+   Returns NULL if not, returns a pointer to the root excluding the drive name. */
+static inline
+char const *
+compat_check_winpath_absolute( char const * path ) {
+  if( *path == '\\' ) return path;
+
+  if( !isupper( *path++ ) ) return NULL;
+  if( *path++ != ':'      ) return NULL;
+  if( *path   != '\\'     ) return NULL;
+  return path;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_SetFilePointer( uint32_t  h_file,
-                         int32_t   l_distance_to_move,
-                         int32_t * lp_distance_to_move_high,
-                         uint32_t  dw_move_method ) {
-  int whence;
-  switch( dw_move_method ) {
-  case FILE_BEGIN:   whence = SEEK_SET; break;
-  case FILE_CURRENT: whence = SEEK_CUR; break;
-  case FILE_END:     whence = SEEK_END; break;
-  default:
-    LOG_ERR(( "KERNEL32_SetFilePointer: invalid move_method (%d)", dw_move_method ));
-    g_last_error = ERROR_INVALID_PARAMETER;
-    return INVALID_SET_FILE_POINTER;
-  }
+/* Mount table
 
-  /* Check handle type */
-  compat_handle_t * hdl = compat_handle_get( h_file );
-  if( !hdl || hdl->close!=compat_handle_file_close ) {
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
-  }
+   Routes absolute Windows paths.  Each mount maps a prefix (a drive or
+   a directory on it) to a host directory or to a virtual provider:
 
-  FILE * f = (FILE *)hdl->data;
-  int fd = fileno( f );
+     \                     host /
+     Z:\                   host /
+     C:\Windows\System32   programs next to this one (virtual)
+     L:\license.dat        the license file, served by the lmgr stubs (virtual)
 
-  uint64_t bits64 = (uint32_t)l_distance_to_move;
-  if( lp_distance_to_move_high ) bits64 |= (((int64_t)(*lp_distance_to_move_high)<<32));
-  int64_t seek = (int64_t)bits64;
+   WIN32_MOUNTS="X:\=/opt/sdk;Y:\include=/usr/include" adds host mounts,
+   replacing built-in ones with the same prefix.  At startup the prefixes
+   are compiled into a trie over case-folded bytes, so routing a path is
+   one walk along its first bytes to the longest matching prefix.  A
+   prefix only matches up to a separator or the end of the path.  The
+   root "\" is the empty prefix and needs the separator, so "" is not a
+   path to it.  Base names of virtual files, as claimed for
+   GetFullPathNameA, hang off the root of the same trie under a NUL
+   byte, which no path contains. */
 
-  LOG_TRACE(( "KERNEL32_SetFilePointer(%u, %d, %p) (whence=%d, seek=%lld)",
-              h_file,
-              l_distance_to_move, lp_distance_to_move_high,
-              dw_move_method, seek ));
+#define COMPAT_MOUNT_MAX 64
 
-  seek = lseek64( fd, seek, whence );
-  if( seek<0 ) {
-    LOG_WARN(( "KERNEL32_SetFilePointer(%u): lseek64 failed: %s", h_file, strerror( errno ) ));
-    g_last_error = ERROR_INVALID_PARAMETER;
-    return INVALID_SET_FILE_POINTER;
-  }
+#define COMPAT_MOUNT_HOST    0
+#define COMPAT_MOUNT_SYS32   1
+#define COMPAT_MOUNT_LICENSE 2
 
-  if( lp_distance_to_move_high ) *lp_distance_to_move_high = ((uint64_t)seek)<<32;
-  return (uint32_t)seek;
+struct compat_mount {
+  char * prefix;  /* as given, without trailing separator */
+  char * host;    /* without trailing slash, "" for / */
+  int    kind;
+};
+
+struct compat_mount_node {
+  uint8_t c;        /* folded byte */
+  int32_t child;    /* -1 if none */
+  int32_t sibling;  /* -1 if none */
+  int32_t mount;    /* -1 unless a prefix ends here */
+};
+
+static struct compat_mount        g_mounts[ COMPAT_MOUNT_MAX ];
+static uint32_t                   g_mount_cnt;
+static struct compat_mount_node * g_mount_trie;
+static uint32_t                   g_mount_nodes;
+
+static inline uint8_t
+compat_mount_fold( char c ) {
+  return c=='/' ? '\\' : (uint8_t)tolower( (uint8_t)c );
 }
 
-WIN32_STDCALL
-int
-KERNEL32_WriteFile( uint32_t     h_file,
-                    void const * lp_buffer,
-                    uint32_t     n_number_of_bytes_to_write,
-                    uint32_t *   lp_number_of_bytes_written,
-                    void *       lp_overlapped ) {
+static inline int
+compat_mount_sep( char c ) {
+  return c=='\\' || c=='/';
+}
 
-  LOG_TRACE(( "KERNEL32_WriteFile(%p, %p, %u, %p, %p)",
-              h_file, lp_buffer,
-              n_number_of_bytes_to_write, lp_number_of_bytes_written,
-              lp_overlapped ));
+static inline int32_t
+compat_mount_child( int32_t node,
+                    uint8_t c ) {
+  int32_t next = g_mount_trie[ node ].child;
+  while( next>=0 && g_mount_trie[ next ].c!=c ) next = g_mount_trie[ next ].sibling;
+  return next;
+}
 
-  /* Check handle type */
-  compat_handle_t * hdl = compat_handle_get( h_file );
-  if( !hdl || hdl->close!=compat_handle_file_close ) {
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+static int32_t
+compat_mount_node( uint8_t c ) {
+  struct compat_mount_node * trie = realloc( g_mount_trie, ( g_mount_nodes+1U )*sizeof(struct compat_mount_node) );
+  if( !trie ) LOG_FATAL(( "out of memory building the mount table" ));
+  g_mount_trie = trie;
+  g_mount_trie[ g_mount_nodes ] = (struct compat_mount_node){ .c = c, .child = -1, .sibling = -1, .mount = -1 };
+  return (int32_t)g_mount_nodes++;
+}
+
+/* compat_mount_insert: Returns the node for key[0,n) below node,
+   adding nodes as needed. */
+static int32_t
+compat_mount_insert( int32_t      node,
+                     char const * key,
+                     size_t       n ) {
+  for( size_t i=0; i<n; i++ ) {
+    uint8_t c = compat_mount_fold( key[i] );
+    int32_t next = compat_mount_child( node, c );
+    if( next<0 ) {
+      next = compat_mount_node( c );
+      g_mount_trie[ next ].sibling = g_mount_trie[ node ].child;
+      g_mount_trie[ node ].child   = next;
+    }
+    node = next;
   }
+  return node;
+}
 
-  /* Write to file */
-  FILE * f = (FILE *)hdl->data;
-  size_t nbytes = fwrite( lp_buffer, 1, n_number_of_bytes_to_write, f );
-  if( lp_number_of_bytes_written ) {
-    *lp_number_of_bytes_written = nbytes;
+/* compat_mount_add: Adds or replaces the mount of prefix.  Returns its
+   index, or -1 if the table is full. */
+static int32_t
+compat_mount_add( char const * prefix,
+                  size_t       prefix_len,
+                  char const * host,
+                  size_t       host_len,
+                  int          kind ) {
+  while( prefix_len && compat_mount_sep( prefix[ prefix_len-1 ] ) ) prefix_len--;
+  while( host_len   && host[ host_len-1 ]=='/'                    ) host_len--;
+
+  int32_t node = compat_mount_insert( 0, prefix, prefix_len );
+  int32_t idx  = g_mount_trie[ node ].mount;
+  if( idx<0 ) {
+    if( g_mount_cnt>=COMPAT_MOUNT_MAX ) {
+      LOG_WARN(( "WIN32_MOUNTS: more than %d mounts, ignoring \"%.*s\"", COMPAT_MOUNT_MAX, (int)prefix_len, prefix ));
+      return -1;
+    }
+    idx = (int32_t)g_mount_cnt++;
+    g_mount_trie[ node ].mount = idx;
+  } else {
+    free( g_mounts[ idx ].prefix );
+    free( g_mounts[ idx ].host );
   }
+  g_mounts[ idx ] = (struct compat_mount){
+    .prefix = strndup( prefix, prefix_len ),
+    .host   = strndup( host,   host_len   ),
+    .kind   = kind
+  };
+  return idx;
+}
 
-  if( nbytes!=n_number_of_bytes_to_write ) {
-    LOG_WARN(( "KERNEL32_WriteFile(%u) failed: %s", h_file, strerror( errno ) ));
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+/* compat_mount_route: Returns the mount holding the Windows path win and
+   sets *rest to the remainder, which is empty or starts with a
+   separator.  NULL if no mount matches. */
+static struct compat_mount const *
+compat_mount_route( char const *  win,
+                    char const ** rest ) {
+  if( !g_mount_nodes ) return NULL;
+  int32_t      node  = 0;
+  int32_t      found = -1;
+  char const * p     = win;
+  for(;;) {
+    /* The empty prefix of the root needs a separator */
+    if( g_mount_trie[ node ].mount>=0 && ( compat_mount_sep( *p ) || ( !*p && p!=win ) ) ) {
+      found = g_mount_trie[ node ].mount;
+      *rest = p;
+    }
+    if( !*p ) break;
+    int32_t next = compat_mount_child( node, compat_mount_fold( *p++ ) );
+    if( next<0 ) break;
+    node = next;
   }
+  return found>=0 ? &g_mounts[ found ] : NULL;
+}
 
-  /* TODO check errno */
+/* compat_mount_to_win: Writes the Windows form of the absolute host path
+   through the host mount with the longest matching directory.  Returns
+   the size needed including the NUL, 0 if no drive mount covers it. */
+static size_t
+compat_mount_to_win( char *       out,
+                     size_t       out_sz,
+                     char const * host ) {
+  struct compat_mount const * best = NULL;
+  size_t best_len = 0;
+  for( uint32_t i=0; i<g_mount_cnt; i++ ) {
+    struct compat_mount const * m = &g_mounts[i];
+    size_t n = strlen( m->host );
+    /* Only drives, not the root of the current drive or shares */
+    if( m->kind!=COMPAT_MOUNT_HOST || !m->prefix[0] || compat_mount_sep( m->prefix[0] ) ) continue;
+    if( 0!=strncmp( host, m->host, n ) || ( host[n] && host[n]!='/' ) ) continue;
+    if( !best || n>best_len ) {
+      best     = m;
+      best_len = n;
+    }
+  }
+  if( !best ) return 0;
+
+  /* A drive root is "X:\", other directories have no trailing separator */
+  char const * rest = host+best_len;
+  size_t plen = strlen( best->prefix );
+  size_t rlen = strlen( rest );
+  int    root = !rlen && best->prefix[ plen-1 ]==':';
+  size_t sz   = plen + rlen + (size_t)root + 1;
+  if( sz>out_sz ) return sz;
+  memcpy( out, best->prefix, plen );
+  if( root ) {
+    out[ plen ] = '\\';
+  } else {
+    for( size_t i=0; i<rlen; i++ ) out[ plen+i ] = rest[i]=='/' ? '\\' : rest[i];
+  }
+  out[ sz-1 ] = '\0';
+  return sz;
+}
 
-  return 1;
+/* compat_mount_claim_add: Lets mount idx claim files with base name
+   name. */
+static void
+compat_mount_claim_add( char const * name,
+                        int32_t      idx ) {
+  if( idx<0 ) return;
+  int32_t node = compat_mount_insert( 0, "", 1 );
+  node = compat_mount_insert( node, name, strlen( name ) );
+  g_mount_trie[ node ].mount = idx;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_ReadFile( uint32_t   h_file,
-                   void *     lp_buffer,
-                   uint32_t   n_number_of_bytes_to_read,
+/* compat_mount_claim: Returns the mount providing a virtual file called
+   name, looked up by its base name, or NULL. */
+static struct compat_mount const *
+compat_mount_claim( char const * name ) {
+  if( !g_mount_nodes ) return NULL;
+  char const * base = name;
+  for( char const * p=name; *p; p++ ) if( compat_mount_sep( *p ) ) base = p+1;
+  int32_t node = compat_mount_child( 0, 0 );
+  for( char const * p=base; node>=0 && *p; p++ ) node = compat_mount_child( node, compat_mount_fold( *p ) );
+  if( node<0 || g_mount_trie[ node ].mount<0 ) return NULL;
+  struct compat_mount const * m = &g_mounts[ g_mount_trie[ node ].mount ];
+  /* Replaced by WIN32_MOUNTS, or the program asked for in a directory */
+  if( m->kind==COMPAT_MOUNT_HOST || ( m->kind==COMPAT_MOUNT_SYS32 && base!=name ) ) return NULL;
+  return m;
+}
+
+static void
+compat_mount_init( char const * spec ) {
+  compat_mount_node( 0 );
+  static char const sys32[]   = "C:\\Windows\\System32";
+  static char const license[] = "L:\\license.dat";
+  char self[ 256 ];
+  snprintf( self, sizeof(self), "%s.exe", __progname );
+  compat_mount_add( "\\",    1, "", 0, COMPAT_MOUNT_HOST );
+  compat_mount_add( "Z:\\",  3, "", 0, COMPAT_MOUNT_HOST );
+  compat_mount_claim_add( self,          compat_mount_add( sys32,   strlen( sys32 ),   "", 0, COMPAT_MOUNT_SYS32   ) );
+  compat_mount_claim_add( "license.dat", compat_mount_add( license, strlen( license ), "", 0, COMPAT_MOUNT_LICENSE ) );
+
+  while( spec && *spec ) {
+    char const * end = strchr( spec, ';' );
+    if( !end ) end = spec+strlen( spec );
+    char const * eq = memchr( spec, '=', (size_t)( end-spec ) );
+    if( !eq || eq==spec || eq[1]!='/' ) {
+      LOG_WARN(( "WIN32_MOUNTS: ignoring \"%.*s\", expected <prefix>=<absolute host dir>", (int)( end-spec ), spec ));
+    } else {
+      compat_mount_add( spec, (size_t)( eq-spec ), eq+1, (size_t)( end-eq-1 ), COMPAT_MOUNT_HOST );
+    }
+    spec = *end ? end+1 : end;
+  }
+}
+
+/* compat_winpath_to_posix: Converts a Windows path to a POSIX path.
+
+   Returns the number of bytes occupied by the POSIX string including trailing NULL.
+   If this number is greater than out_size, assume error.
+
+   Returns 0 if the Windows path is not representable in POSIX. */
+static inline
+uint32_t
+compat_winpath_to_posix( char *       out,
+                         size_t       out_sz,
+                         char const * win ) {
+  assert( out_sz>0 );
+  out[0] = '\0';
+  /* Names no file, and would stand for the working directory */
+  if( !*win ) return 0;
+
+  char const * str;
+  char const * host = "";
+  struct compat_mount const * m = compat_mount_route( win, &str );
+  if( m ) {
+    /* Virtual files have no host path */
+    if( m->kind!=COMPAT_MOUNT_HOST ) return 0;
+    host = m->host;
+    if( !*str && !*host ) str = "/";
+  } else if( compat_check_winpath_absolute( win ) ) {
+    /* Absolute path, but not mounted */
+    return 0;
+  } else {
+    str = win;
+  }
+
+  size_t host_len = strlen( host );
+  size_t sz = host_len+strlen( str )+1;
+  if( sz>out_sz ) return sz;
+
+  /* Copy path, converting slashes */
+  char * orig = out;
+  memcpy( out, host, host_len );
+  out += host_len;
+  while( *str ) {
+    if( *str=='\\' ) *out = '/';
+    else             *out = *str;
+    ++out; ++str;
+  }
+  *out = '\0';
+
+  if( g_case.on ) compat_case_resolve( orig );
+  return sz;
+}
+
+/* Dummy markers */
+static int g_cur_module;
+static int g_cur_library;
+
+typedef struct _COORD {
+  uint16_t X;
+  uint16_t Y;
+} COORD, *PCOORD;
+
+typedef struct _SMALL_RECT {
+  uint16_t Left;
+  uint16_t Top;
+  uint16_t Right;
+  uint16_t Bottom;
+} SMALL_RECT;
+
+struct _CONSOLE_SCREEN_BUFFER_INFO {
+  COORD      dwSize;
+  COORD      dwCursorPosition;
+  uint32_t   wAttributes;
+  SMALL_RECT srWindow;
+  COORD      dwMaximumWindowSize;
+};
+typedef struct _CONSOLE_SCREEN_BUFFER_INFO CONSOLE_SCREEN_BUFFER_INFO;
+
+static CONSOLE_SCREEN_BUFFER_INFO console_buf = {0};
+
+WIN32_STDCALL
+int32_t
+ADVAPI32_RegOpenKeyExA( uint32_t     h_key,
+                        char const * lp_sub_key,
+                        uint32_t     ul_options,
+                        uint32_t     sam_desired,
+                        void **      phk_result ) {
+  STATS_API( ADVAPI32_RegOpenKeyExA );
+
+  char const * hkey_name;
+  switch( h_key ) {
+  case HKEY_CLASSES_ROOT     : hkey_name = "HKEY_CLASSES_ROOT"     ; break;
+  case HKEY_CURRENT_USER     : hkey_name = "HKEY_CURRENT_USER"     ; break;
+  case HKEY_LOCAL_MACHINE    : hkey_name = "HKEY_LOCAL_MACHINE"    ; break;
+  case HKEY_USERS            : hkey_name = "HKEY_USERS"            ; break;
+  case HKEY_PERFORMANCE_DATA : hkey_name = "HKEY_PERFORMANCE_DATA" ; break;
+  case HKEY_CURRENT_CONFIG   : hkey_name = "HKEY_CURRENT_CONFIG"   ; break;
+  case HKEY_DYN_DATA         : hkey_name = "HKEY_DYN_DATA"         ; break;
+  default                    : hkey_name = "<unknown>"             ; break;
+  }
+
+  LOG_DEBUG(( "[TODO] ADVAPI32_RegOpenKeyExA(%s (%p), \"%s\", %x, %x, %p)",
+              hkey_name, h_key, lp_sub_key, ul_options, sam_desired, phk_result ));
+
+  TRACE_API( ADVAPI32_RegOpenKeyExA, ERROR_ACCESS_DENIED, h_key, lp_sub_key, phk_result );
+  return ERROR_ACCESS_DENIED;
+}
+
+WIN32_STDCALL
+int32_t
+ADVAPI32_RegQueryValueExA( void *       h_key,
+                           char const * lp_value_name,
+                           uint32_t *   lp_reserved,
+                           uint32_t *   lp_type,
+                           uint8_t *    lp_data,
+                           uint32_t *   lpcb_data ) {
+  STATS_API( ADVAPI32_RegQueryValueExA );
+  LOG_ERR(( "[TODO] ADVAPI32_RegQueryValueExA(%p, \"%s\", %p, %p, %p, %p)",
+          h_key,
+          lp_value_name,
+          lp_reserved,
+          lp_type,
+          lp_data,
+          lpcb_data ));
+  TRACE_API( ADVAPI32_RegQueryValueExA, ERROR_ACCESS_DENIED, h_key, lp_value_name, lp_data );
+  return ERROR_ACCESS_DENIED;
+}
+
+WIN32_STDCALL
+int32_t
+ADVAPI32_RegCloseKey( void * h_key ) {
+  STATS_API( ADVAPI32_RegCloseKey );
+  LOG_ERR(( "[TODO] ADVAPI32_RegCloseKey(%p)", h_key ));
+  TRACE_API( ADVAPI32_RegCloseKey, ERROR_ACCESS_DENIED, h_key, 0, 0 );
+  return ERROR_ACCESS_DENIED;
+}
+
+WIN32_STDCALL
+int32_t
+KERNEL32_IsBadReadPtr( void const * lp,
+                       uint32_t     ucb ) {
+  STATS_API( KERNEL32_IsBadReadPtr );
+  LOG_ERR(( "[TODO] KERNEL32_IsBadReadPtr(%p, %x)", lp, ucb ));
+  TRACE_API( KERNEL32_IsBadReadPtr, 0, lp, ucb, 0 );
+  abort();
+  return 1;
+}
+
+WIN32_STDCALL
+void
+KERNEL32_RtlUnwind( void * target_frame,
+                    void * target_ip,
+                    void * exception_record,
+                    void * return_value ) {
+  STATS_API( KERNEL32_RtlUnwind );
+  TRACE_API( KERNEL32_RtlUnwind, 0, target_frame, target_ip, exception_record );
+  puts( "KERNEL32_RtlUnwind" );
+}
+
+WIN32_STDCALL
+void
+KERNEL32_ExitProcess( uint32_t exit_code ) {
+  STATS_API( KERNEL32_ExitProcess );
+  LOG_INFO(( "KERNEL32_ExitProcess(%d)", exit_code ));
+  TRACE_API( KERNEL32_ExitProcess, 0, exit_code, 0, 0 );
+  /* Don't report success for output that never made it to disk */
+  if( compat_file_flush_all( 1 ) && !exit_code ) {
+    LOG_ERR(( "KERNEL32_ExitProcess: writing output failed, exiting with 1" ));
+    exit_code = 1;
+  }
+  compat_nondet_report( exit_code );
+  compat_cache_finish( exit_code );
+  if( g_batch_active ) {
+    g_batch_exit_code = exit_code;
+    longjmp( g_batch_jmp, 1 );
+  }
+  exit( exit_code );
+}
+
+WIN32_STDCALL
+int32_t
+KERNEL32_GetCurrentProcess( void ) {
+  STATS_API( KERNEL32_GetCurrentProcess );
+  TRACE_API( KERNEL32_GetCurrentProcess, -1, 0, 0, 0 );
+  return -1;
+}
+
+WIN32_STDCALL
+int32_t
+KERNEL32_DuplicateHandle( uint32_t   h_source_process_handle,
+                          uint32_t   h_source_handle,
+                          uint32_t   h_target_process_handle,
+                          uint32_t * lp_target_handle,
+                          uint32_t   dw_desired_access,
+                          int32_t    b_inherit_handle,
+                          uint32_t   dw_options ) {
+  STATS_API( KERNEL32_DuplicateHandle );
+  LOG_TRACE(( "KERNEL32_DuplicateHandle(%u, %u, %u, %p, %x, %x, %x)",
+              h_source_process_handle, h_source_handle,
+              h_target_process_handle, lp_target_handle,
+              dw_desired_access, b_inherit_handle, dw_options ));
+
+  /* Check handle type */
+  compat_handle_t * hdl = compat_handle_get( h_source_handle );
+  if( !hdl || hdl->close!=compat_handle_file_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_DuplicateHandle, 0, h_source_handle, 0, 0 );
+    return 0;
+  }
+
+  /* Duplicates share the file pointer, like on Windows */
+  struct compat_file * f = (struct compat_file *)hdl->data;
+  f->ref++;
+  *lp_target_handle = compat_handle_alloc( f, compat_handle_file_close );
+  TRACE_API( KERNEL32_DuplicateHandle, 1, h_source_handle, *lp_target_handle, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+int32_t
+KERNEL32_GetLastError( void ) {
+  STATS_API( KERNEL32_GetLastError );
+  TRACE_API( KERNEL32_GetLastError, g_last_error, 0, 0, 0 );
+  return g_last_error;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetStdHandle( int32_t n_std_handle ) {
+  STATS_API( KERNEL32_GetStdHandle );
+  uint32_t h;
+  switch( n_std_handle ) {
+  case STD_INPUT_HANDLE  : h = compat_stdin;  break;
+  case STD_OUTPUT_HANDLE : h = compat_stdout; break;
+  case STD_ERROR_HANDLE  : h = compat_stderr; break;
+  default:
+    h = INVALID_HANDLE_VALUE;
+  }
+  LOG_INFO(( "KERNEL32_GetStdHandle(%p) = %p", n_std_handle, h ));
+  TRACE_API( KERNEL32_GetStdHandle, h, n_std_handle, 0, 0 );
+  return h;
+}
+
+WIN32_STDCALL
+void
+KERNEL32_InitializeCriticalSection( void * lp_critical_section ) {
+  STATS_API( KERNEL32_InitializeCriticalSection );
+  TRACE_API( KERNEL32_InitializeCriticalSection, 0, lp_critical_section, 0, 0 );
+# ifdef HAS_THREADS
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init( lp_critical_section, &attr );
+# endif /* HAS_THREADS */
+}
+
+WIN32_STDCALL
+void
+KERNEL32_DeleteCriticalSection( void * lp_critical_section ) {
+  STATS_API( KERNEL32_DeleteCriticalSection );
+  LOG_TRACE(( "KERNEL32_DeleteCriticalSection(%p)", lp_critical_section ));
+  TRACE_API( KERNEL32_DeleteCriticalSection, 0, lp_critical_section, 0, 0 );
+# ifdef HAS_THREADS
+
+  pthread_mutex_destroy( lp_critical_section );
+# endif /* HAS_THREADS */
+}
+
+WIN32_STDCALL
+void
+KERNEL32_EnterCriticalSection( void * lp_critical_section ) {
+  STATS_API( KERNEL32_EnterCriticalSection );
+  LOG_TRACE(( "KERNEL32_EnterCriticalSection(%p)", lp_critical_section ));
+# ifdef HAS_THREADS
+  pthread_mutex_lock( lp_critical_section );
+# endif /* HAS_THREADS */
+  TRACE_API( KERNEL32_EnterCriticalSection, 0, lp_critical_section, 0, 0 );
+}
+
+WIN32_STDCALL
+void
+KERNEL32_LeaveCriticalSection( void * lp_critical_section ) {
+  STATS_API( KERNEL32_LeaveCriticalSection );
+# ifdef HAS_THREADS
+  pthread_mutex_unlock( lp_critical_section );
+# endif /* HAS_THREADS */
+  TRACE_API( KERNEL32_LeaveCriticalSection, 0, lp_critical_section, 0, 0 );
+}
+
+/* FindFile API
+
+   Directories are read in bulk with compat_dir_next into a per-handle
+   buffer.  Patterns are compiled once with the kernel32 wildcard
+   rewrite: '?' becomes DOS_QM, '*' before '.' becomes DOS_STAR, and
+   '.' before a wildcard or at the end becomes DOS_DOT, so "*.*"
+   matches names without an extension and "*." matches only those.
+   Matching ignores case.  Entry metadata comes from fstatat on the
+   directory fd. */
+
+#define COMPAT_FINDFILE_PATSZ 256
+
+/* Compiled pattern tokens, all other bytes match case-insensitively */
+#define COMPAT_FINDFILE_STAR     '\x01'  /* '*': any run */
+#define COMPAT_FINDFILE_DOS_STAR '\x02'  /* any run up to the last '.' */
+#define COMPAT_FINDFILE_DOS_QM   '\x03'  /* one char, none before '.' or end */
+#define COMPAT_FINDFILE_DOS_DOT  '\x04'  /* '.', or nothing at the end */
+
+/* Fast paths for common patterns */
+#define COMPAT_FINDFILE_ANY     0  /* "*" or "*.*" */
+#define COMPAT_FINDFILE_LITERAL 1  /* no wildcards */
+#define COMPAT_FINDFILE_SUFFIX  2  /* "*.ext" */
+#define COMPAT_FINDFILE_GLOB    3
+
+struct compat_findfile {
+  uint32_t          kind;
+  uint32_t          tail;  /* literal length after the leading wildcard */
+  char              pattern[ COMPAT_FINDFILE_PATSZ ];
+  struct compat_dir dir;
+};
+
+static void compat_filetime_from_unix( FILETIME * ft, struct timespec const * ts );
+
+/* compat_findfile_compile: Rewrites pat into ff->pattern and picks
+   a matcher. */
+static void
+compat_findfile_compile( struct compat_findfile * ff,
+                         char const *             pat ) {
+  size_t n = strlen( pat );
+  int    wild = 0;
+  for( size_t i=0; i<=n; i++ ) {
+    char c = pat[i];
+    char d = i<n ? pat[i+1] : '\0';
+    if( c=='?' ) c = COMPAT_FINDFILE_DOS_QM;
+    else if( c=='*' ) c = d=='.' ? COMPAT_FINDFILE_DOS_STAR : COMPAT_FINDFILE_STAR;
+    else if( c=='.' && ( d=='?' || d=='*' || d=='\0' ) ) c = COMPAT_FINDFILE_DOS_DOT;
+    else c = (char)tolower( (unsigned char)c );
+    if( c && c<=COMPAT_FINDFILE_DOS_DOT && i ) wild = 1;  /* past the first char */
+    ff->pattern[i] = c;
+  }
+
+  char const * p = ff->pattern;
+  if( 0==strcmp( p, "\x01" ) || 0==strcmp( p, "\x02\x04\x01" ) ) {
+    ff->kind = COMPAT_FINDFILE_ANY;
+  } else if( !wild && p[0]>COMPAT_FINDFILE_DOS_DOT ) {
+    ff->kind = COMPAT_FINDFILE_LITERAL;
+  } else if( !wild && p[0]==COMPAT_FINDFILE_DOS_STAR && p[1]=='.' && !strchr( p+2, '.' ) ) {
+    /* The tail holds the last '.' of any match, so DOS_STAR cannot
+       overrun it */
+    ff->kind = COMPAT_FINDFILE_SUFFIX;
+    ff->tail = (uint32_t)( n-1 );
+  } else {
+    ff->kind = COMPAT_FINDFILE_GLOB;
+  }
+}
+
+static int
+compat_findfile_glob( char const * p,
+                      char const * s ) {
+  for(;;) {
+    switch( *p ) {
+    case '\0':
+      return *s=='\0';
+    case COMPAT_FINDFILE_STAR:
+      for( p++;; s++ ) {
+        if( compat_findfile_glob( p, s ) ) return 1;
+        if( !*s ) return 0;
+      }
+    case COMPAT_FINDFILE_DOS_STAR: {
+      char const * end = strrchr( s, '.' );
+      if( !end ) end = s+strlen( s );
+      for( p++;; s++ ) {
+        if( compat_findfile_glob( p, s ) ) return 1;
+        if( s==end ) return 0;
+      }
+    }
+    case COMPAT_FINDFILE_DOS_QM:
+      if( *s && *s!='.' ) s++;
+      p++;
+      break;
+    case COMPAT_FINDFILE_DOS_DOT:
+      if( *s=='.' ) s++;
+      else if( *s ) return 0;
+      p++;
+      break;
+    default:
+      if( *p!=(char)tolower( (unsigned char)*s ) ) return 0;
+      p++; s++;
+      break;
+    }
+  }
+}
+
+static int
+compat_findfile_match( struct compat_findfile const * ff,
+                       char const *                   name ) {
+  switch( ff->kind ) {
+  case COMPAT_FINDFILE_ANY:
+    return 1;
+  case COMPAT_FINDFILE_LITERAL:
+    return 0==strcasecmp( name, ff->pattern );
+  case COMPAT_FINDFILE_SUFFIX: {
+    size_t n = strlen( name );
+    return n>=ff->tail && 0==strcasecmp( name+n-ff->tail, ff->pattern+1 );
+  }
+  default:
+    return compat_findfile_glob( ff->pattern, name );
+  }
+}
+
+static void
+compat_findfile_fill( struct compat_findfile const * ff,
+                      char const *                   name,
+                      WIN32_FIND_DATAA *             data ) {
+  /* 64-bit sizes and inodes, or large files fail with EOVERFLOW */
+  struct stat64 st;
+  memset( data, 0, sizeof(WIN32_FIND_DATAA) );
+  if( 0==fstatat64( ff->dir.fd, name, &st, 0 ) ||
+      0==fstatat64( ff->dir.fd, name, &st, AT_SYMLINK_NOFOLLOW ) ) {
+    uint32_t attr = 0;
+    /* Same attributes as GetFileAttributesA, which leaves out READONLY */
+    if( S_ISDIR( st.st_mode ) ) attr |= FILE_ATTRIBUTE_DIRECTORY;
+    data->dwFileAttributes = attr ? attr : FILE_ATTRIBUTE_NORMAL;
+    if( !S_ISDIR( st.st_mode ) ) {
+      data->nFileSizeHigh = (uint32_t)( (uint64_t)st.st_size>>32 );
+      data->nFileSizeLow  = (uint32_t)st.st_size;
+    }
+    compat_filetime_from_unix( &data->ftCreationTime,   &st.st_ctim );
+    compat_filetime_from_unix( &data->ftLastAccessTime, &st.st_atim );
+    compat_filetime_from_unix( &data->ftLastWriteTime,  &st.st_mtim );
+    compat_nondet_note( COMPAT_NONDET_FILETIME, NULL, 0 );
+  } else {
+    data->dwFileAttributes = FILE_ATTRIBUTE_NORMAL;
+  }
+  strncpy( data->cFileName, name, sizeof(data->cFileName)-1 );
+}
+
+static int
+compat_findfile_next( struct compat_findfile * ff,
+                      WIN32_FIND_DATAA *       data ) {
+  for(;;) {
+    struct compat_dirent64 const * de = compat_dir_next( &ff->dir );
+    if( !de ) return 0;
+    if( strlen( de->d_name )<sizeof(data->cFileName) && compat_findfile_match( ff, de->d_name ) ) {
+      compat_findfile_fill( ff, de->d_name, data );
+      return 1;
+    }
+  }
+}
+
+static uint32_t
+compat_handle_findfile_close( void * opaque ) {
+  struct compat_findfile * ff = opaque;
+  close( ff->dir.fd );
+  free( ff );
+  return 1;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_FindFirstFileA( char const *       lp_file_name,
+                         WIN32_FIND_DATAA * lp_find_file_data ) {
+  STATS_API( KERNEL32_FindFirstFileA );
+  uint64_t tl_t0 = compat_tl_now();
+  char dir_path[ PATH_MAX ];
+  compat_cache_disable( "directory listing" );
+
+  uint32_t n = compat_winpath_to_posix( dir_path, sizeof(dir_path), lp_file_name );
+  if( n==0 ) {
+    LOG_TRACE(( "KERNEL32_FindFirstFileA: Cannot represent path \"%s\"", lp_file_name ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_FindFirstFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+  if( n>sizeof(dir_path) ) {
+    LOG_TRACE(( "KERNEL32_FindFirstFileA: Oversize unix path (%lu bytes)", n ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_FindFirstFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+
+  /* Split dir name and file name */
+  char const * dir  = dir_path;
+  char *       name = strrchr( dir_path, '/' );
+  if( !name ) {
+    dir  = ".";
+    name = dir_path;
+  } else if( name==dir_path ) {
+    dir = "/";
+    name++;
+  } else {
+    *name = '\0'; // split path into two separate strings
+    name++;
+  }
+
+  if( strlen(name) >= COMPAT_FINDFILE_PATSZ ) {
+    LOG_WARN(( "FindFirstFileA: pattern too long (\"%s\")", name ));
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_FindFirstFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+
+  /* Open directory */
+  int fd = open( dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC );
+  if( fd<0 ) {
+    LOG_DEBUG(( "FindFirstFileA: open(\"%s\") failed: %s", dir, strerror( errno ) ));
+    g_last_error = ERROR_PATH_NOT_FOUND;
+    compat_tl_fail( "find", lp_file_name, tl_t0, g_last_error );
+    TRACE_API( KERNEL32_FindFirstFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+
+  /* Create compat handle */
+  struct compat_findfile * find = malloc( sizeof(struct compat_findfile) );
+  if( !find ) {
+    close( fd );
+    g_last_error = ERROR_NOT_ENOUGH_MEMORY;
+    TRACE_API( KERNEL32_FindFirstFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+  compat_dir_open( &find->dir, fd );
+  compat_findfile_compile( find, name );
+
+  if( !compat_findfile_next( find, lp_find_file_data ) ) {
+    /* Don't alloc handle if no file matches */
+    compat_handle_findfile_close( find );
+    LOG_DEBUG(( "FindFirstFileA(\"%s\"): not found", lp_file_name ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    compat_tl_fail( "find", lp_file_name, tl_t0, g_last_error );
+    TRACE_API( KERNEL32_FindFirstFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+
+  /* Create handle for finding further files */
+  uint32_t h = compat_handle_alloc( (void *)find, compat_handle_findfile_close );
+  compat_tl_open( h, COMPAT_TL_FIND, lp_file_name, tl_t0, 0 );
+  compat_tl_entry( h );
+  LOG_DEBUG(( "FindFirstFileA(\"%s\"): found \"%s\"", lp_file_name, lp_find_file_data->cFileName ));
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_FindFirstFileA, h, lp_file_name, 0, 0 );
+  return h;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_FindNextFileA( uint32_t h_find_file,
+                        void *   lp_find_file_data ) {
+  STATS_API( KERNEL32_FindNextFileA );
+  compat_handle_t * h = compat_handle_get( h_find_file );
+  if( !h || h->close!=compat_handle_findfile_close ) {
+    LOG_ERR(( "KERNEL32_FindNextFileA: invalid handle %u", h_find_file ));
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_FindNextFileA, 0, h_find_file, 0, 0 );
+    return 0;
+  }
+
+  struct compat_findfile * find = (struct compat_findfile *)h->data;
+
+  if( !compat_findfile_next( find, lp_find_file_data ) ) {
+    LOG_DEBUG(( "KERNEL32_FindNextFileA(%u, %p): not found", h_find_file, lp_find_file_data ));
+    g_last_error = ERROR_NO_MORE_FILES;
+    TRACE_API( KERNEL32_FindNextFileA, 0, h_find_file, 0, 0 );
+    return 0;
+  }
+
+  compat_tl_entry( h_find_file );
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_FindNextFileA, 1, h_find_file, 0, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_FindClose( uint32_t h_find_file ) {
+  STATS_API( KERNEL32_FindClose );
+  compat_handle_t * h = compat_handle_get( h_find_file );
+  if( !h || h->close!=compat_handle_findfile_close ) {
+    if( h_find_file!=INVALID_HANDLE_VALUE )
+      LOG_ERR(( "KERNEL32_FindClose: invalid handle %u", h_find_file ));
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_FindClose, 0, h_find_file, 0, 0 );
+    return 0;
+  }
+
+  compat_tl_close( h_find_file, -1 );
+  compat_handle_findfile_close( h->data );
+  compat_handle_free( h_find_file );
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_FindClose, 1, h_find_file, 0, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetFileAttributesA( char const * lp_file_name ) {
+  STATS_API( KERNEL32_GetFileAttributesA );
+  char const * rest;
+  struct compat_mount const * m = compat_mount_route( lp_file_name, &rest );
+  if( m && m->kind==COMPAT_MOUNT_SYS32 ) {
+    /* Programs converted alongside this one */
+    if( compat_mount_sep( rest[0] ) && !strpbrk( rest+1, "\\/" ) && strstr( rest+1, ".elf.exe" ) ) {
+      LOG_TRACE(( "KERNEL32_GetFileAttributesA: asking for program %s", lp_file_name ));
+      g_last_error = ERROR_SUCCESS;
+      TRACE_API( KERNEL32_GetFileAttributesA, FILE_ATTRIBUTE_NORMAL, lp_file_name, 0, 0 );
+      return FILE_ATTRIBUTE_NORMAL;
+    }
+  }
+  if( m && m->kind==COMPAT_MOUNT_LICENSE && !*rest ) {
+    LOG_TRACE(( "KERNEL32_GetFileAttributesA: Reporting \"%s\" as exist", lp_file_name ));
+    g_last_error = ERROR_SUCCESS;
+    TRACE_API( KERNEL32_GetFileAttributesA, FILE_ATTRIBUTE_NORMAL, lp_file_name, 0, 0 );
+    return FILE_ATTRIBUTE_NORMAL;
+  }
+
+  /* Convert path to POSIX */
+  char path[ PATH_MAX ];
+  size_t n = compat_winpath_to_posix( path, sizeof(path), lp_file_name );
+  if( n==0 ) {
+    LOG_TRACE(( "KERNEL32_GetFileAttributesA: Cannot represent path \"%s\"", lp_file_name ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_GetFileAttributesA, INVALID_FILE_ATTRIBUTES, lp_file_name, 0, 0 );
+    return INVALID_FILE_ATTRIBUTES;
+  }
+  if( n>sizeof(path) ) {
+    LOG_TRACE(( "KERNEL32_GetFileAttributesA: Oversize unix path (%lu bytes)", n ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_GetFileAttributesA, INVALID_FILE_ATTRIBUTES, lp_file_name, 0, 0 );
+    return INVALID_FILE_ATTRIBUTES;
+  }
+
+  /* Stat file */
+  int kind = compat_stat_lookup( path );
+  compat_cache_on_probe( path, kind );
+  if( kind==COMPAT_STAT_ABSENT ) {
+    LOG_TRACE(( "KERNEL32_GetFileAttributesA: \"%s\" not found", path ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_GetFileAttributesA, INVALID_FILE_ATTRIBUTES, lp_file_name, 0, 0 );
+    return INVALID_FILE_ATTRIBUTES;
+  }
+
+  /* Convert stat to KERNEL32 format */
+  uint32_t mode = 0;
+  if( kind==COMPAT_STAT_DIR ) mode |= FILE_ATTRIBUTE_DIRECTORY;
+  if( mode==0U ) mode = FILE_ATTRIBUTE_NORMAL;
+
+  LOG_TRACE(( "KERNEL32_GetFileAttributesA(\"%s\") = 0x%08x", lp_file_name, mode ));
+
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_GetFileAttributesA, mode, lp_file_name, 0, 0 );
+  return mode;
+}
+
+static char * g_cmdline = NULL;
+
+WIN32_STDCALL
+char *
+KERNEL32_GetCommandLineA( void ) {
+  STATS_API( KERNEL32_GetCommandLineA );
+  if( g_cmdline ) {
+    TRACE_API( KERNEL32_GetCommandLineA, g_cmdline, g_argc, 0, 0 );
+    return g_cmdline;
+  }
+
+
+  /* Returns a second time when resuming from the snapshot */
+  if( g_snapshot_path ) compat_snapshot_take();
+
+  /* CRT init is done, park here until a fork server request arrives.
+     Only returns in the forked worker, with g_argv replaced. */
+  if( g_server_path ) compat_server_run( g_server_path );
+
+  compat_nondet_begin();
+
+  /* Only returns on cache miss */
+  compat_cache_begin();
+
+  int argc     = g_argc-1;
+  char ** argv = g_argv+1;
+  char x;
+
+  char const * progname = __progname;
+  size_t progname_len = strlen( progname );
+
+  /* Count number of chars required */
+  int arglen = progname_len + 4;
+  for( int i=0; i<argc; i++ ) {
+    arglen += 3; // quotes and space
+    char * arg = argv[i];
+    while( (x = *arg++) ) {
+      if( *arg == '"' )
+        arglen += 2;
+      else
+        arglen += 1;
+    }
+  }
+
+  char * cmd = malloc( arglen );
+  assert( cmd );
+
+  /* Copy program name */
+  char * c = cmd;
+  *c++ = '"';
+  memcpy( c, progname, progname_len );
+  c += progname_len;
+  *c++ = '"';
+
+  /* Copy arguments */
+  for( int i=0; i<argc; i++ ) {
+    *c++ = ' ';
+    *c++ = '"';
+    char * arg = argv[i];
+    while( (x = *arg++) ) {
+      if( x == '"' ) {
+        *c++ = '\\';
+        *c++ = '"';
+      } else {
+        *c++ = x;
+      }
+    }
+    *c++ = '"';
+  }
+  *c = '\0';
+
+  g_cmdline = cmd;
+  TRACE_API( KERNEL32_GetCommandLineA, cmd, g_argc, 0, 0 );
+  return cmd;
+}
+
+static char * g_envstr = NULL;
+
+/* compat_env_path_in: Whether the path p of n chars occurs in s as a
+   whole path prefix.  Windows paths match ignoring case and the kind of
+   separator. */
+static int
+compat_env_path_in( char const * s,
+                    char const * p,
+                    size_t       n,
+                    int          win ) {
+  for( ; *s; s++ ) {
+    size_t i;
+    for( i=0; i<n; i++ ) {
+      char a = s[i];
+      char b = p[i];
+      if( win ) {
+        a = a=='/' ? '\\' : (char)tolower( (uint8_t)a );
+        b = b=='/' ? '\\' : (char)tolower( (uint8_t)b );
+      }
+      if( a!=b ) break;
+    }
+    if( i==n && ( !s[n] || s[n]=='/' || s[n]=='\\' ) ) return 1;
+  }
+  return 0;
+}
+
+/* compat_env_is_input_dir: Whether the variable value val is a
+   directory holding the working directory or a path on the command
+   line, like HOME usually is.  Outputs that embed input paths contain
+   it no matter what the environment says. */
+static int
+compat_env_is_input_dir( char const * val ) {
+  size_t n = strlen( val );
+  if( n<2 || val[0]!='/' ) return 0;
+  while( n>1 && val[ n-1 ]=='/' ) n--;
+
+  char   win[ PATH_MAX ];
+  size_t win_sz = compat_mount_to_win( win, sizeof(win), val );
+  size_t win_n  = win_sz && win_sz<=sizeof(win) ? strlen( win ) : 0;
+  if( win_n && win[ win_n-1 ]=='\\' ) win_n = 0;  /* a drive root */
+
+  char cwd[ PATH_MAX ];
+  if( getcwd( cwd, sizeof(cwd) ) && compat_env_path_in( cwd, val, n, 0 ) ) return 1;
+  for( int i=1; i<g_argc; i++ ) {
+    if( compat_env_path_in( g_argv[i], val, n, 0 ) ) return 1;
+    if( win_n && compat_env_path_in( g_argv[i], win, win_n, 1 ) ) return 1;
+  }
+  return 0;
+}
+
+WIN32_STDCALL
+char *
+KERNEL32_GetEnvironmentStrings( void ) {
+  STATS_API( KERNEL32_GetEnvironmentStrings );
+  if( g_envstr ) {
+    TRACE_API( KERNEL32_GetEnvironmentStrings, g_envstr, 0, 0, 0 );
+    return g_envstr;
+  }
+
+  int envlen = 2;
+  char ** env = environ;
+  char * line;
+  while( (line = *env++) ) {
+    envlen += strlen( line ) + 1;
+  }
+
+  g_envstr = malloc( envlen );
+  assert( g_envstr );
+  char * s = g_envstr;
+
+  env = environ;
+  while( (line = *env++) ) {
+    char x;
+    while( (x = *line++) )
+      *s++ = x;
+    *s++ = '\0';
+  }
+  *s++ = '\0';
+
+  assert( envlen >= (s - g_envstr) );
+
+  /* Values of more than a few chars are distinctive enough to spot.
+     Directories the inputs live in are left out, they would show up in
+     any output that names an input. */
+  compat_nondet_note( COMPAT_NONDET_ENV, NULL, 0 );
+  for( env=environ; (line = *env); env++ ) {
+    char const * val = strchr( line, '=' );
+    if( !val || strlen( val+1 )<6 ) continue;
+    if( compat_env_is_input_dir( val+1 ) ) {
+      LOG_DEBUG(( "nondet: not tracking %.*s, it holds inputs", (int)( val-line ), line ));
+      continue;
+    }
+    compat_nondet_pattern( COMPAT_NONDET_ENV, val+1, strlen( val+1 ) );
+  }
+
+  TRACE_API( KERNEL32_GetEnvironmentStrings, g_envstr, envlen, 0, 0 );
+  return g_envstr;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_FreeEnvironmentStringsA( char * lpsz_environment_block ) {
+  STATS_API( KERNEL32_FreeEnvironmentStringsA );
+  if( !g_envstr ) {
+    TRACE_API( KERNEL32_FreeEnvironmentStringsA, 0, lpsz_environment_block, 0, 0 );
+    return 0;
+  }
+  free( g_envstr );
+  g_envstr = NULL;
+  TRACE_API( KERNEL32_FreeEnvironmentStringsA, 1, lpsz_environment_block, 0, 0 );
+  return 1;
+}
+
+/* Working directory
+
+   The Windows form of the working directory is computed once and then
+   only changed by SetCurrentDirectoryA, so GetCurrentDirectoryA and
+   GetFullPathNameA need no getcwd. */
+
+static char   g_cwd[ PATH_MAX ];
+static size_t g_cwd_len;        /* 0 until computed */
+static int    g_cwd_home = -1;  /* directory before the first change, for batch mode */
+
+/* compat_cwd: Returns the Windows form of the working directory, or NULL
+   with g_last_error set. */
+static char const *
+compat_cwd( void ) {
+  if( g_cwd_len ) return g_cwd;
+  char unix_path[ PATH_MAX ];
+  if( !getcwd( unix_path, sizeof(unix_path) ) ) {
+    LOG_ERR(( "getcwd failed: %s", strerror( errno ) ));
+    g_last_error = ERROR_OUTOFMEMORY;
+    return NULL;
+  }
+  size_t sz = compat_mount_to_win( g_cwd, sizeof(g_cwd), unix_path );
+  if( !sz || sz>sizeof(g_cwd) ) {
+    LOG_ERR(( "working directory \"%s\" is not on any drive", unix_path ));
+    g_last_error = ERROR_PATH_NOT_FOUND;
+    return NULL;
+  }
+  g_cwd_len = sz-1;
+  return g_cwd;
+}
+
+/* compat_fullpath: Writes the absolute form of the Windows path win to
+   out, relative to the working directory, with "." and ".." components
+   and repeated separators removed.  Returns the length, 0 on failure
+   with g_last_error set. */
+static size_t
+compat_fullpath( char *       out,
+                 size_t       out_sz,
+                 char const * win ) {
+  char const * base = "";
+  char const * rest = win;
+  char         drive[2];
+
+  if( isalpha( (uint8_t)win[0] ) && win[1]==':' ) {
+    drive[0] = win[0];
+    drive[1] = ':';
+    rest     = win+2;
+    /* "X:foo" is relative to the working directory if that is on X: */
+    if( !compat_mount_sep( *rest ) ) {
+      char const * cwd = compat_cwd();
+      if( cwd && tolower( (uint8_t)cwd[0] )==tolower( (uint8_t)win[0] ) ) {
+        drive[0] = cwd[0];
+        base     = cwd+2;
+      }
+    }
+  } else {
+    char const * cwd = compat_cwd();
+    if( !cwd ) return 0;
+    drive[0] = cwd[0];
+    drive[1] = cwd[1];
+    if( !compat_mount_sep( *rest ) ) base = cwd+2;
+  }
+
+  if( out_sz<4 ) {
+    g_last_error = ERROR_INSUFFICIENT_BUFFER;
+    return 0;
+  }
+  size_t len = 2;
+  out[0] = drive[0];
+  out[1] = drive[1];
+  char const * parts[2] = { base, rest };
+  for( int i=0; i<2; i++ ) {
+    char const * p = parts[i];
+    while( *p ) {
+      while( compat_mount_sep( *p ) ) p++;
+      char const * end = p;
+      while( *end && !compat_mount_sep( *end ) ) end++;
+      size_t n = (size_t)( end-p );
+      if( n==2 && p[0]=='.' && p[1]=='.' ) {
+        while( len>2 && out[ len-1 ]!='\\' ) len--;
+        if( len>2 ) len--;
+      } else if( n && !( n==1 && p[0]=='.' ) ) {
+        if( len+1+n+2>out_sz ) {
+          g_last_error = ERROR_FILENAME_EXCED_RANGE;
+          return 0;
+        }
+        out[ len++ ] = '\\';
+        memcpy( out+len, p, n );
+        len += n;
+      }
+      p = end;
+    }
+  }
+  /* Keep the root's and a trailing separator */
+  size_t wlen = strlen( win );
+  if( len==2 || ( wlen && compat_mount_sep( win[ wlen-1 ] ) ) ) out[ len++ ] = '\\';
+  out[ len ] = '\0';
+  return len;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetCurrentDirectoryA( uint32_t n_buffer_length,
+                               char *   lp_buffer ) {
+  STATS_API( KERNEL32_GetCurrentDirectoryA );
+  char const * cwd = compat_cwd();
+  if( !cwd ) {
+    TRACE_API( KERNEL32_GetCurrentDirectoryA, 0, n_buffer_length, lp_buffer, 0 );
+    return 0;
+  }
+
+  /* Bounds check */
+  if( g_cwd_len>=n_buffer_length ) {
+    LOG_ERR(( "KERNEL32_GetCurrentDirectoryA(%u, %p) failed: insufficient buffer", n_buffer_length, lp_buffer ));
+    g_last_error = ERROR_INSUFFICIENT_BUFFER;
+    TRACE_API( KERNEL32_GetCurrentDirectoryA, g_cwd_len+1, n_buffer_length, lp_buffer, 0 );
+    return g_cwd_len+1;
+  }
+  memcpy( lp_buffer, cwd, g_cwd_len+1 );
+  compat_nondet_note( COMPAT_NONDET_CWD, lp_buffer, g_cwd_len );
+
+  LOG_TRACE(( "KERNEL32_GetCurrentDirectoryA(%u, %p) = \"%s\"", n_buffer_length, lp_buffer, lp_buffer ));
+
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_GetCurrentDirectoryA, g_cwd_len, n_buffer_length, lp_buffer, 0 );
+  return g_cwd_len;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_SetCurrentDirectoryA( char const * lp_path_name ) {
+  STATS_API( KERNEL32_SetCurrentDirectoryA );
+  char full[ PATH_MAX ];
+  char path[ PATH_MAX ];
+  if( !compat_fullpath( full, sizeof(full), lp_path_name ) ) {
+    TRACE_API( KERNEL32_SetCurrentDirectoryA, 0, lp_path_name, 0, 0 );
+    return 0;
+  }
+  uint32_t n = compat_winpath_to_posix( path, sizeof(path), full );
+  if( n==0 || n>sizeof(path) ) {
+    LOG_WARN(( "KERNEL32_SetCurrentDirectoryA: Cannot represent path \"%s\"", full ));
+    g_last_error = ERROR_PATH_NOT_FOUND;
+    TRACE_API( KERNEL32_SetCurrentDirectoryA, 0, lp_path_name, 0, 0 );
+    return 0;
+  }
+
+
+  if( g_cwd_home<0 ) g_cwd_home = open( ".", O_PATH|O_DIRECTORY|O_CLOEXEC );
+  if( chdir( path )<0 ) {
+    LOG_WARN(( "KERNEL32_SetCurrentDirectoryA: chdir(\"%s\") failed: %s", path, strerror( errno ) ));
+    g_last_error = errno==ENOTDIR ? ERROR_DIRECTORY : ERROR_PATH_NOT_FOUND;
+    TRACE_API( KERNEL32_SetCurrentDirectoryA, 0, lp_path_name, 0, 0 );
+    return 0;
+  }
+
+  /* Relative paths now mean something else */
+  compat_stat_reset();
+  g_cwd_len = 0;
+  LOG_DEBUG(( "KERNEL32_SetCurrentDirectoryA(\"%s\"): now in \"%s\"", lp_path_name, compat_cwd() ));
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_SetCurrentDirectoryA, 1, lp_path_name, 0, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_GetSystemDefaultLangID( void ) {
+  STATS_API( KERNEL32_GetSystemDefaultLangID );
+  LOG_WARN(( "[TODO] KERNEL32_GetSystemDefaultLangID()" ));
+  TRACE_API( KERNEL32_GetSystemDefaultLangID, 0, 0, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_GetShortPathNameA( char const * lpsz_long_path,
+                            char *       lpsz_short_path,
+                            int          cch_buffer ) {
+  STATS_API( KERNEL32_GetShortPathNameA );
+  LOG_WARN(( "[TODO] KERNEL32_GetShortPathNameA(%s, %p, %d)", lpsz_long_path, lpsz_short_path, cch_buffer ));
+  TRACE_API( KERNEL32_GetShortPathNameA, 0, lpsz_long_path, lpsz_short_path, cch_buffer );
+  return 0;
+
+}
+
+/********************************************************************************
+   Process Launching
+ ********************************************************************************/
+
+static uint32_t
+compat_handle_proc_close( void * data ) {}
+
+struct compat_proc_state {
+  pid_t pid;
+  int status;
+};
+
+WIN32_STDCALL
+int
+KERNEL32_CreateProcessA( char const * lp_application_name,
+                         char *       lp_command_line,
+                         void *       lp_process_attributes,
+                         void *       lp_thread_attributes,
+                         int32_t      b_inherit_handles,
+                         uint32_t     dw_creation_flags,
+                         void *       lp_environment,
+                         char const * lp_current_directory,
+                         void *       lp_startup_info,
+                         PROCESS_INFORMATION * lp_process_information ) {
+  STATS_API( KERNEL32_CreateProcessA );
+  uint64_t tl_t0 = compat_tl_now();
+  compat_cache_disable( "child process" );
+  char const * rest;
+  struct compat_mount const * m = compat_mount_route( lp_application_name, &rest );
+  if( !m || m->kind!=COMPAT_MOUNT_SYS32 || !compat_mount_sep( rest[0] ) ) {
+    LOG_ERR(( "KERNEL32_CreateProcessA: Refusing to launch %s", lp_application_name ));
+    g_last_error = ERROR_ACCESS_DENIED;
+    TRACE_API( KERNEL32_CreateProcessA, 0, lp_application_name, 0, 0 );
+    return 0;
+  }
+
+  char progname[ 256 ] = {0};
+  strncpy( progname, rest+1, sizeof(progname)-1 );
+
+  char * exe_ext = strstr( progname, ".exe" );
+  if( exe_ext ) *exe_ext = '\0';
+
+  LOG_INFO(( "KERNEL32_CreateProcessA: Launching %s", progname ));
+
+  /* The child may use files the PE has not closed yet */
+  compat_file_flush_all( 0 );
+  pid_t child = fork();
+  if( child==0 ) {
+    char * const argv[2] = {
+      progname,
+      NULL
+    };
+    int res = execv( progname, argv );
+    if( res<0 ) {
+      LOG_ERR(( "KERNEL32_CreateProcessA: execv(\"%s\") failed: %s", progname, strerror( errno ) ));
+      exit( 127 );
+    }
+    exit( 0 );
+    __builtin_unreachable();
+  }
+
+  if( child<0 ) {
+    LOG_ERR(( "KERNEL32_CreateProcessA: fork() failed: %s", strerror( errno ) ));
+    g_last_error = ERROR_ACCESS_DENIED;
+    TRACE_API( KERNEL32_CreateProcessA, 0, lp_application_name, 0, 0 );
+    return 0;
+  }
+
+  /* The child sees and may change the file system behind our back */
+  compat_stat_reset();
+
+  int status;
+  if( waitpid( child, &status, WNOHANG ) ) {
+    LOG_ERR(( "KERNEL32_CreateProcessA: waitpid(%d) failed: %s", child, strerror( errno ) ));
+    g_last_error = ERROR_ACCESS_DENIED;
+    TRACE_API( KERNEL32_CreateProcessA, 0, lp_application_name, 0, child );
+    return 0;
+  }
+
+  struct compat_proc_state * state = calloc( 1, sizeof(*state) );
+  assert( state );
+  state->pid = child;
+
+  uint32_t h = compat_handle_alloc( state, compat_handle_proc_close );
+  compat_tl_open( h, COMPAT_TL_PROC, progname, tl_t0, child );
+
+  LOG_INFO(( "KERNEL32_CreateProcessA(\"%s\", \"%s\", %p, %p, %d, %u, %p, \"%s\", %p, %p)",
+          lp_application_name,
+          lp_command_line,
+          lp_process_attributes,
+          lp_thread_attributes,
+          b_inherit_handles,
+          dw_creation_flags,
+          lp_environment,
+          lp_current_directory,
+          lp_startup_info,
+          lp_process_information ));
+
+  lp_process_information->hProcess = h;
+  lp_process_information->hThread = h;
+  lp_process_information->dwProcessId = h;
+  lp_process_information->dwThreadId = h;
+
+  TRACE_API( KERNEL32_CreateProcessA, 1, lp_application_name, h, child );
+  return 1;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_WaitForSingleObject( uint32_t h_handle,
+                              uint32_t dw_milliseconds ) {
+  STATS_API( KERNEL32_WaitForSingleObject );
+  uint64_t tl_t0 = compat_tl_now();
+  LOG_INFO(( "KERNEL32_WaitForSingleObject(%u, %u)", h_handle, dw_milliseconds ));
+
+  /* Check handle type */
+  compat_handle_t * hdl = compat_handle_get( h_handle );
+  if( !hdl || hdl->close!=compat_handle_proc_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_WaitForSingleObject, 0, h_handle, dw_milliseconds, 0 );
+    return 0;
+  }
+
+  struct compat_proc_state * state = hdl->data;
+  waitpid( state->pid, &state->status, 0 );
+  compat_stat_reset();
+  compat_tl_wait( h_handle, tl_t0, state->status );
+
+  TRACE_API( KERNEL32_WaitForSingleObject, 0, h_handle, dw_milliseconds, state->status );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_GetExitCodeProcess( uint32_t   h_process,
+                             uint32_t * lp_exit_code ) {
+  STATS_API( KERNEL32_GetExitCodeProcess );
+  LOG_WARN(( "[WARN] KERNEL32_GetExitCodeProcess(%u, %p)", h_process, lp_exit_code ));
+
+  /* Check handle type */
+  compat_handle_t * hdl = compat_handle_get( h_process );
+  if( !hdl || hdl->close!=compat_handle_proc_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_GetExitCodeProcess, 0, h_process, 0, 0 );
+    return 0;
+  }
+
+  struct compat_proc_state * state = hdl->data;
+  *lp_exit_code = WEXITSTATUS( state->status );
+
+  TRACE_API( KERNEL32_GetExitCodeProcess, 1, h_process, *lp_exit_code, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_CloseHandle( uint32_t h_object ) {
+  STATS_API( KERNEL32_CloseHandle );
+  LOG_TRACE(( "KERNEL32_CloseHandle(%u)", h_object ));
+  compat_handle_t * hdl = compat_handle_get( h_object );
+  if( !hdl ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_CloseHandle, 0, h_object, 0, 0 );
+    return 0;
+  }
+
+  compat_tl_close( h_object, -1 );
+  uint32_t res = hdl->close( hdl->data );
+  compat_handle_free( h_object );
+  TRACE_API( KERNEL32_CloseHandle, res, h_object, 0, 0 );
+  return res;
+}
+
+#define COMPAT_TLS_SIZE 32
+static __thread uint32_t tls_index = 1;
+static __thread uint32_t tls_slots[COMPAT_TLS_SIZE];
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_TlsAlloc( void ) {
+  STATS_API( KERNEL32_TlsAlloc );
+  uint32_t index = tls_index++;
+  if( index>=COMPAT_TLS_SIZE ) {
+    TRACE_API( KERNEL32_TlsAlloc, TLS_OUT_OF_INDEXES, 0, 0, 0 );
+    return TLS_OUT_OF_INDEXES;
+  }
+  tls_slots[ index ] = 0;
+  LOG_TRACE(( "KERNEL32_TlsAlloc() = %d", index ));
+  TRACE_API( KERNEL32_TlsAlloc, index, 0, 0, 0 );
+  return index;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_TlsFree( uint32_t dw_tls_index ) {
+  STATS_API( KERNEL32_TlsFree );
+  LOG_TRACE(( "KERNEL32_TlsFree(%u)", dw_tls_index ));
+  if( dw_tls_index>=COMPAT_TLS_SIZE ) {
+    TRACE_API( KERNEL32_TlsFree, 0, dw_tls_index, 0, 0 );
+    return 0;
+  }
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_TlsFree, 1, dw_tls_index, 0, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_TlsGetValue( uint32_t dw_tls_index ) {
+  STATS_API( KERNEL32_TlsGetValue );
+  uint32_t val = tls_slots[ dw_tls_index ];
+  LOG_TRACE(( "KERNEL32_TlsGetValue(%u) = %#x", dw_tls_index, val ));
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_TlsGetValue, val, dw_tls_index, 0, 0 );
+  return val;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_TlsSetValue( uint32_t dw_tls_index,
+                      uint32_t lp_tls_value ) {
+  STATS_API( KERNEL32_TlsSetValue );
+  LOG_TRACE(( "KERNEL32_TlsSetValue(%u, %#x)", dw_tls_index, lp_tls_value ));
+  tls_slots[ dw_tls_index ] = lp_tls_value;
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_TlsSetValue, 1, dw_tls_index, lp_tls_value, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+void *
+KERNEL32_GetModuleHandleA( char const * lp_module_name ) {
+  STATS_API( KERNEL32_GetModuleHandleA );
+  LOG_DEBUG(( "KERNEL32_GetModuleHandleA(\"%s\")", lp_module_name ));
+
+  void * handle = NULL;
+  if( !lp_module_name ) {
+    handle = &g_cur_module;
+    TRACE_API( KERNEL32_GetModuleHandleA, handle, lp_module_name, 0, 0 );
+    return handle;
+  }
+
+  g_last_error = ERROR_FILE_NOT_FOUND;
+  TRACE_API( KERNEL32_GetModuleHandleA, 0, lp_module_name, 0, 0 );
+  return NULL;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetModuleFileNameA( void *   h_module,
+                             char *   lp_file_name,
+                             uint32_t n_size ) {
+  STATS_API( KERNEL32_GetModuleFileNameA );
+  LOG_DEBUG(( "KERNEL32_GetModuleFileNameA(%p, %p, %u)", h_module, lp_file_name, n_size ));
+  if( h_module == &g_cur_module ) {
+    snprintf( lp_file_name, n_size, "%s", __progname );
+    TRACE_API( KERNEL32_GetModuleFileNameA, 1, h_module, lp_file_name, n_size );
+    return 1;
+  }
+  TRACE_API( KERNEL32_GetModuleFileNameA, 0, h_module, lp_file_name, n_size );
+  return 0;
+}
+
+WIN32_STDCALL
+void *
+KERNEL32_LoadLibraryA( char const * lp_lib_file_name ) {
+  STATS_API( KERNEL32_LoadLibraryA );
+  LOG_DEBUG(( "KERNEL32_LoadLibraryA(\"%s\")", lp_lib_file_name ));
+  if( strcmp( lp_lib_file_name, __progname )==0 ) {
+    TRACE_API( KERNEL32_LoadLibraryA, &g_cur_library, lp_lib_file_name, 0, 0 );
+    return &g_cur_library;
+  }
+  g_last_error = ERROR_FILE_NOT_FOUND;
+  TRACE_API( KERNEL32_LoadLibraryA, 0, lp_lib_file_name, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_FreeLibrary( void * h_lib_module ) {
+  STATS_API( KERNEL32_FreeLibrary );
+  LOG_WARN(( "[WARN] KERNEL32_FreeLibrary(%p)", h_lib_module ));
+  TRACE_API( KERNEL32_FreeLibrary, 0, h_lib_module, 0, 0 );
+  return 0;
+
+}
+
+/********************************************************************************
+   Hashing
+ ********************************************************************************/
+
+/* XXH64 by Yann Collet (BSD-2-Clause), one-shot variant */
+
+#define XXH_P64_1 0x9E3779B185EBCA87ULL
+#define XXH_P64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P64_3 0x165667B19E3779F9ULL
+#define XXH_P64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_P64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+compat_xxh64_rotl( uint64_t x,
+                   int      r ) {
+  return (x<<r) | (x>>(64-r));
+}
+
+static inline uint64_t
+compat_xxh64_round( uint64_t acc,
+                    uint64_t in ) {
+  acc += in * XXH_P64_2;
+  acc  = compat_xxh64_rotl( acc, 31 );
+  return acc * XXH_P64_1;
+}
+
+static inline uint64_t
+compat_xxh64_merge( uint64_t acc,
+                    uint64_t val ) {
+  acc ^= compat_xxh64_round( 0, val );
+  return acc * XXH_P64_1 + XXH_P64_4;
+}
+
+static inline uint64_t
+compat_xxh64_ld64( uint8_t const * p ) {
+  uint64_t x; memcpy( &x, p, 8 ); return x;
+}
+
+static inline uint32_t
+compat_xxh64_ld32( uint8_t const * p ) {
+  uint32_t x; memcpy( &x, p, 4 ); return x;
+}
+
+static uint64_t
+compat_xxh64( void const * data,
+              size_t       sz,
+              uint64_t     seed ) {
+  uint8_t const * p   = data;
+  uint8_t const * end = p+sz;
+  uint64_t h;
+
+  if( sz>=32 ) {
+    uint64_t v1 = seed + XXH_P64_1 + XXH_P64_2;
+    uint64_t v2 = seed + XXH_P64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_P64_1;
+    do {
+      v1 = compat_xxh64_round( v1, compat_xxh64_ld64( p    ) );
+      v2 = compat_xxh64_round( v2, compat_xxh64_ld64( p+ 8 ) );
+      v3 = compat_xxh64_round( v3, compat_xxh64_ld64( p+16 ) );
+      v4 = compat_xxh64_round( v4, compat_xxh64_ld64( p+24 ) );
+      p += 32;
+    } while( p<=end-32 );
+    h = compat_xxh64_rotl( v1, 1 ) + compat_xxh64_rotl( v2, 7 ) +
+        compat_xxh64_rotl( v3, 12 ) + compat_xxh64_rotl( v4, 18 );
+    h = compat_xxh64_merge( h, v1 );
+    h = compat_xxh64_merge( h, v2 );
+    h = compat_xxh64_merge( h, v3 );
+    h = compat_xxh64_merge( h, v4 );
+  } else {
+    h = seed + XXH_P64_5;
+  }
+  h += (uint64_t)sz;
+
+  for( ; p+8<=end; p+=8 ) {
+    h ^= compat_xxh64_round( 0, compat_xxh64_ld64( p ) );
+    h  = compat_xxh64_rotl( h, 27 ) * XXH_P64_1 + XXH_P64_4;
+  }
+  if( p+4<=end ) {
+    h ^= (uint64_t)compat_xxh64_ld32( p ) * XXH_P64_1;
+    h  = compat_xxh64_rotl( h, 23 ) * XXH_P64_2 + XXH_P64_3;
+    p += 4;
+  }
+  for( ; p<end; p++ ) {
+    h ^= (*p) * XXH_P64_5;
+    h  = compat_xxh64_rotl( h, 11 ) * XXH_P64_1;
+  }
+
+  h ^= h>>33; h *= XXH_P64_2;
+  h ^= h>>29; h *= XXH_P64_3;
+  h ^= h>>32;
+  return h;
+}
+
+/* compat_hash_file: XXH64 of a file's content.  Returns 0 on success. */
+static int
+compat_hash_file( char const * path,
+                  uint64_t *   out ) {
+  int fd = open( path, O_RDONLY|O_CLOEXEC );
+  if( fd<0 ) return -1;
+  struct stat st;
+  if( fstat( fd, &st )<0 ) { close( fd ); return -1; }
+  if( st.st_size==0 ) {
+    close( fd );
+    *out = compat_xxh64( NULL, 0, 0 );
+    return 0;
+  }
+  void * map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( map==MAP_FAILED ) return -1;
+  *out = compat_xxh64( map, st.st_size, 0 );
+  munmap( map, st.st_size );
+  return 0;
+}
+
+/********************************************************************************
+   Compression
+ ********************************************************************************/
+
+/* LZ4 block format compressor (greedy, single hash probe) and
+   decompressor, for cache objects sent over the network.
+   Compressed buffers are prefixed with the uncompressed size (u32 LE). */
+
+#define COMPAT_LZ4_HASH_LOG 12
+
+static inline uint32_t
+compat_lz4_ld32( uint8_t const * p ) {
+  uint32_t x; memcpy( &x, p, 4 ); return x;
+}
+
+static inline uint8_t *
+compat_lz4_put_len( uint8_t * op,
+                    size_t    len ) {
+  while( len>=255 ) { *op++ = 255; len -= 255; }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static inline size_t
+compat_lz4_bound( size_t sz ) {
+  return 4 + sz + sz/255 + 16;
+}
+
+/* compat_lz4_compress: Compresses src into dst, which must hold
+   compat_lz4_bound( sz ) bytes.  Returns the compressed size. */
+static size_t
+compat_lz4_compress( void const * src_,
+                     size_t       sz,
+                     void *       dst_ ) {
+  uint8_t const * src    = src_;
+  uint8_t const * end    = src+sz;
+  uint8_t const * ip     = src;
+  uint8_t const * anchor = src;
+  uint8_t *       op     = dst_;
+
+  uint32_t raw_sz = (uint32_t)sz;
+  memcpy( op, &raw_sz, 4 ); op += 4;
+
+  /* The last match must start 12 bytes before the end,
+     and the last 5 bytes are always literals */
+  if( sz>=13 ) {
+    static uint32_t table[ 1U<<COMPAT_LZ4_HASH_LOG ];
+    memset( table, 0, sizeof(table) );
+    uint8_t const * mflimit = end-12;
+    uint8_t const * mlimit  = end-5;
+    while( ip<mflimit ) {
+      uint32_t seq = compat_lz4_ld32( ip );
+      uint32_t h   = (seq*2654435761U)>>(32-COMPAT_LZ4_HASH_LOG);
+      uint8_t const * ref = src+table[ h ];
+      table[ h ] = (uint32_t)(ip-src);
+      if( ref>=ip || ip-ref>65535 || compat_lz4_ld32( ref )!=seq ) {
+        ip++;
+        continue;
+      }
+
+      while( ip>anchor && ref>src && ip[-1]==ref[-1] ) { ip--; ref--; }
+      uint8_t const * p = ip+4;
+      uint8_t const * r = ref+4;
+      while( p<mlimit && *p==*r ) { p++; r++; }
+
+      size_t lit  = (size_t)(ip-anchor);
+      size_t mlen = (size_t)(p-ip)-4;
+      uint8_t * token = op++;
+      if( lit>=15 ) { *token = 15<<4; op = compat_lz4_put_len( op, lit-15 ); }
+      else          { *token = (uint8_t)(lit<<4); }
+      memcpy( op, anchor, lit ); op += lit;
+      uint32_t off = (uint32_t)(ip-ref);
+      *op++ = (uint8_t)off;
+      *op++ = (uint8_t)(off>>8);
+      if( mlen>=15 ) { *token |= 15; op = compat_lz4_put_len( op, mlen-15 ); }
+      else           { *token |= (uint8_t)mlen; }
+
+      ip = anchor = p;
+    }
+  }
+
+  size_t lit = (size_t)(end-anchor);
+  uint8_t * token = op++;
+  if( lit>=15 ) { *token = 15<<4; op = compat_lz4_put_len( op, lit-15 ); }
+  else          { *token = (uint8_t)(lit<<4); }
+  memcpy( op, anchor, lit ); op += lit;
+
+  return (size_t)(op-(uint8_t *)dst_);
+}
+
+/* compat_lz4_decompress: Returns a malloc'd buffer with the
+   decompressed data, or NULL if the input is malformed. */
+static void *
+compat_lz4_decompress( void const * src_,
+                       size_t       src_sz,
+                       size_t *     out_sz ) {
+  uint8_t const * ip  = src_;
+  uint8_t const * end = ip+src_sz;
+  uint32_t raw_sz;
+  if( src_sz<5 ) return NULL;
+  memcpy( &raw_sz, ip, 4 ); ip += 4;
+
+  uint8_t * dst = malloc( (size_t)raw_sz+1 );
+  if( !dst ) return NULL;
+  uint8_t * op      = dst;
+  uint8_t * dst_end = dst+raw_sz;
+
+  for(;;) {
+    if( ip>=end ) goto fail;
+    uint8_t token = *ip++;
+
+    size_t lit = token>>4;
+    if( lit==15 ) {
+      uint8_t x;
+      do { if( ip>=end ) goto fail; x = *ip++; lit += x; } while( x==255 );
+    }
+    if( lit>(size_t)(end-ip) || lit>(size_t)(dst_end-op) ) goto fail;
+    memcpy( op, ip, lit ); op += lit; ip += lit;
+    if( ip==end ) break;
+
+    if( end-ip<2 ) goto fail;
+    size_t off = (size_t)ip[0] | ((size_t)ip[1]<<8);
+    ip += 2;
+    if( off==0 || off>(size_t)(op-dst) ) goto fail;
+
+    size_t mlen = token&15;
+    if( mlen==15 ) {
+      uint8_t x;
+      do { if( ip>=end ) goto fail; x = *ip++; mlen += x; } while( x==255 );
+    }
+    mlen += 4;
+    if( mlen>(size_t)(dst_end-op) ) goto fail;
+    uint8_t const * ref = op-off;
+    while( mlen-- ) *op++ = *ref++;   /* may overlap */
+  }
+  if( op!=dst_end ) goto fail;
+
+  *out_sz = raw_sz;
+  return dst;
+
+fail:
+  free( dst );
+  return NULL;
+}
+
+/********************************************************************************
+   HTTP Client
+ ********************************************************************************/
+
+/* Minimal HTTP/1.1 client for the remote cache.  Keeps one connection
+   open and sends requests pipelined.  Responses must carry a
+   Content-Length (no chunked encoding).  Every operation is bounded by
+   a deadline; on any error the connection is dropped. */
+
+struct compat_http {
+  char host[ 256 ];
+  char port[ 8 ];
+  char prefix[ 256 ];
+  int  timeout_ms;
+  int  fd;
+};
+
+struct compat_http_req {
+  char const * method;
+  char         path[ 128 ];
+  void *       body;         /* request body, owned */
+  size_t       body_sz;
+  int          status;       /* response */
+  void *       resp;         /* response body, owned, NUL terminated */
+  size_t       resp_sz;
+};
+
+/* compat_http_init: Parses an http://host[:port][/prefix] URL. */
+static int
+compat_http_init( struct compat_http * http,
+                  char const *         url,
+                  int                  timeout_ms ) {
+  memset( http, 0, sizeof(*http) );
+  http->fd         = -1;
+  http->timeout_ms = timeout_ms;
+  if( 0!=strncmp( url, "http://", 7 ) ) return 0;
+  url += 7;
+
+  size_t host_len = strcspn( url, ":/" );
+  if( host_len==0 || host_len>=sizeof(http->host) ) return 0;
+  memcpy( http->host, url, host_len );
+  url += host_len;
+
+  strcpy( http->port, "80" );
+  if( *url==':' ) {
+    url++;
+    size_t port_len = strcspn( url, "/" );
+    if( port_len==0 || port_len>=sizeof(http->port) ) return 0;
+    memcpy( http->port, url, port_len );
+    http->port[ port_len ] = '\0';
+    url += port_len;
+  }
+
+  if( strlen( url )>=sizeof(http->prefix) ) return 0;
+  strcpy( http->prefix, url );
+  size_t prefix_len = strlen( http->prefix );
+  if( prefix_len && http->prefix[ prefix_len-1 ]=='/' ) http->prefix[ prefix_len-1 ] = '\0';
+  return 1;
+}
+
+static void
+compat_http_close( struct compat_http * http ) {
+  if( http->fd>=0 ) close( http->fd );
+  http->fd = -1;
+}
+
+static int64_t
+compat_http_now_ms( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* compat_http_wait: Polls the connection until the deadline.
+   Returns the ready events, 0 on timeout or error. */
+static int
+compat_http_wait( struct compat_http * http,
+                  short                events,
+                  int64_t              deadline ) {
+  for(;;) {
+    int64_t left = deadline-compat_http_now_ms();
+    if( left<=0 ) { errno = ETIMEDOUT; return 0; }
+    struct pollfd pfd = { .fd = http->fd, .events = events };
+    int n = poll( &pfd, 1, (int)left );
+    if( n<0 && errno==EINTR ) continue;
+    if( n<0 ) return 0;
+    if( n>0 ) return pfd.revents;
+  }
+}
+
+static int
+compat_http_connect( struct compat_http * http,
+                     int64_t              deadline ) {
+  if( http->fd>=0 ) return 1;
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo * res;
+  if( getaddrinfo( http->host, http->port, &hints, &res )!=0 ) {
+    errno = EHOSTUNREACH;
+    return 0;
+  }
+  for( struct addrinfo * ai=res; ai; ai=ai->ai_next ) {
+    http->fd = socket( ai->ai_family, ai->ai_socktype|SOCK_CLOEXEC|SOCK_NONBLOCK, ai->ai_protocol );
+    if( http->fd<0 ) continue;
+    if( connect( http->fd, ai->ai_addr, ai->ai_addrlen )==0 ) break;
+    if( errno==EINPROGRESS && compat_http_wait( http, POLLOUT, deadline ) ) {
+      int err = 0;
+      socklen_t err_len = sizeof(err);
+      getsockopt( http->fd, SOL_SOCKET, SO_ERROR, &err, &err_len );
+      if( err==0 ) break;
+      errno = err;
+    }
+    compat_http_close( http );
+  }
+  freeaddrinfo( res );
+  return http->fd>=0;
+}
+
+/* Pipelined request writer.  Requests are sent as far as the socket
+   takes them while responses are read, so a server that answers one
+   request at a time never waits on a client that is still sending. */
+struct compat_http_tx {
+  struct compat_http_req const * reqs;
+  size_t                         cnt;
+  size_t                         next;     /* request being sent */
+  size_t                         off;      /* into hdr, then body */
+  char                           hdr[ 1024 ];
+  size_t                         hdr_sz;
+};
+
+/* compat_http_tx_pump: Sends without blocking until the socket is
+   full or all requests are out.  Returns 0 on error. */
+static int
+compat_http_tx_pump( struct compat_http *    http,
+                     struct compat_http_tx * tx ) {
+  while( tx->next<tx->cnt ) {
+    struct compat_http_req const * req = &tx->reqs[ tx->next ];
+    if( !tx->hdr_sz ) {
+      int n = snprintf( tx->hdr, sizeof(tx->hdr),
+          "%s %s%s HTTP/1.1\r\n"
+          "Host: %s\r\n"
+          "Content-Length: %zu\r\n"
+          "\r\n",
+          req->method, http->prefix, req->path, http->host, req->body_sz );
+      tx->hdr_sz = (size_t)n;
+    }
+    size_t total = tx->hdr_sz+req->body_sz;
+    if( tx->off==total ) {
+      tx->next++;
+      tx->off    = 0;
+      tx->hdr_sz = 0;
+      continue;
+    }
+    int          in_hdr = tx->off<tx->hdr_sz;
+    char const * p      = in_hdr ? tx->hdr+tx->off : (char const *)req->body+( tx->off-tx->hdr_sz );
+    size_t       sz     = in_hdr ? tx->hdr_sz-tx->off : total-tx->off;
+    ssize_t      n      = send( http->fd, p, sz, MSG_NOSIGNAL );
+    if( n<0 && (errno==EAGAIN || errno==EINTR) ) return 1;
+    if( n<=0 ) return 0;
+    tx->off += (size_t)n;
+  }
+  return 1;
+}
+
+/* Buffered response reader */
+struct compat_http_rd {
+  char                    buf[ 4096 ];
+  size_t                  off;
+  size_t                  len;
+  struct compat_http_tx * tx;    /* requests still being sent */
+};
+
+static int
+compat_http_recv( struct compat_http *    http,
+                  struct compat_http_rd * rd,
+                  int64_t                 deadline ) {
+  for(;;) {
+    ssize_t n = recv( http->fd, rd->buf, sizeof(rd->buf), 0 );
+    if( n>0 ) { rd->off = 0; rd->len = (size_t)n; return 1; }
+    if( n==0 ) { errno = ECONNRESET; return 0; }
+    if( errno!=EAGAIN && errno!=EINTR ) return 0;
+    int sending = rd->tx && rd->tx->next<rd->tx->cnt;
+    int ev = compat_http_wait( http, sending ? POLLIN|POLLOUT : POLLIN, deadline );
+    if( !ev ) return 0;
+    if( (ev&POLLOUT) && !compat_http_tx_pump( http, rd->tx ) ) return 0;
+  }
+}
+
+static int
+compat_http_read_line( struct compat_http *    http,
+                       struct compat_http_rd * rd,
+                       char *                  line,
+                       size_t                  line_sz,
+                       int64_t                 deadline ) {
+  size_t n = 0;
+  for(;;) {
+    if( rd->off==rd->len && !compat_http_recv( http, rd, deadline ) ) return 0;
+    char c = rd->buf[ rd->off++ ];
+    if( c=='\n' ) break;
+    if( n+1<line_sz ) line[ n++ ] = c;
+  }
+  if( n && line[ n-1 ]=='\r' ) n--;
+  line[ n ] = '\0';
+  return 1;
+}
+
+static int
+compat_http_read_body( struct compat_http *     http,
+                       struct compat_http_rd *  rd,
+                       struct compat_http_req * req,
+                       size_t                   sz,
+                       int64_t                  deadline ) {
+  char * body = malloc( sz+1 );
+  if( !body ) return 0;
+  size_t got = 0;
+  while( got<sz ) {
+    if( rd->off==rd->len && !compat_http_recv( http, rd, deadline ) ) {
+      free( body );
+      return 0;
+    }
+    size_t n = rd->len-rd->off;
+    if( n>sz-got ) n = sz-got;
+    memcpy( body+got, rd->buf+rd->off, n );
+    rd->off += n;
+    got     += n;
+  }
+  body[ sz ] = '\0';
+  req->resp    = body;
+  req->resp_sz = sz;
+  return 1;
+}
+
+/* compat_http_pipeline: Sends all requests and reads all responses,
+   interleaved.  Returns 1 if every request got a response (of any
+   status). */
+static int
+compat_http_pipeline( struct compat_http *     http,
+                      struct compat_http_req * reqs,
+                      size_t                   cnt ) {
+  int64_t deadline = compat_http_now_ms()+http->timeout_ms;
+  if( !compat_http_connect( http, deadline ) ) return 0;
+
+  struct compat_http_tx tx = { .reqs = reqs, .cnt = cnt };
+  struct compat_http_rd rd = { .tx = &tx };
+  if( !compat_http_tx_pump( http, &tx ) ) goto fail;
+
+  for( size_t i=0; i<cnt; i++ ) {
+    char   line[ 512 ];
+    long   content_len = -1;
+    int    conn_close  = 0;
+    if( !compat_http_read_line( http, &rd, line, sizeof(line), deadline ) ) goto fail;
+    if( sscanf( line, "HTTP/1.%*d %d", &reqs[i].status )!=1 ) goto fail;
+    for(;;) {
+      if( !compat_http_read_line( http, &rd, line, sizeof(line), deadline ) ) goto fail;
+      if( !line[0] ) break;
+      if( 0==strncasecmp( line, "Content-Length:", 15 ) ) content_len = strtol( line+15, NULL, 10 );
+      if( 0==strncasecmp( line, "Connection:", 11 ) && strstr( line+11, "close" ) ) conn_close = 1;
+    }
+    if( content_len<0 ) goto fail;
+    if( !compat_http_read_body( http, &rd, &reqs[i], (size_t)content_len, deadline ) ) goto fail;
+    if( conn_close && i+1<cnt ) goto fail;
+    if( conn_close ) compat_http_close( http );
+  }
+  return 1;
+
+fail:
+  LOG_WARN(( "cache: %s:%s: %s", http->host, http->port, strerror( errno ) ));
+  compat_http_close( http );
+  return 0;
+}
+
+static void
+compat_http_req_free( struct compat_http_req * reqs,
+                      size_t                   cnt ) {
+  for( size_t i=0; i<cnt; i++ ) {
+    free( reqs[i].body );
+    free( reqs[i].resp );
+  }
+  free( reqs );
+}
+
+/********************************************************************************
+   Result Cache
+ ********************************************************************************/
+
+/* The result cache (WIN32_CACHE=<dir>) skips runs that were seen before.
+
+   A run is looked up by a key derived from the ELF hash, command line
+   and MW* environment variables, with the working directory replaced by
+   "." so checkouts in different places share keys.  Recorded paths under
+   the working directory are stored relative to it.  The key's manifest
+   holds up to COMPAT_CACHE_ENTRY_MAX recorded runs, newest first.
+   Each lists the files the run read (with content hashes), the paths
+   it only checked for (found as a file or directory, or not found),
+   and its outputs:
+
+     entry
+     in <hash> <path>
+     present f|d <path>
+     absent <path>
+     cwd <path>
+     out <hash> <path>
+     stdout <hash>
+     stderr <hash>
+     exit <code>
+     end
+
+   If every input of an entry still matches, the outputs are copied
+   out of the content-addressed store and the PE entry point is never
+   called.  Otherwise the run is recorded and added to the manifest
+   when ExitProcess is called. */
+
+#define COMPAT_CACHE_ENTRY_MAX 8
+#define COMPAT_CACHE_MAGIC     "WMC1\n"
+
+#define COMPAT_CACHE_REC_IN      1
+#define COMPAT_CACHE_REC_ABSENT  2
+#define COMPAT_CACHE_REC_OUT     3
+#define COMPAT_CACHE_REC_PRESENT 4  /* hash is 1 for a directory */
+
+struct compat_cache_rec {
+  uint32_t kind;
+  uint64_t hash;
+  char *   path;
+};
+
+struct compat_cache_buf {
+  char * data;
+  size_t sz;
+  size_t cap;
+};
+
+static struct {
+  char const *              dir;        /* NULL if disabled */
+  uint64_t                  elf_hash;
+  uint64_t                  key;
+  int                       recording;
+  struct compat_cache_rec * rec;
+  uint32_t                  rec_cnt;
+  uint32_t                  rec_cap;
+  struct compat_cache_buf   out[2];     /* stdout, stderr */
+  int                       remote;     /* remote store enabled */
+  int                       prefetched; /* remote manifests already merged */
+  char                      cwd[ PATH_MAX ];
+  char                      win_cwd[ PATH_MAX ];
+} g_cache;
+
+static void
+compat_cache_buf_append( struct compat_cache_buf * buf,
+                         void const *              data,
+                         size_t                    sz ) {
+  if( buf->sz+sz > buf->cap ) {
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while( cap < buf->sz+sz ) cap *= 2;
+    char * p = realloc( buf->data, cap );
+    assert( p );
+    buf->data = p;
+    buf->cap  = cap;
+  }
+  memcpy( buf->data+buf->sz, data, sz );
+  buf->sz += sz;
+}
+
+/* compat_cache_reset: Drops the recording of the current run. */
+static void
+compat_cache_reset( void ) {
+  for( uint32_t i=0; i<g_cache.rec_cnt; i++ ) free( g_cache.rec[i].path );
+  g_cache.rec_cnt   = 0;
+  g_cache.recording = 0;
+  g_cache.out[0].sz = 0;
+  g_cache.out[1].sz = 0;
+}
+
+static void
+compat_cache_disable( char const * reason ) {
+  if( !g_cache.recording ) return;
+  LOG_DEBUG(( "cache: not caching this run: %s", reason ));
+  compat_cache_reset();
+}
+
+static struct compat_cache_rec *
+compat_cache_find( char const * path ) {
+  size_t cwd_len = strlen( g_cache.cwd );
+  if( cwd_len>1 && 0==strncmp( path, g_cache.cwd, cwd_len ) && path[ cwd_len ]=='/' )
+    path += cwd_len+1;
+  for( uint32_t i=0; i<g_cache.rec_cnt; i++ ) {
+    if( 0==strcmp( g_cache.rec[i].path, path ) ) return &g_cache.rec[i];
+  }
+  return NULL;
+}
+
+static void
+compat_cache_add( uint32_t     kind,
+                  uint64_t     hash,
+                  char const * path ) {
+  if( strchr( path, '\n' ) ) {
+    compat_cache_disable( "unrepresentable path" );
+    return;
+  }
+  if( g_cache.rec_cnt==g_cache.rec_cap ) {
+    uint32_t cap = g_cache.rec_cap ? 2*g_cache.rec_cap : 64;
+    struct compat_cache_rec * rec = realloc( g_cache.rec, cap*sizeof(*rec) );
+    assert( rec );
+    g_cache.rec     = rec;
+    g_cache.rec_cap = cap;
+  }
+  size_t cwd_len = strlen( g_cache.cwd );
+  if( cwd_len>1 && 0==strncmp( path, g_cache.cwd, cwd_len ) && path[ cwd_len ]=='/' )
+    path += cwd_len+1;
+  struct compat_cache_rec * rec = &g_cache.rec[ g_cache.rec_cnt++ ];
+  rec->kind = kind;
+  rec->hash = hash;
+  rec->path = strdup( path );
+  assert( rec->path );
+}
+
+static void
+compat_cache_on_read( char const * path,
+                      int          ok ) {
+  if( !g_cache.recording ) return;
+  struct compat_cache_rec * rec = compat_cache_find( path );
+  /* First access decides, but reading a probed file adds its content */
+  if( rec && !( ok && rec->kind==COMPAT_CACHE_REC_PRESENT ) ) return;
+  int saved_errno = errno;
+  if( ok ) {
+    uint64_t hash;
+    if( compat_hash_file( path, &hash )!=0 ) compat_cache_disable( "cannot hash input" );
+    else if( rec ) { rec->kind = COMPAT_CACHE_REC_IN; rec->hash = hash; }
+    else           compat_cache_add( COMPAT_CACHE_REC_IN, hash, path );
+  } else if( errno==ENOENT || errno==ENOTDIR ) {
+    compat_cache_add( COMPAT_CACHE_REC_ABSENT, 0, path );
+  } else {
+    compat_cache_disable( "input not readable" );
+  }
+  errno = saved_errno;
+}
+
+/* compat_cache_on_probe: Records a path looked up without opening it,
+   kind is the COMPAT_STAT_* result. */
+static void
+compat_cache_on_probe( char const * path,
+                       int          kind ) {
+  if( !g_cache.recording ) return;
+  if( compat_cache_find( path ) ) return;
+  if( kind==COMPAT_STAT_ABSENT ) compat_cache_add( COMPAT_CACHE_REC_ABSENT, 0, path );
+  else compat_cache_add( COMPAT_CACHE_REC_PRESENT, kind==COMPAT_STAT_DIR, path );
+}
+
+static void
+compat_cache_on_write( char const * path ) {
+  if( !g_cache.recording ) return;
+  struct compat_cache_rec * rec = compat_cache_find( path );
+  if( rec ) {
+    /* A record of the path as it was before the run would never match
+       once the output exists, so the output replaces it */
+    rec->kind = COMPAT_CACHE_REC_OUT;
+    rec->hash = 0;
+    return;
+  }
+  compat_cache_add( COMPAT_CACHE_REC_OUT, 0, path );
+}
+
+static void
+compat_cache_on_stdio( int          fd,
+                       void const * buf,
+                       size_t       sz ) {
+  if( !g_cache.recording ) return;
+  if     ( fd==STDOUT_FILENO ) compat_cache_buf_append( &g_cache.out[0], buf, sz );
+  else if( fd==STDERR_FILENO ) compat_cache_buf_append( &g_cache.out[1], buf, sz );
+}
+
+static void
+compat_cache_path( char *       out,
+                   size_t       out_sz,
+                   uint64_t     hash,
+                   char const * suffix ) {
+  snprintf( out, out_sz, "%s/%02x/%016llx%s", g_cache.dir,
+            (unsigned)(hash>>56), (unsigned long long)hash, suffix );
+}
+
+/* compat_cache_publish: Writes a file atomically.  Returns 1 on success. */
+static int
+compat_cache_publish( char const * path,
+                      void const * data,
+                      size_t       sz ) {
+  char tmp_path[ PATH_MAX ];
+  snprintf( tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid() );
+  int fd = open( tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644 );
+  if( fd<0 && errno==ENOENT ) {
+    /* Create fan-out directory */
+    char dir[ PATH_MAX ];
+    snprintf( dir, sizeof(dir), "%s", path );
+    char * slash = strrchr( dir, '/' );
+    if( slash ) { *slash = '\0'; mkdir( dir, 0755 ); }
+    fd = open( tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644 );
+  }
+  if( fd<0 ) return 0;
+
+  uint8_t const * p   = data;
+  size_t          rem = sz;
+  while( rem ) {
+    ssize_t n = write( fd, p, rem );
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ) break;
+    p += n; rem -= (size_t)n;
+  }
+  int ok = ( close( fd )==0 ) && rem==0;
+  if( ok ) ok = rename( tmp_path, path )==0;
+  if( !ok ) unlink( tmp_path );
+  return ok;
+}
+
+/* compat_cache_put: Adds a blob to the store. */
+static int
+compat_cache_put( void const * data,
+                  size_t       sz,
+                  uint64_t *   out_hash ) {
+  uint64_t hash = compat_xxh64( data, sz, 0 );
+  *out_hash = hash;
+  char path[ PATH_MAX ];
+  compat_cache_path( path, sizeof(path), hash, "" );
+  if( 0==access( path, F_OK ) ) return 1;
+  return compat_cache_publish( path, data, sz );
+}
+
+/* compat_cache_load: Reads a whole file into a malloc'd buffer with a
+   trailing NUL.  Returns NULL on failure. */
+static char *
+compat_cache_load( char const * path,
+                   size_t *     out_sz ) {
+  int fd = open( path, O_RDONLY|O_CLOEXEC );
+  if( fd<0 ) return NULL;
+  struct stat st;
+  char * buf = NULL;
+  if( fstat( fd, &st )==0 && (buf = malloc( st.st_size+1 )) ) {
+    size_t got = 0;
+    while( got<(size_t)st.st_size ) {
+      ssize_t n = read( fd, buf+got, st.st_size-got );
+      if( n<0 && errno==EINTR ) continue;
+      if( n<=0 ) break;
+      got += (size_t)n;
+    }
+    if( got==(size_t)st.st_size ) {
+      buf[ got ] = '\0';
+      *out_sz = got;
+    } else {
+      free( buf );
+      buf = NULL;
+    }
+  }
+  close( fd );
+  return buf;
+}
+
+/* compat_cache_next_line: Splits off the next line of a manifest. */
+static char *
+compat_cache_next_line( char ** cursor ) {
+  char * line = *cursor;
+  if( !*line ) return NULL;
+  char * nl = strchr( line, '\n' );
+  if( nl ) { *nl = '\0'; *cursor = nl+1; }
+  else     { *cursor = line+strlen( line ); }
+  return line;
+}
+
+/* List of blob hashes */
+struct compat_cache_hashes {
+  uint64_t * hash;
+  uint32_t   cnt;
+  uint32_t   cap;
+};
+
+static void
+compat_cache_hashes_push( struct compat_cache_hashes * list,
+                          uint64_t                     hash ) {
+  if( list->cnt==list->cap ) {
+    uint32_t cap = list->cap ? 2*list->cap : 16;
+    uint64_t * p = realloc( list->hash, cap*sizeof(uint64_t) );
+    assert( p );
+    list->hash = p;
+    list->cap  = cap;
+  }
+  list->hash[ list->cnt++ ] = hash;
+}
+
+/* compat_cache_check: Checks whether the inputs of a manifest entry
+   are unchanged.  Outputs that are not in the local store are added
+   to missing if a remote is configured, otherwise the check fails.
+   Leaves the cursor after the entry. */
+static int
+compat_cache_check( char **                      cursor,
+                    struct compat_cache_hashes * missing ) {
+  int    ok = 1;
+  char * line;
+  char   path[ PATH_MAX ];
+  missing->cnt = 0;
+  while( (line = compat_cache_next_line( cursor )) ) {
+    if( 0==strcmp( line, "end" ) ) return ok;
+    if( !ok ) continue;
+
+    unsigned long long hash;
+    int off = 0;
+    if( sscanf( line, "in %llx %n", &hash, &off )==1 && off ) {
+      uint64_t cur;
+      ok = compat_hash_file( line+off, &cur )==0 && cur==(uint64_t)hash;
+    } else if( 0==strncmp( line, "cwd ", 4 ) ) {
+      ok = 0==strcmp( line+4, g_cache.cwd );
+    } else if( 0==strncmp( line, "absent ", 7 ) ) {
+      struct stat64 st;
+      ok = stat64( line+7, &st )!=0 && (errno==ENOENT || errno==ENOTDIR);
+    } else if( 0==strncmp( line, "present ", 8 ) && ( line[8]=='f' || line[8]=='d' ) && line[9]==' ' ) {
+      struct stat64 st;
+      ok = stat64( line+10, &st )==0 && !S_ISDIR( st.st_mode )==( line[8]=='f' );
+    } else if( sscanf( line, "out %llx %n",    &hash, &off )==1 ||
+               sscanf( line, "stdout %llx",    &hash       )==1 ||
+               sscanf( line, "stderr %llx",    &hash       )==1 ) {
+      compat_cache_path( path, sizeof(path), hash, "" );
+      if( 0==access( path, R_OK ) ) continue;
+      if( g_cache.remote ) compat_cache_hashes_push( missing, hash );
+      else                 ok = 0;
+    } else if( 0!=strncmp( line, "exit ", 5 ) ) {
+      ok = 0;
+    }
+  }
+  return 0;
+}
+
+static int
+compat_cache_restore_blob( uint64_t     hash,
+                           char const * dst_path,
+                           FILE *       dst_file ) {
+  char   path[ PATH_MAX ];
+  size_t sz;
+  compat_cache_path( path, sizeof(path), hash, "" );
+  char * data = compat_cache_load( path, &sz );
+  if( !data ) return 0;
+  int ok;
+  if( dst_file ) {
+    ok = fwrite( data, 1, sz, dst_file )==sz;
+  } else {
+    int fd = open( dst_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644 );
+    ok = fd>=0 && write( fd, data, sz )==(ssize_t)sz;
+    if( fd>=0 ) ok = ( close( fd )==0 ) && ok;
+  }
+  free( data );
+  return ok;
+}
+
+/* compat_cache_replay: Materializes the outputs of a checked entry.
+   Returns the recorded exit code, or -1 on failure. */
+static int64_t
+compat_cache_replay( char * entry ) {
+  int64_t code = -1;
+  char *  line;
+  while( (line = compat_cache_next_line( &entry )) ) {
+    if( 0==strcmp( line, "end" ) ) break;
+    unsigned long long hash;
+    unsigned int exit_code;
+    int off = 0;
+    int ok = 1;
+    if( sscanf( line, "out %llx %n", &hash, &off )==1 && off ) {
+      ok = compat_cache_restore_blob( hash, line+off, NULL );
+    } else if( sscanf( line, "stdout %llx", &hash )==1 ) {
+      ok = compat_cache_restore_blob( hash, NULL, stdout );
+    } else if( sscanf( line, "stderr %llx", &hash )==1 ) {
+      ok = compat_cache_restore_blob( hash, NULL, stderr );
+    } else if( sscanf( line, "exit %u", &exit_code )==1 ) {
+      code = exit_code;
+    }
+    if( !ok ) {
+      LOG_WARN(( "cache: failed to restore \"%s\"", line ));
+      return -1;
+    }
+  }
+  return code;
+}
+
+/* compat_cache_key_win: Whether s starts with the Windows path win,
+   ignoring case and the kind of separator. */
+static int
+compat_cache_key_win( char const * s,
+                      char const * win,
+                      size_t       n ) {
+  for( size_t i=0; i<n; i++ ) {
+    char a = s[i]  =='\\' ? '/' : (char)tolower( (uint8_t)s[i]   );
+    char b = win[i]=='\\' ? '/' : (char)tolower( (uint8_t)win[i] );
+    if( a!=b ) return 0;
+  }
+  return 1;
+}
+
+/* compat_cache_key_str: Appends s to the key with '\\' read as '/' and
+   the working directory, in POSIX or Windows form, replaced by ".". */
+static void
+compat_cache_key_str( struct compat_cache_buf * buf,
+                      char const *              s,
+                      char const *              win_cwd ) {
+  size_t cwd_len = strlen( g_cache.cwd );
+  size_t win_len = strlen( win_cwd );
+  while( *s ) {
+    size_t m = 0;
+    if     ( cwd_len>1 && 0==strncmp( s, g_cache.cwd, cwd_len ) ) m = cwd_len;
+    else if( win_len>3 && compat_cache_key_win( s, win_cwd, win_len ) ) m = win_len;
+    if( m && ( !s[m] || s[m]=='/' || s[m]=='\\' ) ) {
+      compat_cache_buf_append( buf, ".", 1 );
+      s += m;
+      continue;
+    }
+    char c = *s=='\\' ? '/' : *s;
+    compat_cache_buf_append( buf, &c, 1 );
+    s++;
+  }
+  compat_cache_buf_append( buf, "", 1 );
+}
+
+static void
+compat_cache_compute_key( void ) {
+  char * win_cwd = g_cache.win_cwd;
+  if( !getcwd( g_cache.cwd, sizeof(g_cache.cwd) ) ) g_cache.cwd[0] = '\0';
+  size_t win_sz = compat_mount_to_win( win_cwd, sizeof(g_cache.win_cwd), g_cache.cwd );
+  if( !win_sz || win_sz>sizeof(g_cache.win_cwd) ) win_cwd[0] = '\0';
+
+  struct compat_cache_buf buf = {0};
+  compat_cache_buf_append( &buf, &g_cache.elf_hash, sizeof(g_cache.elf_hash) );
+  /* Pinned clock reads are not noted as nondeterministic, so the
+     pinned instant is part of the key */
+  int64_t epoch = g_time_pinned ? g_time_epoch : -1;
+  compat_cache_buf_append( &buf, &epoch, sizeof(epoch) );
+  for( int i=1; i<g_argc; i++ ) {
+    compat_cache_key_str( &buf, g_argv[i], win_cwd );
+  }
+  for( char ** env=environ; *env; env++ ) {
+    if( 0==strncmp( *env, "MW", 2 ) ) compat_cache_key_str( &buf, *env, win_cwd );
+  }
+  g_cache.key = compat_xxh64( buf.data, buf.sz, 0 );
+  free( buf.data );
+}
+
+/* compat_cache_merge: Writes the manifest for key, made of the entries
+   of head followed by those of tail that are not in head, capped at
+   COMPAT_CACHE_ENTRY_MAX.  Both are manifest bodies without magic. */
+static int
+compat_cache_merge( uint64_t     key,
+                    char const * head,
+                    char const * tail ) {
+  struct compat_cache_buf manifest = {0};
+  compat_cache_buf_append( &manifest, COMPAT_CACHE_MAGIC, strlen( COMPAT_CACHE_MAGIC ) );
+  size_t head_end = manifest.sz;
+
+  char const * parts[2] = { head, tail };
+  int entry_cnt = 0;
+  for( int i=0; i<2; i++ ) {
+    char const * p = parts[i];
+    while( p && *p && entry_cnt<COMPAT_CACHE_ENTRY_MAX ) {
+      char const * end = strstr( p, "\nend\n" );
+      if( !end ) break;
+      end += 5;
+      size_t sz  = (size_t)(end-p);
+      int    dup = 0;
+      if( i==1 ) {
+        /* Skip entries already in head */
+        char const * q   = manifest.data+strlen( COMPAT_CACHE_MAGIC );
+        char const * lim = manifest.data+head_end;
+        while( q<lim ) {
+          char const * q_end = memmem( q, (size_t)(lim-q), "\nend\n", 5 );
+          if( !q_end ) break;
+          q_end += 5;
+          if( (size_t)(q_end-q)==sz && 0==memcmp( q, p, sz ) ) { dup = 1; break; }
+          q = q_end;
+        }
+      }
+      if( !dup ) {
+        compat_cache_buf_append( &manifest, p, sz );
+        entry_cnt++;
+      }
+      p = end;
+    }
+    if( i==0 ) head_end = manifest.sz;
+  }
+
+  char path[ PATH_MAX ];
+  compat_cache_path( path, sizeof(path), key, ".m" );
+  int ok = compat_cache_publish( path, manifest.data, manifest.sz );
+  if( !ok ) LOG_WARN(( "cache: failed to write %s", path ));
+  free( manifest.data );
+  return ok;
+}
+
+/* compat_cache_load_manifest: Loads the local manifest for key.
+   Returns a malloc'd buffer and sets body past the magic, or NULL. */
+static char *
+compat_cache_load_manifest( uint64_t key,
+                            char **  body ) {
+  char   path[ PATH_MAX ];
+  size_t sz;
+  compat_cache_path( path, sizeof(path), key, ".m" );
+  char * manifest = compat_cache_load( path, &sz );
+  if( manifest && 0!=strncmp( manifest, COMPAT_CACHE_MAGIC, strlen( COMPAT_CACHE_MAGIC ) ) ) {
+    free( manifest );
+    manifest = NULL;
+  }
+  if( manifest ) *body = manifest+strlen( COMPAT_CACHE_MAGIC );
+  return manifest;
+}
+
+/* Remote store
+
+   The remote cache is a plain HTTP store with two namespaces:
+   /m/<key> for manifests and /b/<hash> for blobs.  Bodies are LZ4
+   compressed.  Everything fetched lands in the local store, so local
+   lookups work the same either way.  The remote is dropped for the
+   rest of the process after the first network error. */
+
+static struct compat_http g_cache_http;
+
+static void
+compat_cache_remote_fail( void ) {
+  if( !g_cache.remote ) return;
+  LOG_WARN(( "cache: remote unavailable, continuing without it" ));
+  g_cache.remote = 0;
+}
+
+static struct compat_http_req *
+compat_cache_remote_reqs( size_t cnt ) {
+  struct compat_http_req * reqs = calloc( cnt ? cnt : 1, sizeof(struct compat_http_req) );
+  assert( reqs );
+  return reqs;
+}
+
+static void
+compat_cache_remote_put_body( struct compat_http_req * req,
+                              void const *             data,
+                              size_t                   sz ) {
+  req->method  = "PUT";
+  req->body    = malloc( compat_lz4_bound( sz ) );
+  assert( req->body );
+  req->body_sz = compat_lz4_compress( data, sz, req->body );
+}
+
+/* compat_cache_remote_manifests: Fetches the remote manifests for keys
+   (pipelined) and merges them into the local ones. */
+static void
+compat_cache_remote_manifests( uint64_t const * keys,
+                               size_t           cnt ) {
+  if( !g_cache.remote || !cnt ) return;
+  struct compat_http_req * reqs = compat_cache_remote_reqs( cnt );
+  for( size_t i=0; i<cnt; i++ ) {
+    reqs[i].method = "GET";
+    snprintf( reqs[i].path, sizeof(reqs[i].path), "/m/%016llx", (unsigned long long)keys[i] );
+  }
+  if( !compat_http_pipeline( &g_cache_http, reqs, cnt ) ) {
+    compat_cache_remote_fail();
+    compat_http_req_free( reqs, cnt );
+    return;
+  }
+
+  for( size_t i=0; i<cnt; i++ ) {
+    if( reqs[i].status!=200 ) continue;
+    size_t raw_sz;
+    char * remote = compat_lz4_decompress( reqs[i].resp, reqs[i].resp_sz, &raw_sz );
+    if( !remote ) {
+      LOG_WARN(( "cache: corrupt remote manifest %s", reqs[i].path ));
+      continue;
+    }
+    remote[ raw_sz ] = '\0';
+    if( 0==strncmp( remote, COMPAT_CACHE_MAGIC, strlen( COMPAT_CACHE_MAGIC ) ) ) {
+      char * local_body = NULL;
+      char * local = compat_cache_load_manifest( keys[i], &local_body );
+      compat_cache_merge( keys[i], local_body, remote+strlen( COMPAT_CACHE_MAGIC ) );
+      free( local );
+    }
+    free( remote );
+  }
+  compat_http_req_free( reqs, cnt );
+}
+
+/* compat_cache_remote_blobs: Fetches blobs (pipelined) into the local
+   store.  Returns 1 if all of them were found. */
+static int
+compat_cache_remote_blobs( struct compat_cache_hashes const * list ) {
+  if( !g_cache.remote ) return 0;
+  struct compat_http_req * reqs = compat_cache_remote_reqs( list->cnt );
+  for( uint32_t i=0; i<list->cnt; i++ ) {
+    reqs[i].method = "GET";
+    snprintf( reqs[i].path, sizeof(reqs[i].path), "/b/%016llx", (unsigned long long)list->hash[i] );
+  }
+  int ok = compat_http_pipeline( &g_cache_http, reqs, list->cnt );
+  if( !ok ) compat_cache_remote_fail();
+
+  for( uint32_t i=0; ok && i<list->cnt; i++ ) {
+    size_t raw_sz;
+    void * raw = NULL;
+    uint64_t hash;
+    if( reqs[i].status==200 ) raw = compat_lz4_decompress( reqs[i].resp, reqs[i].resp_sz, &raw_sz );
+    ok = raw && compat_cache_put( raw, raw_sz, &hash ) && hash==list->hash[i];
+    if( raw && !ok ) LOG_WARN(( "cache: corrupt remote blob %s", reqs[i].path ));
+    free( raw );
+  }
+  compat_http_req_free( reqs, list->cnt );
+  return ok;
+}
+
+/* compat_cache_remote_store: Uploads blobs and the manifest for key. */
+static void
+compat_cache_remote_store( struct compat_cache_hashes const * blobs,
+                           uint64_t                           key ) {
+  if( !g_cache.remote ) return;
+  size_t cnt = blobs->cnt+1;
+  struct compat_http_req * reqs = compat_cache_remote_reqs( cnt );
+
+  char   path[ PATH_MAX ];
+  size_t sz;
+  for( uint32_t i=0; i<blobs->cnt; i++ ) {
+    compat_cache_path( path, sizeof(path), blobs->hash[i], "" );
+    char * data = compat_cache_load( path, &sz );
+    if( !data ) { cnt = i; goto done; }
+    compat_cache_remote_put_body( &reqs[i], data, sz );
+    snprintf( reqs[i].path, sizeof(reqs[i].path), "/b/%016llx", (unsigned long long)blobs->hash[i] );
+    free( data );
+  }
+  compat_cache_path( path, sizeof(path), key, ".m" );
+  char * manifest = compat_cache_load( path, &sz );
+  if( !manifest ) { cnt--; goto done; }
+  compat_cache_remote_put_body( &reqs[ cnt-1 ], manifest, sz );
+  snprintf( reqs[ cnt-1 ].path, sizeof(reqs[ cnt-1 ].path), "/m/%016llx", (unsigned long long)key );
+  free( manifest );
+
+  if( !compat_http_pipeline( &g_cache_http, reqs, cnt ) ) {
+    compat_cache_remote_fail();
+    goto done;
+  }
+  for( size_t i=0; i<cnt; i++ ) {
+    if( reqs[i].status/100!=2 ) LOG_WARN(( "cache: upload %s failed (HTTP %d)", reqs[i].path, reqs[i].status ));
+  }
+
+done:
+  compat_http_req_free( reqs, blobs->cnt+1 );
+}
+
+/* compat_cache_prefetch: Fetches the remote manifests of many runs
+   at once, e.g. all units of a batch. */
+static void
+compat_cache_prefetch( uint64_t const * keys,
+                       size_t           cnt ) {
+  if( !g_cache.dir ) return;
+  compat_cache_remote_manifests( keys, cnt );
+  g_cache.prefetched = 1;
+}
+
+/* compat_cache_lookup: Replays the first matching manifest entry.
+   Returns on miss. */
+static void
+compat_cache_lookup( char * body ) {
+  struct compat_cache_hashes missing = {0};
+  char * cursor = body;
+  char * line;
+  while( (line = compat_cache_next_line( &cursor )) ) {
+    if( 0!=strcmp( line, "entry" ) ) continue;
+    char * entry = cursor;
+    if( !compat_cache_check( &cursor, &missing ) ) continue;
+    if( missing.cnt && !compat_cache_remote_blobs( &missing ) ) continue;
+
+    /* compat_cache_check cut the entry into lines already */
+    for( char * p=entry; p<cursor; p++ ) if( *p=='\0' ) *p = '\n';
+    int64_t code = compat_cache_replay( entry );
+    if( code<0 ) break;
+
+    LOG_INFO(( "cache: hit %016llx", (unsigned long long)g_cache.key ));
+    free( missing.hash );
+    fflush( NULL );
+    KERNEL32_ExitProcess( (uint32_t)code );
+  }
+  free( missing.hash );
+}
+
+/* compat_cache_begin: Replays a cached result or starts recording. */
+static void
+compat_cache_begin( void ) {
+  if( !g_cache.dir ) return;
+  compat_cache_reset();
+  compat_cache_compute_key();
+
+  char * body;
+  char * manifest = compat_cache_load_manifest( g_cache.key, &body );
+  if( manifest ) compat_cache_lookup( body );
+  free( manifest );
+
+  if( g_cache.remote && !g_cache.prefetched ) {
+    compat_cache_remote_manifests( &g_cache.key, 1 );
+    manifest = compat_cache_load_manifest( g_cache.key, &body );
+    if( manifest ) compat_cache_lookup( body );
+    free( manifest );
+  }
+
+  LOG_DEBUG(( "cache: miss %016llx", (unsigned long long)g_cache.key ));
+  g_cache.recording = 1;
+
+  /* The key does not cover the working directory, so an output that
+     names it (e.g. from an absolute argument) ties the entry to it */
+  size_t cwd_len = strlen( g_cache.cwd     );
+  size_t win_len = strlen( g_cache.win_cwd );
+  if( cwd_len>1 ) compat_nondet_pattern( COMPAT_NONDET_CWD, g_cache.cwd,     cwd_len );
+  if( win_len>3 ) compat_nondet_pattern( COMPAT_NONDET_CWD, g_cache.win_cwd, win_len );
+}
+
+/* compat_cache_finish: Stores the recorded run. */
+static void
+compat_cache_finish( uint32_t exit_code ) {
+  if( !compat_nondet_cacheable() ) compat_cache_disable( "nondeterministic" );
+  if( !g_cache.recording ) return;
+  g_cache.recording = 0;
+  fflush( NULL );
+  compat_file_flush_all( 0 );
+
+  struct compat_cache_buf    entry = {0};
+  struct compat_cache_hashes blobs = {0};
+  char line[ PATH_MAX+64 ];
+  int  ok = 1;
+  compat_cache_buf_append( &entry, "entry\n", 6 );
+  if( compat_nondet_leaked( COMPAT_NONDET_CWD ) ) {
+    /* Outputs embed the working directory */
+    int n = snprintf( line, sizeof(line), "cwd %s\n", g_cache.cwd );
+    compat_cache_buf_append( &entry, line, (size_t)n );
+  }
+  for( uint32_t i=0; ok && i<g_cache.rec_cnt; i++ ) {
+    struct compat_cache_rec * rec = &g_cache.rec[i];
+    int n = 0;
+    switch( rec->kind ) {
+    case COMPAT_CACHE_REC_IN:
+      n = snprintf( line, sizeof(line), "in %016llx %s\n", (unsigned long long)rec->hash, rec->path );
+      break;
+    case COMPAT_CACHE_REC_ABSENT:
+      n = snprintf( line, sizeof(line), "absent %s\n", rec->path );
+      break;
+    case COMPAT_CACHE_REC_PRESENT:
+      n = snprintf( line, sizeof(line), "present %c %s\n", rec->hash ? 'd' : 'f', rec->path );
+      break;
+    case COMPAT_CACHE_REC_OUT: {
+      /* Outputs deleted before exit were temporaries */
+      size_t sz;
+      char * data = compat_cache_load( rec->path, &sz );
+      if( !data ) continue;
+      uint64_t hash;
+      ok = compat_cache_put( data, sz, &hash );
+      free( data );
+      compat_cache_hashes_push( &blobs, hash );
+      n = snprintf( line, sizeof(line), "out %016llx %s\n", (unsigned long long)hash, rec->path );
+      break;
+    }
+    }
+    compat_cache_buf_append( &entry, line, (size_t)n );
+  }
+
+  static char const * const stdio_name[2] = { "stdout", "stderr" };
+  for( int i=0; ok && i<2; i++ ) {
+    if( !g_cache.out[i].sz ) continue;
+    uint64_t hash;
+    ok = compat_cache_put( g_cache.out[i].data, g_cache.out[i].sz, &hash );
+    compat_cache_hashes_push( &blobs, hash );
+    int n = snprintf( line, sizeof(line), "%s %016llx\n", stdio_name[i], (unsigned long long)hash );
+    compat_cache_buf_append( &entry, line, (size_t)n );
+  }
+  int n = snprintf( line, sizeof(line), "exit %u\nend\n", exit_code );
+  compat_cache_buf_append( &entry, line, (size_t)n + 1 );   /* with NUL */
+
+  if( !ok ) {
+    LOG_WARN(( "cache: failed to store outputs in %s", g_cache.dir ));
+  } else {
+    /* Prepend to manifest, dropping the oldest entries */
+    char * old_body = NULL;
+    char * old = compat_cache_load_manifest( g_cache.key, &old_body );
+    ok = compat_cache_merge( g_cache.key, entry.data, old_body );
+    free( old );
+    if( ok ) compat_cache_remote_store( &blobs, g_cache.key );
+  }
+
+  free( blobs.hash );
+  free( entry.data );
+  compat_cache_reset();
+}
+
+/********************************************************************************
+   Nondeterminism Tracking
+ ********************************************************************************/
+
+/* Shims that leak host state into the PE (clock, cwd, environment,
+   file times) note their results here.  Distinctive byte patterns of
+   each result (e.g. __DATE__/__TIME__ style strings for clock reads)
+   are kept, and every WriteFile is scanned for them.  A hit means the
+   result reached an output, making the run nondeterministic.
+
+   Patterns split across two WriteFile calls are not detected.
+
+   With WIN32_NONDET_REPORT=<path>, a verdict is written at exit:
+
+     run <args>
+     verdict deterministic|unobserved|nondeterministic
+     cacheable yes|no
+     call <shim> <count> leaked|unobserved
+     exit <code>
+     end
+
+   "unobserved" means state was read, but no result was seen in any
+   output.  The result cache refuses to store runs that are not
+   cacheable. */
+
+#define COMPAT_NONDET_PATTERN_MAX 64
+#define COMPAT_NONDET_PATTERN_SZ  256
+#define COMPAT_NONDET_PER_SRC_MAX 16
+
+static char const * const compat_nondet_name[ COMPAT_NONDET_CNT ] = {
+  [ COMPAT_NONDET_TICK      ] = "GetTickCount",
+  [ COMPAT_NONDET_SYSTIME   ] = "GetSystemTime",
+  [ COMPAT_NONDET_LOCALTIME ] = "GetLocalTime",
+  [ COMPAT_NONDET_CWD       ] = "GetCurrentDirectoryA",
+  [ COMPAT_NONDET_ENV       ] = "GetEnvironmentStrings",
+  [ COMPAT_NONDET_FILETIME  ] = "GetFileTime"
+};
+
+struct compat_nondet_pat {
+  uint32_t src;
+  uint32_t sz;
+  uint8_t  data[ COMPAT_NONDET_PATTERN_SZ ];
+};
+
+static struct {
+  int                      active;        /* scan outputs */
+  char *                   report_path;
+  int                      report_cnt;
+  uint32_t                 calls  [ COMPAT_NONDET_CNT ];
+  uint32_t                 leaks  [ COMPAT_NONDET_CNT ];
+  uint32_t                 pat_per[ COMPAT_NONDET_CNT ];
+  struct compat_nondet_pat pat[ COMPAT_NONDET_PATTERN_MAX ];
+  uint32_t                 pat_cnt;
+} g_nondet;
+
+static void
+compat_nondet_pattern( uint32_t     src,
+                       void const * val,
+                       size_t       sz ) {
+  if( !sz || g_nondet.pat_cnt>=COMPAT_NONDET_PATTERN_MAX ) return;
+  if( g_nondet.pat_per[ src ]>=COMPAT_NONDET_PER_SRC_MAX ) return;
+  if( sz>COMPAT_NONDET_PATTERN_SZ ) sz = COMPAT_NONDET_PATTERN_SZ;
+  for( uint32_t i=0; i<g_nondet.pat_cnt; i++ ) {
+    struct compat_nondet_pat const * pat = &g_nondet.pat[i];
+    if( pat->src==src && pat->sz==sz && 0==memcmp( pat->data, val, sz ) ) return;
+  }
+  struct compat_nondet_pat * pat = &g_nondet.pat[ g_nondet.pat_cnt++ ];
+  pat->src = src;
+  pat->sz  = (uint32_t)sz;
+  memcpy( pat->data, val, sz );
+  g_nondet.pat_per[ src ]++;
+}
+
+static void
+compat_nondet_note( uint32_t     src,
+                    void const * val,
+                    size_t       sz ) {
+  g_nondet.calls[ src ]++;
+  compat_nondet_pattern( src, val, sz );
+}
+
+/* compat_nondet_note_time: Notes a clock read, with the forms that
+   end up in __DATE__ and __TIME__. */
+static void
+compat_nondet_note_time( uint32_t           src,
+                         SYSTEMTIME const * st ) {
+  static char const * const month[12] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+  };
+  compat_nondet_note( src, NULL, 0 );
+  if( st->wMonth<1 || st->wMonth>12 || st->wDay>31 ||
+      st->wHour>23 || st->wMinute>59 || st->wSecond>60 )
+    return;
+
+  char buf[ 32 ];
+  int n = snprintf( buf, sizeof(buf), "%02u:%02u:%02u", st->wHour, st->wMinute, st->wSecond );
+  compat_nondet_pattern( src, buf, (size_t)n );
+  n = snprintf( buf, sizeof(buf), "%s %2u %04u", month[ st->wMonth-1 ], st->wDay, st->wYear );
+  compat_nondet_pattern( src, buf, (size_t)n );
+}
+
+static void
+compat_nondet_scan( void const * buf,
+                    size_t       sz ) {
+  if( !g_nondet.active ) return;
+  for( uint32_t i=0; i<g_nondet.pat_cnt; i++ ) {
+    struct compat_nondet_pat const * pat = &g_nondet.pat[i];
+    if( g_nondet.leaks[ pat->src ] ) continue;
+    if( memmem( buf, sz, pat->data, pat->sz ) ) {
+      LOG_DEBUG(( "nondet: result of %s reached an output", compat_nondet_name[ pat->src ] ));
+      g_nondet.leaks[ pat->src ]++;
+    }
+  }
+}
+
+/* compat_nondet_reset: Forgets everything noted so far. */
+static void
+compat_nondet_reset( void ) {
+  memset( g_nondet.calls,   0, sizeof(g_nondet.calls)   );
+  memset( g_nondet.leaks,   0, sizeof(g_nondet.leaks)   );
+  memset( g_nondet.pat_per, 0, sizeof(g_nondet.pat_per) );
+  g_nondet.pat_cnt = 0;
+}
+
+/* compat_nondet_cacheable: Whether outputs only depend on what the
+   result cache keys on.  The working directory is checked by the entry
+   instead (see compat_cache_finish). */
+static int
+compat_nondet_cacheable( void ) {
+  for( uint32_t i=0; i<COMPAT_NONDET_CNT; i++ ) {
+    if( i!=COMPAT_NONDET_CWD && g_nondet.leaks[i] ) return 0;
+  }
+  return 1;
+}
+
+static int
+compat_nondet_leaked( uint32_t src ) {
+  return g_nondet.leaks[ src ]!=0;
+}
+
+static char const *
+compat_nondet_verdict( void ) {
+  int called = 0;
+  for( uint32_t i=0; i<COMPAT_NONDET_CNT; i++ ) {
+    if( g_nondet.leaks[i] ) return "nondeterministic";
+    if( g_nondet.calls[i] ) called = 1;
+  }
+  return called ? "unobserved" : "deterministic";
+}
+
+/* compat_nondet_begin: Called once the command line is final. */
+static void
+compat_nondet_begin( void ) {
+  char const * path = getenv( "WIN32_NONDET_REPORT" );
+  if( path ) {
+    free( g_nondet.report_path );
+    g_nondet.report_path = strdup( path );
+    g_nondet.report_cnt  = 0;
+    unsetenv( "WIN32_NONDET_REPORT" );
+  }
+  g_nondet.active = g_nondet.report_path || g_cache.dir;
+}
+
+static void
+compat_nondet_report( uint32_t exit_code ) {
+  if( !g_nondet.report_path ) return;
+
+  /* The first report of a process replaces the file, later ones
+     (batch mode) are appended */
+  int flags = O_WRONLY|O_CREAT|O_CLOEXEC|( g_nondet.report_cnt ? O_APPEND : O_TRUNC );
+  FILE * f = NULL;
+  int fd = open( g_nondet.report_path, flags, 0644 );
+  if( fd>=0 ) f = fdopen( fd, "a" );
+  if( !f ) {
+    LOG_WARN(( "nondet: cannot write report %s: %s", g_nondet.report_path, strerror( errno ) ));
+    if( fd>=0 ) close( fd );
+    return;
+  }
+  g_nondet.report_cnt++;
+
+  fputs( "run", f );
+  for( int i=1; i<g_argc; i++ ) fprintf( f, " %s", g_argv[i] );
+  fprintf( f, "\nverdict %s\n", compat_nondet_verdict() );
+  fprintf( f, "cacheable %s\n", compat_nondet_cacheable() ? "yes" : "no" );
+  for( uint32_t i=0; i<COMPAT_NONDET_CNT; i++ ) {
+    if( !g_nondet.calls[i] ) continue;
+    fprintf( f, "call %s %u %s\n", compat_nondet_name[i], g_nondet.calls[i],
+             g_nondet.leaks[i] ? "leaked" : "unobserved" );
+  }
+  fprintf( f, "exit %u\nend\n", exit_code );
+  fclose( f );
+}
+
+/********************************************************************************
+   Time
+ ********************************************************************************/
+
+/* Wall clock time comes from CLOCK_REALTIME (served by the vDSO).
+
+   If SOURCE_DATE_EPOCH is set, every clock is pinned for reproducible
+   builds: the wall clock reads as that instant in UTC, the local time
+   zone is UTC, and GetTickCount advances by 1ms per call. */
+
+/* Seconds between 1601-01-01 and 1970-01-01 */
+#define COMPAT_FILETIME_UNIX_EPOCH 11644473600LL
+
+static void
+compat_time_init( void ) {
+  char const * sde = getenv( "SOURCE_DATE_EPOCH" );
+  if( !sde ) return;
+  char * end;
+  errno = 0;
+  long long epoch = strtoll( sde, &end, 10 );
+  if( errno || end==sde || *end || epoch<0 ) {
+    LOG_WARN(( "ignoring invalid SOURCE_DATE_EPOCH \"%s\"", sde ));
+    return;
+  }
+  g_time_pinned = 1;
+  g_time_epoch  = epoch;
+}
+
+static void
+compat_time_now( struct timespec * ts ) {
+  if( g_time_pinned ) {
+    ts->tv_sec  = (time_t)g_time_epoch;
+    ts->tv_nsec = 0;
+    return;
+  }
+  clock_gettime( CLOCK_REALTIME, ts );
+}
+
+/* Proleptic Gregorian calendar conversions (days since 1970-01-01),
+   after Howard Hinnant's chrono algorithms */
+
+static int64_t
+compat_days_from_civil( int64_t  y,
+                        uint32_t m,
+                        uint32_t d ) {
+  y -= m<=2;
+  int64_t  era = (y>=0 ? y : y-399)/400;
+  uint32_t yoe = (uint32_t)(y-era*400);
+  uint32_t doy = (153*(m>2 ? m-3 : m+9)+2)/5 + d-1;
+  uint32_t doe = yoe*365 + yoe/4 - yoe/100 + doy;
+  return era*146097 + (int64_t)doe - 719468;
+}
+
+static void
+compat_civil_from_days( int64_t    z,
+                        int64_t *  y_out,
+                        uint32_t * m_out,
+                        uint32_t * d_out ) {
+  z += 719468;
+  int64_t  era = (z>=0 ? z : z-146096)/146097;
+  uint32_t doe = (uint32_t)(z-era*146097);
+  uint32_t yoe = (doe - doe/1460 + doe/36524 - doe/146096)/365;
+  uint32_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+  uint32_t mp  = (5*doy+2)/153;
+  uint32_t d   = doy - (153*mp+2)/5 + 1;
+  uint32_t m   = mp<10 ? mp+3 : mp-9;
+  *y_out = (int64_t)yoe + era*400 + (m<=2);
+  *m_out = m;
+  *d_out = d;
+}
+
+static uint32_t
+compat_days_in_month( int64_t  y,
+                      uint32_t m ) {
+  static uint8_t const days[12] = { 31,28,31,30,31,30,31,31,30,31,30,31 };
+  int leap = (y%4==0 && y%100!=0) || y%400==0;
+  return days[ m-1 ] + (m==2 && leap);
+}
+
+/* compat_systime_from_unix: Splits seconds since the Unix epoch. */
+static void
+compat_systime_from_unix( int64_t      sec,
+                          uint32_t     ms,
+                          SYSTEMTIME * st ) {
+  int64_t days = sec/86400;
+  int64_t rem  = sec%86400;
+  if( rem<0 ) { rem += 86400; days--; }
+  int64_t  y;
+  uint32_t m, d;
+  compat_civil_from_days( days, &y, &m, &d );
+  st->wYear         = (uint16_t)y;
+  st->wMonth        = (uint16_t)m;
+  st->wDayOfWeek    = (uint16_t)(((days%7)+11)%7);   /* 1970-01-01 was a Thursday */
+  st->wDay          = (uint16_t)d;
+  st->wHour         = (uint16_t)(rem/3600);
+  st->wMinute       = (uint16_t)((rem/60)%60);
+  st->wSecond       = (uint16_t)(rem%60);
+  st->wMilliseconds = (uint16_t)ms;
+}
+
+static inline uint64_t
+compat_filetime_u64( FILETIME const * ft ) {
+  return ((uint64_t)ft->dwHighDateTime<<32) | ft->dwLowDateTime;
+}
+
+static inline void
+compat_filetime_set( FILETIME * ft,
+                     uint64_t   val ) {
+  ft->dwLowDateTime  = (uint32_t)val;
+  ft->dwHighDateTime = (uint32_t)(val>>32);
+}
+
+static void
+compat_filetime_from_unix( FILETIME *              ft,
+                           struct timespec const * ts ) {
+  compat_filetime_set( ft, (uint64_t)( ts->tv_sec+COMPAT_FILETIME_UNIX_EPOCH )*10000000ULL
+                           + (uint64_t)ts->tv_nsec/100U );
+}
+
+/* compat_local_offset: Seconds east of UTC at the given time. */
+static long
+compat_local_offset( time_t t,
+                     int *  is_dst ) {
+  struct tm tm;
+  if( g_time_pinned || !localtime_r( &t, &tm ) ) {
+    if( is_dst ) *is_dst = 0;
+    return 0;
+  }
+  if( is_dst ) *is_dst = tm.tm_isdst>0;
+  return tm.tm_gmtoff;
+}
+
+/* compat_tz_transition: Finds the first DST change after t within the
+   next year and describes it the way TIME_ZONE_INFORMATION does
+   (n-th weekday of a month, in local time before the change).
+   Returns the time of the change, or 0 if there is none. */
+static time_t
+compat_tz_transition( time_t       t,
+                      SYSTEMTIME * rule ) {
+  int dst0;
+  compat_local_offset( t, &dst0 );
+
+  /* Coarse scan by day, then bisect to the second */
+  time_t lo = t, hi = 0;
+  for( int day=1; day<=366; day++ ) {
+    int dst;
+    compat_local_offset( t + (time_t)day*86400, &dst );
+    if( dst!=dst0 ) { hi = t + (time_t)day*86400; break; }
+    lo = t + (time_t)day*86400;
+  }
+  if( !hi ) return 0;
+  while( hi-lo>1 ) {
+    time_t mid = lo+(hi-lo)/2;
+    int dst;
+    compat_local_offset( mid, &dst );
+    if( dst==dst0 ) lo = mid;
+    else            hi = mid;
+  }
+
+  SYSTEMTIME local;
+  compat_systime_from_unix( (int64_t)hi + compat_local_offset( lo, NULL ), 0, &local );
+  memset( rule, 0, sizeof(*rule) );
+  rule->wMonth     = local.wMonth;
+  rule->wDayOfWeek = local.wDayOfWeek;
+  rule->wDay       = (uint16_t)((local.wDay-1)/7 + 1);
+  if( local.wDay+7U > compat_days_in_month( local.wYear, local.wMonth ) ) rule->wDay = 5;
+  rule->wHour      = local.wHour;
+  rule->wMinute    = local.wMinute;
+  return hi;
+}
+
+static void
+compat_tz_name( uint16_t *   out,
+                char const * name ) {
+  uint32_t i = 0;
+  for( ; name && name[i] && i<31; i++ ) out[i] = (uint8_t)name[i];
+  out[i] = 0;
+}
+
+/********************************************************************************
+   Heap
+ ********************************************************************************/
+
+/* The PE heap is served by libc malloc by default.
+
+   In batch mode, it is served from a private arena instead, which can
+   be discarded in O(1) between compile units.  The arena is a single
+   reserved address range with a bump pointer and power-of-two free
+   lists.  Its control block lives at the start of the range itself. */
+
+#define COMPAT_ARENA_SZ      (1U<<30)
+#define COMPAT_ARENA_HDR_SZ  16U
+#define COMPAT_ARENA_CLS_MIN 5
+#define COMPAT_ARENA_CLS_CNT 31
+
+struct compat_arena {
+  uint8_t * top;                            /* bump pointer */
+  uint8_t * end;                            /* end of reserved range */
+  void *    free[ COMPAT_ARENA_CLS_CNT ];   /* free lists by log2 block size */
+};
+
+/* Header in front of every arena block */
+struct compat_arena_blk {
+  uint32_t cls;
+  uint32_t pad[3];
+};
+
+static struct compat_arena * g_arena;
+
+/* compat_arena_reset: Frees all arena blocks at once. */
+static void
+compat_arena_reset( void ) {
+  uint8_t * base = (uint8_t *)g_arena;
+  g_arena->top = base + ((sizeof(struct compat_arena)+15U)&~15U);
+  memset( g_arena->free, 0, sizeof(g_arena->free) );
+}
+
+/* compat_arena_init: Reserves the arena.  If base is not NULL, the
+   arena must be placed exactly there (required for snapshots). */
+static int
+compat_arena_init( void * base ) {
+  int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE;
+  if( base ) flags |= MAP_FIXED_NOREPLACE;
+  void * mem = mmap( base, COMPAT_ARENA_SZ, PROT_READ|PROT_WRITE, flags, -1, 0 );
+  if( mem==MAP_FAILED ) {
+    LOG_WARN(( "heap: failed to reserve arena: %s", strerror( errno ) ));
+    return 0;
+  }
+  if( base && mem!=base ) {
+    /* Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a hint */
+    LOG_WARN(( "heap: arena address %p is taken", base ));
+    munmap( mem, COMPAT_ARENA_SZ );
+    return 0;
+  }
+  g_arena = mem;
+  g_arena->end = (uint8_t *)mem + COMPAT_ARENA_SZ;
+  compat_arena_reset();
+  return 1;
+}
+
+static inline int
+compat_arena_owns( void const * ptr ) {
+  return g_arena &&
+         (uint8_t const *)ptr >  (uint8_t const *)g_arena &&
+         (uint8_t const *)ptr <  g_arena->end;
+}
+
+static inline size_t
+compat_arena_usable( void const * ptr ) {
+  struct compat_arena_blk const * blk = (struct compat_arena_blk const *)ptr - 1;
+  return (1U<<blk->cls) - COMPAT_ARENA_HDR_SZ;
+}
+
+static void *
+compat_arena_alloc( size_t sz ) {
+  uint32_t cls = COMPAT_ARENA_CLS_MIN;
+  while( cls<COMPAT_ARENA_CLS_CNT && (1U<<cls)-COMPAT_ARENA_HDR_SZ < sz ) cls++;
+  if( cls>=COMPAT_ARENA_CLS_CNT ) return NULL;
+
+  struct compat_arena_blk * blk = g_arena->free[ cls ];
+  if( blk ) {
+    g_arena->free[ cls ] = *(void **)(blk+1);
+  } else {
+    if( (size_t)(g_arena->end - g_arena->top) < (1U<<cls) ) return NULL;
+    blk = (struct compat_arena_blk *)g_arena->top;
+    g_arena->top += 1U<<cls;
+  }
+  blk->cls = cls;
+  return blk+1;
+}
+
+static void
+compat_arena_free( void * ptr ) {
+  struct compat_arena_blk * blk = (struct compat_arena_blk *)ptr - 1;
+  *(void **)ptr = g_arena->free[ blk->cls ];
+  g_arena->free[ blk->cls ] = blk;
+}
+
+static void *
+compat_heap_alloc( size_t sz ) {
+  if( g_arena ) return compat_arena_alloc( sz );
+  return malloc( sz );
+}
+
+static void
+compat_heap_free( void * ptr ) {
+  if( !ptr ) return;
+  if( compat_arena_owns( ptr ) ) compat_arena_free( ptr );
+  else                           free( ptr );
+}
+
+static size_t
+compat_heap_usable( void * ptr ) {
+  if( !ptr ) return 0;
+  if( compat_arena_owns( ptr ) ) return compat_arena_usable( ptr );
+  return malloc_usable_size( ptr );
+}
+
+static void *
+compat_heap_realloc( void * ptr,
+                     size_t sz ) {
+  if( !compat_arena_owns( ptr ) ) {
+    if( !ptr && g_arena ) return compat_arena_alloc( sz );
+    return realloc( ptr, sz );
+  }
+  size_t old_sz = compat_arena_usable( ptr );
+  if( sz<=old_sz ) return ptr;
+  void * obj = compat_arena_alloc( sz );
+  if( !obj ) return NULL;
+  memcpy( obj, ptr, old_sz );
+  compat_arena_free( ptr );
+  return obj;
+}
+
+WIN32_STDCALL
+int32_t *
+KERNEL32_GlobalAlloc( uint32_t u_flags,
+                      uint32_t dw_bytes ) {
+  STATS_API( KERNEL32_GlobalAlloc );
+  if( dw_bytes==0 )
+    dw_bytes=1;
+  void * ptr = compat_heap_alloc( dw_bytes );
+  if( ptr && (u_flags&0x40)!=0 ) {
+    memset( ptr, 0, dw_bytes );
+  }
+  LOG_TRACE(( "KERNEL32_GlobalAlloc(%#x, %u) = %p", u_flags, dw_bytes, ptr ));
+  TRACE_API( KERNEL32_GlobalAlloc, ptr, u_flags, dw_bytes, 0 );
+  return (int32_t *)ptr;
+}
+
+WIN32_STDCALL
+int32_t *
+KERNEL32_GlobalFree( int32_t * h_mem ) {
+  STATS_API( KERNEL32_GlobalFree );
+  LOG_TRACE(( "KERNEL32_GlobalFree(%p)", h_mem ));
+  compat_heap_free( h_mem );
+  TRACE_API( KERNEL32_GlobalFree, 0, h_mem, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetFullPathNameA( char const * lp_file_name,
+                           uint32_t     n_buffer_length,
+                           char *       lp_buffer,
+                           char **      lp_file_part ) {
+  STATS_API( KERNEL32_GetFullPathNameA );
+  /* The program searching for itself, or for its license file */
+  struct compat_mount const * m = compat_mount_claim( lp_file_name );
+  if( m && m->kind==COMPAT_MOUNT_SYS32 ) {
+    LOG_DEBUG(( "KERNEL32_GetFullPathNameA: requested System32 self exe path" ));
+    uint32_t n = (uint32_t)snprintf( lp_buffer, n_buffer_length, "%s\\%s.exe", m->prefix, __progname );
+    TRACE_API( KERNEL32_GetFullPathNameA, n, lp_file_name, n_buffer_length, lp_buffer );
+    return n;
+  }
+  if( m ) {
+    LOG_DEBUG(( "KERNEL32_GetFullPathNameA: requested license.dat" ));
+    uint32_t n = (uint32_t)snprintf( lp_buffer, n_buffer_length, "%s", m->prefix );
+    TRACE_API( KERNEL32_GetFullPathNameA, n, lp_file_name, n_buffer_length, lp_buffer );
+    return n;
+  }
+
+  char   full[ PATH_MAX ];
+  size_t len = compat_fullpath( full, sizeof(full), lp_file_name );
+  if( !len ) {
+    LOG_WARN(( "KERNEL32_GetFullPathNameA(\"%s\") failed", lp_file_name ));
+    TRACE_API( KERNEL32_GetFullPathNameA, 0, lp_file_name, n_buffer_length, lp_buffer );
+    return 0;
+  }
+  size_t sz = len+1;
+  if( sz>n_buffer_length ) {
+    LOG_WARN(( "KERNEL32_GetFullPathNameA(\"%s\", %u, %p, %p) failed: insufficient buffer",
+               lp_file_name, n_buffer_length, lp_buffer, lp_file_part ));
+    g_last_error = ERROR_INSUFFICIENT_BUFFER;
+    TRACE_API( KERNEL32_GetFullPathNameA, sz, lp_file_name, n_buffer_length, lp_buffer );
+    return sz;
+  }
+  memcpy( lp_buffer, full, sz );
+  /* Relative paths hand out the working directory */
+  if( !compat_check_winpath_absolute( lp_file_name ) ) compat_nondet_note( COMPAT_NONDET_CWD, g_cwd, g_cwd_len );
+
+  /* Fill in base name */
+  char const * dbg_file_part = "";
+  if( lp_file_part ) {
+    char * last = strrchr( lp_buffer, '\\' );
+    if( !last ) last = lp_buffer;
+    dbg_file_part = *lp_file_part = last+1;
+  }
+
+  LOG_TRACE(( "KERNEL32_GetFullPathNameA(\"%s\", %u, %p, %p) => (\"%s\", \"%s\")",
+              lp_file_name, n_buffer_length, lp_buffer, lp_file_part, lp_buffer, dbg_file_part ));
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_GetFullPathNameA, sz-1, lp_file_name, n_buffer_length, lp_buffer );
+  return sz-1;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_SetFilePointer( uint32_t  h_file,
+                         int32_t   l_distance_to_move,
+                         int32_t * lp_distance_to_move_high,
+                         uint32_t  dw_move_method ) {
+  STATS_API( KERNEL32_SetFilePointer );
+  int whence;
+  switch( dw_move_method ) {
+  case FILE_BEGIN:   whence = SEEK_SET; break;
+  case FILE_CURRENT: whence = SEEK_CUR; break;
+  case FILE_END:     whence = SEEK_END; break;
+  default:
+    LOG_ERR(( "KERNEL32_SetFilePointer: invalid move_method (%d)", dw_move_method ));
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_SetFilePointer, INVALID_SET_FILE_POINTER, h_file, l_distance_to_move, dw_move_method );
+    return INVALID_SET_FILE_POINTER;
+  }
+
+  /* Check handle type */
+  compat_handle_t * hdl = compat_handle_get( h_file );
+  if( !hdl || hdl->close!=compat_handle_file_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_SetFilePointer, 0, h_file, l_distance_to_move, dw_move_method );
+    return 0;
+  }
+
+  struct compat_file * f = (struct compat_file *)hdl->data;
+
+  /* Without a high part the distance is a signed 32-bit value */
+  int64_t seek = l_distance_to_move;
+  if( lp_distance_to_move_high )
+    seek = (int64_t)( ((uint64_t)(uint32_t)*lp_distance_to_move_high<<32) | (uint32_t)l_distance_to_move );
+
+  LOG_TRACE(( "KERNEL32_SetFilePointer(%u, %d, %p) (whence=%d, seek=%lld)",
+              h_file,
+              l_distance_to_move, lp_distance_to_move_high,
+              dw_move_method, seek ));
+
+  seek = compat_file_seek( f, seek, whence );
+  if( seek<0 ) {
+    LOG_WARN(( "KERNEL32_SetFilePointer(%u): seek failed: %s", h_file, strerror( errno ) ));
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_SetFilePointer, INVALID_SET_FILE_POINTER, h_file, l_distance_to_move, dw_move_method );
+    return INVALID_SET_FILE_POINTER;
+  }
+
+  if( lp_distance_to_move_high ) *lp_distance_to_move_high = (int32_t)( (uint64_t)seek>>32 );
+  TRACE_API( KERNEL32_SetFilePointer, seek, h_file, l_distance_to_move, dw_move_method );
+  return (uint32_t)seek;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_WriteFile( uint32_t     h_file,
+                    void const * lp_buffer,
+                    uint32_t     n_number_of_bytes_to_write,
+                    uint32_t *   lp_number_of_bytes_written,
+                    void *       lp_overlapped ) {
+  STATS_API( KERNEL32_WriteFile );
+  uint64_t tl_t0 = compat_tl_now();
+
+  LOG_TRACE(( "KERNEL32_WriteFile(%p, %p, %u, %p, %p)",
+              h_file, lp_buffer,
+              n_number_of_bytes_to_write, lp_number_of_bytes_written,
+              lp_overlapped ));
+
+  /* Check handle type */
+  compat_handle_t * hdl = compat_handle_get( h_file );
+  if( !hdl || hdl->close!=compat_handle_file_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_WriteFile, 0, h_file, n_number_of_bytes_to_write, 0 );
+    return 0;
+  }
+
+  /* Write to file */
+  struct compat_file * f = (struct compat_file *)hdl->data;
+  ssize_t res    = compat_file_write( f, lp_buffer, n_number_of_bytes_to_write );
+  size_t  nbytes = res<0 ? 0 : (size_t)res;
+  compat_nondet_scan( lp_buffer, nbytes );
+  if( f->stream ) compat_cache_on_stdio( f->fd, lp_buffer, nbytes );
+  compat_tl_io( h_file, 1, tl_t0, nbytes );
+  if( lp_number_of_bytes_written ) {
+    *lp_number_of_bytes_written = nbytes;
+  }
+
+  if( nbytes!=n_number_of_bytes_to_write ) {
+    LOG_WARN(( "KERNEL32_WriteFile(%u) failed: %s", h_file, strerror( errno ) ));
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_WriteFile, 0, h_file, n_number_of_bytes_to_write, nbytes );
+    return 0;
+  }
+
+  /* TODO check errno */
+
+  TRACE_API( KERNEL32_WriteFile, 1, h_file, n_number_of_bytes_to_write, nbytes );
+  return 1;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_ReadFile( uint32_t   h_file,
+                   void *     lp_buffer,
+                   uint32_t   n_number_of_bytes_to_read,
                    uint32_t * lp_number_of_bytes_read,
                    void *     lp_overlapped ) {
+  STATS_API( KERNEL32_ReadFile );
+  uint64_t tl_t0 = compat_tl_now();
   LOG_TRACE(( "KERNEL32_ReadFile(%u, %p, %u, %p, %p)",
               h_file, lp_buffer,
               n_number_of_bytes_to_read, lp_number_of_bytes_read, lp_overlapped ));
 
-  compat_handle_t * h = compat_handle_get( h_file );
-  compat_handle_t * hdl = compat_handle_get( h_file );
-  if( !hdl || hdl->close!=compat_handle_file_close ) {
-    g_last_error = ERROR_INVALID_HANDLE;
+  compat_handle_t * h = compat_handle_get( h_file );
+  compat_handle_t * hdl = compat_handle_get( h_file );
+  if( !hdl || hdl->close!=compat_handle_file_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_ReadFile, 0, h_file, n_number_of_bytes_to_read, 0 );
+    return 0;
+  }
+
+  struct compat_file * f = (struct compat_file *)hdl->data;
+  if( f->stream && f->fd==STDIN_FILENO ) compat_cache_disable( "reads stdin" );
+
+  ssize_t res = compat_file_read( f, lp_buffer, n_number_of_bytes_to_read );
+  size_t  n   = res<0 ? 0 : (size_t)res;
+  if( lp_number_of_bytes_read ) *lp_number_of_bytes_read = n;
+  compat_tl_io( h_file, 0, tl_t0, n );
+
+  if( res<0 ) {
+    LOG_WARN(( "KERNEL32_ReadFile(%u): read(%d) failed: %s", h_file, f->fd, strerror( errno ) ));
+    g_last_error = ERROR_READ_FAULT;
+    TRACE_API( KERNEL32_ReadFile, 0, h_file, n_number_of_bytes_to_read, 0 );
+    return 0;
+  }
+
+  TRACE_API( KERNEL32_ReadFile, 1, h_file, n_number_of_bytes_to_read, n );
+  return 1;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_CreateFileA( char const * lp_file_name,
+                      uint32_t     dw_desired_access,
+                      uint32_t     dw_share_mode,
+                      void *       lp_security_attributes,
+                      uint32_t     dw_creation_disposition,
+                      uint32_t     dw_flags_and_attributes,
+                      uint32_t     h_template_file ) {
+  STATS_API( KERNEL32_CreateFileA );
+  uint64_t tl_t0 = compat_tl_now();
+  char file_path[ PATH_MAX ];
+
+  uint32_t n = compat_winpath_to_posix( file_path, sizeof(file_path), lp_file_name );
+  if( n==0 ) {
+    LOG_TRACE(( "KERNEL32_CreateFileA: Cannot represent path \"%s\"", lp_file_name ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_CreateFileA, INVALID_HANDLE_VALUE, lp_file_name, dw_desired_access, dw_creation_disposition );
+    return INVALID_HANDLE_VALUE;
+  }
+  if( n>sizeof(file_path) ) {
+    LOG_TRACE(( "KERNEL32_CreateFileA: Oversize unix path (%lu bytes)", n ));
+    g_last_error = ERROR_INSUFFICIENT_BUFFER;
+    TRACE_API( KERNEL32_CreateFileA, INVALID_HANDLE_VALUE, lp_file_name, dw_desired_access, dw_creation_disposition );
+    return INVALID_HANDLE_VALUE;
+  }
+
+  int fd;
+  char * tmp = NULL;
+  int    publish = 0;
+  struct stat64 st;
+  struct compat_fcache_ent * ent = NULL;
+  int absent = dw_desired_access==0x80000000 && compat_stat_peek( file_path )==COMPAT_STAT_ABSENT;
+  int shared = !absent && compat_file_share( file_path );
+  if( !absent && g_fcache.cap && stat64( file_path, &st )==0 && S_ISREG( st.st_mode ) ) {
+    if( dw_desired_access==0x80000000 ) {
+      if( !shared ) ent = compat_fcache_lookup( &st );
+    } else {
+      /* Truncating in place keeps the inode, drop it up front */
+      struct compat_fcache_ent * old = compat_fcache_lookup( &st );
+      if( old ) {
+        g_fcache.hits--;
+        compat_fcache_unlink( old );
+        compat_fcache_put( old );
+      }
+    }
+  }
+  switch( dw_desired_access ) {
+  case 0x80000000:
+    if( ent ) { fd = -1; break; }
+    if( absent ) { fd = -1; errno = ENOENT; break; }
+    /* O_NOATIME is only permitted on files we own */
+    fd = open( file_path, O_RDONLY|O_CLOEXEC|O_NOATIME );
+    if( fd<0 && errno==EPERM ) fd = open( file_path, O_RDONLY|O_CLOEXEC );
+    if( fd<0 && ( errno==ENOENT || errno==ENOTDIR ) ) {
+      int err = errno;
+      compat_stat_note( file_path, COMPAT_STAT_ABSENT );
+      errno = err;
+    }
+    if( fd>=0 && g_fcache.cap && !shared && ( ent = compat_fcache_fill( fd, file_path ) ) ) {
+      close( fd );
+      fd = -1;
+    }
+    break;
+  case 0x40000000:
+  case 0xc0000000: {
+    int acc = dw_desired_access==0x40000000 ? O_WRONLY : O_RDWR;
+    /* Devices, pipes and symlinks are written in place */
+    publish = g_publish && ( lstat64( file_path, &st )<0 ? errno==ENOENT : S_ISREG( st.st_mode ) );
+    if( publish ) fd = compat_file_open_tmp( file_path, &tmp );
+    else            fd = open( file_path, acc|O_CREAT|O_TRUNC|O_CLOEXEC, 0666 );
+    compat_stat_forget( file_path );
+    break;
+  }
+  default:
+    LOG_ERR(( "Unsupported CreateFileA dw_desired_access mode 0x%08x", dw_desired_access ));
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_CreateFileA, INVALID_HANDLE_VALUE, lp_file_name, dw_desired_access, dw_creation_disposition );
+    return INVALID_HANDLE_VALUE;
+
+  }
+
+  if( dw_desired_access==0x80000000 ) compat_cache_on_read( file_path, fd>=0 || ent );
+  else                                 compat_cache_on_write( file_path );
+
+  struct compat_file * file = NULL;
+  if( ent ) {
+    file = compat_file_new_cached( ent );
+    if( !file ) {
+      compat_fcache_put( ent );
+      errno = ENOMEM;
+    }
+  } else if( fd>=0 ) {
+    file = compat_file_new( fd, 0 );
+    if( file && !publish ) file->shared = shared;
+    if( file && publish ) {
+      /* Coalesce the whole output into few large writes */
+      compat_file_reserve( file, COMPAT_FILE_BUF_MAX );
+      file->publish = strdup( file_path );
+      file->tmp     = tmp;
+      if( !file->publish ) {
+        free( file->buf );
+        free( file );
+        file = NULL;
+      }
+    }
+    if( !file ) {
+      close( fd );
+      if( tmp ) unlink( tmp );
+      free( tmp );
+      errno = ENOMEM;
+    }
+  }
+  if( !file ) {
+    LOG_WARN(( "KERNEL32_CreateFileA: open(\"%s\") failed: %s", file_path, strerror( errno ) ));
+    switch( errno ) {
+    case EACCES:  g_last_error = ERROR_ACCESS_DENIED;  break;
+    case EEXIST:  g_last_error = ERROR_ALREADY_EXISTS; break;
+    case ENOENT:  g_last_error = ERROR_FILE_NOT_FOUND; break;
+    case ENOTDIR: g_last_error = ERROR_PATH_NOT_FOUND; break;
+    case EROFS:   g_last_error = ERROR_WRITE_FAULT;    break;
+    case ENOMEM:  g_last_error = ERROR_NOT_ENOUGH_MEMORY; break;
+    default:
+      LOG_WARN(( "don't have a Win32 error code for %s", strerror( errno ) ));
+      g_last_error = ERROR_NOT_SUPPORTED;
+      break;
+    }
+    compat_tl_fail( "file", lp_file_name, tl_t0, g_last_error );
+    TRACE_API( KERNEL32_CreateFileA, INVALID_HANDLE_VALUE, lp_file_name, dw_desired_access, dw_creation_disposition );
+    return INVALID_HANDLE_VALUE;
+  }
+
+  if( fd>=0 && dw_desired_access==0x80000000 ) posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+  uint32_t h = compat_handle_alloc( file, compat_handle_file_close );
+  compat_tl_open( h, COMPAT_TL_FILE, lp_file_name, tl_t0, 0 );
+  TRACE_API( KERNEL32_CreateFileA, h, lp_file_name, dw_desired_access, dw_creation_disposition );
+  LOG_DEBUG(( "KERNEL32_CreateFileA(\"%s\", %#x, %#x, %p, %u, %u, %u) = %u (fd = %d)",
+              lp_file_name,
+              dw_desired_access, dw_share_mode,
+              lp_security_attributes,
+              dw_creation_disposition,
+              dw_flags_and_attributes,
+              h_template_file,
+              h,
+              fd ));
+  return h;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetTickCount( void ) {
+  STATS_API( KERNEL32_GetTickCount );
+  LOG_TRACE(( "KERNEL32_GetTickCount()" ));
+  struct timespec tv;
+  if( g_time_pinned ) {
+    g_time_ticks++;
+    TRACE_API( KERNEL32_GetTickCount, g_time_ticks, 0, 0, 0 );
+    return g_time_ticks;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &tv );
+  uint32_t ticks = (tv.tv_sec*1000) + (tv.tv_nsec/1000000);
+  compat_nondet_note( COMPAT_NONDET_TICK, &ticks, sizeof(ticks) );
+  TRACE_API( KERNEL32_GetTickCount, ticks, 0, 0, 0 );
+  return ticks;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_DeleteFileA( char const * lp_file_name ) {
+  STATS_API( KERNEL32_DeleteFileA );
+  char file_path[ PATH_MAX ];
+
+  uint32_t n = compat_winpath_to_posix( file_path, sizeof(file_path), lp_file_name );
+  if( n==0 ) {
+    LOG_TRACE(( "KERNEL32_DeleteFileA: Cannot represent path \"%s\"", lp_file_name ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_DeleteFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+  if( n>sizeof(file_path) ) {
+    LOG_TRACE(( "KERNEL32_DeleteFileA: Oversize unix path (%lu bytes)", n ));
+    g_last_error = ERROR_INSUFFICIENT_BUFFER;
+    TRACE_API( KERNEL32_DeleteFileA, INVALID_HANDLE_VALUE, lp_file_name, 0, 0 );
+    return INVALID_HANDLE_VALUE;
+  }
+
+
+  LOG_DEBUG(( "KERNEL32_DeleteFileA: unlink(\"%s\")", file_path ));
+  /* An output that was never published only needs to be dropped */
+  uint32_t dropped = compat_file_discard( file_path );
+  compat_stat_forget( file_path );
+  if( unlink( file_path )!=0 && !( dropped && errno==ENOENT ) ) {
+    LOG_WARN(( "KERNEL32_DeleteFileA: unlink(\"%s\") failed: %s", file_path, strerror( errno ) ));
+    g_last_error = ERROR_ACCESS_DENIED; /* TODO errno */
+    TRACE_API( KERNEL32_DeleteFileA, 0, lp_file_name, 0, 0 );
+    return 0;
+  }
+
+  TRACE_API( KERNEL32_DeleteFileA, 1, lp_file_name, 0, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_MoveFileA( char const * lp_existing_file_name,
+                    char const * lp_new_file_name ) {
+  STATS_API( KERNEL32_MoveFileA );
+  LOG_WARN(( "[WARN] KERNEL32_MoveFileA(%p, %p)", lp_existing_file_name, lp_new_file_name ));
+  TRACE_API( KERNEL32_MoveFileA, 0, lp_existing_file_name, lp_new_file_name, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_FormatMessageA( uint32_t  dw_flags,
+                         void *    lp_source,
+                         uint32_t  dw_message_id,
+                         uint32_t  dw_language_id,
+                         char *    lp_buffer,
+                         uint32_t  n_size,
+                         void *    arguments ) {
+  STATS_API( KERNEL32_FormatMessageA );
+  if( dw_flags==0x00001000 ) {
+    LOG_DEBUG(( "KERNEL32_FormatMessageA(0x%08x, %p, %u, %u, %p, %u, %p)",
+                dw_flags, lp_source, dw_message_id, dw_language_id, lp_buffer, n_size, arguments ));
+    if( dw_message_id==0x0000000a ) {
+      if( n_size<strlen("The operation completed successfully.")+1 ) {
+        g_last_error = ERROR_INSUFFICIENT_BUFFER;
+        TRACE_API( KERNEL32_FormatMessageA, 0, dw_flags, dw_message_id, n_size );
+        return 0;
+      }
+      strcpy( lp_buffer, "The operation completed successfully." );
+      TRACE_API( KERNEL32_FormatMessageA, strlen(lp_buffer)+1, dw_flags, dw_message_id, n_size );
+      return strlen(lp_buffer)+1;
+    }
+    LOG_WARN(( "KERNEL32_FormatMessageA: Unknown dw_message_id 0x%08x", dw_message_id ));
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_FormatMessageA, 0, dw_flags, dw_message_id, n_size );
+    return 0;
+  }
+  LOG_WARN(( "[WARN] KERNEL32_FormatMessageA(%#x, %p, %u, %u, %p, %u, %p)",
+          dw_flags,
+          lp_source,
+          dw_message_id,
+          dw_language_id,
+          lp_buffer,
+          n_size,
+          arguments ));
+  TRACE_API( KERNEL32_FormatMessageA, 0, dw_flags, dw_message_id, n_size );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_GetFileTime( uint32_t   h_file,
+                      FILETIME * lp_creation_time,
+                      FILETIME * lp_last_access_time,
+                      FILETIME * lp_last_write_time ) {
+  STATS_API( KERNEL32_GetFileTime );
+  LOG_WARN(( "[TODO] KERNEL32_GetFileTime(%u, %p, %p, %p)",
+          h_file,
+          lp_creation_time,
+          lp_last_access_time,
+          lp_last_write_time ));
+  compat_nondet_note( COMPAT_NONDET_FILETIME, NULL, 0 );
+  TRACE_API( KERNEL32_GetFileTime, 0, h_file, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_SetFileTime( uint32_t h_file,
+                      void *   lp_creation_time,
+                      void *   lp_last_access_time,
+                      void *   lp_last_write_time ) {
+  STATS_API( KERNEL32_SetFileTime );
+  LOG_WARN(( "[WARN] KERNEL32_SetFileTime(%u, %p, %p, %p)",
+          h_file,
+          lp_creation_time,
+          lp_last_access_time,
+          lp_last_write_time ));
+  TRACE_API( KERNEL32_SetFileTime, 0, h_file, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetFileSize( uint32_t h_file,
+                      uint32_t * lp_file_size_high ) {
+  STATS_API( KERNEL32_GetFileSize );
+
+  /* Check handle type */
+  compat_handle_t * hdl = compat_handle_get( h_file );
+  if( !hdl || hdl->close!=compat_handle_file_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_GetFileSize, 0, h_file, 0, 0 );
+    return 0;
+  }
+
+  int64_t end = compat_file_size( (struct compat_file *)hdl->data );
+  if( end<0 ) {
+    LOG_WARN(( "KERNEL32_GetFileSize(%u): fstat failed: %s", h_file, strerror( errno ) ));
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_GetFileSize, INVALID_FILE_SIZE, h_file, 0, 0 );
+    return INVALID_FILE_SIZE;
+  }
+
+  LOG_DEBUG(( "KERNEL32_GetFileSize(%u) = %lld", h_file, end ));
+
+  if( lp_file_size_high ) *lp_file_size_high = (uint32_t)( (uint64_t)end>>32 );
+  TRACE_API( KERNEL32_GetFileSize, end, h_file, 0, 0 );
+  return (uint32_t)end;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_SetEndOfFile( uint32_t h_file ) {
+  STATS_API( KERNEL32_SetEndOfFile );
+  LOG_TRACE(( "KERNEL32_SetEndOfFile(%u)", h_file ));
+
+  compat_handle_t * hdl = compat_handle_get( h_file );
+  if( !hdl || hdl->close!=compat_handle_file_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_SetEndOfFile, 0, h_file, 0, 0 );
+    return 0;
+  }
+
+  struct compat_file * f = (struct compat_file *)hdl->data;
+  if( f->stream || !compat_file_flush( f ) || ftruncate64( f->fd, (off64_t)f->off )<0 ) {
+    LOG_WARN(( "KERNEL32_SetEndOfFile(%u) failed: %s", h_file, strerror( errno ) ));
+    g_last_error = ERROR_ACCESS_DENIED;
+    TRACE_API( KERNEL32_SetEndOfFile, 0, h_file, f->off, 0 );
+    return 0;
+  }
+  f->size    = f->off;
+  f->buf_len = 0;
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_SetEndOfFile, 1, h_file, f->off, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_CreateDirectoryA( char const * lp_path_name,
+                           void *       lp_security_attributes ) {
+  STATS_API( KERNEL32_CreateDirectoryA );
+  LOG_WARN(( "[WARN] KERNEL32_CreateDirectoryA(%p, %p)", lp_path_name, lp_security_attributes ));
+  TRACE_API( KERNEL32_CreateDirectoryA, 0, lp_path_name, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_RemoveDirectoryA( char const * lp_path_name ) {
+  STATS_API( KERNEL32_RemoveDirectoryA );
+  LOG_WARN(( "[WARN] KERNEL32_RemoveDirectoryA(%p)", lp_path_name ));
+  TRACE_API( KERNEL32_RemoveDirectoryA, 0, lp_path_name, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_SetStdHandle( uint32_t n_std_handle,
+                       uint32_t h_handle ) {
+  STATS_API( KERNEL32_SetStdHandle );
+  LOG_WARN(( "[WARN] KERNEL32_SetStdHandle(%u, %u)", n_std_handle, h_handle ));
+  TRACE_API( KERNEL32_SetStdHandle, 0, n_std_handle, h_handle, 0 );
+  return 0;
+
+}
+
+WIN32_STDCALL
+void
+KERNEL32_GetSystemTime( SYSTEMTIME * lp_system_time ) {
+  STATS_API( KERNEL32_GetSystemTime );
+  struct timespec ts;
+  compat_time_now( &ts );
+  compat_systime_from_unix( ts.tv_sec, (uint32_t)(ts.tv_nsec/1000000), lp_system_time );
+  LOG_TRACE(( "KERNEL32_GetSystemTime(%p)", lp_system_time ));
+  if( !g_time_pinned ) compat_nondet_note_time( COMPAT_NONDET_SYSTIME, lp_system_time );
+  TRACE_API( KERNEL32_GetSystemTime, 0, lp_system_time, ts.tv_sec, 0 );
+}
+
+WIN32_STDCALL
+int
+KERNEL32_SystemTimeToFileTime( SYSTEMTIME const * lp_system_time,
+                               FILETIME *         lp_file_time ) {
+  STATS_API( KERNEL32_SystemTimeToFileTime );
+  SYSTEMTIME const * st = lp_system_time;
+  LOG_TRACE(( "KERNEL32_SystemTimeToFileTime(%p, %p)", lp_system_time, lp_file_time ));
+  if( st->wYear<1601 || st->wYear>30827 ||
+      st->wMonth<1 || st->wMonth>12 ||
+      st->wDay<1 || st->wDay>compat_days_in_month( st->wYear, st->wMonth ) ||
+      st->wHour>23 || st->wMinute>59 || st->wSecond>59 || st->wMilliseconds>999 ) {
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_SystemTimeToFileTime, 0, lp_system_time, lp_file_time, 0 );
+    return 0;
+  }
+  int64_t days = compat_days_from_civil( st->wYear, st->wMonth, st->wDay );
+  int64_t sec  = days*86400 + st->wHour*3600 + st->wMinute*60 + st->wSecond;
+  uint64_t ft  = (uint64_t)(sec+COMPAT_FILETIME_UNIX_EPOCH)*10000000ULL
+               + (uint64_t)st->wMilliseconds*10000ULL;
+  compat_filetime_set( lp_file_time, ft );
+  TRACE_API( KERNEL32_SystemTimeToFileTime, 1, lp_system_time, lp_file_time, 0 );
+  return 1;
+}
+
+WIN32_STDCALL
+int32_t
+KERNEL32_CompareFileTime( void * lp_file_time_1,
+                          void * lp_file_time_2 ) {
+  STATS_API( KERNEL32_CompareFileTime );
+  LOG_WARN(( "[WARN] KERNEL32_CompareFileTime(%p, %p)", lp_file_time_1, lp_file_time_2 ));
+  TRACE_API( KERNEL32_CompareFileTime, 0, lp_file_time_1, lp_file_time_2, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+int32_t *
+KERNEL32_GlobalReAlloc( int32_t * h_mem,
+                        uint32_t  u_bytes,
+                        uint32_t  u_flags ) {
+  STATS_API( KERNEL32_GlobalReAlloc );
+  LOG_TRACE(( "KERNEL32_GlobalReAlloc(%p, %u, %#x)", h_mem, u_bytes, u_flags ));
+  if( u_bytes==0 )
+    u_bytes=1;
+
+  /* libc realloc always moves */
+  if( u_flags & 0x02 == 0 ) {
+    g_last_error = ERROR_OUTOFMEMORY;
+    TRACE_API( KERNEL32_GlobalReAlloc, 0, h_mem, u_bytes, u_flags );
+    return NULL;
+  }
+
+  /* Remember occupied byte range if we're instructed to zero */
+  int zero = (u_flags&0x40)!=0;
+  size_t sz_old;
+  if (zero)
+    sz_old = compat_heap_usable( h_mem );
+
+  void * obj = compat_heap_realloc( h_mem, u_bytes );
+
+  if( obj==NULL ) {
+    g_last_error = ERROR_OUTOFMEMORY;
+    TRACE_API( KERNEL32_GlobalReAlloc, 0, h_mem, u_bytes, u_flags );
+    return NULL;
+  }
+
+  /* Zero new bytes */
+  g_last_error = ERROR_SUCCESS;
+  if( (u_flags&0x40)!=0 ) {
+    size_t sz_new = compat_heap_usable( obj );
+    if( sz_new>sz_old ) {
+      memset((char*)obj + sz_old, 0, sz_new - sz_old);
+    }
+  }
+
+  TRACE_API( KERNEL32_GlobalReAlloc, obj, h_mem, u_bytes, u_flags );
+  return obj;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GlobalFlags( int32_t * h_mem ) {
+  STATS_API( KERNEL32_GlobalFlags );
+  LOG_TRACE(( "KERNEL32_GlobalFlags(%p)", h_mem ));
+  TRACE_API( KERNEL32_GlobalFlags, 0, h_mem, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_FileTimeToSystemTime( FILETIME const * lp_file_time,
+                               SYSTEMTIME *     lp_system_time ) {
+  STATS_API( KERNEL32_FileTimeToSystemTime );
+  LOG_TRACE(( "KERNEL32_FileTimeToSystemTime(%p, %p)", lp_file_time, lp_system_time ));
+  uint64_t ft = compat_filetime_u64( lp_file_time );
+  if( ft>=0x8000000000000000ULL ) {
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_FileTimeToSystemTime, 0, lp_file_time, lp_system_time, 0 );
     return 0;
   }
+  int64_t  sec = (int64_t)(ft/10000000ULL) - COMPAT_FILETIME_UNIX_EPOCH;
+  uint32_t ms  = (uint32_t)((ft%10000000ULL)/10000ULL);
+  compat_systime_from_unix( sec, ms, lp_system_time );
+  TRACE_API( KERNEL32_FileTimeToSystemTime, 1, lp_file_time, lp_system_time, 0 );
+  return 1;
+}
 
-  FILE * f = (FILE *)hdl->data;
-  size_t n = fread( lp_buffer, 1, n_number_of_bytes_to_read, f );
-  if( lp_number_of_bytes_read ) *lp_number_of_bytes_read = n;
+WIN32_STDCALL
+uint32_t
+KERNEL32_FindResourceA( uint32_t     h_module,
+                        char const * lp_name,
+                        char const * lp_type ) {
+  STATS_API( KERNEL32_FindResourceA );
+  LOG_WARN(( "[WARN] KERNEL32_FindResourceA(%u, %p, %p)", h_module, lp_name, lp_type ));
+  TRACE_API( KERNEL32_FindResourceA, 0, h_module, lp_name, lp_type );
+  return 0;
+}
+
+WIN32_STDCALL
+int32_t *
+KERNEL32_LoadResource( uint32_t h_module,
+                       uint32_t h_resource ) {
+  STATS_API( KERNEL32_LoadResource );
+  LOG_WARN(( "[WARN] KERNEL32_LoadResource(%u, %u)", h_module, h_resource ));
+  TRACE_API( KERNEL32_LoadResource, 0, h_module, h_resource, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+void *
+KERNEL32_LockResource( int32_t * h_resource ) {
+  STATS_API( KERNEL32_LockResource );
+  LOG_WARN(( "[WARN] KERNEL32_LockResource(%p)", h_resource ));
+  TRACE_API( KERNEL32_LockResource, 0, h_resource, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_SizeofResource( uint32_t h_module,
+                         uint32_t h_resource ) {
+  STATS_API( KERNEL32_SizeofResource );
+  LOG_WARN(( "[WARN] KERNEL32_SizeofResource(%u, %u)", h_module, h_resource ));
+  TRACE_API( KERNEL32_SizeofResource, 0, h_module, h_resource, 0 );
+  return 0;
+
+}
+
+/* File mappings
+
+   A mapping handle holds an fd: a dup of the file's fd, or a memfd for
+   mappings backed by the page file.  Views are mmaps of that fd, so they
+   outlive the mapping handle as on Windows.  Named mappings are only
+   visible within this process. */
+
+struct compat_mapping {
+  int                     fd;
+  uint32_t                ref;       /* handles, see OpenFileMappingA */
+  uint32_t                protect;   /* PAGE_* */
+  uint64_t                size;
+  char *                  name;
+  struct compat_mapping * next;      /* named mappings */
+};
+
+static struct compat_mapping * g_mappings;
+
+/* Views, to find their length in UnmapViewOfFile */
+struct compat_view {
+  void * addr;
+  size_t len;
+};
+
+static struct compat_view * g_views;
+static uint32_t             g_view_cnt;
+static uint32_t             g_view_cap;
+
+static uint32_t
+compat_handle_mapping_close( void * data ) {
+  struct compat_mapping * m = data;
+  if( --m->ref ) return 1;
+  for( struct compat_mapping ** p=&g_mappings; *p; p=&(*p)->next ) {
+    if( *p==m ) { *p = m->next; break; }
+  }
+  close( m->fd );
+  free( m->name );
+  free( m );
+  return 1;
+}
+
+static struct compat_mapping *
+compat_mapping_find( char const * name ) {
+  for( struct compat_mapping * m=g_mappings; m; m=m->next )
+    if( 0==strcmp( m->name, name ) ) return m;
+  return NULL;
+}
+
+/* compat_mapping_reset: Unmaps all views, e.g. between batch runs. */
+static void
+compat_mapping_reset( void ) {
+  for( uint32_t i=0; i<g_view_cnt; i++ ) munmap( g_views[i].addr, g_views[i].len );
+  g_view_cnt = 0;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_CreateFileMappingA( uint32_t     h_file,
+                             void *       lp_file_mapping_attributes,
+                             uint32_t     fl_protect,
+                             uint32_t     dw_maximum_size_high,
+                             uint32_t     dw_maximum_size_low,
+                             char const * lp_name ) {
+  STATS_API( KERNEL32_CreateFileMappingA );
+  LOG_DEBUG(( "KERNEL32_CreateFileMappingA(%u, %p, %#x, %u, %u, \"%s\")",
+              h_file,
+              lp_file_mapping_attributes,
+              fl_protect,
+              dw_maximum_size_high,
+              dw_maximum_size_low,
+              lp_name ? lp_name : "" ));
+
+  if( lp_name ) {
+    struct compat_mapping * m = compat_mapping_find( lp_name );
+    if( m ) {
+      m->ref++;
+      uint32_t h = compat_handle_alloc( m, compat_handle_mapping_close );
+      g_last_error = ERROR_ALREADY_EXISTS;
+      TRACE_API( KERNEL32_CreateFileMappingA, h, h_file, fl_protect, dw_maximum_size_low );
+      return h;
+    }
+  }
+
+  uint32_t protect = fl_protect&0xff;
+  int      write   = protect==PAGE_READWRITE || protect==PAGE_EXECUTE_READWRITE;
+  if( !write && protect!=PAGE_READONLY && protect!=PAGE_WRITECOPY &&
+      protect!=PAGE_EXECUTE_READ && protect!=PAGE_EXECUTE_WRITECOPY ) {
+    LOG_WARN(( "KERNEL32_CreateFileMappingA: unsupported protection %#x", fl_protect ));
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+    return 0;
+  }
+  uint64_t size = ((uint64_t)dw_maximum_size_high<<32) | dw_maximum_size_low;
+
+  int fd;
+  if( h_file==(uint32_t)INVALID_HANDLE_VALUE ) {
+    /* Backed by the page file */
+    if( !size ) {
+      g_last_error = ERROR_INVALID_PARAMETER;
+      TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+      return 0;
+    }
+    fd = memfd_create( lp_name ? lp_name : "compat-mapping", MFD_CLOEXEC );
+    if( fd>=0 && ftruncate64( fd, (off64_t)size )<0 ) {
+      close( fd );
+      fd = -1;
+    }
+    if( fd<0 ) {
+      LOG_WARN(( "KERNEL32_CreateFileMappingA: memfd failed: %s", strerror( errno ) ));
+      g_last_error = ERROR_NOT_ENOUGH_MEMORY;
+      TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+      return 0;
+    }
+  } else {
+    compat_handle_t * hdl = compat_handle_get( h_file );
+    if( !hdl || hdl->close!=compat_handle_file_close ) {
+      g_last_error = ERROR_INVALID_HANDLE;
+      TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+      return 0;
+    }
+    struct compat_file * f = (struct compat_file *)hdl->data;
+    if( f->stream || ( f->ent && write ) || !compat_file_flush( f ) ) {
+      g_last_error = ERROR_ACCESS_DENIED;
+      TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+      return 0;
+    }
+    /* Views may change the file under the read-ahead */
+    f->buf_len = 0;
+    /* Other handles may have changed the size */
+    int64_t cur = compat_file_size( f );
+    if( cur>=0 ) f->size = (uint64_t)cur;
+    if( !size ) size = f->size;
+    if( !size ) {
+      g_last_error = ERROR_FILE_INVALID;
+      TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+      return 0;
+    }
+    if( size>f->size ) {
+      /* Windows grows the file to the mapping size */
+      if( !write || ftruncate64( f->fd, (off64_t)size )<0 ) {
+        g_last_error = write ? ERROR_DISK_FULL : ERROR_NOT_ENOUGH_MEMORY;
+        TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+        return 0;
+      }
+      f->size = size;
+    }
+    fd = f->ent ? compat_fcache_open( f->ent ) : fcntl( f->fd, F_DUPFD_CLOEXEC, 0 );
+    if( fd<0 ) {
+      g_last_error = errno==ESTALE ? ERROR_FILE_INVALID : ERROR_TOO_MANY_OPEN_FILES;
+      TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+      return 0;
+    }
+  }
+
+  struct compat_mapping * m = calloc( 1, sizeof(struct compat_mapping) );
+  if( !m ) {
+    close( fd );
+    g_last_error = ERROR_NOT_ENOUGH_MEMORY;
+    TRACE_API( KERNEL32_CreateFileMappingA, 0, h_file, fl_protect, dw_maximum_size_low );
+    return 0;
+  }
+  m->fd      = fd;
+  m->ref     = 1;
+  m->protect = protect;
+  m->size    = size;
+  if( lp_name ) {
+    m->name    = strdup( lp_name );
+    m->next    = g_mappings;
+    g_mappings = m;
+  }
 
-  if( n!=n_number_of_bytes_to_read ) {
-    LOG_WARN(( "KERNEL32_ReadFile(%u): fread(f=%p) failed: %s", h_file, f, strerror( errno ) ));
+  uint32_t h = compat_handle_alloc( m, compat_handle_mapping_close );
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_CreateFileMappingA, h, h_file, fl_protect, dw_maximum_size_low );
+  return h;
+}
+
+WIN32_STDCALL
+int32_t *
+KERNEL32_MapViewOfFile( uint32_t h_file_mapping_object,
+                        uint32_t dw_desired_access,
+                        uint32_t dw_file_offset_high,
+                        uint32_t dw_file_offset_low,
+                        uint32_t dw_number_of_bytes_to_map ) {
+  STATS_API( KERNEL32_MapViewOfFile );
+  LOG_DEBUG(( "KERNEL32_MapViewOfFile(%u, %#x, %u, %u, %u)",
+              h_file_mapping_object,
+              dw_desired_access,
+              dw_file_offset_high,
+              dw_file_offset_low,
+              dw_number_of_bytes_to_map ));
+
+  compat_handle_t * hdl = compat_handle_get( h_file_mapping_object );
+  if( !hdl || hdl->close!=compat_handle_mapping_close ) {
+    g_last_error = ERROR_INVALID_HANDLE;
+    TRACE_API( KERNEL32_MapViewOfFile, 0, h_file_mapping_object, dw_file_offset_low, dw_number_of_bytes_to_map );
+    return NULL;
+  }
+  struct compat_mapping * m = hdl->data;
+
+  uint64_t off = ((uint64_t)dw_file_offset_high<<32) | dw_file_offset_low;
+  uint64_t len = dw_number_of_bytes_to_map ? dw_number_of_bytes_to_map : m->size-off;
+  if( off>=m->size || len>m->size-off || len>SIZE_MAX || (off&0xffffU) ) {
+    g_last_error = ERROR_INVALID_PARAMETER;
+    TRACE_API( KERNEL32_MapViewOfFile, 0, h_file_mapping_object, dw_file_offset_low, dw_number_of_bytes_to_map );
+    return NULL;
+  }
+
+  /* FILE_MAP_COPY, or any view of a PAGE_WRITECOPY mapping, is private */
+  int prot  = PROT_READ;
+  int flags = MAP_SHARED;
+  int cow   = dw_desired_access==FILE_MAP_COPY ||
+              m->protect==PAGE_WRITECOPY || m->protect==PAGE_EXECUTE_WRITECOPY;
+  if( cow ) {
+    prot |= PROT_WRITE;
+    flags = MAP_PRIVATE;
+  } else if( dw_desired_access&FILE_MAP_WRITE ) {
+    if( m->protect!=PAGE_READWRITE && m->protect!=PAGE_EXECUTE_READWRITE ) {
+      g_last_error = ERROR_ACCESS_DENIED;
+      TRACE_API( KERNEL32_MapViewOfFile, 0, h_file_mapping_object, dw_file_offset_low, dw_number_of_bytes_to_map );
+      return NULL;
+    }
+    prot |= PROT_WRITE;
+  }
+  if( dw_desired_access&FILE_MAP_EXECUTE ) prot |= PROT_EXEC;
+
+  if( g_view_cnt==g_view_cap ) {
+    uint32_t cap = g_view_cap ? g_view_cap*2 : 16;
+    struct compat_view * views = realloc( g_views, cap*sizeof(struct compat_view) );
+    if( !views ) {
+      g_last_error = ERROR_NOT_ENOUGH_MEMORY;
+      TRACE_API( KERNEL32_MapViewOfFile, 0, h_file_mapping_object, dw_file_offset_low, dw_number_of_bytes_to_map );
+      return NULL;
+    }
+    g_views    = views;
+    g_view_cap = cap;
+  }
+
+  void * addr = mmap64( NULL, (size_t)len, prot, flags, m->fd, (off64_t)off );
+  if( addr==MAP_FAILED ) {
+    LOG_WARN(( "KERNEL32_MapViewOfFile: mmap failed: %s", strerror( errno ) ));
+    g_last_error = errno==EACCES ? ERROR_ACCESS_DENIED : ERROR_NOT_ENOUGH_MEMORY;
+    TRACE_API( KERNEL32_MapViewOfFile, 0, h_file_mapping_object, dw_file_offset_low, dw_number_of_bytes_to_map );
+    return NULL;
+  }
+  g_views[ g_view_cnt++ ] = (struct compat_view){ addr, (size_t)len };
+
+  g_last_error = ERROR_SUCCESS;
+  TRACE_API( KERNEL32_MapViewOfFile, addr, h_file_mapping_object, dw_file_offset_low, dw_number_of_bytes_to_map );
+  return addr;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_UnmapViewOfFile( int32_t * lp_base_address ) {
+  STATS_API( KERNEL32_UnmapViewOfFile );
+  LOG_DEBUG(( "KERNEL32_UnmapViewOfFile(%p)", lp_base_address ));
+  for( uint32_t i=0; i<g_view_cnt; i++ ) {
+    if( g_views[i].addr!=lp_base_address ) continue;
+    munmap( g_views[i].addr, g_views[i].len );
+    g_views[i] = g_views[ --g_view_cnt ];
+    g_last_error = ERROR_SUCCESS;
+    TRACE_API( KERNEL32_UnmapViewOfFile, 1, lp_base_address, 0, 0 );
+    return 1;
   }
+  g_last_error = ERROR_INVALID_ADDRESS;
+  TRACE_API( KERNEL32_UnmapViewOfFile, 0, lp_base_address, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetSystemDirectoryA( char * lp_buffer,
+                              uint32_t u_size ) {
+  STATS_API( KERNEL32_GetSystemDirectoryA );
+  LOG_DEBUG(( "KERNEL32_GetSystemDirectoryA(%p, %u)", lp_buffer, u_size ));
+  uint32_t n = (uint32_t)snprintf( lp_buffer, u_size, "C:\\Windows\\System32" );
+  TRACE_API( KERNEL32_GetSystemDirectoryA, n, lp_buffer, u_size, 0 );
+  return n;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetWindowsDirectoryA( char *   lp_buffer,
+                               uint32_t u_size ) {
+  STATS_API( KERNEL32_GetWindowsDirectoryA );
+  uint32_t n = (uint32_t)snprintf( lp_buffer, u_size, "C:\\Windows" );
+  TRACE_API( KERNEL32_GetWindowsDirectoryA, n, lp_buffer, u_size, 0 );
+  return n;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_SetConsoleCtrlHandler( void * lp_handler_routine,
+                                int    b_add ) {
+  STATS_API( KERNEL32_SetConsoleCtrlHandler );
+  LOG_WARN(( "[TODO] KERNEL32_SetConsoleCtrlHandler(%p, %u)", lp_handler_routine, b_add ));
+  TRACE_API( KERNEL32_SetConsoleCtrlHandler, 0, lp_handler_routine, b_add, 0 );
+  return 0;
+}
 
+WIN32_STDCALL
+int
+KERNEL32_GetConsoleScreenBufferInfo( uint32_t h_console_output,
+                                     void *   lp_console_screen_buffer_info ) {
+  STATS_API( KERNEL32_GetConsoleScreenBufferInfo );
+  LOG_DEBUG(( "KERNEL32_GetConsoleScreenBufferInfo(%u, %p)", h_console_output, lp_console_screen_buffer_info ));
+  
+  struct winsize w;
+  int res = ioctl( STDOUT_FILENO, TIOCGWINSZ, &w );
+  if( res<0 ) {
+    console_buf.dwSize.X = 80;
+    console_buf.dwSize.Y = 25;
+  } else {
+    console_buf.dwSize.X = w.ws_col;
+    console_buf.dwSize.Y = w.ws_row;
+  }
+  
+  memcpy( lp_console_screen_buffer_info, &console_buf, sizeof(CONSOLE_SCREEN_BUFFER_INFO) );
+  TRACE_API( KERNEL32_GetConsoleScreenBufferInfo, 1, h_console_output, lp_console_screen_buffer_info, 0 );
   return 1;
 }
 
+WIN32_STDCALL
+int
+KERNEL32_SetFileAttributesA( char const * lp_file_name,
+                             uint32_t     dw_file_attributes ) {
+  STATS_API( KERNEL32_SetFileAttributesA );
+  LOG_WARN(( "[WARN] KERNEL32_SetFileAttributesA(%p, %u)", lp_file_name, dw_file_attributes ));
+  TRACE_API( KERNEL32_SetFileAttributesA, 0, lp_file_name, dw_file_attributes, 0 );
+  return 0;
+}
+
 WIN32_STDCALL
 uint32_t
-KERNEL32_CreateFileA( char const * lp_file_name,
-                      uint32_t     dw_desired_access,
-                      uint32_t     dw_share_mode,
-                      void *       lp_security_attributes,
-                      uint32_t     dw_creation_disposition,
-                      uint32_t     dw_flags_and_attributes,
-                      uint32_t     h_template_file ) {
-  char file_path[ PATH_MAX ];
+KERNEL32_OpenFileMappingA( uint32_t     dw_desired_access,
+                           int          b_inherit_handle,
+                           char const * lp_name ) {
+  STATS_API( KERNEL32_OpenFileMappingA );
+  LOG_DEBUG(( "KERNEL32_OpenFileMappingA(%#x, %u, \"%s\")", dw_desired_access, b_inherit_handle, lp_name ));
+  struct compat_mapping * m = lp_name ? compat_mapping_find( lp_name ) : NULL;
+  if( !m ) {
+    g_last_error = ERROR_FILE_NOT_FOUND;
+    TRACE_API( KERNEL32_OpenFileMappingA, 0, dw_desired_access, lp_name, 0 );
+    return 0;
+  }
+  m->ref++;
+  g_last_error = ERROR_SUCCESS;
+  uint32_t h = compat_handle_alloc( m, compat_handle_mapping_close );
+  TRACE_API( KERNEL32_OpenFileMappingA, h, dw_desired_access, lp_name, 0 );
+  return h;
+}
+
+WIN32_STDCALL
+int32_t
+KERNEL32_MultiByteToWideChar( uint32_t     u_code_page,
+                              uint32_t     dw_flags,
+                              char const * lp_multi_byte_str,
+                              int          cch_multi_byte,
+                              void *       lp_wide_char_str,
+                              int          cch_wide_char ) {
+  STATS_API( KERNEL32_MultiByteToWideChar );
+  LOG_WARN(( "[WARN] KERNEL32_MultiByteToWideChar(%u, %u, %p, %u, %p, %u)",
+          u_code_page,
+          dw_flags,
+          lp_multi_byte_str,
+          cch_multi_byte,
+          lp_wide_char_str,
+          cch_wide_char ));
+  TRACE_API( KERNEL32_MultiByteToWideChar, 0, u_code_page, lp_multi_byte_str, cch_multi_byte );
+  return 0;
+}
+
+WIN32_STDCALL
+int
+KERNEL32_IsValidCodePage( uint32_t u_code_page ) {
+  STATS_API( KERNEL32_IsValidCodePage );
+  LOG_WARN(( "[WARN] KERNEL32_IsValidCodePage(%u)", u_code_page ));
+  TRACE_API( KERNEL32_IsValidCodePage, 0, u_code_page, 0, 0 );
+  return 0;
+}
+
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetACP( void ) {
+  STATS_API( KERNEL32_GetACP );
+  LOG_WARN(( "[WARN] KERNEL32_GetACP()" ));
+  TRACE_API( KERNEL32_GetACP, 0, 0, 0, 0 );
+  return 0;
+}
 
-  uint32_t n = compat_winpath_to_posix( file_path, sizeof(file_path), lp_file_name );
-  if( n==0 ) {
-    LOG_TRACE(( "KERNEL32_CreateFileA: Cannot represent path \"%s\"", lp_file_name ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_HANDLE_VALUE;
-  }
-  if( n>sizeof(file_path) ) {
-    LOG_TRACE(( "KERNEL32_CreateFileA: Oversize unix path (%lu bytes)", n ));
-    g_last_error = ERROR_INSUFFICIENT_BUFFER;
-    return INVALID_HANDLE_VALUE;
-  }
+WIN32_STDCALL
+void
+KERNEL32_GetLocalTime( SYSTEMTIME * lp_system_time ) {
+  STATS_API( KERNEL32_GetLocalTime );
+  struct timespec ts;
+  compat_time_now( &ts );
+  int64_t local = (int64_t)ts.tv_sec + compat_local_offset( ts.tv_sec, NULL );
+  compat_systime_from_unix( local, (uint32_t)(ts.tv_nsec/1000000), lp_system_time );
+  LOG_TRACE(( "KERNEL32_GetLocalTime(%p)", lp_system_time ));
+  if( !g_time_pinned ) compat_nondet_note_time( COMPAT_NONDET_LOCALTIME, lp_system_time );
+  TRACE_API( KERNEL32_GetLocalTime, 0, lp_system_time, local, 0 );
+}
 
-  FILE * file;
-  switch( dw_desired_access ) {
-  case 0x80000000: file = fopen( file_path, "rb"  ); break;
-  case 0x40000000: file = fopen( file_path, "wb"  ); break;
-  case 0xc0000000: file = fopen( file_path, "wb+" ); break;
-  default:
-    LOG_ERR(( "Unsupported CreateFileA dw_desired_access mode 0x%08x", dw_desired_access ));
-    g_last_error = ERROR_INVALID_PARAMETER;
-    return INVALID_HANDLE_VALUE;
+WIN32_STDCALL
+uint32_t
+KERNEL32_GetTimeZoneInformation( TIME_ZONE_INFORMATION * lp_time_zone_information ) {
+  STATS_API( KERNEL32_GetTimeZoneInformation );
+  TIME_ZONE_INFORMATION * tzi = lp_time_zone_information;
+  LOG_TRACE(( "KERNEL32_GetTimeZoneInformation(%p)", lp_time_zone_information ));
+  memset( tzi, 0, sizeof(*tzi) );
+
+  struct timespec ts;
+  compat_time_now( &ts );
+  struct tm now;
+  if( g_time_pinned || !localtime_r( &ts.tv_sec, &now ) ) {
+    compat_tz_name( tzi->StandardName, "UTC" );
+    compat_tz_name( tzi->DaylightName, "UTC" );
+    TRACE_API( KERNEL32_GetTimeZoneInformation, TIME_ZONE_ID_UNKNOWN, tzi, 0, 0 );
+    return TIME_ZONE_ID_UNKNOWN;
   }
 
-  if( !file ) {
-    LOG_WARN(( "KERNEL32_CreateFileA: fopen(\"%s\") failed: %s", file_path, strerror( errno ) ));
-    switch( errno ) {
-    case EACCES:  g_last_error = ERROR_ACCESS_DENIED;  break;
-    case EEXIST:  g_last_error = ERROR_ALREADY_EXISTS; break;
-    case ENOENT:  g_last_error = ERROR_FILE_NOT_FOUND; break;
-    case ENOTDIR: g_last_error = ERROR_PATH_NOT_FOUND; break;
-    case EROFS:   g_last_error = ERROR_WRITE_FAULT;    break;
-    default:
-      LOG_WARN(( "don't have a Win32 error code for %s", strerror( errno ) ));
-      g_last_error = ERROR_NOT_SUPPORTED;
-      break;
-    }
-    return INVALID_HANDLE_VALUE;
+  /* Find the standard and daylight rules of the current year */
+  SYSTEMTIME rule[2];
+  time_t year_start = ts.tv_sec - (time_t)now.tm_yday*86400;
+  time_t first  = compat_tz_transition( year_start, &rule[0] );
+  int has_dst   = first && compat_tz_transition( first, &rule[1] );
+
+  if( !has_dst ) {
+    tzi->Bias = (int32_t)(-now.tm_gmtoff/60);
+    compat_tz_name( tzi->StandardName, now.tm_zone );
+    compat_tz_name( tzi->DaylightName, now.tm_zone );
+    TRACE_API( KERNEL32_GetTimeZoneInformation, TIME_ZONE_ID_UNKNOWN, tzi, tzi->Bias, 0 );
+    return TIME_ZONE_ID_UNKNOWN;
   }
 
-  uint32_t h = compat_handle_alloc( file, compat_handle_file_close );
-  LOG_DEBUG(( "KERNEL32_CreateFileA(\"%s\", %#x, %#x, %p, %u, %u, %u) = %u (FILE = %p)",
-              lp_file_name,
-              dw_desired_access, dw_share_mode,
-              lp_security_attributes,
-              dw_creation_disposition,
-              dw_flags_and_attributes,
-              h_template_file,
-              h,
-              file ));
-  return h;
+  /* Offsets on either side of the first transition of the year */
+  int dst_a, dst_b;
+  long off_a = compat_local_offset( year_start, &dst_a );
+  struct tm tm_a, tm_b;
+  localtime_r( &year_start, &tm_a );
+  time_t mid = year_start + 183*86400;
+  long off_b = compat_local_offset( mid, &dst_b );
+  localtime_r( &mid, &tm_b );
+  long std_off = dst_a ? off_b : off_a;
+  long dst_off = dst_a ? off_a : off_b;
+
+  tzi->Bias         = (int32_t)(-std_off/60);
+  tzi->DaylightBias = (int32_t)(-(dst_off-std_off)/60);
+  compat_tz_name( tzi->StandardName, dst_a ? tm_b.tm_zone : tm_a.tm_zone );
+  compat_tz_name( tzi->DaylightName, dst_a ? tm_a.tm_zone : tm_b.tm_zone );
+  /* rule[0] is the first change of the year: into DST (north) or out of it (south) */
+  tzi->DaylightDate = dst_a ? rule[1] : rule[0];
+  tzi->StandardDate = dst_a ? rule[0] : rule[1];
+  uint32_t id = now.tm_isdst>0 ? TIME_ZONE_ID_DAYLIGHT : TIME_ZONE_ID_STANDARD;
+  TRACE_API( KERNEL32_GetTimeZoneInformation, id, tzi, tzi->Bias, tzi->DaylightBias );
+  return id;
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_GetTickCount( void ) {
-  LOG_TRACE(( "KERNEL32_GetTickCount()" ));
-  struct timespec tv;
-  clock_gettime( CLOCK_MONOTONIC, &tv );
-  return (tv.tv_sec*1000) + (tv.tv_nsec/1000000);
+int
+KERNEL32_FileTimeToLocalFileTime( FILETIME const * lp_file_time,
+                                  FILETIME *       lp_local_file_time ) {
+  STATS_API( KERNEL32_FileTimeToLocalFileTime );
+  LOG_TRACE(( "KERNEL32_FileTimeToLocalFileTime(%p, %p)", lp_file_time, lp_local_file_time ));
+  /* Like Windows, this applies the current bias, not the one in
+     effect at the given time */
+  struct timespec ts;
+  compat_time_now( &ts );
+  int64_t off = compat_local_offset( ts.tv_sec, NULL );
+  compat_filetime_set( lp_local_file_time,
+                       compat_filetime_u64( lp_file_time ) + (uint64_t)(off*10000000LL) );
+  TRACE_API( KERNEL32_FileTimeToLocalFileTime, 1, lp_file_time, lp_local_file_time, off );
+  return 1;
 }
 
 WIN32_STDCALL
 int
-KERNEL32_DeleteFileA( char const * lp_file_name ) {
-  char file_path[ PATH_MAX ];
+KERNEL32_IsDBCSLeadByte( uint8_t test_char ) {
+  STATS_API( KERNEL32_IsDBCSLeadByte );
+  LOG_WARN(( "[WARN] KERNEL32_IsDBCSLeadByte(%#x)", test_char ));
+  TRACE_API( KERNEL32_IsDBCSLeadByte, 0, test_char, 0, 0 );
+  return 0;
+}
 
-  uint32_t n = compat_winpath_to_posix( file_path, sizeof(file_path), lp_file_name );
-  if( n==0 ) {
-    LOG_TRACE(( "KERNEL32_DeleteFileA: Cannot represent path \"%s\"", lp_file_name ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_HANDLE_VALUE;
-  }
-  if( n>sizeof(file_path) ) {
-    LOG_TRACE(( "KERNEL32_DeleteFileA: Oversize unix path (%lu bytes)", n ));
-    g_last_error = ERROR_INSUFFICIENT_BUFFER;
-    return INVALID_HANDLE_VALUE;
-  }
+WIN32_CDECL
+int32_t
+LMGR8C_lp_checkout( int32_t v1,
+                    int32_t policy,
+                    char *  feature,
+                    char *  version,
+                    int     num_lic,
+                    char *  license_file_list ) {
+  STATS_API( LMGR8C_lp_checkout );
+  //LOG_WARN(( "[WARN] LMGR8C_lp_checkout(%p, %p, \"%s\", \"%s\", %u, \"%s\")",
+  //         v1,
+  //         policy,
+  //         feature, 
+  //         version,
+  //         num_lic,
+  //         license_file_list ));
+  TRACE_API( LMGR8C_lp_checkout, 0, policy, feature, version );
+  return 0;
+}
 
-  LOG_DEBUG(( "KERNEL32_DeleteFileA: unlink(\"%s\")", file_path ));
-  if( !unlink( file_path ) ) {
-    LOG_WARN(( "KERNEL32_DeleteFileA: unlink(\"%s\") failed: %s", file_path, strerror( errno ) ));
-    g_last_error = ERROR_ACCESS_DENIED; /* TODO errno */
-    return 0;
-  }
+WIN32_CDECL
+void
+LMGR8C_lp_checkin( void * handle ) {
+  STATS_API( LMGR8C_lp_checkin );
+  LOG_WARN(( "[WARN] LMGR8C_lp_checkin(%p)", handle ));
+  TRACE_API( LMGR8C_lp_checkin, 0, handle, 0, 0 );
+}
 
-  return 1;
+static char lmgr8c_errbuf[4096] = {0};
+
+/* lp_errstring	*/
+WIN32_CDECL
+char *
+LMGR8C_lp_errstring( void ) {
+  STATS_API( LMGR8C_lp_errstring );
+  LOG_WARN(( "LMGR8C_lp_errstring()" ));
+  snprintf( lmgr8c_errbuf, sizeof(lmgr8c_errbuf), "Hello!" );
+  TRACE_API( LMGR8C_lp_errstring, lmgr8c_errbuf, 0, 0, 0 );
+  return lmgr8c_errbuf;
+
+}
+
+WIN32_CDECL
+int32_t
+LMGR326B_lp_checkin() {
+  STATS_API( LMGR326B_lp_checkin );
+  LOG_INFO(( "LMGR326B_lp_checkin()" ));
+  TRACE_API( LMGR326B_lp_checkin, 0, 0, 0, 0 );
+  return 0;
+}
+
+WIN32_CDECL
+int32_t
+LMGR326B_lp_checkout() {
+  STATS_API( LMGR326B_lp_checkout );
+  LOG_INFO(( "LMGR326B_lp_checkout()" ));
+  TRACE_API( LMGR326B_lp_checkout, 0, 0, 0, 0 );
+  return 0;
+}
+
+WIN32_CDECL
+int32_t
+LMGR326B_lp_errstring() {
+  STATS_API( LMGR326B_lp_errstring );
+  LOG_WARN(( "[WARN] LMGR326B_lp_errstring()" ));
+  TRACE_API( LMGR326B_lp_errstring, 0, 0, 0, 0 );
+  return 0;
 }
 
 WIN32_STDCALL
 int
-KERNEL32_MoveFileA( char const * lp_existing_file_name,
-                    char const * lp_new_file_name ) {
-  LOG_WARN(( "[WARN] KERNEL32_MoveFileA(%p, %p)", lp_existing_file_name, lp_new_file_name ));
+USER32_MessageBoxA( uint32_t    h_wnd,
+                    char const * lp_text,
+                    char const * lp_caption,
+                    uint32_t    u_type ) {
+  STATS_API( USER32_MessageBoxA );
+  LOG_WARN(( "[WARN] USER32_MessageBoxA(%u, %p, %p, %u)", h_wnd, lp_text, lp_caption, u_type ));
+  TRACE_API( USER32_MessageBoxA, 0, lp_text, lp_caption, u_type );
   return 0;
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_FormatMessageA( uint32_t  dw_flags,
-                         void *    lp_source,
-                         uint32_t  dw_message_id,
-                         uint32_t  dw_language_id,
-                         char *    lp_buffer,
-                         uint32_t  n_size,
-                         void *    arguments ) {
-  if( dw_flags==0x00001000 ) {
-    LOG_DEBUG(( "KERNEL32_FormatMessageA(0x%08x, %p, %u, %u, %p, %u, %p)",
-                dw_flags, lp_source, dw_message_id, dw_language_id, lp_buffer, n_size, arguments ));
-    if( dw_message_id==0x0000000a ) {
-      if( n_size<strlen("The operation completed successfully.")+1 ) {
-        g_last_error = ERROR_INSUFFICIENT_BUFFER;
-        return 0;
-      }
-      strcpy( lp_buffer, "The operation completed successfully." );
-      return strlen(lp_buffer)+1;
-    }
-    LOG_WARN(( "KERNEL32_FormatMessageA: Unknown dw_message_id 0x%08x", dw_message_id ));
-    g_last_error = ERROR_INVALID_PARAMETER;
+int32_t
+USER32_LoadStringA( uint32_t h_instance,
+                    uint32_t u_id,
+                    char *   lp_buffer,
+                    int      n_buffer_max ) {
+  STATS_API( USER32_LoadStringA );
+  LOG_WARN(( "[WARN] USER32_LoadStringA(%u, %u, %p, %u)", h_instance, u_id, lp_buffer, n_buffer_max ));
+  if( u_id>=__pe_str_cnt ) {
+    TRACE_API( USER32_LoadStringA, 0, u_id, lp_buffer, n_buffer_max );
     return 0;
   }
-  LOG_WARN(( "[WARN] KERNEL32_FormatMessageA(%#x, %p, %u, %u, %p, %u, %p)",
-          dw_flags,
-          lp_source,
-          dw_message_id,
-          dw_language_id,
-          lp_buffer,
-          n_size,
-          arguments ));
-  return 0;
+  snprintf( lp_buffer, n_buffer_max, "%s", __pe_strs[u_id] );
+  TRACE_API( USER32_LoadStringA, 1, u_id, lp_buffer, n_buffer_max );
+  return 1;
 }
 
 WIN32_STDCALL
-int
-KERNEL32_GetFileTime( uint32_t   h_file,
-                      FILETIME * lp_creation_time,
-                      FILETIME * lp_last_access_time,
-                      FILETIME * lp_last_write_time ) {
-  LOG_WARN(( "[TODO] KERNEL32_GetFileTime(%u, %p, %p, %p)",
-          h_file,
-          lp_creation_time,
-          lp_last_access_time,
-          lp_last_write_time ));
+uint32_t
+VERSION_GetFileVersionInfoSizeA( char const * lptstr_filename,
+                                 uint32_t *   lpdw_handle ) {
+  STATS_API( VERSION_GetFileVersionInfoSizeA );
+# if PE_HAS_VERSION
+  LOG_DEBUG(( "VERSION_GetFileVersionInfoSizeA(%s, %p)", lptstr_filename, lpdw_handle ));
+  lpdw_handle = NULL;
+  uint32_t sz = (uint32_t)( __pe_rodata_version_end - __pe_rodata_version_start );
+  TRACE_API( VERSION_GetFileVersionInfoSizeA, sz, lptstr_filename, 0, 0 );
+  return sz;
+# else
+  TRACE_API( VERSION_GetFileVersionInfoSizeA, 0, lptstr_filename, 0, 0 );
   return 0;
+# endif
 }
 
 WIN32_STDCALL
 int
-KERNEL32_SetFileTime( uint32_t h_file,
-                      void *   lp_creation_time,
-                      void *   lp_last_access_time,
-                      void *   lp_last_write_time ) {
-  LOG_WARN(( "[WARN] KERNEL32_SetFileTime(%u, %p, %p, %p)",
-          h_file,
-          lp_creation_time,
-          lp_last_access_time,
-          lp_last_write_time ));
+VERSION_GetFileVersionInfoA( char const * lptstr_filename,
+                             uint32_t     dw_handle,
+                             uint32_t     dw_len,
+                             void *       lp_data ) {
+  STATS_API( VERSION_GetFileVersionInfoA );
+# if PE_HAS_VERSION
+  LOG_DEBUG(( "VERSION_GetFileVersionInfoA(%s, %u, %p)", lptstr_filename, dw_len, lp_data ));
+  memcpy( lp_data, __pe_rodata_version_start, dw_len );
+  TRACE_API( VERSION_GetFileVersionInfoA, 1, lptstr_filename, dw_len, lp_data );
+  return 1;
+# else
+  TRACE_API( VERSION_GetFileVersionInfoA, 0, lptstr_filename, dw_len, lp_data );
   return 0;
+# endif
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_GetFileSize( uint32_t h_file,
-                      uint32_t * lp_file_size_high ) {
+int
+VERSION_VerQueryValueA( void const * p_block,
+                        char const * lp_sub_block,
+                        void **      lplp_buffer,
+                        uint32_t *   pu_len ) {
+  STATS_API( VERSION_VerQueryValueA );
+  LOG_DEBUG(( "VERSION_VerQueryValueA(%p, %s, %p, %p)", p_block, lp_sub_block, lplp_buffer, pu_len ));
+  if( 0!=strcmp( lp_sub_block, "\\" ) ) {
+    LOG_WARN(( "VERSION_VerQueryValueA: unhandled sub block %s", lp_sub_block ));
 
-  /* Check handle type */
-  compat_handle_t * hdl = compat_handle_get( h_file );
-  if( !hdl || hdl->close!=compat_handle_file_close ) {
-    g_last_error = ERROR_INVALID_HANDLE;
-    return 0;
+    if( strstr( lp_sub_block, "\\CompanyName" ) ) {
+      *lplp_buffer = "Freescale Semiconductor, Inc.";
+      *pu_len = 30;
+    } else if( strstr( lp_sub_block, "\\ProductName" ) ) {
+      *lplp_buffer = "Freescale CodeWarrior";
+      *pu_len = 22;
+    } else if( strstr( lp_sub_block, "\\LegalCopyright" ) ) {
+      *lplp_buffer = "Copyright \xa9 2000-2010";
+      *pu_len = 23;
+    } else {
+      *lplp_buffer = "(unknown)";
+      *pu_len = 10;
+    }
+    TRACE_API( VERSION_VerQueryValueA, 1, p_block, lp_sub_block, *lplp_buffer );
+    return 1;
   }
 
-  FILE * f = (FILE *)hdl->data;
-  int fd = fileno( f );
-
-  /* Backup current seek */
-  int64_t prev = lseek64( fd, 0,    SEEK_CUR );
-  if( prev<0 ) {
-    LOG_WARN(( "KERNEL32_GetFileSize(%u): lseek64 failed: %s", h_file, strerror( errno ) ));
-    g_last_error = ERROR_FILE_NOT_FOUND;
-    return INVALID_FILE_SIZE;
+  /* Search for 0xFEEF04BD magic */
+  uint32_t const magic = 0xFEEF04BD;
+  uint32_t const * p = p_block;
+  /* TODO missing bounds check */
+  for( int i=0; i<16; i++, p++ ) {
+    if( *p==magic ) {
+      /* Found it! */
+      *lplp_buffer = (void *)p;
+      *pu_len = 0x3c;
+      TRACE_API( VERSION_VerQueryValueA, 1, p_block, lp_sub_block, p );
+      return 1;
+    }
   }
 
-  /* TODO check for errors */
-  int64_t end  = lseek64( fd, 0,    SEEK_END );
-                 lseek64( fd, prev, SEEK_SET );
-
-  LOG_DEBUG(( "KERNEL32_GetFileSize(%u) = %lld", h_file, end ));
+  LOG_WARN(( "VERSION_VerQueryValueA: didn't find VS_FIXEDFILEINFO" ));
+  TRACE_API( VERSION_VerQueryValueA, 0, p_block, lp_sub_block, 0 );
+  return 0;
 
-  if( lp_file_size_high ) *lp_file_size_high = ((uint64_t)end)<<32;
-  return (uint32_t)end;
 }
 
 WIN32_STDCALL
 int
-KERNEL32_SetEndOfFile( uint32_t h_file ) {
-  LOG_WARN(( "KERNEL32_SetEndOfFile(%u)", h_file ));
+ole32_CoInitialize( void * pv_reserved ) {
+  LOG_WARN(( "[WARN] ole32_CoInitialize(%p)", pv_reserved ));
   return 0;
 }
 
 WIN32_STDCALL
-int
-KERNEL32_CreateDirectoryA( char const * lp_path_name,
-                           void *       lp_security_attributes ) {
-  LOG_WARN(( "[WARN] KERNEL32_CreateDirectoryA(%p, %p)", lp_path_name, lp_security_attributes ));
-  return 0;
+void
+ole32_CoUninitialize( void ) {
+  LOG_WARN(( "[WARN] ole32_CoUninitialize()" ));
 }
 
 WIN32_STDCALL
 int
-KERNEL32_RemoveDirectoryA( char const * lp_path_name ) {
-  LOG_WARN(( "[WARN] KERNEL32_RemoveDirectoryA(%p)", lp_path_name ));
-  return 0;
+ole32_CoCreateInstance( void *   rclsid,
+                        void *   p_unk_outer,
+                        uint32_t dw_cls_context,
+                        void *   riid,
+                        void **  ppv ) {
+  LOG_WARN(( "[WARN] ole32_CoCreateInstance(%04x%04x-%04x-%04x-%04x-%04x%04x%04x, %p, %u, %p, %p)",
+                   ((uint16_t*)rclsid)[1],
+                   ((uint16_t*)rclsid)[0],
+                   ((uint16_t*)rclsid)[2],
+                   ((uint16_t*)rclsid)[3],
+                   __builtin_bswap16( ((uint16_t*)rclsid)[4] ),
+                   __builtin_bswap16( ((uint16_t*)rclsid)[5] ),
+                   __builtin_bswap16( ((uint16_t*)rclsid)[6] ),
+                   __builtin_bswap16( ((uint16_t*)rclsid)[7] ),
+                   p_unk_outer, dw_cls_context, riid, ppv ));
+  *ppv = NULL;
+  return 0x80040154;
 }
 
 WIN32_STDCALL
-int
-KERNEL32_SetStdHandle( uint32_t n_std_handle,
-                       uint32_t h_handle ) {
-  LOG_WARN(( "[WARN] KERNEL32_SetStdHandle(%u, %u)", n_std_handle, h_handle ));
-  return 0;
+void
+ole32_CoTaskMemFree( void * pv ) {
+  LOG_WARN(( "[WARN] ole32_CoTaskMemFree(%p)", pv ));
 }
 
 WIN32_STDCALL
-void
-KERNEL32_GetSystemTime( void * lp_system_time ) {
-  LOG_WARN(( "[TODO] KERNEL32_GetSystemTime(%p)" ));
+void *
+ole32_CoTaskMemAlloc( uint32_t cb ) {
+  LOG_WARN(( "[WARN] ole32_CoTaskMemAlloc(%u)", cb ));
+  return 0;
 }
 
 WIN32_STDCALL
 int
-KERNEL32_SystemTimeToFileTime( void * lp_system_time,
-                               void * lp_file_time ) {
-  LOG_WARN(( "KERNEL32_SystemTimeToFileTime(%p, %p)", lp_system_time, lp_file_time ));
+WS2_32_WSAStartup( uint16_t w_version_requested,
+                   void *   lp_wsa_data ) {
+  STATS_API( WS2_32_WSAStartup );
+  LOG_WARN(( "[WARN] WS2_32_WSAStartup(%u, %p)", w_version_requested, lp_wsa_data ));
+  TRACE_API( WS2_32_WSAStartup, 0, w_version_requested, lp_wsa_data, 0 );
   return 0;
 }
 
 WIN32_STDCALL
-int32_t
-KERNEL32_CompareFileTime( void * lp_file_time_1,
-                          void * lp_file_time_2 ) {
-  LOG_WARN(( "[WARN] KERNEL32_CompareFileTime(%p, %p)", lp_file_time_1, lp_file_time_2 ));
+int
+WS2_32_WSAGetLastError( void ) {
+  STATS_API( WS2_32_WSAGetLastError );
+  LOG_ERR(( "[TODO] WS2_32_WSAGetLastError()" ));
+  TRACE_API( WS2_32_WSAGetLastError, 0, 0, 0, 0 );
   return 0;
 }
 
 WIN32_STDCALL
-int32_t *
-KERNEL32_GlobalReAlloc( int32_t * h_mem,
-                        uint32_t  u_bytes,
-                        uint32_t  u_flags ) {
-  LOG_TRACE(( "KERNEL32_GlobalReAlloc(%p, %u, %#x)", h_mem, u_bytes, u_flags ));
-  if( u_bytes==0 )
-    u_bytes=1;
-
-  /* libc realloc always moves */
-  if( u_flags & 0x02 == 0 ) {
-    g_last_error = ERROR_OUTOFMEMORY;
-    return NULL;
-  }
-
-  /* Remember occupied byte range if we're instructed to zero */
-  int zero = (u_flags&0x40)!=0;
-  size_t sz_old;
-  if (zero)
-    sz_old = malloc_usable_size( h_mem );
-
-  void * obj = realloc( h_mem, u_bytes );
-
-  if( obj==NULL ) {
-    g_last_error = ERROR_OUTOFMEMORY;
-    return NULL;
-  }
-
-  /* Zero new bytes */
-  g_last_error = ERROR_SUCCESS;
-  if( (u_flags&0x40)!=0 ) {
-    size_t sz_new = malloc_usable_size( obj );
-    if( sz_new>sz_old ) {
-      memset((char*)obj + sz_old, 0, sz_new - sz_old);
-    }
-  }
-  
-  return obj;
+uint16_t
+WS2_32_ntohs( uint16_t netshort ) {
+  STATS_API( WS2_32_ntohs );
+  TRACE_API( WS2_32_ntohs, __builtin_bswap16( netshort ), netshort, 0, 0 );
+  return __builtin_bswap16( netshort );
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_GlobalFlags( int32_t * h_mem ) {
-  LOG_TRACE(( "KERNEL32_GlobalFlags(%p)", h_mem ));
+char const *
+WS2_32_inet_ntoa( void * in_addr ) {
+  STATS_API( WS2_32_inet_ntoa );
+  LOG_ERR(( "[TODO] WS2_32_inet_ntoa(%p)", in_addr ));
+  TRACE_API( WS2_32_inet_ntoa, 0, in_addr, 0, 0 );
   return 0;
 }
 
 WIN32_STDCALL
 int
-KERNEL32_FileTimeToSystemTime( void * lp_file_time,
-                               void * lp_system_time ) {
-  LOG_WARN(( "[WARN] KERNEL32_FileTimeToSystemTime(%p, %p)", lp_file_time, lp_system_time ));
+WS2_32_shutdown( uint32_t s,
+                 int      how ) {
+  STATS_API( WS2_32_shutdown );
+  LOG_WARN(( "[WARN] WS2_32_shutdown(%u, %u)", s, how ));
+  TRACE_API( WS2_32_shutdown, 0, s, how, 0 );
   return 0;
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_FindResourceA( uint32_t     h_module,
-                        char const * lp_name,
-                        char const * lp_type ) {
-  LOG_WARN(( "[WARN] KERNEL32_FindResourceA(%u, %p, %p)", h_module, lp_name, lp_type ));
+int
+WS2_32_closesocket( uint32_t s ) {
+  STATS_API( WS2_32_closesocket );
+  LOG_WARN(( "[WARN] WS2_32_closesocket(%u)", s ));
+  TRACE_API( WS2_32_closesocket, 0, s, 0, 0 );
   return 0;
 }
 
 WIN32_STDCALL
-int32_t *
-KERNEL32_LoadResource( uint32_t h_module,
-                       uint32_t h_resource ) {
-  LOG_WARN(( "[WARN] KERNEL32_LoadResource(%u, %u)", h_module, h_resource ));
+int
+WS2_32_WSACleanup( void ) {
+  STATS_API( WS2_32_WSACleanup );
+  LOG_WARN(( "[WARN] WS2_32_WSACleanup()" ));
+  TRACE_API( WS2_32_WSACleanup, 0, 0, 0, 0 );
   return 0;
 }
 
 WIN32_STDCALL
-void *
-KERNEL32_LockResource( int32_t * h_resource ) {
-  LOG_WARN(( "[WARN] KERNEL32_LockResource(%p)", h_resource ));
+uint32_t
+WS2_32_socket( int af,
+               int type,
+               int protocol ) {
+  STATS_API( WS2_32_socket );
+  LOG_WARN(( "[WARN] WS2_32_socket(%u, %u, %u)", af, type, protocol ));
+  TRACE_API( WS2_32_socket, 0, af, type, protocol );
   return 0;
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_SizeofResource( uint32_t h_module,
-                         uint32_t h_resource ) {
-  LOG_WARN(( "[WARN] KERNEL32_SizeofResource(%u, %u)", h_module, h_resource ));
+uint16_t
+WS2_32_htons( uint16_t hostshort ) {
+  STATS_API( WS2_32_htons );
+  LOG_WARN(( "[WARN] WS2_32_htons(%u)", hostshort ));
+  TRACE_API( WS2_32_htons, 0, hostshort, 0, 0 );
   return 0;
 }
 
 WIN32_STDCALL
 uint32_t
-KERNEL32_CreateFileMappingA( uint32_t     h_file,
-                             void *       lp_file_mapping_attributes,
-                             uint32_t     fl_protect,
-                             uint32_t     dw_maximum_size_high,
-                             uint32_t     dw_maximum_size_low,
-                             char const * lp_name ) {
-  LOG_WARN(( "[WARN] KERNEL32_CreateFileMappingA(%u, %p, %u, %u, %u, %p)",
-          h_file,
-          lp_file_mapping_attributes,
-          fl_protect,
-          dw_maximum_size_high,
-          dw_maximum_size_low,
-          lp_name ));
+WS2_32_inet_addr( char const * cp ) {
+  STATS_API( WS2_32_inet_addr );
+  LOG_WARN(( "[WARN] WS2_32_inet_addr(%p)", cp ));
+  TRACE_API( WS2_32_inet_addr, 0, cp, 0, 0 );
   return 0;
 }
 
 WIN32_STDCALL
-int32_t *
-KERNEL32_MapViewOfFile( uint32_t h_file_mapping_object,
-                        uint32_t dw_desired_access,
-                        uint32_t dw_file_offset_high,
-                        uint32_t dw_file_offset_low,
-                        uint32_t dw_number_of_bytes_to_map ) {
-  LOG_WARN(( "[WARN] KERNEL32_MapViewOfFile(%u, %u, %u, %u, %u)",
-          h_file_mapping_object,
-          dw_desired_access,
-          dw_file_offset_high,
-          dw_file_offset_low,
-          dw_number_of_bytes_to_map ));
+int
+WS2_32_connect( uint32_t s,
+                void *   name,
+                int      namelen ) {
+  STATS_API( WS2_32_connect );
+  LOG_WARN(( "[WARN] WS2_32_connect(%u, %p, %u)", s, name, namelen ));
+  TRACE_API( WS2_32_connect, 0, s, name, namelen );
   return 0;
 }
 
 WIN32_STDCALL
 int
-KERNEL32_UnmapViewOfFile( int32_t * lp_base_address ) {
-  LOG_WARN(( "[WARN] KERNEL32_UnmapViewOfFile(%p)", lp_base_address ));
+WS2_32_select( int    nfds,
+               void * readfds,
+               void * writefds,
+               void * exceptfds,
+               void * timeout ) {
+  STATS_API( WS2_32_select );
+  LOG_WARN(( "[WARN] WS2_32_select(%u, %p, %p, %p, %p)", nfds, readfds, writefds, exceptfds, timeout ));
+  TRACE_API( WS2_32_select, 0, nfds, readfds, writefds );
   return 0;
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_GetSystemDirectoryA( char * lp_buffer,
-                              uint32_t u_size ) {
-  LOG_DEBUG(( "KERNEL32_GetSystemDirectoryA(%p, %u)", lp_buffer, u_size ));
-  return snprintf( lp_buffer, u_size, "C:\\Windows\\System32" );
+int
+WS2_32___WSAFDIsSet( uint32_t s,
+                     void *   fd_set ) {
+  STATS_API( WS2_32___WSAFDIsSet );
+  LOG_WARN(( "[WARN] WS2_32___WSAFDIsSet(%u, %p)", s, fd_set ));
+  TRACE_API( WS2_32___WSAFDIsSet, 0, s, fd_set, 0 );
+  return 0;
 }
 
 WIN32_STDCALL
-uint32_t
-KERNEL32_GetWindowsDirectoryA( char *   lp_buffer,
-                               uint32_t u_size ) {
-  return snprintf( lp_buffer, u_size, "C:\\Windows" );
+int
+WS2_32_send( uint32_t s,
+             void *   buf,
+             int      len,
+             int      flags ) {
+  STATS_API( WS2_32_send );
+  LOG_WARN(( "[WARN] WS2_32_send(%u, %p, %u, %u)", s, buf, len, flags ));
+  TRACE_API( WS2_32_send, 0, s, buf, len );
+  return 0;
 }
 
 WIN32_STDCALL
 int
-KERNEL32_SetConsoleCtrlHandler( void * lp_handler_routine,
-                                int    b_add ) {
-  LOG_WARN(( "[TODO] KERNEL32_SetConsoleCtrlHandler(%p, %u)", lp_handler_routine, b_add ));
+WS2_32_recv( uint32_t s,
+             void *   buf,
+             int      len,
+             int      flags ) {
+  STATS_API( WS2_32_recv );
+  LOG_WARN(( "[WARN] WS2_32_recv(%u, %p, %u, %u)", s, buf, len, flags ));
+  TRACE_API( WS2_32_recv, 0, s, buf, len );
   return 0;
+
 }
 
-WIN32_STDCALL
-int
-KERNEL32_GetConsoleScreenBufferInfo( uint32_t h_console_output,
-                                     void *   lp_console_screen_buffer_info ) {
-  LOG_DEBUG(( "KERNEL32_GetConsoleScreenBufferInfo(%u, %p)", h_console_output, lp_console_screen_buffer_info ));
-  
-  struct winsize w;
-  int res = ioctl( STDOUT_FILENO, TIOCGWINSZ, &w );
-  if( res<0 ) {
-    console_buf.dwSize.X = 80;
-    console_buf.dwSize.Y = 25;
-  } else {
-    console_buf.dwSize.X = w.ws_col;
-    console_buf.dwSize.Y = w.ws_row;
+static int
+compat_parse_loglvl_( char * lvl ) {
+  if( !lvl ) return LOGLVL_DEFAULT;
+
+  for( char *s = lvl; *s; ++s ) *s = toupper( *s );
+
+  if( !strcmp( lvl, "FATAL"   ) ) return LOGLVL_FATAL;
+  if( !strcmp( lvl, "ERR"     ) ) return LOGLVL_ERR;
+  if( !strcmp( lvl, "ERROR"   ) ) return LOGLVL_ERR;
+  if( !strcmp( lvl, "WARN"    ) ) return LOGLVL_WARN;
+  if( !strcmp( lvl, "WARNING" ) ) return LOGLVL_WARN;
+  if( !strcmp( lvl, "INFO"    ) ) return LOGLVL_INFO;
+  if( !strcmp( lvl, "DBG"     ) ) return LOGLVL_DEBUG;
+  if( !strcmp( lvl, "DEBUG"   ) ) return LOGLVL_DEBUG;
+  if( !strcmp( lvl, "TRACE"   ) ) return LOGLVL_TRACE;
+
+  return LOGLVL_DEFAULT;
+}
+
+/* compat_log_init: Sets the log level from WIN32_LOG.  Asking for
+   messages that were compiled out is reported even when warnings were
+   compiled out as well. */
+static void
+compat_log_init( void ) {
+  compat_log_level_ = compat_parse_loglvl_( getenv( "WIN32_LOG" ) );
+  if( compat_log_level_<COMPAT_LOG_MIN && compat_log_level_<=LOGLVL_WARN )
+    compat_log1_( LOGLVL_WARN, compat_log0_(
+        "WIN32_LOG: messages below %s were compiled out, rebuild with LOG_MIN=%d to see them",
+        compat_level_str_[ COMPAT_LOG_MIN ], compat_log_level_ ) );
+}
+
+/********************************************************************************
+   Perf Map
+ ********************************************************************************/
+
+/* With WIN32_PERF_MAP set, the PE functions found by pe2elf are written
+   to /tmp/perf-<pid>.map, the format perf and other profilers use to
+   symbolize code they cannot find in an ELF symbol table. */
+
+static int g_perfmap;
+
+static void
+compat_perfmap_write( void ) {
+  if( !g_perfmap ) return;
+
+  char path[ 64 ];
+  snprintf( path, sizeof(path), "/tmp/perf-%d.map", (int)getpid() );
+  FILE * f = fopen( path, "w" );
+  if( !f ) {
+    LOG_WARN(( "perf map: cannot create %s: %s", path, strerror( errno ) ));
+    return;
+  }
+  for( unsigned int i=0; i<__pe_func_cnt; i++ )
+    fprintf( f, "%x %x %s\n", __pe_funcs[i].addr, __pe_funcs[i].size, __pe_funcs[i].name );
+  fclose( f );
+  LOG_DEBUG(( "perf map: wrote %u functions to %s", __pe_func_cnt, path ));
+}
+
+/********************************************************************************
+   Symbols
+ ********************************************************************************/
+
+/* Resolves code addresses to function names.  PE code uses the table
+   from pe2elf, everything else the ELF symbol table of /proc/self/exe,
+   loaded on first use. */
+
+#if UINTPTR_MAX==0xffffffffU
+typedef Elf32_Ehdr compat_elf_ehdr_t;
+typedef Elf32_Shdr compat_elf_shdr_t;
+typedef Elf32_Sym  compat_elf_sym_t;
+#define COMPAT_ELF_ST_TYPE ELF32_ST_TYPE
+#else
+typedef Elf64_Ehdr compat_elf_ehdr_t;
+typedef Elf64_Shdr compat_elf_shdr_t;
+typedef Elf64_Sym  compat_elf_sym_t;
+#define COMPAT_ELF_ST_TYPE ELF64_ST_TYPE
+#endif
+
+struct compat_sym {
+  uintptr_t    addr;
+  uintptr_t    size;
+  char const * name;
+};
+
+static struct compat_sym * g_syms;
+static uint32_t            g_sym_cnt;
+static int                 g_syms_loaded;
+
+static int
+compat_sym_cmp( void const * a,
+                void const * b ) {
+  uintptr_t x = ((struct compat_sym const *)a)->addr;
+  uintptr_t y = ((struct compat_sym const *)b)->addr;
+  return (x>y) - (x<y);
+}
+
+static void
+compat_syms_load( void ) {
+  g_syms_loaded = 1;
+
+  int fd = open( "/proc/self/exe", O_RDONLY|O_CLOEXEC );
+  if( fd<0 ) return;
+  struct stat st;
+  if( fstat( fd, &st )<0 ) { close( fd ); return; }
+  /* Stays mapped, names point into it */
+  uint8_t const * img = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( img==MAP_FAILED ) return;
+
+  compat_elf_ehdr_t const * eh = (compat_elf_ehdr_t const *)img;
+  if( (size_t)st.st_size<sizeof(*eh) || memcmp( eh->e_ident, ELFMAG, SELFMAG ) ||
+      eh->e_shoff+(size_t)eh->e_shnum*sizeof(compat_elf_shdr_t)>(size_t)st.st_size ) {
+    munmap( (void *)img, (size_t)st.st_size );
+    return;
+  }
+  compat_elf_shdr_t const * sh = (compat_elf_shdr_t const *)( img+eh->e_shoff );
+  for( uint32_t i=0; i<eh->e_shnum; i++ ) {
+    if( sh[i].sh_type!=SHT_SYMTAB || sh[i].sh_link>=eh->e_shnum ) continue;
+    compat_elf_sym_t const * sym = (compat_elf_sym_t const *)( img+sh[i].sh_offset );
+    char const *             str = (char const *)( img+sh[ sh[i].sh_link ].sh_offset );
+    size_t cnt = sh[i].sh_size/sizeof(compat_elf_sym_t);
+    g_syms = calloc( cnt, sizeof(struct compat_sym) );
+    if( !g_syms ) return;
+    for( size_t j=0; j<cnt; j++ ) {
+      if( COMPAT_ELF_ST_TYPE( sym[j].st_info )!=STT_FUNC || !sym[j].st_value ) continue;
+      g_syms[ g_sym_cnt++ ] = (struct compat_sym){ sym[j].st_value, sym[j].st_size, str+sym[j].st_name };
+    }
+    qsort( g_syms, g_sym_cnt, sizeof(struct compat_sym), compat_sym_cmp );
+    return;
+  }
+}
+
+/* compat_sym_lookup: Returns the name of the function containing pc,
+   or NULL if unknown.  Optionally returns the function start. */
+static char const *
+compat_sym_lookup( uintptr_t   pc,
+                   uintptr_t * start ) {
+  if( pc>=(uintptr_t)__pe_text_start && pc<(uintptr_t)__pe_text_end ) {
+    uint32_t lo = 0, hi = __pe_func_cnt;
+    while( lo<hi ) {
+      uint32_t mid = lo+(hi-lo)/2;
+      if( __pe_funcs[ mid ].addr<=pc ) lo = mid+1;
+      else                             hi = mid;
+    }
+    if( lo && pc-__pe_funcs[ lo-1 ].addr<__pe_funcs[ lo-1 ].size ) {
+      if( start ) *start = __pe_funcs[ lo-1 ].addr;
+      return __pe_funcs[ lo-1 ].name;
+    }
+    return NULL;
+  }
+
+  if( !g_syms_loaded ) compat_syms_load();
+  uint32_t lo = 0, hi = g_sym_cnt;
+  while( lo<hi ) {
+    uint32_t mid = lo+(hi-lo)/2;
+    if( g_syms[ mid ].addr<=pc ) lo = mid+1;
+    else                         hi = mid;
+  }
+  /* Some libc asm lacks sizes, accept those up to the next symbol */
+  if( lo && ( pc-g_syms[ lo-1 ].addr<g_syms[ lo-1 ].size || ( !g_syms[ lo-1 ].size && lo<g_sym_cnt ) ) ) {
+    if( start ) *start = g_syms[ lo-1 ].addr;
+    return g_syms[ lo-1 ].name;
+  }
+  return NULL;
+}
+
+/********************************************************************************
+   Stack Walker
+ ********************************************************************************/
+
+/* Walks call stacks that mix SysV frames (compat.c, built with frame
+   pointers), frameless libc code and stdcall PE frames.
+
+   Frames are followed along the EBP chain.  A link is only trusted if
+   it stays within the stack and its return address points into code
+   right after a call instruction.  Where the chain is missing (libc
+   leaf functions, PE code using EBP as a general register), the stack
+   is scanned upward for the next plausible return address, and the
+   chain is picked up again from the saved EBP next to it.
+
+   Everything here is async-signal-safe. */
+
+extern char __executable_start[];
+extern char etext[];
+
+#define COMPAT_WALK_STACKS 4
+
+static struct {
+  uintptr_t lo;
+  uintptr_t hi;
+} g_walk_stack[ COMPAT_WALK_STACKS ];
+static uint32_t g_walk_stack_cnt;
+
+/* compat_walk_stack_add: Records the bounds of the stack mapping that
+   contains sp.  The main stack grows down, so it is recorded as reaching
+   RLIMIT_STACK below its top.  Reads /proc/self/maps, so it must not be
+   called from a signal handler. */
+static void
+compat_walk_stack_add( uintptr_t sp ) {
+  int fd = open( "/proc/self/maps", O_RDONLY|O_CLOEXEC );
+  if( fd<0 ) return;
+  char buf[ 4096 ];
+  size_t have = 0;
+  uintptr_t lo = 0, hi = 0;
+  int found = 0;
+  for(;;) {
+    ssize_t n = read( fd, buf+have, sizeof(buf)-have );
+    if( n<=0 ) break;
+    have += (size_t)n;
+    char * line = buf;
+    char * nl;
+    while( (nl = memchr( line, '\n', (size_t)(buf+have-line) )) ) {
+      char * c = line;
+      lo = hi = 0;
+      for( ; isxdigit( *c ); c++ ) lo = lo*16 + (uintptr_t)(isdigit( *c ) ? *c-'0' : (*c|0x20)-'a'+10);
+      if( *c=='-' ) c++;
+      for( ; isxdigit( *c ); c++ ) hi = hi*16 + (uintptr_t)(isdigit( *c ) ? *c-'0' : (*c|0x20)-'a'+10);
+      if( sp>=lo && sp<hi ) {
+        found = 1;
+        if( memmem( c, (size_t)(nl-c), "[stack]", 7 ) ) {
+          struct rlimit rl;
+          lo = 0;
+          if( 0==getrlimit( RLIMIT_STACK, &rl ) && rl.rlim_cur!=RLIM_INFINITY && rl.rlim_cur<hi )
+            lo = hi-(uintptr_t)rl.rlim_cur;
+        }
+        break;
+      }
+      line = nl+1;
+    }
+    if( found ) break;
+    have = (size_t)(buf+have-line);
+    memmove( buf, line, have );
   }
-  
-  memcpy( lp_console_screen_buffer_info, &console_buf, sizeof(CONSOLE_SCREEN_BUFFER_INFO) );
-  return 1;
+  close( fd );
+  if( !found ) return;
+
+  /* A stack is known by its top, which does not move */
+  for( uint32_t i=0; i<g_walk_stack_cnt; i++ ) {
+    if( g_walk_stack[i].hi==hi ) {
+      if( lo<g_walk_stack[i].lo ) g_walk_stack[i].lo = lo;
+      return;
+    }
+  }
+  if( g_walk_stack_cnt==COMPAT_WALK_STACKS ) return;
+  g_walk_stack[ g_walk_stack_cnt ].lo = lo;
+  g_walk_stack[ g_walk_stack_cnt ].hi = hi;
+  g_walk_stack_cnt++;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_SetFileAttributesA( char const * lp_file_name,
-                             uint32_t     dw_file_attributes ) {
-  LOG_WARN(( "[WARN] KERNEL32_SetFileAttributesA(%p, %u)", lp_file_name, dw_file_attributes ));
+/* compat_walk_stack_top: Returns the end of the recorded stack containing
+   sp, or 0 if unknown. */
+static uintptr_t
+compat_walk_stack_top( uintptr_t sp ) {
+  for( uint32_t i=0; i<g_walk_stack_cnt; i++ )
+    if( sp>=g_walk_stack[i].lo && sp<g_walk_stack[i].hi ) return g_walk_stack[i].hi;
   return 0;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_OpenFileMappingA( uint32_t     dw_desired_access,
-                           int          b_inherit_handle,
-                           char const * lp_name ) {
-  LOG_WARN(( "[WARN] KERNEL32_OpenFileMappingA(%u, %u, %p)", dw_desired_access, b_inherit_handle, lp_name ));
-  return 0;
+static inline int
+compat_walk_in_code( uintptr_t a ) {
+  return ( a>=(uintptr_t)__pe_text_start     && a<(uintptr_t)__pe_text_end ) ||
+         ( a>=(uintptr_t)__executable_start && a<(uintptr_t)etext          );
 }
 
-WIN32_STDCALL
-int32_t
-KERNEL32_MultiByteToWideChar( uint32_t     u_code_page,
-                              uint32_t     dw_flags,
-                              char const * lp_multi_byte_str,
-                              int          cch_multi_byte,
-                              void *       lp_wide_char_str,
-                              int          cch_wide_char ) {
-  LOG_WARN(( "[WARN] KERNEL32_MultiByteToWideChar(%u, %u, %p, %u, %p, %u)",
-          u_code_page,
-          dw_flags,
-          lp_multi_byte_str,
-          cch_multi_byte,
-          lp_wide_char_str,
-          cch_wide_char ));
+/* compat_walk_is_ra: Checks whether a is preceded by a call instruction. */
+static int
+compat_walk_is_ra( uintptr_t a ) {
+  if( !compat_walk_in_code( a-7 ) || !compat_walk_in_code( a-1 ) ) return 0;
+  uint8_t const * p = (uint8_t const *)a;
+  if( p[-5]==0xe8 ) return 1;                             /* call rel32         */
+  if( p[-2]==0xff && (p[-1]&0x38)==0x10 ) return 1;       /* call r/m           */
+  if( p[-3]==0xff && (p[-2]&0x38)==0x10 ) return 1;       /* call [r+disp8]     */
+  if( p[-6]==0xff && (p[-5]&0x38)==0x10 ) return 1;       /* call [r+disp32]    */
+  if( p[-7]==0xff && (p[-6]&0x38)==0x10 ) return 1;       /* call [sib+disp32]  */
   return 0;
 }
 
-WIN32_STDCALL
-int
-KERNEL32_IsValidCodePage( uint32_t u_code_page ) {
-  LOG_WARN(( "[WARN] KERNEL32_IsValidCodePage(%u)", u_code_page ));
-  return 0;
+/* compat_walk_framed: Returns 1 if pc is past a `push ebp; mov ebp, esp`
+   prologue at the start of its function, i.e. EBP points to its frame. */
+static int
+compat_walk_framed( uintptr_t pc ) {
+  uintptr_t start;
+  if( !compat_sym_lookup( pc, &start ) ) return 0;
+  uint8_t const * p = (uint8_t const *)start;
+  uint32_t len = 0;
+  if( p[0]==0x55 && ( (p[1]==0x89 && p[2]==0xe5) || (p[1]==0x8b && p[2]==0xec) ) )
+    len = 3;
+  else if( p[0]==0x55 && p[1]==0x48 && p[2]==0x89 && p[3]==0xe5 )  /* x86_64 */
+    len = 4;
+  return len && pc>=start+len;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_GetACP( void ) {
-  LOG_WARN(( "[WARN] KERNEL32_GetACP()" ));
+/* compat_walk_scan: Returns the address of the first plausible return
+   address in [sp,end), or 0. */
+static uintptr_t
+compat_walk_scan( uintptr_t sp,
+                  uintptr_t end ) {
+  for( uintptr_t p=sp; p+sizeof(uintptr_t)<=end; p+=sizeof(uintptr_t) )
+    if( compat_walk_is_ra( *(uintptr_t const *)p ) ) return p;
   return 0;
 }
 
-WIN32_STDCALL
-void
-KERNEL32_GetLocalTime( void * lp_system_time ) {
-  LOG_WARN(( "[TODO] KERNEL32_GetLocalTime(%p)", lp_system_time ));
+/* compat_stack_walk: Writes up to max program counters, innermost first.
+   Returns the number written. */
+static uint32_t
+compat_stack_walk( uintptr_t   pc,
+                   uintptr_t   fp,
+                   uintptr_t   sp,
+                   uintptr_t * out,
+                   uint32_t    max ) {
+  uint32_t n = 0;
+  if( max ) out[ n++ ] = pc;
+  uintptr_t hi = compat_walk_stack_top( sp );
+  if( !hi ) return n;
+  uintptr_t const w = sizeof(uintptr_t);
+
+  /* A frameless leaf leaves its return address below the caller's frame.
+     Scanning may also hit stale return addresses in uninitialized locals,
+     so skip it where EBP is known to be set up. */
+  uintptr_t p = 0;
+  if( !compat_walk_framed( pc ) ) {
+    uintptr_t leaf_end = ( fp>sp && fp<hi ) ? fp : sp+64*w;
+    p = compat_walk_scan( sp, leaf_end<hi ? leaf_end : hi );
+  }
+  if( p && n<max ) {
+    out[ n++ ] = *(uintptr_t const *)p;
+    sp = p+w;
+  }
+
+  while( n<max ) {
+    if( fp>=sp && fp+2*w<=hi && !(fp&(w-1)) ) {
+      uintptr_t ra  = ((uintptr_t const *)fp)[1];
+      uintptr_t nfp = ((uintptr_t const *)fp)[0];
+      if( compat_walk_is_ra( ra ) ) {
+        out[ n++ ] = ra;
+        sp = fp+2*w;
+        fp = nfp;
+        continue;
+      }
+    }
+
+    /* Broken chain, scan for the next frame */
+    uintptr_t end = sp+1024*w;
+    p = compat_walk_scan( sp, end<hi ? end : hi );
+    if( !p ) break;
+    out[ n++ ] = *(uintptr_t const *)p;
+    sp = p+w;
+    fp = ((uintptr_t const *)p)[-1];  /* saved EBP if p is in a regular frame */
+  }
+  return n;
 }
 
-WIN32_STDCALL
-uint32_t
-KERNEL32_GetTimeZoneInformation( void * lp_time_zone_information ) {
-  LOG_WARN(( "[TODO] KERNEL32_GetTimeZoneInformation(%p)", lp_time_zone_information ));
-  return 0;
+/********************************************************************************
+   Profiler
+ ********************************************************************************/
+
+/* WIN32_PROFILE=<hz> samples the interrupted program counter on SIGPROF
+   (process CPU time).  At exit, samples are attributed to functions and
+   classified as PE code, compat shims or libc, and printed to stderr.
+
+   With WIN32_PROFILE_STACKS=<file>, each sample also records its call
+   stack, written to <file> as collapsed stacks for flamegraph.pl. */
+
+#define COMPAT_PROF_MAX       (1U<<20)
+#define COMPAT_PROF_DEPTH     64U
+#define COMPAT_PROF_STK_WORDS (1U<<23)
+
+/* Counters written by the signal handler are published with release
+   stores and read with acquire loads */
+static uintptr_t *   g_prof_pc;
+static uint32_t      g_prof_cnt;
+static uint32_t      g_prof_dropped;
+static long          g_prof_hz;
+static uintptr_t *   g_prof_stk;      /* records of { depth, pc[depth] } */
+static uint32_t      g_prof_stk_used;
+static char const *  g_prof_stk_path;
+
+static void
+compat_prof_on_signal( int         sig,
+                       siginfo_t * info,
+                       void *      ctx ) {
+  (void)sig; (void)info;
+  ucontext_t const * uc = ctx;
+#if defined(__i386__)
+  uintptr_t pc = (uintptr_t)uc->uc_mcontext.gregs[ REG_EIP ];
+  uintptr_t fp = (uintptr_t)uc->uc_mcontext.gregs[ REG_EBP ];
+  uintptr_t sp = (uintptr_t)uc->uc_mcontext.gregs[ REG_ESP ];
+#elif defined(__x86_64__)
+  uintptr_t pc = (uintptr_t)uc->uc_mcontext.gregs[ REG_RIP ];
+  uintptr_t fp = (uintptr_t)uc->uc_mcontext.gregs[ REG_RBP ];
+  uintptr_t sp = (uintptr_t)uc->uc_mcontext.gregs[ REG_RSP ];
+#else
+  uintptr_t pc = 0, fp = 0, sp = 0; (void)uc;
+#endif
+  uint32_t cnt = __atomic_load_n( &g_prof_cnt, __ATOMIC_RELAXED );
+  if( cnt>=COMPAT_PROF_MAX ) {
+    __atomic_fetch_add( &g_prof_dropped, 1U, __ATOMIC_RELAXED );
+    return;
+  }
+  g_prof_pc[ cnt ] = pc;
+  __atomic_store_n( &g_prof_cnt, cnt+1U, __ATOMIC_RELEASE );
+
+  uint32_t used = __atomic_load_n( &g_prof_stk_used, __ATOMIC_RELAXED );
+  if( g_prof_stk && used+1U+COMPAT_PROF_DEPTH<=COMPAT_PROF_STK_WORDS ) {
+    uintptr_t * rec = g_prof_stk+used;
+    rec[0] = compat_stack_walk( pc, fp, sp, rec+1, COMPAT_PROF_DEPTH );
+    __atomic_store_n( &g_prof_stk_used, used+1U+(uint32_t)rec[0], __ATOMIC_RELEASE );
+  }
 }
 
-WIN32_STDCALL
-int
-KERNEL32_FileTimeToLocalFileTime( void const * lp_file_time,
-                                  void *       lp_local_file_time ) {
-  LOG_WARN(( "[WARN] KERNEL32_FileTimeToLocalFileTime(%p, %p)", lp_file_time, lp_local_file_time ));
-  return 0;
+/* compat_prof_arm: Starts the timer.  Timers are not inherited by fork. */
+static void
+compat_prof_arm( void ) {
+  if( !g_prof_pc ) return;
+  __atomic_store_n( &g_prof_cnt,      0U, __ATOMIC_RELAXED );
+  __atomic_store_n( &g_prof_dropped,  0U, __ATOMIC_RELAXED );
+  __atomic_store_n( &g_prof_stk_used, 0U, __ATOMIC_RELAXED );
+  long us = 1000000L/g_prof_hz;
+  struct itimerval it = {
+    .it_interval = { .tv_sec = us/1000000L, .tv_usec = us%1000000L },
+    .it_value    = { .tv_sec = us/1000000L, .tv_usec = us%1000000L }
+  };
+  setitimer( ITIMER_PROF, &it, NULL );
 }
 
-WIN32_STDCALL
-int
-KERNEL32_IsDBCSLeadByte( uint8_t test_char ) {
-  LOG_WARN(( "[WARN] KERNEL32_IsDBCSLeadByte(%#x)", test_char ));
-  return 0;
+enum { COMPAT_PROF_PE, COMPAT_PROF_SHIM, COMPAT_PROF_LIBC, COMPAT_PROF_CAT_CNT };
+
+static int
+compat_prof_classify( uintptr_t    pc,
+                      char const * name ) {
+  static char const * const shim_prefix[] = {
+    "compat_", "KERNEL32_", "USER32_", "ADVAPI32_", "VERSION_", "WS2_32_", "LMGR"
+  };
+  if( pc>=(uintptr_t)__pe_text_start && pc<(uintptr_t)__pe_text_end ) return COMPAT_PROF_PE;
+  for( uint32_t i=0; name && i<sizeof(shim_prefix)/sizeof(shim_prefix[0]); i++ )
+    if( !strncmp( name, shim_prefix[i], strlen( shim_prefix[i] ) ) ) return COMPAT_PROF_SHIM;
+  return COMPAT_PROF_LIBC;
 }
 
-WIN32_CDECL
-int32_t
-LMGR8C_lp_checkout( int32_t v1,
-                    int32_t policy,
-                    char *  feature,
-                    char *  version,
-                    int     num_lic,
-                    char *  license_file_list ) {
-  //LOG_WARN(( "[WARN] LMGR8C_lp_checkout(%p, %p, \"%s\", \"%s\", %u, \"%s\")",
-  //         v1,
-  //         policy,
-  //         feature, 
-  //         version,
-  //         num_lic,
-  //         license_file_list ));
-  return 0;
+struct compat_prof_fn {
+  char const * name;
+  uintptr_t    addr;
+  uint32_t     cnt;
+  int          cat;
+};
+
+static int
+compat_prof_pc_cmp( void const * a,
+                    void const * b ) {
+  uintptr_t x = *(uintptr_t const *)a, y = *(uintptr_t const *)b;
+  return (x>y) - (x<y);
 }
 
-WIN32_CDECL
-void
-LMGR8C_lp_checkin( void * handle ) {
-  LOG_WARN(( "[WARN] LMGR8C_lp_checkin(%p)", handle ));
+static int
+compat_prof_fn_cmp( void const * a,
+                    void const * b ) {
+  uint32_t x = ((struct compat_prof_fn const *)a)->cnt;
+  uint32_t y = ((struct compat_prof_fn const *)b)->cnt;
+  return (x<y) - (x>y);
 }
 
-static char lmgr8c_errbuf[4096] = {0};
+static int
+compat_prof_str_cmp( void const * a,
+                     void const * b ) {
+  return strcmp( *(char * const *)a, *(char * const *)b );
+}
 
-/* lp_errstring	*/
-WIN32_CDECL
-char *
-LMGR8C_lp_errstring( void ) {
-  LOG_WARN(( "LMGR8C_lp_errstring()" ));
-  snprintf( lmgr8c_errbuf, sizeof(lmgr8c_errbuf), "Hello!" );
-  return lmgr8c_errbuf;
+/* compat_prof_write_stacks: Writes "outer;...;inner count" lines. */
+static void
+compat_prof_write_stacks( void ) {
+  uint32_t used = __atomic_load_n( &g_prof_stk_used, __ATOMIC_ACQUIRE );
+  uint32_t cnt  = 0;
+  for( uint32_t off=0; off<used; off += 1U+(uint32_t)g_prof_stk[ off ] ) cnt++;
+  char ** line = calloc( cnt ? cnt : 1, sizeof(char *) );
+  if( !line ) return;
+
+  uint32_t i = 0;
+  for( uint32_t off=0; off<used && i<cnt; off += 1U+(uint32_t)g_prof_stk[ off ], i++ ) {
+    uint32_t         depth = (uint32_t)g_prof_stk[ off ];
+    uintptr_t const * pc   = g_prof_stk+off+1;
+    char * str = NULL;
+    size_t sz  = 0;
+    FILE * ms  = open_memstream( &str, &sz );
+    if( !ms ) break;
+    for( uint32_t d=depth; d-- > 0; ) {
+      /* Return addresses may point past the end of the calling function */
+      uintptr_t a = d ? pc[d]-1 : pc[d];
+      char const * name = compat_sym_lookup( a, NULL );
+      if( name ) fputs( name, ms );
+      else       fprintf( ms, "%#lx", (unsigned long)a );
+      if( d ) fputc( ';', ms );
+    }
+    fclose( ms );
+    line[i] = str;
+  }
+  cnt = i;
+  qsort( line, cnt, sizeof(char *), compat_prof_str_cmp );
+
+  FILE * f = fopen( g_prof_stk_path, "w" );
+  if( !f ) {
+    LOG_WARN(( "profile: cannot create %s: %s", g_prof_stk_path, strerror( errno ) ));
+  }
+  for( uint32_t j=0; j<cnt; ) {
+    uint32_t k = j+1;
+    while( k<cnt && !strcmp( line[k], line[j] ) ) k++;
+    if( f ) fprintf( f, "%s %u\n", line[j], k-j );
+    j = k;
+  }
+  if( f ) fclose( f );
+  for( uint32_t j=0; j<cnt; j++ ) free( line[j] );
+  free( line );
 }
 
-WIN32_CDECL
-int32_t
-LMGR326B_lp_checkin() {
-  LOG_INFO(( "LMGR326B_lp_checkin()" ));
-  return 0;
+static void
+compat_prof_report( void ) {
+  if( !g_prof_pc ) return;
+  struct itimerval off = {0};
+  setitimer( ITIMER_PROF, &off, NULL );
+  if( g_prof_stk ) compat_prof_write_stacks();
+  uint32_t n = __atomic_load_n( &g_prof_cnt, __ATOMIC_ACQUIRE );
+  if( !n ) return;
+
+  /* Sorted PCs of the same function are adjacent */
+  qsort( g_prof_pc, n, sizeof(uintptr_t), compat_prof_pc_cmp );
+  struct compat_prof_fn * fn = calloc( n, sizeof(struct compat_prof_fn) );
+  if( !fn ) return;
+  uint32_t fn_cnt = 0;
+  uint32_t cat_cnt[ COMPAT_PROF_CAT_CNT ] = {0};
+  for( uint32_t i=0; i<n; i++ ) {
+    uintptr_t start = g_prof_pc[i];
+    char const * name = compat_sym_lookup( g_prof_pc[i], &start );
+    int cat = compat_prof_classify( g_prof_pc[i], name );
+    cat_cnt[ cat ]++;
+    if( fn_cnt && fn[ fn_cnt-1 ].addr==start && fn[ fn_cnt-1 ].name==name ) {
+      fn[ fn_cnt-1 ].cnt++;
+      continue;
+    }
+    fn[ fn_cnt++ ] = (struct compat_prof_fn){ name, start, 1, cat };
+  }
+  qsort( fn, fn_cnt, sizeof(struct compat_prof_fn), compat_prof_fn_cmp );
+
+  static char const * const cat_name[ COMPAT_PROF_CAT_CNT ] = { "pe", "shim", "libc" };
+  fprintf( stderr, "profile: %u samples at %ld Hz (%u dropped): pe %.1f%%, shim %.1f%%, libc %.1f%%\n",
+           n, g_prof_hz, __atomic_load_n( &g_prof_dropped, __ATOMIC_RELAXED ),
+           100.0*cat_cnt[ COMPAT_PROF_PE   ]/n,
+           100.0*cat_cnt[ COMPAT_PROF_SHIM ]/n,
+           100.0*cat_cnt[ COMPAT_PROF_LIBC ]/n );
+  for( uint32_t i=0; i<fn_cnt; i++ ) {
+    char unk[ 32 ];
+    char const * name = fn[i].name;
+    if( !name ) { snprintf( unk, sizeof(unk), "%#lx", (unsigned long)fn[i].addr ); name = unk; }
+    fprintf( stderr, "%8u %6.2f%% %-4s %s\n",
+             fn[i].cnt, 100.0*fn[i].cnt/n, cat_name[ fn[i].cat ], name );
+  }
+  free( fn );
 }
 
-WIN32_CDECL
-int32_t
-LMGR326B_lp_checkout() {
-  LOG_INFO(( "LMGR326B_lp_checkout()" ));
-  return 0;
+static void
+compat_prof_init( char const * hz_str,
+                  char const * stacks_path ) {
+  char * end;
+  long hz = strtol( hz_str, &end, 10 );
+  if( *end || hz<=0 || hz>100000 ) {
+    LOG_WARN(( "ignoring invalid WIN32_PROFILE \"%s\"", hz_str ));
+    return;
+  }
+  g_prof_pc = mmap( NULL, COMPAT_PROF_MAX*sizeof(uintptr_t), PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+  if( g_prof_pc==MAP_FAILED ) { g_prof_pc = NULL; return; }
+  g_prof_hz = hz;
+
+  if( stacks_path ) {
+    g_prof_stk = mmap( NULL, COMPAT_PROF_STK_WORDS*sizeof(uintptr_t), PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0 );
+    if( g_prof_stk==MAP_FAILED ) g_prof_stk = NULL;
+    g_prof_stk_path = strdup( stacks_path );
+    /* Cache the main stack's bounds and symbols outside of the signal handler */
+    uintptr_t here = (uintptr_t)&here;
+    compat_walk_stack_add( here );
+    if( !g_syms_loaded ) compat_syms_load();
+  }
+
+  struct sigaction sa = {
+    .sa_sigaction = compat_prof_on_signal,
+    .sa_flags     = SA_SIGINFO|SA_RESTART
+  };
+  sigaction( SIGPROF, &sa, NULL );
+  atexit( compat_prof_report );
+  compat_prof_arm();
 }
 
-WIN32_CDECL
-int32_t
-LMGR326B_lp_errstring() {
-  LOG_WARN(( "[WARN] LMGR326B_lp_errstring()" ));
-  return 0;
+/********************************************************************************
+   Fork Server
+ ********************************************************************************/
+
+/* The fork server turns the process into a zygote once the PE's CRT
+   has finished initializing (at the first GetCommandLineA call).
+
+   For every client connection, the zygote forks a supervisor which
+   receives the request and forks the actual worker.  The worker takes
+   over the client's stdio, cwd, argv and environment, then returns
+   into the PE.  The supervisor waits for the worker and reports the
+   exit code back to the client. */
+
+static int
+compat_server_read_full( int    fd,
+                         void * buf,
+                         size_t sz ) {
+  uint8_t * p = buf;
+  while( sz ) {
+    ssize_t n = read( fd, p, sz );
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ) return 0;
+    p  += n;
+    sz -= n;
+  }
+  return 1;
 }
 
-WIN32_STDCALL
-int
-USER32_MessageBoxA( uint32_t    h_wnd,
-                    char const * lp_text,
-                    char const * lp_caption,
-                    uint32_t    u_type ) {
-  LOG_WARN(( "[WARN] USER32_MessageBoxA(%u, %p, %p, %u)", h_wnd, lp_text, lp_caption, u_type ));
-  return 0;
+/* compat_server_recv: Reads a request from a client connection.
+
+   On success, fills fds with the client's stdio descriptors and
+   returns a heap-allocated payload.  Returns NULL on failure. */
+static char *
+compat_server_recv( int                   conn,
+                    compat_server_req_t * req,
+                    int                   fds[3] ) {
+  union {
+    struct cmsghdr hdr;
+    char           buf[ CMSG_SPACE( 3*sizeof(int) ) ];
+  } ctl;
+  struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+  struct msghdr msg = {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = ctl.buf,
+    .msg_controllen = sizeof(ctl.buf)
+  };
+
+  ssize_t n = recvmsg( conn, &msg, MSG_WAITALL|MSG_CMSG_CLOEXEC );
+  if( n!=sizeof(*req) ) {
+    LOG_WARN(( "fork server: short request header (%d bytes)", (int)n ));
+    return NULL;
+  }
+
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msg );
+  if( !cmsg || cmsg->cmsg_level!=SOL_SOCKET || cmsg->cmsg_type!=SCM_RIGHTS ||
+      cmsg->cmsg_len!=CMSG_LEN( 3*sizeof(int) ) ) {
+    LOG_WARN(( "fork server: request without stdio descriptors" ));
+    return NULL;
+  }
+  memcpy( fds, CMSG_DATA( cmsg ), 3*sizeof(int) );
+
+  if( req->magic!=COMPAT_SERVER_MAGIC || req->payload_sz>COMPAT_SERVER_PAYLOAD_MAX ) {
+    LOG_WARN(( "fork server: malformed request (magic=%#x payload_sz=%u)", req->magic, req->payload_sz ));
+    return NULL;
+  }
+
+  char * payload = malloc( req->payload_sz+1 );
+  assert( payload );
+  if( !compat_server_read_full( conn, payload, req->payload_sz ) ) {
+    LOG_WARN(( "fork server: truncated request payload" ));
+    free( payload );
+    return NULL;
+  }
+  payload[ req->payload_sz ] = '\0';
+  return payload;
 }
 
-WIN32_STDCALL
-int32_t
-USER32_LoadStringA( uint32_t h_instance,
-                    uint32_t u_id,
-                    char *   lp_buffer,
-                    int      n_buffer_max ) {
-  LOG_WARN(( "[WARN] USER32_LoadStringA(%u, %u, %p, %u)", h_instance, u_id, lp_buffer, n_buffer_max ));
-  if( u_id>=__pe_str_cnt )
-    return 0;
-  snprintf( lp_buffer, n_buffer_max, "%s", __pe_strs[u_id] );
-  return 1;
+/* compat_server_apply: Installs a request into the current (worker) process. */
+static void
+compat_server_apply( compat_server_req_t const * req,
+                     char *                      payload,
+                     int const                   fds[3] ) {
+  for( int i=0; i<3; i++ ) {
+    dup2( fds[i], i );
+    if( fds[i]>2 ) close( fds[i] );
+  }
+  clearerr( stdin );
+  compat_trace_attach();
+  compat_stats_reset();
+  compat_tl_reset();
+  compat_stat_reset();
+  compat_perfmap_write();
+  compat_prof_arm();
+
+  char * end = payload+req->payload_sz;
+  char * s   = payload;
+
+  char const * cwd = s;
+  s += strlen( s )+1;
+  if( cwd[0] && chdir( cwd )<0 )
+    LOG_WARN(( "fork server: chdir(\"%s\") failed: %s", cwd, strerror( errno ) ));
+  g_cwd_len = 0;
+
+  char ** argv = calloc( req->argc+1, sizeof(char *) );
+  char ** envp = calloc( req->envc+1, sizeof(char *) );
+  assert( argv && envp );
+  for( uint32_t i=0; i<req->argc && s<end; i++ ) { argv[i] = s; s += strlen( s )+1; }
+  for( uint32_t i=0; i<req->envc && s<end; i++ ) { envp[i] = s; s += strlen( s )+1; }
+
+  g_argc  = (int)req->argc;
+  g_argv  = argv;
+  environ = envp;
+
+  unsetenv( "PATH" );
+  unsetenv( "WIN32_SERVER" );
+  compat_log_init();
+  g_time_pinned = 0;
+  g_time_ticks  = 0;
+  compat_time_init();
 }
 
-WIN32_STDCALL
-uint32_t
-VERSION_GetFileVersionInfoSizeA( char const * lptstr_filename,
-                                 uint32_t *   lpdw_handle ) {
-# if PE_HAS_VERSION
-  LOG_DEBUG(( "VERSION_GetFileVersionInfoSizeA(%s, %p)", lptstr_filename, lpdw_handle ));
-  lpdw_handle = NULL;
-  return __pe_rodata_version_end - __pe_rodata_version_start;
-# else
-  return 0;
-# endif
+/* compat_server_serve: Handles one client connection in the supervisor.
+
+   Returns in the worker process only. */
+static void
+compat_server_serve( int conn ) {
+  signal( SIGCHLD, SIG_DFL );
+
+  compat_server_req_t req;
+  int fds[3];
+  char * payload = compat_server_recv( conn, &req, fds );
+  if( !payload ) _exit( 1 );
+
+  pid_t worker = fork();
+  if( worker<0 ) {
+    LOG_ERR(( "fork server: fork() failed: %s", strerror( errno ) ));
+    _exit( 1 );
+  }
+  if( worker==0 ) {
+    close( conn );
+    compat_server_apply( &req, payload, fds );
+    return;
+  }
+
+  for( int i=0; i<3; i++ ) close( fds[i] );
+  free( payload );
+
+  int status;
+  while( waitpid( worker, &status, 0 )<0 ) {
+    if( errno!=EINTR ) {
+      LOG_ERR(( "fork server: waitpid(%d) failed: %s", worker, strerror( errno ) ));
+      _exit( 1 );
+    }
+  }
+
+  int32_t code;
+  if( WIFEXITED( status ) ) code = WEXITSTATUS( status );
+  else                      code = 128+WTERMSIG( status );
+  if( write( conn, &code, sizeof(code) )!=sizeof(code) )
+    LOG_WARN(( "fork server: failed to send exit code: %s", strerror( errno ) ));
+  _exit( 0 );
 }
 
-WIN32_STDCALL
-int
-VERSION_GetFileVersionInfoA( char const * lptstr_filename,
-                             uint32_t     dw_handle,
-                             uint32_t     dw_len,
-                             void *       lp_data ) {
-# if PE_HAS_VERSION
-  LOG_DEBUG(( "VERSION_GetFileVersionInfoA(%s, %u, %p)", lptstr_filename, dw_len, lp_data ));
-  memcpy( lp_data, __pe_rodata_version_start, dw_len );
-  return 1;
-# else
-  return 0;
-# endif
+static void
+compat_server_run( char const * path ) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if( strlen( path )>=sizeof(addr.sun_path) ) {
+    LOG_FATAL(( "fork server: socket path too long: %s", path ));
+  }
+  strcpy( addr.sun_path, path );
+
+  int lfd = socket( AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+  if( lfd<0 ) LOG_FATAL(( "fork server: socket() failed: %s", strerror( errno ) ));
+
+  /* Only replace a socket left behind by a server that is gone */
+  struct stat st;
+  if( 0==lstat( path, &st ) ) {
+    if( !S_ISSOCK( st.st_mode ) )
+      LOG_FATAL(( "fork server: %s exists and is not a socket", path ));
+    int probe = socket( AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+    if( probe<0 ) LOG_FATAL(( "fork server: socket() failed: %s", strerror( errno ) ));
+    int live = 0==connect( probe, (struct sockaddr *)&addr, sizeof(addr) ) || errno!=ECONNREFUSED;
+    close( probe );
+    if( live ) LOG_FATAL(( "fork server: %s is in use", path ));
+    unlink( path );
+  }
+  if( bind( lfd, (struct sockaddr *)&addr, sizeof(addr) )<0 )
+    LOG_FATAL(( "fork server: bind(\"%s\") failed: %s", path, strerror( errno ) ));
+  if( listen( lfd, 128 )<0 )
+    LOG_FATAL(( "fork server: listen() failed: %s", strerror( errno ) ));
+
+  /* Supervisors are reaped automatically */
+  struct sigaction sa = { .sa_handler = SIG_DFL, .sa_flags = SA_NOCLDWAIT };
+  sigaction( SIGCHLD, &sa, NULL );
+
+  LOG_INFO(( "fork server: listening on %s", path ));
+  fflush( NULL );
+
+  for(;;) {
+    int conn = accept4( lfd, NULL, NULL, SOCK_CLOEXEC );
+    if( conn<0 ) {
+      if( errno!=EINTR ) LOG_WARN(( "fork server: accept() failed: %s", strerror( errno ) ));
+      continue;
+    }
+
+    pid_t pid = fork();
+    if( pid==0 ) {
+      close( lfd );
+      compat_server_serve( conn );
+      return;
+    }
+    if( pid<0 ) LOG_WARN(( "fork server: fork() failed: %s", strerror( errno ) ));
+    close( conn );
+  }
+}
+
+/********************************************************************************
+   Batch Mode
+ ********************************************************************************/
+
+/* Batch mode runs the PE entry point once per line of a list file,
+   all within a single process.
+
+   The PE's writable sections are captured before the first run and
+   restored after each one.  ExitProcess longjmps back to the batch
+   loop instead of exiting.  Runtime state that outlives a run
+   (handles, heap, cached strings) is reset in compat_batch_reset. */
+
+struct compat_batch_region {
+  uint8_t * start;
+  uint8_t * end;
+  uint8_t * copy;
+};
+
+static struct compat_batch_region g_batch_regions[] = {
+  { __pe_data_start,     __pe_data_end,     NULL },
+  { __pe_data_CRT_start, __pe_data_CRT_end, NULL },
+  { __pe_bss_start,      __pe_bss_end,      NULL },
+  { __pe_bss_tib_start,  __pe_bss_tib_end,  NULL }
+};
+
+#define COMPAT_BATCH_REGION_CNT (sizeof(g_batch_regions)/sizeof(g_batch_regions[0]))
+
+static void
+compat_batch_snapshot( void ) {
+  for( size_t i=0; i<COMPAT_BATCH_REGION_CNT; i++ ) {
+    struct compat_batch_region * r = &g_batch_regions[i];
+    r->copy = malloc( r->end - r->start );
+    assert( r->copy );
+    memcpy( r->copy, r->start, r->end - r->start );
+  }
 }
 
-WIN32_STDCALL
-int
-VERSION_VerQueryValueA( void const * p_block,
-                        char const * lp_sub_block,
-                        void **      lplp_buffer,
-                        uint32_t *   pu_len ) {
-  LOG_DEBUG(( "VERSION_VerQueryValueA(%p, %s, %p, %p)", p_block, lp_sub_block, lplp_buffer, pu_len ));
-  if( 0!=strcmp( lp_sub_block, "\\" ) ) {
-    LOG_WARN(( "VERSION_VerQueryValueA: unhandled sub block %s", lp_sub_block ));
+static void
+compat_batch_reset( void ) {
+  compat_ctr_host();
+  fflush( NULL );
+
+  for( size_t i=0; i<COMPAT_BATCH_REGION_CNT; i++ ) {
+    struct compat_batch_region * r = &g_batch_regions[i];
+    memcpy( r->start, r->copy, r->end - r->start );
+  }
+
+  /* Close everything but the standard handles */
+  for( uint32_t h=compat_stderr+1; h<=handle_nonce && h<COMPAT_HANDLE_CNT; h++ ) {
+    compat_handle_t * hdl = compat_handle_get( h );
+    if( !hdl ) continue;
+    compat_tl_close( h, -1 );
+    hdl->close( hdl->data );
+    compat_handle_free( h );
+  }
+  handle_nonce = compat_stderr;
+
+  compat_arena_reset();
+  compat_mapping_reset();
+  compat_stat_reset();
+
+  /* Undo SetCurrentDirectoryA of the unit */
+  if( g_cwd_home>=0 ) {
+    if( fchdir( g_cwd_home )<0 ) LOG_WARN(( "batch: cannot restore working directory: %s", strerror( errno ) ));
+    close( g_cwd_home );
+    g_cwd_home = -1;
+    g_cwd_len  = 0;
+  }
 
-    if( strstr( lp_sub_block, "\\CompanyName" ) ) {
-      *lplp_buffer = "Freescale Semiconductor, Inc.";
-      *pu_len = 30;
-      return 1;
-    }
-    if( strstr( lp_sub_block, "\\ProductName" ) ) {
-      *lplp_buffer = "Freescale CodeWarrior";
-      *pu_len = 22;
-      return 1;
-    }
-    if( strstr( lp_sub_block, "\\LegalCopyright" ) ) {
-      *lplp_buffer = "Copyright \xa9 2000-2010";
-      *pu_len = 23;
-      return 1;
+  free( g_cmdline ); g_cmdline = NULL;
+  free( g_envstr  ); g_envstr  = NULL;
+
+  tls_index = 1;
+  memset( tls_slots, 0, sizeof(tls_slots) );
+
+  compat_cache_reset();
+  compat_nondet_reset();
+
+  g_last_error = ERROR_SUCCESS;
+}
+
+/* compat_batch_split: Splits a list file line into arguments in place.
+   Whitespace separates arguments, double quotes group them.
+   Returns the argument count. */
+static int
+compat_batch_split( char *  line,
+                    char ** argv,
+                    int     argv_max ) {
+  int argc = 0;
+  char * s = line;
+  for(;;) {
+    while( *s && isspace( (unsigned char)*s ) ) s++;
+    if( !*s ) break;
+    if( argc>=argv_max ) {
+      LOG_WARN(( "batch: too many arguments, truncating" ));
+      break;
     }
 
-    *lplp_buffer = "(unknown)";
-    *pu_len = 10;
-    return 1;
+    char * out = s;
+    argv[ argc++ ] = out;
+    int quoted = 0;
+    while( *s && (quoted || !isspace( (unsigned char)*s )) ) {
+      if( *s=='"' ) { quoted = !quoted; s++; continue; }
+      *out++ = *s++;
+    }
+    if( *s ) s++;
+    *out = '\0';
   }
+  return argc;
+}
 
-  /* Search for 0xFEEF04BD magic */
-  uint32_t const magic = 0xFEEF04BD;
-  uint32_t const * p = p_block;
-  /* TODO missing bounds check */
-  for( int i=0; i<16; i++, p++ ) {
-    if( *p==magic ) {
-      /* Found it! */
-      *lplp_buffer = (void *)p;
-      *pu_len = 0x3c;
-      return 1;
+#define COMPAT_BATCH_ARGV_MAX 1024
+
+/* compat_batch_prefetch: Fetches the remote cache manifests of all
+   units in one pipelined round trip. */
+static void
+compat_batch_prefetch( FILE * list ) {
+  static char * argv[ COMPAT_BATCH_ARGV_MAX+2 ];
+  int     saved_argc = g_argc;
+  char ** saved_argv = g_argv;
+  argv[0] = g_argv[0];
+
+  uint64_t * keys     = NULL;
+  size_t     key_cnt  = 0;
+  size_t     key_cap  = 0;
+  char *     line     = NULL;
+  size_t     line_cap = 0;
+  while( getline( &line, &line_cap, list )>=0 ) {
+    char * s = line;
+    while( isspace( (unsigned char)*s ) ) s++;
+    if( *s=='\0' || *s=='#' ) continue;
+
+    int n = compat_batch_split( s, argv+1, COMPAT_BATCH_ARGV_MAX );
+    argv[ n+1 ] = NULL;
+    g_argc = n+1;
+    g_argv = argv;
+    compat_cache_compute_key();
+
+    if( key_cnt==key_cap ) {
+      key_cap = key_cap ? 2*key_cap : 64;
+      keys = realloc( keys, key_cap*sizeof(uint64_t) );
+      assert( keys );
     }
+    keys[ key_cnt++ ] = g_cache.key;
   }
+  free( line );
+  rewind( list );
+  g_argc = saved_argc;
+  g_argv = saved_argv;
 
-  LOG_WARN(( "VERSION_VerQueryValueA: didn't find VS_FIXEDFILEINFO" ));
-  return 0;
+  compat_cache_prefetch( keys, key_cnt );
+  free( keys );
 }
 
-WIN32_STDCALL
-int
-ole32_CoInitialize( void * pv_reserved ) {
-  LOG_WARN(( "[WARN] ole32_CoInitialize(%p)", pv_reserved ));
-  return 0;
-}
+__attribute__((noreturn))
+static void
+compat_batch_run( char const * list_path ) {
+  FILE * list = fopen( list_path, "r" );
+  if( !list ) LOG_FATAL(( "batch: fopen(\"%s\") failed: %s", list_path, strerror( errno ) ));
+
+  if( !compat_arena_init( NULL ) ) LOG_FATAL(( "batch: cannot run without heap arena" ));
+  compat_batch_snapshot();
+  if( g_cache.remote ) compat_batch_prefetch( list );
+
+  static char * argv[ COMPAT_BATCH_ARGV_MAX+2 ];
+  argv[0] = g_argv[0];
+
+  char *  line     = NULL;
+  size_t  line_cap = 0;
+  volatile int      lineno = 0;
+  volatile uint32_t units  = 0;
+  volatile uint32_t failed = 0;
+  volatile int      status = 0;
+
+  while( getline( &line, &line_cap, list )>=0 ) {
+    lineno++;
+    char * s = line;
+    while( isspace( (unsigned char)*s ) ) s++;
+    if( *s=='\0' || *s=='#' ) continue;
+
+    int n = compat_batch_split( s, argv+1, COMPAT_BATCH_ARGV_MAX );
+    argv[ n+1 ] = NULL;
+    g_argc = n+1;
+    g_argv = argv;
+
+    LOG_INFO(( "batch: line %d: running", lineno ));
+    g_batch_exit_code = 0;
+    if( setjmp( g_batch_jmp )==0 ) {
+      g_batch_active = 1;
+      compat_ctr_pe();
+      __pe_text_start_call();
+    }
+    g_batch_active = 0;
 
-WIN32_STDCALL
-void
-ole32_CoUninitialize( void ) {
-  LOG_WARN(( "[WARN] ole32_CoUninitialize()" ));
-}
+    units++;
+    if( g_batch_exit_code!=0 ) {
+      LOG_ERR(( "batch: line %d exited with code %u", lineno, g_batch_exit_code ));
+      failed++;
+      if( !status ) status = (int)g_batch_exit_code;
+    }
 
-WIN32_STDCALL
-int
-ole32_CoCreateInstance( void *   rclsid,
-                        void *   p_unk_outer,
-                        uint32_t dw_cls_context,
-                        void *   riid,
-                        void **  ppv ) {
-  LOG_WARN(( "[WARN] ole32_CoCreateInstance(%04x%04x-%04x-%04x-%04x-%04x%04x%04x, %p, %u, %p, %p)",
-                   ((uint16_t*)rclsid)[1],
-                   ((uint16_t*)rclsid)[0],
-                   ((uint16_t*)rclsid)[2],
-                   ((uint16_t*)rclsid)[3],
-                   __builtin_bswap16( ((uint16_t*)rclsid)[4] ),
-                   __builtin_bswap16( ((uint16_t*)rclsid)[5] ),
-                   __builtin_bswap16( ((uint16_t*)rclsid)[6] ),
-                   __builtin_bswap16( ((uint16_t*)rclsid)[7] ),
-                   p_unk_outer, dw_cls_context, riid, ppv ));
-  *ppv = NULL;
-  return 0x80040154;
-}
+    compat_batch_reset();
+  }
 
-WIN32_STDCALL
-void
-ole32_CoTaskMemFree( void * pv ) {
-  LOG_WARN(( "[WARN] ole32_CoTaskMemFree(%p)", pv ));
+  free( line );
+  fclose( list );
+  LOG_INFO(( "batch: %u units, %u failed", units, failed ));
+  exit( status );
 }
 
-WIN32_STDCALL
-void *
-ole32_CoTaskMemAlloc( uint32_t cb ) {
-  LOG_WARN(( "[WARN] ole32_CoTaskMemAlloc(%u)", cb ));
-  return 0;
-}
+/********************************************************************************
+   Snapshot
+ ********************************************************************************/
 
-WIN32_STDCALL
-int
-WS2_32_WSAStartup( uint16_t w_version_requested,
-                   void *   lp_wsa_data ) {
-  LOG_WARN(( "[WARN] WS2_32_WSAStartup(%u, %p)", w_version_requested, lp_wsa_data ));
-  return 0;
-}
+/* Snapshot mode skips CRT init on every run but the first.
+
+   The first run executes the PE on a stack and heap arena at fixed
+   addresses.  Once CRT init is done (first GetCommandLineA call), the
+   PE's writable sections, the used part of the arena and stack, and
+   the register context are written to a snapshot file.  Later runs
+   map that file over the same addresses and resume from the saved
+   context, as if GetCommandLineA had just been called.
+
+   Snapshots are named after a hash of the ELF, so a rebuilt tool gets
+   a fresh snapshot. */
+
+#define COMPAT_SNAP_MAGIC      0x53534d57 /* "WMSS" */
+#define COMPAT_SNAP_VERSION    1
+#define COMPAT_SNAP_PAGE       4096U
+#define COMPAT_SNAP_REGION_MAX 8
+
+#define COMPAT_STACK_SZ        (8U<<20)
+#define COMPAT_STACK_BASE      ((void *)(0x50000000U-COMPAT_STACK_SZ))
+#define COMPAT_ARENA_BASE      ((void *)0x50000000U)
+
+/* Callee-saved register context */
+struct compat_ctx {
+  uint32_t ebx;
+  uint32_t esi;
+  uint32_t edi;
+  uint32_t ebp;
+  uint32_t esp;
+  uint32_t eip;
+  uint32_t fpucw;
+};
+typedef struct compat_ctx compat_ctx_t;
+
+/* compat_ctx_save: Saves the caller's context.  Returns 0, or 1 when
+   resumed through compat_ctx_resume.
+   compat_ctx_resume: Resumes a saved context.
+   compat_stack_enter: Calls fn on a new stack. */
+int  compat_ctx_save   ( compat_ctx_t *       ctx );
+void compat_ctx_resume ( compat_ctx_t const * ctx ) __attribute__((noreturn));
+void compat_stack_enter( void * stack_top, void (* fn)( void ) ) __attribute__((noreturn));
+
+#if defined(__i386__)
+__asm__(
+  ".text\n"
+  ".globl compat_ctx_save\n"
+  "compat_ctx_save:\n"
+  "  movl 4(%esp), %eax\n"
+  "  movl %ebx,  0(%eax)\n"
+  "  movl %esi,  4(%eax)\n"
+  "  movl %edi,  8(%eax)\n"
+  "  movl %ebp, 12(%eax)\n"
+  "  leal 4(%esp), %ecx\n"
+  "  movl %ecx, 16(%eax)\n"
+  "  movl (%esp), %ecx\n"
+  "  movl %ecx, 20(%eax)\n"
+  "  fnstcw 24(%eax)\n"
+  "  xorl %eax, %eax\n"
+  "  ret\n"
+  ".globl compat_ctx_resume\n"
+  "compat_ctx_resume:\n"
+  "  movl 4(%esp), %eax\n"
+  "  fldcw 24(%eax)\n"
+  "  movl  0(%eax), %ebx\n"
+  "  movl  4(%eax), %esi\n"
+  "  movl  8(%eax), %edi\n"
+  "  movl 12(%eax), %ebp\n"
+  "  movl 16(%eax), %esp\n"
+  "  movl 20(%eax), %ecx\n"
+  "  movl $1, %eax\n"
+  "  jmp *%ecx\n"
+  ".globl compat_stack_enter\n"
+  "compat_stack_enter:\n"
+  "  movl 8(%esp), %eax\n"
+  "  movl 4(%esp), %esp\n"
+  "  xorl %ebp, %ebp\n"
+  "  call *%eax\n"
+  "  hlt\n"
+);
+#define COMPAT_SNAP_SUPPORTED 1
+#else
+#define COMPAT_SNAP_SUPPORTED 0
+int  compat_ctx_save   ( compat_ctx_t *       ctx ) { (void)ctx; return 0; }
+void compat_ctx_resume ( compat_ctx_t const * ctx ) { (void)ctx; abort(); }
+void compat_stack_enter( void * stack_top, void (* fn)( void ) ) { (void)stack_top; fn(); abort(); }
+#endif
+
+struct compat_snap_region {
+  uint32_t addr;
+  uint32_t size;
+  uint32_t file_off;
+};
 
-WIN32_STDCALL
-int
-WS2_32_WSAGetLastError( void ) {
-  LOG_ERR(( "[TODO] WS2_32_WSAGetLastError()" ));
-  return 0;
-}
+struct compat_snap_hdr {
+  uint32_t     magic;
+  uint32_t     version;
+  uint64_t     elf_hash;
+  compat_ctx_t ctx;
+  int32_t      last_error;
+  uint32_t     tls_index;
+  uint32_t     tls_slots[ COMPAT_TLS_SIZE ];
+  uint32_t     region_cnt;
+  struct compat_snap_region region[ COMPAT_SNAP_REGION_MAX ];
+};
 
-WIN32_STDCALL
-uint16_t
-WS2_32_ntohs( uint16_t netshort ) {
-  return __builtin_bswap16( netshort );
-}
+static compat_ctx_t g_snapshot_ctx;
+static uint64_t     g_snapshot_elf_hash;
 
-WIN32_STDCALL
-char const *
-WS2_32_inet_ntoa( void * in_addr ) {
-  LOG_ERR(( "[TODO] WS2_32_inet_ntoa(%p)", in_addr ));
-  return 0;
+static inline uint32_t
+compat_snap_align_up( uint32_t x ) {
+  return (x+COMPAT_SNAP_PAGE-1U)&~(COMPAT_SNAP_PAGE-1U);
 }
 
-WIN32_STDCALL
-int
-WS2_32_shutdown( uint32_t s,
-                 int      how ) {
-  LOG_WARN(( "[WARN] WS2_32_shutdown(%u, %u)", s, how ));
-  return 0;
+static int
+compat_snap_add_region( struct compat_snap_hdr * hdr,
+                        void const *             start,
+                        void const *             end ) {
+  if( hdr->region_cnt>=COMPAT_SNAP_REGION_MAX ) return 0;
+  struct compat_snap_region * r = &hdr->region[ hdr->region_cnt++ ];
+  r->addr = (uint32_t)(uintptr_t)start;
+  r->size = (uint32_t)((uint8_t const *)end - (uint8_t const *)start);
+  return 1;
 }
 
-WIN32_STDCALL
-int
-WS2_32_closesocket( uint32_t s ) {
-  LOG_WARN(( "[WARN] WS2_32_closesocket(%u)", s ));
-  return 0;
-}
+/* compat_snapshot_write: Writes the snapshot file.  Must not be
+   inlined into compat_snapshot_take, whose frame is part of the
+   snapshot. */
+__attribute__((noinline))
+static void
+compat_snapshot_write( char const * path ) {
+  if( handle_nonce!=compat_stderr ) {
+    LOG_WARN(( "snapshot: CRT init opened handles, not taking snapshot" ));
+    return;
+  }
 
-WIN32_STDCALL
-int
-WS2_32_WSACleanup( void ) {
-  LOG_WARN(( "[WARN] WS2_32_WSACleanup()" ));
-  return 0;
-}
+  static struct compat_snap_hdr hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  hdr.magic      = COMPAT_SNAP_MAGIC;
+  hdr.version    = COMPAT_SNAP_VERSION;
+  hdr.elf_hash   = g_snapshot_elf_hash;
+  hdr.ctx        = g_snapshot_ctx;
+  hdr.last_error = g_last_error;
+  hdr.tls_index  = tls_index;
+  memcpy( hdr.tls_slots, tls_slots, sizeof(hdr.tls_slots) );
+
+  uint8_t * stack_lo = (uint8_t *)(uintptr_t)( g_snapshot_ctx.esp & ~(COMPAT_SNAP_PAGE-1U) );
+  uint8_t * arena_hi = (uint8_t *)(uintptr_t)compat_snap_align_up( (uint32_t)(uintptr_t)g_arena->top );
+  compat_snap_add_region( &hdr, __pe_data_start,     __pe_data_end     );
+  compat_snap_add_region( &hdr, __pe_data_CRT_start, __pe_data_CRT_end );
+  compat_snap_add_region( &hdr, __pe_bss_start,      __pe_bss_end      );
+  compat_snap_add_region( &hdr, __pe_bss_tib_start,  __pe_bss_tib_end  );
+  compat_snap_add_region( &hdr, g_arena,  arena_hi );
+  compat_snap_add_region( &hdr, stack_lo, (uint8_t *)COMPAT_STACK_BASE + COMPAT_STACK_SZ );
+
+  uint32_t off = compat_snap_align_up( sizeof(hdr) );
+  for( uint32_t i=0; i<hdr.region_cnt; i++ ) {
+    hdr.region[i].file_off = off;
+    off = compat_snap_align_up( off + hdr.region[i].size );
+  }
 
-WIN32_STDCALL
-uint32_t
-WS2_32_socket( int af,
-               int type,
-               int protocol ) {
-  LOG_WARN(( "[WARN] WS2_32_socket(%u, %u, %u)", af, type, protocol ));
-  return 0;
-}
+  /* Write to a temporary file first, so concurrent runs never see a
+     partial snapshot */
+  char tmp_path[ PATH_MAX ];
+  snprintf( tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid() );
+  int fd = open( tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644 );
+  if( fd<0 ) {
+    LOG_WARN(( "snapshot: open(\"%s\") failed: %s", tmp_path, strerror( errno ) ));
+    return;
+  }
 
-WIN32_STDCALL
-uint16_t
-WS2_32_htons( uint16_t hostshort ) {
-  LOG_WARN(( "[WARN] WS2_32_htons(%u)", hostshort ));
-  return 0;
+  int ok = pwrite( fd, &hdr, sizeof(hdr), 0 )==(ssize_t)sizeof(hdr);
+  for( uint32_t i=0; ok && i<hdr.region_cnt; i++ ) {
+    struct compat_snap_region const * r = &hdr.region[i];
+    ok = pwrite( fd, (void *)(uintptr_t)r->addr, r->size, r->file_off )==(ssize_t)r->size;
+  }
+  ok = ok && ftruncate( fd, off )==0;
+  ok = ( close( fd )==0 ) && ok;
+  if( ok ) ok = rename( tmp_path, path )==0;
+  if( !ok ) {
+    LOG_WARN(( "snapshot: failed to write \"%s\": %s", path, strerror( errno ) ));
+    unlink( tmp_path );
+    return;
+  }
+  LOG_INFO(( "snapshot: wrote %s (%u bytes)", path, off ));
 }
 
-WIN32_STDCALL
-uint32_t
-WS2_32_inet_addr( char const * cp ) {
-  LOG_WARN(( "[WARN] WS2_32_inet_addr(%p)", cp ));
-  return 0;
+/* compat_snapshot_take: Called once CRT init is done.  Returns twice:
+   right after writing the snapshot, and in every run resumed from it. */
+static void
+compat_snapshot_take( void ) {
+  char * path = g_snapshot_path;
+  g_snapshot_path = NULL;
+  if( compat_ctx_save( &g_snapshot_ctx ) ) {
+    LOG_DEBUG(( "snapshot: resumed" ));
+    return;
+  }
+  compat_snapshot_write( path );
+  free( path );
 }
 
-WIN32_STDCALL
-int
-WS2_32_connect( uint32_t s,
-                void *   name,
-                int      namelen ) {
-  LOG_WARN(( "[WARN] WS2_32_connect(%u, %p, %u)", s, name, namelen ));
-  return 0;
+/* compat_snapshot_map: Places a region of the snapshot file at its
+   address.  Page-aligned regions are mapped copy-on-write, others
+   are read. */
+static int
+compat_snapshot_map( int                               fd,
+                     struct compat_snap_region const * r ) {
+  void * addr = (void *)(uintptr_t)r->addr;
+  if( (r->addr%COMPAT_SNAP_PAGE)==0 && (r->size%COMPAT_SNAP_PAGE)==0 ) {
+    if( r->size==0 ) return 1;
+    void * map = mmap( addr, r->size, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_FIXED, fd, r->file_off );
+    return map==addr;
+  }
+  return pread( fd, addr, r->size, r->file_off )==(ssize_t)r->size;
 }
 
-WIN32_STDCALL
-int
-WS2_32_select( int    nfds,
-               void * readfds,
-               void * writefds,
-               void * exceptfds,
-               void * timeout ) {
-  LOG_WARN(( "[WARN] WS2_32_select(%u, %p, %p, %p, %p)", nfds, readfds, writefds, exceptfds, timeout ));
-  return 0;
-}
+/* compat_snapshot_restore: Resumes from the snapshot file if it is
+   valid, otherwise returns. */
+static void
+compat_snapshot_restore( char const * path ) {
+  int fd = open( path, O_RDONLY|O_CLOEXEC );
+  if( fd<0 ) return;
+
+  static struct compat_snap_hdr hdr;
+  if( pread( fd, &hdr, sizeof(hdr), 0 )!=(ssize_t)sizeof(hdr) ||
+      hdr.magic     !=COMPAT_SNAP_MAGIC   ||
+      hdr.version   !=COMPAT_SNAP_VERSION ||
+      hdr.elf_hash  !=g_snapshot_elf_hash ||
+      hdr.region_cnt!=6U ) {
+    LOG_WARN(( "snapshot: ignoring invalid snapshot %s", path ));
+    close( fd );
+    return;
+  }
 
-WIN32_STDCALL
-int
-WS2_32___WSAFDIsSet( uint32_t s,
-                     void *   fd_set ) {
-  LOG_WARN(( "[WARN] WS2_32___WSAFDIsSet(%u, %p)", s, fd_set ));
-  return 0;
-}
+  /* Only map over memory we expect */
+  struct compat_snap_hdr expect = {0};
+  uint8_t * stack_top = (uint8_t *)COMPAT_STACK_BASE + COMPAT_STACK_SZ;
+  compat_snap_add_region( &expect, __pe_data_start,     __pe_data_end     );
+  compat_snap_add_region( &expect, __pe_data_CRT_start, __pe_data_CRT_end );
+  compat_snap_add_region( &expect, __pe_bss_start,      __pe_bss_end      );
+  compat_snap_add_region( &expect, __pe_bss_tib_start,  __pe_bss_tib_end  );
+  for( uint32_t i=0; i<4; i++ ) {
+    if( hdr.region[i].addr!=expect.region[i].addr ||
+        hdr.region[i].size!=expect.region[i].size ) {
+      LOG_WARN(( "snapshot: section layout mismatch in %s", path ));
+      close( fd );
+      return;
+    }
+  }
+  struct compat_snap_region const * arena = &hdr.region[4];
+  struct compat_snap_region const * stack = &hdr.region[5];
+  if( arena->addr!=(uint32_t)(uintptr_t)g_arena || arena->size>COMPAT_ARENA_SZ ||
+      stack->addr< (uint32_t)(uintptr_t)COMPAT_STACK_BASE ||
+      stack->addr+stack->size!=(uint32_t)(uintptr_t)stack_top ) {
+    LOG_WARN(( "snapshot: memory layout mismatch in %s", path ));
+    close( fd );
+    return;
+  }
 
-WIN32_STDCALL
-int
-WS2_32_send( uint32_t s,
-             void *   buf,
-             int      len,
-             int      flags ) {
-  LOG_WARN(( "[WARN] WS2_32_send(%u, %p, %u, %u)", s, buf, len, flags ));
-  return 0;
-}
+  /* Past this point, the process state is overwritten */
+  for( uint32_t i=0; i<hdr.region_cnt; i++ ) {
+    if( !compat_snapshot_map( fd, &hdr.region[i] ) )
+      LOG_FATAL(( "snapshot: failed to restore %s: %s", path, strerror( errno ) ));
+  }
+  close( fd );
 
-WIN32_STDCALL
-int
-WS2_32_recv( uint32_t s,
-             void *   buf,
-             int      len,
-             int      flags ) {
-  LOG_WARN(( "[WARN] WS2_32_recv(%u, %p, %u, %u)", s, buf, len, flags ));
-  return 0;
+  g_last_error = hdr.last_error;
+  tls_index    = hdr.tls_index;
+  memcpy( tls_slots, hdr.tls_slots, sizeof(tls_slots) );
+
+  LOG_DEBUG(( "snapshot: restoring %s", path ));
+  compat_ctr_pe();
+  compat_ctx_resume( &hdr.ctx );
 }
 
-static int
-compat_parse_loglvl_( char * lvl ) {
-  if( !lvl ) return LOGLVL_DEFAULT;
+/* compat_snapshot_boot: Runs the PE in snapshot mode.  Resumes from an
+   existing snapshot, or runs CRT init and creates one.  Returns if
+   snapshot mode is not available. */
+static void
+compat_snapshot_boot( char const * dir ) {
+  if( !COMPAT_SNAP_SUPPORTED ) {
+    LOG_WARN(( "snapshot: not supported on this architecture" ));
+    return;
+  }
 
-  for( char *s = lvl; *s; ++s ) *s = toupper( *s );
+  if( compat_hash_file( "/proc/self/exe", &g_snapshot_elf_hash )!=0 ) {
+    LOG_WARN(( "snapshot: cannot hash /proc/self/exe: %s", strerror( errno ) ));
+    return;
+  }
 
-  if( !strcmp( lvl, "FATAL"   ) ) return LOGLVL_FATAL;
-  if( !strcmp( lvl, "ERR"     ) ) return LOGLVL_ERR;
-  if( !strcmp( lvl, "ERROR"   ) ) return LOGLVL_ERR;
-  if( !strcmp( lvl, "WARN"    ) ) return LOGLVL_WARN;
-  if( !strcmp( lvl, "WARNING" ) ) return LOGLVL_WARN;
-  if( !strcmp( lvl, "INFO"    ) ) return LOGLVL_INFO;
-  if( !strcmp( lvl, "DBG"     ) ) return LOGLVL_DEBUG;
-  if( !strcmp( lvl, "DEBUG"   ) ) return LOGLVL_DEBUG;
-  if( !strcmp( lvl, "TRACE"   ) ) return LOGLVL_TRACE;
+  void * stack = mmap( COMPAT_STACK_BASE, COMPAT_STACK_SZ, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED_NOREPLACE, -1, 0 );
+  if( stack!=COMPAT_STACK_BASE ) {
+    LOG_WARN(( "snapshot: stack address %p is taken", COMPAT_STACK_BASE ));
+    if( stack!=MAP_FAILED ) munmap( stack, COMPAT_STACK_SZ );
+    return;
+  }
+  if( !compat_arena_init( COMPAT_ARENA_BASE ) ) {
+    munmap( stack, COMPAT_STACK_SZ );
+    return;
+  }
 
-  return LOGLVL_DEFAULT;
+  char path[ PATH_MAX ];
+  snprintf( path, sizeof(path), "%s/%016llx.snap", dir,
+            (unsigned long long)g_snapshot_elf_hash );
+
+  compat_snapshot_restore( path );
+
+  /* No usable snapshot, create one */
+  LOG_INFO(( "snapshot: creating %s", path ));
+  g_snapshot_path = strdup( path );
+  compat_ctr_pe();
+  compat_stack_enter( (uint8_t *)stack + COMPAT_STACK_SZ, (void (*)( void ))__pe_text_start );
 }
 
 int
@@ -2079,13 +8622,106 @@ main( int     argc,
   if( tty ) compat_level_str_ = level_str_color;
   else      compat_level_str_ = level_str_plain;
 
-  log_level = compat_parse_loglvl_( getenv("WIN32_LOG") );
+  compat_log_init();
+
+  compat_time_init();
+  compat_mount_init( getenv( "WIN32_MOUNTS" ) );
+  compat_fcache_init( getenv( "WIN32_FILE_CACHE" ) );
+  char const * stat_cache = getenv( "WIN32_STAT_CACHE" );
+  g_statc.off = stat_cache && 0==strcmp( stat_cache, "0" );
+  char const * ignore_case = getenv( "WIN32_IGNORE_CASE" );
+  g_case.on = ignore_case && 0==strcmp( ignore_case, "1" );
+  char const * atomic_write = getenv( "WIN32_ATOMIC_WRITE" );
+  g_publish = atomic_write && 0==strcmp( atomic_write, "1" );
+  char const * async_write = getenv( "WIN32_ASYNC_WRITE" );
+  g_aw.on = async_write && 0==strcmp( async_write, "1" );
+  g_publish_mode = umask( 0 );
+  umask( g_publish_mode );
+  g_publish_mode = 0666 & ~g_publish_mode;
+
+  /* Don't let child processes truncate the trace */
+  char const * trace_path = getenv( "WIN32_TRACE" );
+  if( trace_path ) {
+    compat_trace_init( trace_path );
+    unsetenv( "WIN32_TRACE" );
+  }
+  char const * stats_mode = getenv( "WIN32_STATS" );
+  if( stats_mode ) {
+    char const * counters = getenv( "WIN32_COUNTERS" );
+    compat_stats_init( stats_mode, counters && 0==strcmp( counters, "1" ) );
+    unsetenv( "WIN32_STATS" );
+    unsetenv( "WIN32_COUNTERS" );
+  }
+  char const * timeline = getenv( "WIN32_TIMELINE" );
+  if( timeline ) {
+    compat_tl_init( timeline );
+    unsetenv( "WIN32_TIMELINE" );
+  }
+  g_perfmap = !!getenv( "WIN32_PERF_MAP" );
+  compat_perfmap_write();
+
+  char const * prof_hz = getenv( "WIN32_PROFILE" );
+  if( prof_hz ) {
+    compat_prof_init( prof_hz, getenv( "WIN32_PROFILE_STACKS" ) );
+    unsetenv( "WIN32_PROFILE" );
+    unsetenv( "WIN32_PROFILE_STACKS" );
+  }
 
   unsetenv( "PATH" );
 
-  assert( compat_stdin  = compat_handle_alloc( stdin,  compat_handle_file_close ) );
-  assert( compat_stdout = compat_handle_alloc( stdout, compat_handle_file_close ) );
-  assert( compat_stderr = compat_handle_alloc( stderr, compat_handle_file_close ) );
+  /* Don't leak server mode into child processes */
+  g_server_path = getenv( "WIN32_SERVER" );
+  if( g_server_path ) {
+    g_server_path = strdup( g_server_path );
+    unsetenv( "WIN32_SERVER" );
+  }
+
+  assert( compat_stdin  = compat_handle_alloc( compat_file_new( STDIN_FILENO,  1 ), compat_handle_file_close ) );
+  assert( compat_stdout = compat_handle_alloc( compat_file_new( STDOUT_FILENO, 1 ), compat_handle_file_close ) );
+  assert( compat_stderr = compat_handle_alloc( compat_file_new( STDERR_FILENO, 1 ), compat_handle_file_close ) );
+  atexit( compat_file_flush_exit );
+
+  g_cache.dir = getenv( "WIN32_CACHE" );
+  if( g_cache.dir ) {
+    g_cache.dir = strdup( g_cache.dir );
+    unsetenv( "WIN32_CACHE" );
+    /* Hash once, so fork server workers inherit it */
+    if( compat_hash_file( "/proc/self/exe", &g_cache.elf_hash )!=0 ) {
+      LOG_WARN(( "cache: cannot hash /proc/self/exe, disabling cache" ));
+      g_cache.dir = NULL;
+    }
+  }
+
+  char const * remote_url = getenv( "WIN32_CACHE_REMOTE" );
+  if( remote_url && g_cache.dir ) {
+    char const * timeout_str = getenv( "WIN32_CACHE_TIMEOUT" );
+    int timeout_ms = timeout_str ? atoi( timeout_str ) : 2000;
+    if( compat_http_init( &g_cache_http, remote_url, timeout_ms ) ) g_cache.remote = 1;
+    else LOG_WARN(( "cache: unsupported remote URL \"%s\"", remote_url ));
+  } else if( remote_url ) {
+    LOG_WARN(( "cache: WIN32_CACHE_REMOTE requires WIN32_CACHE" ));
+  }
+  unsetenv( "WIN32_CACHE_REMOTE" );
+  unsetenv( "WIN32_CACHE_TIMEOUT" );
+
+  char const * snapshot_dir = getenv( "WIN32_SNAPSHOT" );
+  if( snapshot_dir ) {
+    snapshot_dir = strdup( snapshot_dir );
+    unsetenv( "WIN32_SNAPSHOT" );
+  }
+
+  char const * batch_path = getenv( "WIN32_BATCH" );
+  if( batch_path ) {
+    if( g_server_path ) {
+      LOG_WARN(( "WIN32_SERVER is ignored in batch mode" ));
+      g_server_path = NULL;
+    }
+    if( snapshot_dir ) LOG_WARN(( "WIN32_SNAPSHOT is ignored in batch mode" ));
+    compat_batch_run( batch_path );
+  }
+
+  if( snapshot_dir ) compat_snapshot_boot( snapshot_dir );
 
+  compat_ctr_pe();
   __pe_text_start_enter();
 }
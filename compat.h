@@ -251,6 +251,7 @@
 #define ERROR_PROCESS_MODE_ALREADY_BACKGROUND    402
 #define ERROR_PROCESS_MODE_NOT_BACKGROUND        403
 #define ERROR_INVALID_ADDRESS            487
+#define ERROR_FILE_INVALID              1006
 
 #define TLS_OUT_OF_INDEXES 0xFFFFFFFF
 
@@ -296,11 +297,50 @@
 #define STD_OUTPUT_HANDLE (-11)
 #define STD_ERROR_HANDLE  (-12)
 
+#define PAGE_READONLY          0x02
+#define PAGE_READWRITE         0x04
+#define PAGE_WRITECOPY         0x08
+#define PAGE_EXECUTE_READ      0x20
+#define PAGE_EXECUTE_READWRITE 0x40
+#define PAGE_EXECUTE_WRITECOPY 0x80
+
+#define FILE_MAP_COPY       0x0001
+#define FILE_MAP_WRITE      0x0002
+#define FILE_MAP_READ       0x0004
+#define FILE_MAP_EXECUTE    0x0020
+#define FILE_MAP_ALL_ACCESS 0xf001f
+
 typedef struct _FILETIME {
   uint32_t dwLowDateTime;
   uint32_t dwHighDateTime;
 } FILETIME;
 
+typedef struct _SYSTEMTIME {
+  uint16_t wYear;
+  uint16_t wMonth;
+  uint16_t wDayOfWeek;
+  uint16_t wDay;
+  uint16_t wHour;
+  uint16_t wMinute;
+  uint16_t wSecond;
+  uint16_t wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct _TIME_ZONE_INFORMATION {
+  int32_t    Bias;
+  uint16_t   StandardName[32];
+  SYSTEMTIME StandardDate;
+  int32_t    StandardBias;
+  uint16_t   DaylightName[32];
+  SYSTEMTIME DaylightDate;
+  int32_t    DaylightBias;
+} TIME_ZONE_INFORMATION;
+
+#define TIME_ZONE_ID_UNKNOWN  0
+#define TIME_ZONE_ID_STANDARD 1
+#define TIME_ZONE_ID_DAYLIGHT 2
+#define TIME_ZONE_ID_INVALID  0xFFFFFFFF
+
 typedef struct _WIN32_FIND_DATAA {
   uint32_t dwFileAttributes;
   FILETIME ftCreationTime;
@@ -358,23 +398,45 @@ void compat_handle_free( uint32_t h );
 // Generated by pe2elf
 
 extern uint8_t __pe_text_start[];
+extern uint8_t __pe_text_end[];
 extern uint8_t __pe_rodata_exc_start[];
 extern uint8_t __pe_rodata_start[];
 extern uint8_t __pe_rodata_version_start[];
 extern uint8_t __pe_rodata_version_end[];
 extern uint8_t __pe_data_start[];
+extern uint8_t __pe_data_end[];
 extern uint8_t __pe_data_CRT_start[];
+extern uint8_t __pe_data_CRT_end[];
 extern uint8_t __pe_data_idata_start[];
+extern uint8_t __pe_data_idata_end[];
+extern uint8_t __pe_bss_start[];
+extern uint8_t __pe_bss_end[];
+extern uint8_t __pe_bss_tib_start[];
+extern uint8_t __pe_bss_tib_end[];
 
 #define __pe_text_start_enter() __asm__ volatile ("jmp __pe_text_start")
+#define __pe_text_start_call()  ((void (*)( void ))__pe_text_start)()
 
 extern int const __pe_str_cnt;
 extern char const * const __pe_strs[];
 
+/* Functions inferred by pe2elf, sorted by address */
+struct __pe_func {
+  uint32_t     addr;
+  uint32_t     size;
+  char const * name;
+};
+
+extern unsigned int const __pe_func_cnt;
+extern struct __pe_func const __pe_funcs[];
+
 // Private logging API
 
 char const * const * compat_level_str_;
 
+/* Runtime log level, set from WIN32_LOG */
+extern int compat_log_level_;
+
 char const *
 compat_log0_( char const * fmt, ... )
 __attribute__((format(printf,1,2)));
@@ -383,12 +445,16 @@ void
 compat_log1_( int level,
               char const * msg );
 
+void
+compat_trace_fatal( int sig );
+
 __attribute__((noreturn))
 static inline
 void
 compat_log2_( int level,
               char const * msg ) {
   compat_log1_( level, msg );
+  compat_trace_fatal( 0 );
   exit( 1 );
 }
 
@@ -403,13 +469,143 @@ compat_log2_( int level,
 
 // Public logging API
 
-#define LOG_TRACE(a)   compat_log1_( LOGLVL_TRACE, compat_log0_ a )
-#define LOG_DEBUG(a)   compat_log1_( LOGLVL_DEBUG, compat_log0_ a )
-#define LOG_INFO(a)    compat_log1_( LOGLVL_INFO , compat_log0_ a )
-#define LOG_WARN(a)    compat_log1_( LOGLVL_WARN , compat_log0_ a )
-#define LOG_ERR(a)     compat_log1_( LOGLVL_ERR  , compat_log0_ a )
+/* COMPAT_LOG_MIN is the lowest level compiled in.  Sites below it are
+   removed entirely; the rest check the runtime level before formatting.
+   Fatal messages are always emitted. */
+#ifndef COMPAT_LOG_MIN
+#define COMPAT_LOG_MIN LOGLVL_TRACE
+#endif
+
+#define COMPAT_LOG_(level,a)                                             \
+  do {                                                                   \
+    if( (level)>=COMPAT_LOG_MIN &&                                       \
+        __builtin_expect( (level)>=compat_log_level_, 0 ) )              \
+      compat_log1_( (level), compat_log0_ a );                           \
+  } while(0)
+
+#define LOG_TRACE(a)   COMPAT_LOG_( LOGLVL_TRACE, a )
+#define LOG_DEBUG(a)   COMPAT_LOG_( LOGLVL_DEBUG, a )
+#define LOG_INFO(a)    COMPAT_LOG_( LOGLVL_INFO , a )
+#define LOG_WARN(a)    COMPAT_LOG_( LOGLVL_WARN , a )
+#define LOG_ERR(a)     COMPAT_LOG_( LOGLVL_ERR  , a )
 #define LOG_FATAL(a)   compat_log2_( LOGLVL_FATAL, compat_log0_ a )
 
+// Fork server
+
+/* Wire format of a fork server request (client -> server).
+
+   The header is sent together with an SCM_RIGHTS message carrying
+   the client's stdin, stdout and stderr file descriptors.
+   It is followed by payload_sz bytes of NUL-terminated strings:
+   the working directory, argc arguments, then envc environment entries.
+
+   The server replies with a single int32_t exit code. */
+struct compat_server_req {
+  uint32_t magic;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t payload_sz;
+};
+typedef struct compat_server_req compat_server_req_t;
+
+#define COMPAT_SERVER_MAGIC       0x31534d57 /* "WMS1" */
+#define COMPAT_SERVER_PAYLOAD_MAX (1U<<20)
+
+// Binary trace
+
+/* Layout of a WIN32_TRACE file: a header followed by a ring of ev_cnt
+   fixed-size events.  head counts all events ever recorded; event i
+   lives in slot i%ev_cnt.  Timestamps are raw ticks, converted to ns
+   with the (tick, ns) pairs sampled at start and at the last sync. */
+struct compat_trace_hdr {
+  uint32_t magic;
+  uint32_t ev_cnt;     /* power of two */
+  uint32_t head;
+  int32_t  fatal_sig;  /* -1 if clean, 0 after LOG_FATAL, else signal number */
+  uint64_t tick0;
+  uint64_t ns0;
+  uint64_t tick1;
+  uint64_t ns1;
+  uint32_t pid;
+  uint32_t _pad[5];
+};
+typedef struct compat_trace_hdr compat_trace_hdr_t;
+
+struct compat_trace_ev {
+  uint64_t tick;
+  uint16_t api;        /* COMPAT_API_* */
+  uint16_t tid;
+  uint32_t ret;
+  uint32_t err;        /* g_last_error after the call */
+  uint32_t arg[3];
+};
+typedef struct compat_trace_ev compat_trace_ev_t;
+
+#define COMPAT_TRACE_MAGIC  0x54323357 /* "W32T" */
+#define COMPAT_TRACE_EV_CNT (1U<<16)
+
+/* Shim IDs, shared by the binary trace and WIN32_STATS.
+   Append only, IDs are stored in trace files. */
+#define COMPAT_APIS(X)                                                        \
+  X(KERNEL32_ExitProcess)              X(KERNEL32_CloseHandle)                \
+  X(KERNEL32_CreateFileA)              X(KERNEL32_ReadFile)                   \
+  X(KERNEL32_WriteFile)                X(KERNEL32_SetFilePointer)             \
+  X(KERNEL32_GetFileSize)              X(KERNEL32_GetFileAttributesA)         \
+  X(KERNEL32_DeleteFileA)              X(KERNEL32_MoveFileA)                  \
+  X(KERNEL32_FindFirstFileA)           X(KERNEL32_FindNextFileA)              \
+  X(KERNEL32_FindClose)                X(KERNEL32_GetFullPathNameA)           \
+  X(KERNEL32_GetCurrentDirectoryA)     X(KERNEL32_GlobalAlloc)                \
+  X(KERNEL32_GlobalFree)               X(KERNEL32_GlobalReAlloc)              \
+  X(KERNEL32_TlsGetValue)              X(KERNEL32_TlsSetValue)                \
+  X(KERNEL32_EnterCriticalSection)     X(KERNEL32_LeaveCriticalSection)       \
+  X(KERNEL32_CreateProcessA)           X(KERNEL32_WaitForSingleObject)        \
+  X(KERNEL32_GetCommandLineA)          X(KERNEL32_GetTickCount)               \
+  X(KERNEL32_CreateFileMappingA)       X(KERNEL32_MapViewOfFile)              \
+  X(KERNEL32_UnmapViewOfFile)          X(ADVAPI32_RegOpenKeyExA)              \
+  X(ADVAPI32_RegQueryValueExA)         X(ADVAPI32_RegCloseKey)                \
+  X(KERNEL32_IsBadReadPtr)             X(KERNEL32_RtlUnwind)                  \
+  X(KERNEL32_GetCurrentProcess)        X(KERNEL32_DuplicateHandle)            \
+  X(KERNEL32_GetLastError)             X(KERNEL32_GetStdHandle)               \
+  X(KERNEL32_InitializeCriticalSection) X(KERNEL32_DeleteCriticalSection)     \
+  X(KERNEL32_GetEnvironmentStrings)    X(KERNEL32_FreeEnvironmentStringsA)    \
+  X(KERNEL32_SetCurrentDirectoryA)     X(KERNEL32_GetSystemDefaultLangID)     \
+  X(KERNEL32_GetShortPathNameA)        X(KERNEL32_GetExitCodeProcess)         \
+  X(KERNEL32_TlsAlloc)                 X(KERNEL32_TlsFree)                    \
+  X(KERNEL32_GetModuleHandleA)         X(KERNEL32_GetModuleFileNameA)         \
+  X(KERNEL32_LoadLibraryA)             X(KERNEL32_FreeLibrary)                \
+  X(KERNEL32_FormatMessageA)           X(KERNEL32_GetFileTime)                \
+  X(KERNEL32_SetFileTime)              X(KERNEL32_SetEndOfFile)               \
+  X(KERNEL32_CreateDirectoryA)         X(KERNEL32_RemoveDirectoryA)           \
+  X(KERNEL32_SetStdHandle)             X(KERNEL32_GetSystemTime)              \
+  X(KERNEL32_SystemTimeToFileTime)     X(KERNEL32_CompareFileTime)            \
+  X(KERNEL32_GlobalFlags)              X(KERNEL32_FileTimeToSystemTime)       \
+  X(KERNEL32_FindResourceA)            X(KERNEL32_LoadResource)               \
+  X(KERNEL32_LockResource)             X(KERNEL32_SizeofResource)             \
+  X(KERNEL32_GetSystemDirectoryA)      X(KERNEL32_GetWindowsDirectoryA)       \
+  X(KERNEL32_SetConsoleCtrlHandler)    X(KERNEL32_GetConsoleScreenBufferInfo) \
+  X(KERNEL32_SetFileAttributesA)       X(KERNEL32_OpenFileMappingA)           \
+  X(KERNEL32_MultiByteToWideChar)      X(KERNEL32_IsValidCodePage)            \
+  X(KERNEL32_GetACP)                   X(KERNEL32_GetLocalTime)               \
+  X(KERNEL32_GetTimeZoneInformation)   X(KERNEL32_FileTimeToLocalFileTime)    \
+  X(KERNEL32_IsDBCSLeadByte)           X(LMGR8C_lp_checkout)                  \
+  X(LMGR8C_lp_checkin)                 X(LMGR8C_lp_errstring)                 \
+  X(LMGR326B_lp_checkin)               X(LMGR326B_lp_checkout)                \
+  X(LMGR326B_lp_errstring)             X(USER32_MessageBoxA)                  \
+  X(USER32_LoadStringA)                X(VERSION_GetFileVersionInfoSizeA)     \
+  X(VERSION_GetFileVersionInfoA)       X(VERSION_VerQueryValueA)              \
+  X(WS2_32_WSAStartup)                 X(WS2_32_WSAGetLastError)              \
+  X(WS2_32_ntohs)                      X(WS2_32_inet_ntoa)                    \
+  X(WS2_32_shutdown)                   X(WS2_32_closesocket)                  \
+  X(WS2_32_WSACleanup)                 X(WS2_32_socket)                       \
+  X(WS2_32_htons)                      X(WS2_32_inet_addr)                    \
+  X(WS2_32_connect)                    X(WS2_32_select)                       \
+  X(WS2_32___WSAFDIsSet)               X(WS2_32_send)                         \
+  X(WS2_32_recv)
+
+#define COMPAT_API_ENUM_(n) COMPAT_API_##n,
+enum { COMPAT_APIS( COMPAT_API_ENUM_ ) COMPAT_API_CNT };
+#undef COMPAT_API_ENUM_
+
 // PE imports
 
 WIN32_STDCALL
@@ -695,12 +891,12 @@ KERNEL32_SetStdHandle( uint32_t n_std_handle,
 
 WIN32_STDCALL
 void
-KERNEL32_GetSystemTime( void * lp_system_time );
+KERNEL32_GetSystemTime( SYSTEMTIME * lp_system_time );
 
 WIN32_STDCALL
 int
-KERNEL32_SystemTimeToFileTime( void * lp_system_time,
-                               void * lp_file_time );
+KERNEL32_SystemTimeToFileTime( SYSTEMTIME const * lp_system_time,
+                               FILETIME *         lp_file_time );
 
 WIN32_STDCALL
 int32_t
@@ -719,8 +915,8 @@ KERNEL32_GlobalFlags( int32_t * h_mem );
 
 WIN32_STDCALL
 int
-KERNEL32_FileTimeToSystemTime( void * lp_file_time,
-                               void * lp_system_time );
+KERNEL32_FileTimeToSystemTime( FILETIME const * lp_file_time,
+                               SYSTEMTIME *     lp_system_time );
 
 WIN32_STDCALL
 uint32_t
@@ -813,16 +1009,16 @@ KERNEL32_GetACP( void );
 
 WIN32_STDCALL
 void
-KERNEL32_GetLocalTime( void * lp_system_time );
+KERNEL32_GetLocalTime( SYSTEMTIME * lp_system_time );
 
 WIN32_STDCALL
 uint32_t
-KERNEL32_GetTimeZoneInformation( void * lp_time_zone_information );
+KERNEL32_GetTimeZoneInformation( TIME_ZONE_INFORMATION * lp_time_zone_information );
 
 WIN32_STDCALL
 int
-KERNEL32_FileTimeToLocalFileTime( void const * lp_file_time,
-                                  void *       lp_local_file_time );
+KERNEL32_FileTimeToLocalFileTime( FILETIME const * lp_file_time,
+                                  FILETIME *       lp_local_file_time );
 
 WIN32_STDCALL
 int
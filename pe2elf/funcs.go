@@ -0,0 +1,182 @@
+package main
+
+import (
+	"debug/elf"
+	"debug/pe"
+	"encoding/binary"
+	"fmt"
+	"log"
+	"sort"
+)
+
+// peFunc is a function in the PE .text section.
+type peFunc struct {
+	addr uint32
+	size uint32
+	name string
+}
+
+// inferFuncs guesses function boundaries in the PE .text section.
+//
+// Function starts are collected from:
+// - the entry point and user symbols
+// - relocated pointers into .text stored outside of .text (vtables, callbacks)
+// - targets of `call rel32` instructions found by a byte scan
+// - `push ebp; mov ebp, esp` prologues after padding or a return
+//
+// A byte scan also matches bytes that merely look like a call,
+// so call targets only count if they are called from at least two sites
+// or directly follow padding or a return instruction.
+// Each function extends to the next start, minus trailing padding.
+func inferFuncs(peFile *pe.File, baseVaddr, entryVaddr uint32, symbols []sym) []peFunc {
+	peText := peFile.Section(".text")
+	if peText == nil {
+		return nil
+	}
+	text, err := peText.Data()
+	if err != nil {
+		log.Printf("inferFuncs: %v", err)
+		return nil
+	}
+	if uint32(len(text)) > peText.VirtualSize {
+		text = text[:peText.VirtualSize]
+	}
+	textVA := baseVaddr + peText.VirtualAddress
+	textEnd := textVA + uint32(len(text))
+	inText := func(va uint32) bool { return textVA <= va && va < textEnd }
+
+	names := make(map[uint32]string)
+	starts := make(map[uint32]bool)
+	if inText(entryVaddr) {
+		starts[entryVaddr] = true
+	}
+	for _, s := range symbols {
+		if inText(s.addr) {
+			starts[s.addr] = true
+			names[s.addr] = s.name
+		}
+	}
+
+	for _, target := range relocTargets(peFile, peText) {
+		if inText(target) {
+			starts[target] = true
+		}
+	}
+
+	callers := make(map[uint32]int)
+	for i := 0; i+5 <= len(text); i++ {
+		if text[i] != 0xe8 {
+			continue
+		}
+		rel := int32(binary.LittleEndian.Uint32(text[i+1 : i+5]))
+		target := textVA + uint32(i) + 5 + uint32(rel)
+		if inText(target) {
+			callers[target]++
+		}
+	}
+	afterPad := func(off uint32) bool {
+		return off == 0 || isPadding(text[off-1]) || text[off-1] == 0xc3 ||
+			(off >= 3 && text[off-3] == 0xc2)
+	}
+	for target, n := range callers {
+		if n >= 2 || afterPad(target-textVA) {
+			starts[target] = true
+		}
+	}
+	for i := 0; i+3 <= len(text); i++ {
+		if text[i] == 0x55 && (text[i+1] == 0x8b && text[i+2] == 0xec || text[i+1] == 0x89 && text[i+2] == 0xe5) &&
+			afterPad(uint32(i)) {
+			starts[textVA+uint32(i)] = true
+		}
+	}
+
+	sorted := make([]uint32, 0, len(starts))
+	for va := range starts {
+		sorted = append(sorted, va)
+	}
+	sort.Slice(sorted, func(i, j int) bool { return sorted[i] < sorted[j] })
+
+	funcs := make([]peFunc, 0, len(sorted))
+	for i, va := range sorted {
+		end := textEnd
+		if i+1 < len(sorted) {
+			end = sorted[i+1]
+		}
+		for end-1 > va && isPadding(text[end-1-textVA]) {
+			end--
+		}
+		name := names[va]
+		if name == "" {
+			name = fmt.Sprintf("__pe_fn_%x", va)
+		}
+		funcs = append(funcs, peFunc{addr: va, size: end - va, name: name})
+	}
+	logger(1).Printf("Inferred %d functions", len(funcs))
+	return funcs
+}
+
+func isPadding(b byte) bool {
+	return b == 0xcc || b == 0x90
+}
+
+// relocTargets returns the targets of all PE relocations whose site is outside of skip.
+// Sites within skip are ignored since they are usually jump tables.
+func relocTargets(peFile *pe.File, skip *pe.Section) []uint32 {
+	peRelocs := peFile.Section(".reloc")
+	if peRelocs == nil {
+		return nil
+	}
+	d, err := peRelocs.Data()
+	if err != nil {
+		return nil
+	}
+	var targets []uint32
+	for len(d) >= 8 {
+		pageRVA := binary.LittleEndian.Uint32(d[0:4])
+		blockSize := binary.LittleEndian.Uint32(d[4:8])
+		if pageRVA == 0 || blockSize < 8 || int(blockSize) > len(d) {
+			break
+		}
+		for i := uint32(8); i+2 <= blockSize; i += 2 {
+			reloc := binary.LittleEndian.Uint16(d[i : i+2])
+			if reloc>>12 != 3 {
+				continue
+			}
+			siteRVA := pageRVA + uint32(reloc&0xfff)
+			if skip.VirtualAddress <= siteRVA && siteRVA < skip.VirtualAddress+skip.VirtualSize {
+				continue
+			}
+			for _, s := range peFile.Sections {
+				if s.VirtualAddress <= siteRVA && siteRVA+4 <= s.VirtualAddress+s.Size {
+					var buf [4]byte
+					if _, err := s.ReadAt(buf[:], int64(siteRVA-s.VirtualAddress)); err == nil {
+						targets = append(targets, binary.LittleEndian.Uint32(buf[:]))
+					}
+					break
+				}
+			}
+		}
+		d = d[blockSize:]
+	}
+	return targets
+}
+
+// addFuncSyms emits a sized STT_FUNC symbol for each function in .text.
+//
+// Must run before addUserSyms and addRelocs,
+// so relocs and user symbols at function starts share these symbols.
+func (e *elfWriter) addFuncSyms(funcs []peFunc, textShndx int) {
+	text := e.sections[textShndx]
+	for _, f := range funcs {
+		if f.addr < text.Addr || f.addr+f.size > text.Addr+text.Size {
+			continue
+		}
+		e.addSym(elf.Sym32{
+			Value: f.addr - text.Addr,
+			Info:  elf.ST_INFO(elf.STB_GLOBAL, elf.STT_FUNC),
+			Shndx: uint16(textShndx),
+			Other: uint8(elf.STV_DEFAULT),
+			Size:  f.size,
+		}, f.name)
+	}
+}
@@ -124,6 +124,8 @@ func main() {
 	entryVaddr := baseVaddr + peOpt.AddressOfEntryPoint
 	logger(1).Printf("Entry vaddr:  %#x", entryVaddr)
 
+	funcs := inferFuncs(peFile, baseVaddr, entryVaddr, symbols)
+
 	var writer elfWriter
 	if err := writer.init(outFile); err != nil {
 		log.Fatal(err)
@@ -132,6 +134,7 @@ func main() {
 
 	var versionBytes []byte
 	var strs []string
+	escape := strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
 	peRes := peFile.Section(".rsrc")
 	if peRes != nil {
 		var res winres.ResourceSet
@@ -143,7 +146,6 @@ func main() {
 			log.Fatal("Failed to parse .rsrc: ", err)
 		}
 
-		escape := strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
 		var strID uint
 		versionBytes = res.Get(winres.RT_VERSION, winres.ID(1), 1033)
 		res.WalkType(winres.RT_STRING, func(resID winres.Identifier, langID uint16, data []byte) bool {
@@ -186,17 +188,38 @@ char const * const __pe_strs[] = {
 {{- end }}
 ""
 };
+
+struct __pe_func { unsigned int addr; unsigned int size; char const * name; };
+
+unsigned int const __pe_func_cnt = {{ .Funcs | len }};
+
+struct __pe_func const __pe_funcs[] = {
+{{- range .Funcs }}
+  { {{ .Addr | printf "%#x" }}, {{ .Size }}, "{{ .Name }}" },
+{{- end }}
+  { 0, 0, "" }
+};
 `
 
 	tmpl, err := template.New("").Parse(cstrTmpl)
 	if err != nil {
 		log.Fatal("Invalid template: ", err)
 	}
+	type cstrFunc struct {
+		Addr, Size uint32
+		Name       string
+	}
+	cstrFuncs := make([]cstrFunc, len(funcs))
+	for i, f := range funcs {
+		cstrFuncs[i] = cstrFunc{Addr: f.addr, Size: f.size, Name: escape.Replace(f.name)}
+	}
 	if err := tmpl.Execute(outCstrFile, struct {
-		Strs []string
-		Ver  [4]uint16
+		Strs  []string
+		Funcs []cstrFunc
+		Ver   [4]uint16
 	}{
-		Strs: strs,
+		Strs:  strs,
+		Funcs: cstrFuncs,
 	}); err != nil {
 		log.Fatal("Failed to evaluate template: ", err)
 	}
@@ -211,6 +234,7 @@ char const * const __pe_strs[] = {
 	}); err != nil {
 		log.Fatal(err)
 	}
+	writer.addFuncSyms(funcs, len(writer.sections)-1)
 
 	peExc := peFile.Section(".exc")
 	rawExc := peExc.Open()
@@ -244,6 +268,9 @@ char const * const __pe_strs[] = {
 	}); err != nil {
 		log.Fatal("copySection(.data):", err)
 	}
+	if err = writer.pageAlign(len(writer.sections) - 1); err != nil {
+		log.Fatal("pageAlign(.data):", err)
+	}
 
 	peCRT := peFile.Section(".CRT")
 	rawCRT := peCRT.Open()
@@ -255,6 +282,9 @@ char const * const __pe_strs[] = {
 	}); err != nil {
 		log.Fatal("copySection(.data.CRT):", err)
 	}
+	if err = writer.pageAlign(len(writer.sections) - 1); err != nil {
+		log.Fatal("pageAlign(.data.CRT):", err)
+	}
 
 	peIdata := peFile.Section(".idata")
 	logger(1).Printf("Idata vaddr:  %#x", baseVaddr+peIdata.VirtualAddress)
@@ -288,15 +318,21 @@ char const * const __pe_strs[] = {
 		}
 	}
 
-	writer.addImplicitSyms()
-
 	writer.addUserSyms(symbols)
 
 	peBss := peFile.Section(".bss")
 	logger(1).Printf("Bss vaddr:    %#x", baseVaddr+peBss.VirtualAddress)
 	writer.addBss(peBss.VirtualSize, baseVaddr+peBss.VirtualAddress, ".bss")
+	if err = writer.pageAlign(len(writer.sections) - 1); err != nil {
+		log.Fatal("pageAlign(.bss):", err)
+	}
 
 	writer.addBss(tibSize, tibVaddr, ".bss.tib")
+	if err = writer.pageAlign(len(writer.sections) - 1); err != nil {
+		log.Fatal("pageAlign(.bss.tib):", err)
+	}
+
+	writer.addImplicitSyms()
 
 	if err := writer.patchMovFs(len(writer.sections)-1 /*bss.tib*/, 1 /*text*/); err != nil {
 		log.Fatal("patchMovFs:", err)
@@ -541,6 +577,28 @@ func (e *elfWriter) copySection(rd io.Reader, name string, sec elf.Section32) er
 	return nil
 }
 
+// pageAlign pads a writable section to whole pages.
+//
+// The runtime maps process snapshots over the PE's writable sections,
+// which only works if no runtime data shares a page with them.
+// Must be called right after the section was added.
+func (e *elfWriter) pageAlign(shndx int) error {
+	const pageSize = 0x1000
+	sec := &e.sections[shndx]
+	sec.Addralign = pageSize
+	pad := (pageSize - sec.Size%pageSize) % pageSize
+	if sec.Type == uint32(elf.SHT_PROGBITS) && pad > 0 {
+		if e.pos() != sec.Off+sec.Size {
+			return fmt.Errorf("section %d is not at end of file", shndx)
+		}
+		if _, err := e.wr.Write(make([]byte, pad)); err != nil {
+			return err
+		}
+	}
+	sec.Size += pad
+	return nil
+}
+
 // addShstr adds a string to the section header string table.
 func (e *elfWriter) addShstr(s string) uint32 {
 	addr := uint32(e.shstrtab.Len())
@@ -566,12 +624,18 @@ func (e *elfWriter) addSym(sym elf.Sym32, name string) int {
 	if symndx, ok := e.symmap[key]; ok {
 		return symndx
 	}
+	ndx := e.appendSym(sym, name)
+	e.symmap[key] = ndx
+	return ndx
+}
+
+// appendSym adds a symbol to the symbol table without deduplication.
+func (e *elfWriter) appendSym(sym elf.Sym32, name string) int {
 	if name != "" {
 		sym.Name = e.addStr(name)
 	}
 	ndx := len(e.symtab)
 	e.symtab = append(e.symtab, sym)
-	e.symmap[key] = ndx
 	return ndx
 }
 
@@ -699,17 +763,21 @@ func (e *elfWriter) addRelocs(s *pe.Section, baseVaddr uint32) {
 	}
 }
 
+// addImplicitSyms emits start and end symbols for each section.
+//
+// These are aliases that never take part in symbol deduplication,
+// so other symbols at the same address (e.g. __pe_tib) keep their names.
 func (e *elfWriter) addImplicitSyms() {
 	for i, s := range e.sections[1:] {
 		shName, _ := getString(e.shstrtab.Bytes(), int(s.Name))
-		e.addSym(elf.Sym32{
+		e.appendSym(elf.Sym32{
 			Value: 0,
 			Info:  elf.ST_INFO(elf.STB_GLOBAL, elf.STT_NOTYPE),
 			Shndx: uint16(i + 1),
 			Other: uint8(elf.STV_DEFAULT),
 			Size:  0,
 		}, "__pe"+strings.ReplaceAll(shName, ".", "_")+"_start")
-		e.addSym(elf.Sym32{
+		e.appendSym(elf.Sym32{
 			Value: s.Size,
 			Info:  elf.ST_INFO(elf.STB_GLOBAL, elf.STT_NOTYPE),
 			Shndx: uint16(i + 1),
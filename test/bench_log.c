@@ -0,0 +1,35 @@
+/* bench_log: Per-call cost of shims whose log sites are filtered out.
+
+   Run with WIN32_LOG unset, once per LOG_MIN of interest:
+
+     make bench LOG_MIN=0
+     make bench LOG_MIN=1 */
+
+#include "harness.h"
+
+#define BENCH_ITER 10000000
+
+void
+test_entry( void ) {
+  KERNEL32_GetCommandLineA();
+  uint32_t idx = KERNEL32_TlsAlloc();
+  static uint8_t cs[ 64 ];
+  KERNEL32_InitializeCriticalSection( cs );
+
+  printf( "COMPAT_LOG_MIN=%d, %d iterations, ns per call\n", COMPAT_LOG_MIN, BENCH_ITER );
+  for( int round=0; round<3; round++ ) {
+    double t0 = test_now_ns();
+    for( int i=0; i<BENCH_ITER; i++ ) KERNEL32_TlsGetValue( idx );
+    double t1 = test_now_ns();
+    for( int i=0; i<BENCH_ITER; i++ ) {
+      KERNEL32_EnterCriticalSection( cs );
+      KERNEL32_LeaveCriticalSection( cs );
+    }
+    double t2 = test_now_ns();
+    for( int i=0; i<BENCH_ITER/10; i++ ) KERNEL32_GlobalFree( KERNEL32_GlobalAlloc( 0, 64 ) );
+    double t3 = test_now_ns();
+    printf( "  TlsGetValue %6.1f  Enter+LeaveCS %6.1f  GlobalAlloc+Free %6.1f\n",
+            (t1-t0)/BENCH_ITER, (t2-t1)/BENCH_ITER, (t3-t2)/(BENCH_ITER/10) );
+  }
+  KERNEL32_ExitProcess( 0 );
+}
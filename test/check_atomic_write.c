@@ -0,0 +1,63 @@
+/* check_atomic_write: With WIN32_ATOMIC_WRITE, an output appears only
+   once complete, and rewriting it with the same bytes keeps its mtime. */
+
+#include "harness.h"
+
+static void
+write_out( char const * s ) {
+  uint32_t n;
+  uint32_t h = KERNEL32_CreateFileA( "out.o", 0x40000000, 0, NULL, 2, 0, 0 );
+  TEST_CHECK( h!=INVALID_HANDLE_VALUE );
+  TEST_CHECK( KERNEL32_WriteFile( h, s, (uint32_t)strlen( s ), &n, NULL ) );
+  TEST_CHECK( KERNEL32_CloseHandle( h ) );
+}
+
+static int
+has( char const * s ) {
+  char buf[ 64 ] = {0};
+  FILE * f = fopen( "out.o", "r" );
+  if( !f ) return 0;
+  size_t n = fread( buf, 1, sizeof(buf)-1, f );
+  fclose( f );
+  return n==strlen( s ) && !memcmp( buf, s, n );
+}
+
+static int64_t
+mtime( void ) {
+  struct stat st;
+  return stat( "out.o", &st )==0 ? (int64_t)st.st_mtime : -1;
+}
+
+void
+test_entry( void ) {
+  KERNEL32_GetCommandLineA();
+  g_publish = 1;
+  test_tmpdir( "check_atomic_write" );
+
+  write_out( "hello" );
+  TEST_CHECK( has( "hello" ) );
+  struct timespec old[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+  utimensat( AT_FDCWD, "out.o", old, 0 );
+
+  /* Same bytes */
+  write_out( "hello" );
+  TEST_CHECK( has( "hello" ) );
+  TEST_CHECK( mtime()==1000000000 );
+
+  write_out( "world" );
+  TEST_CHECK( has( "world" ) );
+  TEST_CHECK( mtime()!=1000000000 );
+
+  /* Starting a child process does not publish a half-written output */
+  uint32_t n;
+  uint32_t h = KERNEL32_CreateFileA( "out.o", 0x40000000, 0, NULL, 2, 0, 0 );
+  TEST_CHECK( KERNEL32_WriteFile( h, "part", 4, &n, NULL ) );
+  TEST_CHECK( compat_file_flush_all( 0 )==0 );
+  TEST_CHECK( has( "world" ) );
+  TEST_CHECK( KERNEL32_WriteFile( h, "ial", 3, &n, NULL ) );
+  TEST_CHECK( KERNEL32_CloseHandle( h ) );
+  TEST_CHECK( has( "partial" ) );
+
+  test_tmpdir_rm();
+  test_done();
+}
@@ -0,0 +1,42 @@
+/* check_file_shared: Handles open on the same file see each other's
+   writes and size, and writes lost before a child process starts make
+   CloseHandle fail. */
+
+#include "harness.h"
+
+void
+test_entry( void ) {
+  KERNEL32_GetCommandLineA();
+  test_tmpdir( "check_file_shared" );
+
+  char     buf[ 16 ];
+  uint32_t n;
+  uint32_t w = KERNEL32_CreateFileA( "a.txt", 0x40000000, 0, NULL, 2, 0, 0 );
+  TEST_CHECK( w!=INVALID_HANDLE_VALUE );
+  TEST_CHECK( KERNEL32_WriteFile( w, "abc", 3, &n, NULL ) );
+  uint32_t r = KERNEL32_CreateFileA( "a.txt", 0x80000000, 1, NULL, 3, 0, 0 );
+  TEST_CHECK( r!=INVALID_HANDLE_VALUE );
+  TEST_CHECK( KERNEL32_GetFileSize( r, NULL )==3 );
+  TEST_CHECK( KERNEL32_ReadFile( r, buf, sizeof(buf), &n, NULL ) && n==3 && !memcmp( buf, "abc", 3 ) );
+  TEST_CHECK( KERNEL32_WriteFile( w, "def", 3, &n, NULL ) );
+  TEST_CHECK( KERNEL32_GetFileSize( r, NULL )==6 );
+  TEST_CHECK( KERNEL32_ReadFile( r, buf, sizeof(buf), &n, NULL ) && n==3 && !memcmp( buf, "def", 3 ) );
+  TEST_CHECK( KERNEL32_CloseHandle( r ) );
+  TEST_CHECK( KERNEL32_CloseHandle( w ) );
+
+  /* Make the flush before a child process fail, as on a full disk */
+  struct rlimit rl, small;
+  getrlimit( RLIMIT_FSIZE, &rl );
+  small = rl;
+  small.rlim_cur = 4;
+  signal( SIGXFSZ, SIG_IGN );
+  w = KERNEL32_CreateFileA( "b.txt", 0x40000000, 0, NULL, 2, 0, 0 );
+  TEST_CHECK( KERNEL32_WriteFile( w, "0123456789", 10, &n, NULL ) );
+  setrlimit( RLIMIT_FSIZE, &small );
+  TEST_CHECK( compat_file_flush_all( 0 )==1 );
+  setrlimit( RLIMIT_FSIZE, &rl );
+  TEST_CHECK( !KERNEL32_CloseHandle( w ) );
+
+  test_tmpdir_rm();
+  test_done();
+}
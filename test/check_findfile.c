@@ -0,0 +1,52 @@
+/* check_findfile: FindFirstFileA/FindNextFileA across a directory that
+   takes several getdents64 calls, and sizes past 4 GiB. */
+
+#include "harness.h"
+
+#define FILE_CNT 3000
+
+static uint32_t
+count( char const * pattern ) {
+  WIN32_FIND_DATAA fd;
+  uint32_t h = KERNEL32_FindFirstFileA( pattern, &fd );
+  if( h==INVALID_HANDLE_VALUE ) return 0;
+  uint32_t n = 1;
+  while( KERNEL32_FindNextFileA( h, &fd ) ) n++;
+  KERNEL32_FindClose( h );
+  return n;
+}
+
+void
+test_entry( void ) {
+  KERNEL32_GetCommandLineA();
+  test_tmpdir( "check_findfile" );
+  for( int i=0; i<FILE_CNT; i++ ) {
+    char name[ 32 ];
+    snprintf( name, sizeof(name), "file_with_a_long_name_%04d.%s", i, i%3 ? "c" : "h" );
+    int fd = open( name, O_WRONLY|O_CREAT, 0644 );
+    if( fd<0 ) {
+      fprintf( stderr, "setup failed: %s: %s\n", name, strerror( errno ) );
+      exit( 2 );
+    }
+    close( fd );
+  }
+  test_sh( "truncate -s 5G big.bin && chmod a-w big.bin" );
+
+  TEST_CHECK( count( "*" )==FILE_CNT+3 );  /* with ".", ".." and big.bin */
+  TEST_CHECK( count( "*.*" )==FILE_CNT+3 );
+  TEST_CHECK( count( "*.h" )==FILE_CNT/3 );
+  TEST_CHECK( count( "FILE_WITH_A_LONG_NAME_0?1?.C" )==67 );
+  TEST_CHECK( count( "*.zz" )==0 );
+
+  WIN32_FIND_DATAA fd;
+  uint32_t h = KERNEL32_FindFirstFileA( "big.bin", &fd );
+  TEST_CHECK( h!=INVALID_HANDLE_VALUE );
+  /* Read-only on the host, like GetFileAttributesA reports it */
+  TEST_CHECK( fd.dwFileAttributes==FILE_ATTRIBUTE_NORMAL );
+  TEST_CHECK( fd.dwFileAttributes==KERNEL32_GetFileAttributesA( "big.bin" ) );
+  TEST_CHECK( fd.nFileSizeHigh==1 && fd.nFileSizeLow==(1U<<30) );
+  KERNEL32_FindClose( h );
+
+  test_tmpdir_rm();
+  test_done();
+}
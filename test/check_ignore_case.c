@@ -0,0 +1,37 @@
+/* check_ignore_case: With WIN32_IGNORE_CASE, paths resolve whatever
+   their case, and each directory on the way is listed only once. */
+
+#include "harness.h"
+
+void
+test_entry( void ) {
+  KERNEL32_GetCommandLineA();
+  g_case.on = 1;
+  test_tmpdir( "check_ignore_case" );
+  test_sh( "mkdir -p Inc/Sub && echo x >Inc/Sub/Header.H && echo y >Inc/Sub/other.h" );
+  compat_stat_reset();
+
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "inc\\sub\\header.h" )==FILE_ATTRIBUTE_NORMAL );
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "INC\\SUB" )==FILE_ATTRIBUTE_DIRECTORY );
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "inc\\sub\\missing.h" )==INVALID_FILE_ATTRIBUTES );
+
+  uint32_t h = KERNEL32_CreateFileA( "INC\\sub\\HEADER.h", 0x80000000, 1, NULL, 3, 0, 0 );
+  TEST_CHECK( h!=INVALID_HANDLE_VALUE );
+  char     buf[ 4 ];
+  uint32_t n;
+  TEST_CHECK( KERNEL32_ReadFile( h, buf, sizeof(buf), &n, NULL ) && n==2 && buf[0]=='x' );
+  KERNEL32_CloseHandle( h );
+
+  /* Probing more missing names does not read the directories again */
+  for( int i=0; i<8; i++ ) {
+    char name[ 32 ];
+    snprintf( name, sizeof(name), "inc\\sub\\none%d.h", i );
+    TEST_CHECK( KERNEL32_GetFileAttributesA( name )==INVALID_FILE_ATTRIBUTES );
+  }
+  TEST_CHECK( g_statc.listed==3 );  /* ".", "Inc", "Inc/Sub" */
+
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "inc\\..\\Inc\\sub\\OTHER.h" )==FILE_ATTRIBUTE_NORMAL );
+
+  test_tmpdir_rm();
+  test_done();
+}
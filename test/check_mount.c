@@ -0,0 +1,34 @@
+/* check_mount: The empty path is not the root, and virtual files are
+   claimed by base name. */
+
+#include "harness.h"
+
+void
+test_entry( void ) {
+  KERNEL32_GetCommandLineA();
+  test_tmpdir( "check_mount" );
+  test_sh( "echo x >x.h" );
+
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "" )==INVALID_FILE_ATTRIBUTES );
+  TEST_CHECK( KERNEL32_CreateFileA( "", 0x80000000, 1, NULL, 3, 0, 0 )==INVALID_HANDLE_VALUE );
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "\\" )==FILE_ATTRIBUTE_DIRECTORY );
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "\\tmp" )==FILE_ATTRIBUTE_DIRECTORY );
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "z:\\tmp" )==FILE_ATTRIBUTE_DIRECTORY );
+  /* The failed lookup of "" leaves the working directory alone */
+  TEST_CHECK( KERNEL32_GetFileAttributesA( "x.h" )==FILE_ATTRIBUTE_NORMAL );
+
+  char full[ 256 ], want[ 256 ];
+  TEST_CHECK( KERNEL32_GetFullPathNameA( "license.dat", sizeof(full), full, NULL )>0 );
+  TEST_CHECK( 0==strcmp( full, "L:\\license.dat" ) );
+  TEST_CHECK( KERNEL32_GetFullPathNameA( "sub\\LICENSE.DAT", sizeof(full), full, NULL )>0 );
+  TEST_CHECK( 0==strcmp( full, "L:\\license.dat" ) );
+  snprintf( want, sizeof(want), "%s.exe", __progname );
+  TEST_CHECK( KERNEL32_GetFullPathNameA( want, sizeof(full), full, NULL )>0 );
+  snprintf( want, sizeof(want), "C:\\Windows\\System32\\%s.exe", __progname );
+  TEST_CHECK( 0==strcmp( full, want ) );
+  TEST_CHECK( KERNEL32_GetFullPathNameA( "x.h", sizeof(full), full, NULL )>0 );
+  TEST_CHECK( full[1]==':' && 0==strcmp( full+strlen( full )-4, "\\x.h" ) );
+
+  test_tmpdir_rm();
+  test_done();
+}
@@ -0,0 +1,98 @@
+/* harness.h: Runs compat.c without a converted PE.
+
+   A check or benchmark includes this header, then defines test_entry.
+   compat.c is included directly, so tests can reach its static state.
+   The symbols pe2elf would generate are provided here, with test_entry
+   standing in for the PE entry point: main sets up the runtime as for
+   any converted tool and jumps to it.  test_entry must end with
+   KERNEL32_ExitProcess.
+
+   Built and run by `make check` and `make bench`. */
+
+#include "../compat.c"
+
+#include <time.h>
+
+/* Entered with a jmp from main, so the stack may be misaligned */
+__attribute__((force_align_arg_pointer)) void test_entry( void );
+
+__asm__( ".globl __pe_text_start\n.set __pe_text_start, test_entry\n"
+         ".globl __pe_text_end\n.set __pe_text_end, test_entry\n" );
+
+static uint8_t test_pe_data[ 64 ];
+static uint8_t test_pe_bss [ 64 ];
+
+__asm__( ".globl __pe_data_start\n.set __pe_data_start, test_pe_data\n"
+         ".globl __pe_data_end\n.set __pe_data_end, test_pe_data+32\n"
+         ".globl __pe_data_CRT_start\n.set __pe_data_CRT_start, test_pe_data+32\n"
+         ".globl __pe_data_CRT_end\n.set __pe_data_CRT_end, test_pe_data+64\n"
+         ".globl __pe_bss_start\n.set __pe_bss_start, test_pe_bss\n"
+         ".globl __pe_bss_end\n.set __pe_bss_end, test_pe_bss+32\n"
+         ".globl __pe_bss_tib_start\n.set __pe_bss_tib_start, test_pe_bss+32\n"
+         ".globl __pe_bss_tib_end\n.set __pe_bss_tib_end, test_pe_bss+64\n" );
+
+uint8_t __pe_rodata_exc_start[1];
+uint8_t __pe_rodata_start[1];
+uint8_t __pe_rodata_version_start[1];
+uint8_t __pe_rodata_version_end[1];
+uint8_t __pe_data_idata_start[1];
+uint8_t __pe_data_idata_end[1];
+
+int const                 __pe_str_cnt  = 0;
+char const * const        __pe_strs[]   = { "" };
+struct __pe_func const    __pe_funcs[]  = { { 0, 0, "" } };
+unsigned int const        __pe_func_cnt = 0;
+
+/* Check helpers */
+
+static int test_fail_cnt;
+
+#define TEST_CHECK(c) do {                                              \
+    if( !(c) ) {                                                        \
+      fprintf( stderr, "%s:%d: FAIL: %s\n", __FILE__, __LINE__, #c );   \
+      test_fail_cnt++;                                                  \
+    }                                                                   \
+  } while(0)
+
+/* test_done: Exits with 1 if any check failed. */
+static void
+test_done( void ) {
+  if( test_fail_cnt ) fprintf( stderr, "%d check(s) failed\n", test_fail_cnt );
+  KERNEL32_ExitProcess( test_fail_cnt ? 1U : 0U );
+}
+
+/* test_sh: Runs a shell command, for setting up files. */
+static void
+test_sh( char const * cmd ) {
+  if( system( cmd )!=0 ) {
+    fprintf( stderr, "setup failed: %s\n", cmd );
+    exit( 2 );
+  }
+}
+
+/* test_tmpdir: Creates a scratch directory named after the check and
+   makes it the working directory.  test_tmpdir_rm removes it again. */
+static char test_tmpdir_path[ 64 ];
+
+static void
+test_tmpdir( char const * name ) {
+  snprintf( test_tmpdir_path, sizeof(test_tmpdir_path), "/tmp/%s.XXXXXX", name );
+  if( !mkdtemp( test_tmpdir_path ) || chdir( test_tmpdir_path )<0 ) {
+    fprintf( stderr, "setup failed: scratch directory %s: %s\n", test_tmpdir_path, strerror( errno ) );
+    exit( 2 );
+  }
+}
+
+static void
+test_tmpdir_rm( void ) {
+  char cmd[ 80 ];
+  snprintf( cmd, sizeof(cmd), "rm -rf %s", test_tmpdir_path );
+  test_sh( cmd );
+}
+
+static double
+test_now_ns( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (double)ts.tv_sec*1e9 + (double)ts.tv_nsec;
+}
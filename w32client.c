@@ -0,0 +1,152 @@
+/* w32client: Forwards a tool invocation to a fork server.
+
+   Usage: WIN32_SERVER=<socket> w32client [args...]
+
+   Sends the arguments, working directory, environment and stdio
+   descriptors to a converted tool running with WIN32_SERVER=<socket>,
+   then exits with the exit code of the remote run. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/limits.h>
+
+#include "compat.h"
+
+extern char ** environ;
+
+static size_t
+append( char *       buf,
+        size_t       off,
+        char const * s ) {
+  size_t sz = strlen( s )+1;
+  if( buf ) memcpy( buf+off, s, sz );
+  return off+sz;
+}
+
+/* build_payload: Serializes cwd, argv and environ.
+   First pass (buf==NULL) only computes the size. */
+static size_t
+build_payload( char *       buf,
+               char const * cwd,
+               int          argc,
+               char **      argv ) {
+  size_t off = append( buf, 0, cwd );
+  for( int i=0; i<argc; i++ )             off = append( buf, off, argv[i] );
+  for( char ** env=environ; *env; env++ ) off = append( buf, off, *env );
+  return off;
+}
+
+int
+main( int     argc,
+      char ** argv ) {
+  char const * path = getenv( "WIN32_SERVER" );
+  if( !path ) {
+    fprintf( stderr, "w32client: WIN32_SERVER not set\n" );
+    return 127;
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if( strlen( path )>=sizeof(addr.sun_path) ) {
+    fprintf( stderr, "w32client: socket path too long: %s\n", path );
+    return 127;
+  }
+  strcpy( addr.sun_path, path );
+
+  char cwd[ PATH_MAX ];
+  if( !getcwd( cwd, sizeof(cwd) ) ) {
+    fprintf( stderr, "w32client: getcwd failed: %s\n", strerror( errno ) );
+    return 127;
+  }
+
+  uint32_t envc = 0;
+  for( char ** env=environ; *env; env++ ) envc++;
+
+  size_t payload_sz = build_payload( NULL, cwd, argc, argv );
+  if( payload_sz>COMPAT_SERVER_PAYLOAD_MAX ) {
+    fprintf( stderr, "w32client: request too large (%zu bytes)\n", payload_sz );
+    return 127;
+  }
+  char * payload = malloc( payload_sz );
+  if( !payload ) return 127;
+  build_payload( payload, cwd, argc, argv );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0 );
+  if( fd<0 || connect( fd, (struct sockaddr *)&addr, sizeof(addr) )<0 ) {
+    fprintf( stderr, "w32client: connect(\"%s\") failed: %s\n", path, strerror( errno ) );
+    return 127;
+  }
+
+  compat_server_req_t req = {
+    .magic      = COMPAT_SERVER_MAGIC,
+    .argc       = (uint32_t)argc,
+    .envc       = envc,
+    .payload_sz = (uint32_t)payload_sz
+  };
+
+  union {
+    struct cmsghdr hdr;
+    char           buf[ CMSG_SPACE( 3*sizeof(int) ) ];
+  } ctl;
+  memset( &ctl, 0, sizeof(ctl) );
+  struct iovec iov[2] = {
+    { .iov_base = &req,    .iov_len = sizeof(req) },
+    { .iov_base = payload, .iov_len = payload_sz  }
+  };
+  struct msghdr msg = {
+    .msg_iov        = iov,
+    .msg_iovlen     = 2,
+    .msg_control    = ctl.buf,
+    .msg_controllen = sizeof(ctl.buf)
+  };
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR( &msg );
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN( 3*sizeof(int) );
+  int const fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  memcpy( CMSG_DATA( cmsg ), fds, sizeof(fds) );
+
+  /* Header and descriptors go out with the first message */
+  ssize_t n = sendmsg( fd, &msg, MSG_NOSIGNAL );
+  if( n<0 ) {
+    fprintf( stderr, "w32client: sendmsg failed: %s\n", strerror( errno ) );
+    return 127;
+  }
+  size_t sent = (size_t)n;
+  if( sent<sizeof(req) ) {
+    fprintf( stderr, "w32client: short write of request header\n" );
+    return 127;
+  }
+  size_t total = sizeof(req)+payload_sz;
+  while( sent<total ) {
+    size_t pos = sent-sizeof(req);
+    n = send( fd, payload+pos, payload_sz-pos, MSG_NOSIGNAL );
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ) {
+      fprintf( stderr, "w32client: send failed: %s\n", strerror( errno ) );
+      return 127;
+    }
+    sent += (size_t)n;
+  }
+  free( payload );
+
+  int32_t code;
+  size_t got = 0;
+  while( got<sizeof(code) ) {
+    n = read( fd, (char *)&code+got, sizeof(code)-got );
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ) {
+      fprintf( stderr, "w32client: server hung up without exit code\n" );
+      return 127;
+    }
+    got += (size_t)n;
+  }
+
+  close( fd );
+  return code;
+}
@@ -0,0 +1,74 @@
+/* w32trace: Decodes a binary trace written with WIN32_TRACE=<file>.
+
+   Usage: w32trace <file>
+
+   Prints the events still in the ring, oldest first, one per line:
+   sequence number, time since start in microseconds, thread ID,
+   shim name, the first three arguments, return value and last error. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compat.h"
+
+#define COMPAT_TRACE_NAME_(n) #n,
+static char const * const api_name[ COMPAT_API_CNT ] = {
+  COMPAT_APIS( COMPAT_TRACE_NAME_ )
+};
+
+int
+main( int     argc,
+      char ** argv ) {
+  if( argc!=2 ) {
+    fprintf( stderr, "usage: w32trace <file>\n" );
+    return 2;
+  }
+
+  FILE * f = fopen( argv[1], "rb" );
+  if( !f ) {
+    fprintf( stderr, "w32trace: %s: %s\n", argv[1], strerror( errno ) );
+    return 1;
+  }
+
+  compat_trace_hdr_t hdr;
+  if( fread( &hdr, sizeof(hdr), 1, f )!=1 || hdr.magic!=COMPAT_TRACE_MAGIC ||
+      !hdr.ev_cnt || (hdr.ev_cnt&(hdr.ev_cnt-1U)) ) {
+    fprintf( stderr, "w32trace: %s: not a trace file\n", argv[1] );
+    return 1;
+  }
+
+  compat_trace_ev_t * ev = malloc( hdr.ev_cnt*sizeof(compat_trace_ev_t) );
+  if( !ev || fread( ev, sizeof(compat_trace_ev_t), hdr.ev_cnt, f )!=hdr.ev_cnt ) {
+    fprintf( stderr, "w32trace: %s: truncated\n", argv[1] );
+    return 1;
+  }
+  fclose( f );
+
+  /* Linear tick to ns conversion between the two calibration points */
+  double ns_per_tick = 0.0;
+  if( hdr.tick1>hdr.tick0 )
+    ns_per_tick = (double)(hdr.ns1-hdr.ns0) / (double)(hdr.tick1-hdr.tick0);
+
+  uint32_t cnt = hdr.head<hdr.ev_cnt ? hdr.head : hdr.ev_cnt;
+  printf( "# pid %u, %u events, showing last %u%s\n",
+          hdr.pid, hdr.head, cnt, ns_per_tick==0.0 ? " (uncalibrated, raw ticks)" : "" );
+
+  for( uint32_t i=hdr.head-cnt; i!=hdr.head; i++ ) {
+    compat_trace_ev_t const * e = &ev[ i&(hdr.ev_cnt-1U) ];
+    double t = (double)(int64_t)(e->tick-hdr.tick0);
+    if( ns_per_tick!=0.0 ) t = t*ns_per_tick/1e3;
+    printf( "%10u %14.3f %5u %-22s %#10x %#10x %#10x = %#10x err=%u\n",
+            i, t, e->tid,
+            e->api<COMPAT_API_CNT ? api_name[ e->api ] : "?",
+            e->arg[0], e->arg[1], e->arg[2], e->ret, e->err );
+  }
+
+  if( hdr.fatal_sig==0 ) printf( "# terminated by LOG_FATAL\n" );
+  else if( hdr.fatal_sig>0 ) printf( "# terminated by signal %d (%s)\n", hdr.fatal_sig, strsignal( hdr.fatal_sig ) );
+
+  free( ev );
+  return 0;
+}